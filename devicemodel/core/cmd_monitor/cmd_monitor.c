@@ -99,6 +99,11 @@ static void register_socket_message_handlers(struct vmctx *ctx)
 	arg.ctx_arg = ctx;
 	register_command_handler(user_vm_destroy_handler, &arg, DESTROY);
 	register_command_handler(user_vm_blkrescan_handler, &arg, BLKRESCAN);
+	register_command_handler(user_vm_iothread_stats_handler, &arg, IOTHREAD_STATS);
+	register_command_handler(user_vm_balloon_handler, &arg, BALLOON);
+	register_command_handler(user_vm_blkqos_handler, &arg, BLKQOS);
+	register_command_handler(user_vm_blkstats_handler, &arg, BLKSTATS);
+	register_command_handler(user_vm_snapshot_handler, &arg, SNAPSHOT);
 }
 
 int init_cmd_monitor(struct vmctx *ctx)
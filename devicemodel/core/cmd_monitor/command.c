@@ -26,6 +26,11 @@
 #define CMD_OBJS \
 	GEN_CMD_OBJ(DESTROY), \
 	GEN_CMD_OBJ(BLKRESCAN), \
+	GEN_CMD_OBJ(IOTHREAD_STATS), \
+	GEN_CMD_OBJ(BALLOON), \
+	GEN_CMD_OBJ(BLKQOS), \
+	GEN_CMD_OBJ(BLKSTATS), \
+	GEN_CMD_OBJ(SNAPSHOT), \
 
 struct command dm_command_list[CMDS_NUM] = {CMD_OBJS};
 
@@ -10,8 +10,13 @@
 
 #define DESTROY "destroy"
 #define BLKRESCAN "blkrescan"
+#define IOTHREAD_STATS "iothread_stats"
+#define BALLOON "balloon"
+#define BLKQOS "blkqos"
+#define BLKSTATS "blkstats"
+#define SNAPSHOT "snapshot"
 
-#define CMDS_NUM 2U
+#define CMDS_NUM 7U
 #define CMD_NAME_MAX 32U
 #define CMD_ARG_MAX 320U
 
@@ -20,6 +20,9 @@
 #include "vmmapi.h"
 #include "log.h"
 #include "monitor.h"
+#include "iothread.h"
+#include "block_if.h"
+#include "snapshot.h"
 
 #define SUCCEEDED 0
 #define FAILED -1
@@ -67,6 +70,63 @@ static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
 	return ret;
 }
 
+/*
+ * Reply with msg, or with a failed ACK if it is missing or doesn't fit in
+ * the client buffer. msg is freed.
+ */
+static int send_socket_msg(struct socket_dev *sock, int fd, char *msg)
+{
+	struct socket_client *client = NULL;
+	int ret;
+
+	client = find_socket_client(sock, fd);
+	if (client == NULL) {
+		free(msg);
+		return -1;
+	}
+
+	if (msg == NULL || strlen(msg) >= CLIENT_BUF_LEN) {
+		if (msg != NULL)
+			pr_err("Reply of %zu bytes doesn't fit in the socket buffer.\n", strlen(msg));
+		free(msg);
+		return send_socket_ack(sock, fd, false);
+	}
+
+	memset(client->buf, 0, CLIENT_BUF_LEN);
+	memcpy(client->buf, msg, strlen(msg));
+	client->len = strlen(msg);
+	ret = write_socket_char(client);
+	if (ret < 0)
+		pr_err("Failed to send reply by socket.\n");
+	free(msg);
+	return ret;
+}
+
+/* Start a reply of a command that succeeded: {"ack": 0, ...} */
+static cJSON *create_reply_object(void)
+{
+	cJSON *ret_obj = cJSON_CreateObject();
+
+	if (ret_obj != NULL && cJSON_AddNumberToObject(ret_obj, "ack", SUCCEEDED) == NULL) {
+		cJSON_Delete(ret_obj);
+		ret_obj = NULL;
+	}
+	return ret_obj;
+}
+
+/* Print and free a reply, NULL if it or its printing failed */
+static char *print_reply_object(cJSON *ret_obj, bool complete, const char *what)
+{
+	char *msg = NULL;
+
+	if (ret_obj != NULL && complete)
+		msg = cJSON_PrintUnformatted(ret_obj);
+	if (msg == NULL)
+		pr_err("Failed to generate %s message.\n", what);
+	cJSON_Delete(ret_obj);
+	return msg;
+}
+
 int user_vm_destroy_handler(void *arg, void *command_para)
 {
 	int ret;
@@ -122,3 +182,309 @@ int user_vm_blkrescan_handler(void *arg, void *command_para)
 	}
 	return ret;
 }
+
+/*
+ * Reply with the utilization of each iothread of the pool:
+ * {"ack": 0, "iothreads": [{"id", "cpus", "events", "busy_us", "fds"}, ...]}
+ */
+static char *generate_iothread_stats_message(void)
+{
+	struct iothread_stats stats;
+	cJSON *ret_obj, *threads, *thread;
+	bool complete = false;
+	int i;
+
+	ret_obj = create_reply_object();
+	if (ret_obj == NULL)
+		goto out;
+	threads = cJSON_AddArrayToObject(ret_obj, "iothreads");
+	if (threads == NULL)
+		goto out;
+
+	for (i = 0; i < iothread_num(); i++) {
+		if (iothread_get_stats(i, &stats) < 0)
+			continue;
+		thread = cJSON_CreateObject();
+		if (thread == NULL)
+			goto out;
+		cJSON_AddItemToArray(threads, thread);
+		cJSON_AddNumberToObject(thread, "id", i);
+		cJSON_AddStringToObject(thread, "cpus", stats.cpus);
+		cJSON_AddNumberToObject(thread, "events", (double)stats.events);
+		cJSON_AddNumberToObject(thread, "busy_us", (double)(stats.busy_ns / 1000UL));
+		cJSON_AddNumberToObject(thread, "fds", stats.nr_fds);
+	}
+	complete = true;
+out:
+	return print_reply_object(ret_obj, complete, "iothread stats");
+}
+
+int user_vm_iothread_stats_handler(void *arg, void *command_para)
+{
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+
+	return send_socket_msg(sock, cmd_para->fd, generate_iothread_stats_message());
+}
+
+/*
+ * Set the balloon target ("<size>") or only query it (""), and reply with
+ * its state: {"ack": 0, "target", "actual", "returned", "stats": {...}}
+ * The sizes are in bytes. "stats" holds the last statistics sent by the
+ * guest, each query asks it for new ones.
+ */
+static const char *balloon_stat_names[VM_BALLOON_NR_STATS] = {
+	"swap_in", "swap_out", "major_faults", "minor_faults", "free_memory",
+	"total_memory", "available_memory", "disk_caches",
+	"hugetlb_allocations", "hugetlb_failures",
+};
+
+static char *generate_balloon_message(struct vm_balloon_info *info)
+{
+	cJSON *ret_obj, *stats;
+	bool complete = false;
+	int i;
+
+	ret_obj = create_reply_object();
+	if (ret_obj == NULL)
+		goto out;
+	cJSON_AddNumberToObject(ret_obj, "target", (double)info->target);
+	cJSON_AddNumberToObject(ret_obj, "actual", (double)info->actual);
+	cJSON_AddNumberToObject(ret_obj, "returned", (double)info->returned);
+	if (info->stats_valid) {
+		stats = cJSON_AddObjectToObject(ret_obj, "stats");
+		if (stats == NULL)
+			goto out;
+		for (i = 0; i < VM_BALLOON_NR_STATS; i++)
+			cJSON_AddNumberToObject(stats, balloon_stat_names[i],
+					(double)info->stats[i]);
+	}
+	complete = true;
+out:
+	return print_reply_object(ret_obj, complete, "balloon");
+}
+
+int user_vm_balloon_handler(void *arg, void *command_para)
+{
+	int ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct vm_balloon_info info;
+
+	ret = vm_monitor_balloon(hdl_arg->ctx_arg, cmd_para->option, &info);
+	if (ret < 0) {
+		pr_err("Failed to handle balloon command %s.\n", cmd_para->option);
+		return send_socket_ack(sock, cmd_para->fd, false);
+	}
+
+	return send_socket_msg(sock, cmd_para->fd, generate_balloon_message(&info));
+}
+
+/*
+ * Reply with the I/O limits of the block devices that have some, and how
+ * much they held requests back:
+ * {"ack": 0, "devices": [{"id", "iops_rd", "iops_rd_burst", ...,
+ *  "throttled_rd", "throttled_wr", "throttled_rd_us", "throttled_wr_us",
+ *  "queued"}, ...]}
+ * Limits that are not set are left out.
+ */
+static void add_blkqos_device(struct blockif_ctxt *bc, const char *ident, void *arg)
+{
+	struct blockif_qos_info info;
+	cJSON *devices = arg, *dev;
+	char name[32];
+	int i;
+
+	if (blockif_get_qos(bc, &info) < 0)
+		return;
+	dev = cJSON_CreateObject();
+	if (dev == NULL)
+		return;
+	cJSON_AddItemToArray(devices, dev);
+	cJSON_AddStringToObject(dev, "id", ident);
+	for (i = 0; i < BLOCKIF_QOS_NR; i++) {
+		if (!info.rate[i])
+			continue;
+		cJSON_AddNumberToObject(dev, blockif_qos_names[i], (double)info.rate[i]);
+		snprintf(name, sizeof(name), "%s_burst", blockif_qos_names[i]);
+		cJSON_AddNumberToObject(dev, name, (double)info.burst[i]);
+	}
+	cJSON_AddNumberToObject(dev, "throttled_rd", (double)info.throttled[0]);
+	cJSON_AddNumberToObject(dev, "throttled_wr", (double)info.throttled[1]);
+	cJSON_AddNumberToObject(dev, "throttled_rd_us", (double)(info.throttled_ns[0] / 1000UL));
+	cJSON_AddNumberToObject(dev, "throttled_wr_us", (double)(info.throttled_ns[1] / 1000UL));
+	cJSON_AddNumberToObject(dev, "queued", info.queued);
+}
+
+static char *generate_blkqos_message(void)
+{
+	cJSON *ret_obj, *devices;
+	bool complete = false;
+
+	ret_obj = create_reply_object();
+	if (ret_obj == NULL)
+		goto out;
+	devices = cJSON_AddArrayToObject(ret_obj, "devices");
+	if (devices == NULL)
+		goto out;
+	blockif_foreach(add_blkqos_device, devices);
+	complete = true;
+out:
+	return print_reply_object(ret_obj, complete, "blkqos");
+}
+
+int user_vm_blkqos_handler(void *arg, void *command_para)
+{
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+
+	return send_socket_msg(sock, cmd_para->fd, generate_blkqos_message());
+}
+
+/*
+ * Reply with the request statistics of the block device "<id>", or of all
+ * of them (""):
+ * {"ack": 0, "devices": [{"id", "queued", "inflight", "max_depth",
+ *  "blocked", "read": {"ops", "bytes", "errors", "queue_us": [...],
+ *  "service_us": [...]}, "write": {...}, "flush": {...},
+ *  "discard": {...}}, ...]}
+ * Entry n of the histograms counts the requests that took less than 1us
+ * for n = 0, [2^(n-1), 2^n) us otherwise. They end at the last non-zero
+ * entry. The devices that don't fit in the reply anymore are left out and
+ * "truncated": true is added.
+ */
+struct blkstats_query {
+	cJSON *reply;
+	cJSON *devices;
+	const char *id;
+	bool truncated;
+};
+
+/* room kept for the "truncated" member in the reply */
+#define BLKSTATS_TRUNCATED_LEN	sizeof(",\"truncated\":true")
+
+static void add_blkstats_hist(cJSON *obj, const char *name, const uint64_t *hist)
+{
+	cJSON *arr;
+	int i, n;
+
+	arr = cJSON_AddArrayToObject(obj, name);
+	if (arr == NULL)
+		return;
+	for (n = BLOCKIF_HIST_NR; n > 0 && !hist[n - 1]; n--)
+		;
+	for (i = 0; i < n; i++)
+		cJSON_AddItemToArray(arr, cJSON_CreateNumber((double)hist[i]));
+}
+
+static void add_blkstats_device(struct blockif_ctxt *bc, const char *ident, void *arg)
+{
+	struct blkstats_query *query = arg;
+	struct blockif_stats stats;
+	struct blockif_op_stats *ost;
+	cJSON *dev, *op;
+	char *msg;
+	int i;
+
+	if (query->truncated || (query->id[0] != '\0' && strcmp(query->id, ident)))
+		return;
+	blockif_get_stats(bc, &stats);
+	dev = cJSON_CreateObject();
+	if (dev == NULL)
+		return;
+	cJSON_AddItemToArray(query->devices, dev);
+	cJSON_AddStringToObject(dev, "id", ident);
+	cJSON_AddNumberToObject(dev, "queued", stats.queued);
+	cJSON_AddNumberToObject(dev, "inflight", stats.inflight);
+	cJSON_AddNumberToObject(dev, "max_depth", stats.max_depth);
+	cJSON_AddNumberToObject(dev, "blocked", (double)stats.blocked);
+	for (i = 0; i < BLOCKIF_OP_NR; i++) {
+		ost = &stats.op[i];
+		op = cJSON_AddObjectToObject(dev, blockif_op_names[i]);
+		if (op == NULL)
+			return;
+		cJSON_AddNumberToObject(op, "ops", (double)ost->ops);
+		cJSON_AddNumberToObject(op, "bytes", (double)ost->bytes);
+		cJSON_AddNumberToObject(op, "errors", (double)ost->errors);
+		add_blkstats_hist(op, "queue_us", ost->queue_hist);
+		add_blkstats_hist(op, "service_us", ost->service_hist);
+	}
+
+	/* Take the device back out if the reply got too large with it */
+	msg = cJSON_PrintUnformatted(query->reply);
+	if (msg == NULL || strlen(msg) + BLKSTATS_TRUNCATED_LEN >= CLIENT_BUF_LEN) {
+		cJSON_DeleteItemFromArray(query->devices,
+				cJSON_GetArraySize(query->devices) - 1);
+		query->truncated = true;
+	}
+	free(msg);
+}
+
+static char *generate_blkstats_message(const char *id)
+{
+	struct blkstats_query query;
+	cJSON *ret_obj;
+	bool complete = false;
+
+	ret_obj = create_reply_object();
+	if (ret_obj == NULL)
+		goto out;
+	query.devices = cJSON_AddArrayToObject(ret_obj, "devices");
+	if (query.devices == NULL)
+		goto out;
+	query.reply = ret_obj;
+	query.id = id;
+	query.truncated = false;
+	blockif_foreach(add_blkstats_device, &query);
+	if (query.truncated) {
+		pr_err("blkstats reply truncated, it doesn't fit in %u bytes.\n", CLIENT_BUF_LEN);
+		if (cJSON_AddTrueToObject(ret_obj, "truncated") == NULL)
+			goto out;
+	}
+	complete = true;
+out:
+	return print_reply_object(ret_obj, complete, "blkstats");
+}
+
+int user_vm_blkstats_handler(void *arg, void *command_para)
+{
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+
+	return send_socket_msg(sock, cmd_para->fd, generate_blkstats_message(cmd_para->option));
+}
+
+/*
+ * Save the VM to the file given as option and let it run again if it was
+ * running. The VM is paused while its memory is written.
+ */
+int user_vm_snapshot_handler(void *arg, void *command_para)
+{
+	int ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct socket_client *client = NULL;
+	bool cmd_completed = false;
+
+	client = find_socket_client(sock, cmd_para->fd);
+	if (client == NULL)
+		return -1;
+
+	ret = vm_snapshot_save(hdl_arg->ctx_arg, cmd_para->option);
+	if (ret == 0) {
+		cmd_completed = true;
+	} else {
+		pr_err("Failed to save the VM to %s.\n", cmd_para->option);
+	}
+
+	ret = send_socket_ack(sock, cmd_para->fd, cmd_completed);
+	if (ret < 0) {
+		pr_err("Failed to send ACK by socket.\n");
+	}
+	return ret;
+}
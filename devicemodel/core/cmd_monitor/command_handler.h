@@ -9,4 +9,9 @@ extern struct socket_dev *sock_server;
 
 int user_vm_destroy_handler(void *arg, void *command_para);
 int user_vm_blkrescan_handler(void *arg, void *command_para);
+int user_vm_iothread_stats_handler(void *arg, void *command_para);
+int user_vm_balloon_handler(void *arg, void *command_para);
+int user_vm_blkqos_handler(void *arg, void *command_para);
+int user_vm_blkstats_handler(void *arg, void *command_para);
+int user_vm_snapshot_handler(void *arg, void *command_para);
 #endif
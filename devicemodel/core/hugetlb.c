@@ -35,10 +35,15 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <time.h>
 #include <log.h>
 #include <linux/memfd.h>
+#include <sys/syscall.h>
 
 #include "vmmapi.h"
+#include "dm_string.h"
 
 extern char *vmname;
 
@@ -57,6 +62,22 @@ extern char *vmname;
 #define SYS_NR_HUGEPAGES  "nr_hugepages"
 #define SYS_FREE_HUGEPAGES  "free_hugepages"
 
+/* Per node pools, used when the guest memory is bound to a NUMA node */
+#define SYS_NODE_PATH  "/sys/devices/system/node/node%d/hugepages/"
+#define SYS_NODE_LV1  "hugepages-2048kB/"
+#define SYS_NODE_LV2  "hugepages-1048576kB/"
+
+/* Guest memory is prefaulted by up to this many threads per region */
+#define PREFAULT_THREADS_MAX	16
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND		2
+#endif
+#define NUMA_NODE_MAX		64
+
 /* File used for lock between different processes access to hugetlbfs.
  * We observed when access hugetlbfs from different process to allocate
  * huge page at the same time could fail. So use file lock here to make
@@ -133,6 +154,7 @@ struct vm_mmap_mem_region {
 	vm_paddr_t fd_offset;
 	char *hva_base;
 	int fd;
+	size_t pg_size;
 };
 
 static struct vm_mmap_mem_region mmap_mem_regions[16];
@@ -143,6 +165,24 @@ static size_t total_size;
 static int hugetlb_lv_max;
 static int lock_fd;
 
+/* NUMA node the guest memory is bound to, -1 if not bound */
+static int hugetlb_node = -1;
+static char node_pages_path[HUGETLB_LV_MAX][2][MAX_PATH_LEN];
+
+/*
+ * prefault_work: one chunk of a region prefaulted by one thread
+ * - addr/len: the chunk
+ * - pagesz: the huge page size of the region
+ * - ret: 0 or -errno if the huge pages could not be allocated
+ */
+struct prefault_work {
+	pthread_t tid;
+	char *addr;
+	size_t len;
+	size_t pagesz;
+	int ret;
+};
+
 static int lock_acrn_hugetlb(void)
 {
 	int ret;
@@ -200,6 +240,108 @@ static bool should_enable_hugetlb_level(int level)
 	        hugetlb_priv[level].highmem > 0);
 }
 
+static uint64_t hugetlb_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+static void *hugetlb_prefault_thread(void *arg)
+{
+	struct prefault_work *work = arg;
+	char *addr;
+
+	/* MADV_POPULATE_WRITE reports a failed allocation instead of
+	 * raising SIGBUS, it is available since Linux 5.14.
+	 */
+	if (madvise(work->addr, work->len, MADV_POPULATE_WRITE) == 0) {
+		work->ret = 0;
+		return NULL;
+	}
+	if (errno != EINVAL) {
+		work->ret = -errno;
+		return NULL;
+	}
+
+	/* Access to the address will trigger hugetlb_fault() in kernel,
+	 * it will allocate and clear the huge page.*/
+	for (addr = work->addr; addr < work->addr + work->len; addr += work->pagesz)
+		*(volatile char *)addr = *addr;
+	work->ret = 0;
+	return NULL;
+}
+
+/*
+ * Allocate and clear the huge pages of [addr, addr + len). Clearing the
+ * pages dominates the startup of large guests, so the region is split
+ * into contiguous chunks prefaulted in parallel, one per online CPU.
+ */
+static int hugetlb_prefault(char *addr, size_t len, size_t pagesz)
+{
+	struct prefault_work works[PREFAULT_THREADS_MAX];
+	size_t pages, chunk;
+	uint64_t start;
+	long ncpus;
+	int i, nr, ret = 0;
+
+	pages = len / pagesz;
+	if (pages == 0)
+		return 0;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr = (ncpus > 0) ? ncpus : 1;
+	if (nr > PREFAULT_THREADS_MAX)
+		nr = PREFAULT_THREADS_MAX;
+	if (nr > pages)
+		nr = pages;
+
+	start = hugetlb_now_ms();
+	chunk = pages / nr;
+	for (i = 0; i < nr; i++) {
+		works[i].addr = addr + i * chunk * pagesz;
+		works[i].len = (i == nr - 1) ? (pages - i * chunk) * pagesz :
+				chunk * pagesz;
+		works[i].pagesz = pagesz;
+		works[i].ret = 0;
+
+		/* the first chunk is done by the caller */
+		if (i == 0)
+			continue;
+		if (pthread_create(&works[i].tid, NULL,
+				hugetlb_prefault_thread, &works[i]) != 0) {
+			pr_warn("prefault thread create failed, continue serially\n");
+			works[i].tid = 0;
+			hugetlb_prefault_thread(&works[i]);
+		}
+	}
+	hugetlb_prefault_thread(&works[0]);
+
+	for (i = 0; i < nr; i++) {
+		if (i > 0 && works[i].tid != 0)
+			pthread_join(works[i].tid, NULL);
+		if (works[i].ret < 0)
+			ret = works[i].ret;
+	}
+
+	if (ret < 0)
+		pr_err("prefault %ld pages with pagesz 0x%lx failed: %s\n",
+			pages, pagesz, strerror(-ret));
+	else
+		pr_info("prefault %ld pages with pagesz 0x%lx by %d threads in %lu ms\n",
+			pages, pagesz, nr, hugetlb_now_ms() - start);
+	return ret;
+}
+
+static int hugetlb_bind_node(char *addr, size_t len)
+{
+	unsigned long nodemask = 1UL << hugetlb_node;
+
+	return syscall(SYS_mbind, addr, len, MPOL_BIND, &nodemask,
+			NUMA_NODE_MAX, 0);
+}
+
 /*
  * level  : hugepage level
  * len	  : region length for mmap
@@ -211,7 +353,7 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 {
 	char *addr;
 	size_t pagesz = 0;
-	int fd, i;
+	int fd, ret;
 
 	if (level >= HUGETLB_LV_MAX) {
 		pr_err("exceed max hugetlb level");
@@ -228,6 +370,20 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	if (addr == MAP_FAILED)
 		return -ENOMEM;
 
+	pr_info("mmap 0x%lx@%p\n", len, addr);
+
+	if (hugetlb_node >= 0 && hugetlb_bind_node(addr, len) < 0) {
+		pr_err("failed to bind 0x%lx@%p to node %d: %s\n",
+			len, addr, hugetlb_node, strerror(errno));
+		return -ENOMEM;
+	}
+
+	/* pre-allocate hugepages */
+	pagesz = hugetlb_priv[level].pg_size;
+	ret = hugetlb_prefault(addr, len, pagesz);
+	if (ret < 0)
+		return ret;
+
 	if (addr_out)
 		*addr_out = addr;
 
@@ -237,20 +393,8 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	mmap_mem_regions[mem_idx].fd = fd;
 	mmap_mem_regions[mem_idx].fd_offset = skip;
 	mmap_mem_regions[mem_idx].hva_base = addr;
+	mmap_mem_regions[mem_idx].pg_size = pagesz;
 	mem_idx++;
-	pr_info("mmap 0x%lx@%p\n", len, addr);
-
-	/* pre-allocate hugepages by touch them */
-	pagesz = hugetlb_priv[level].pg_size;
-
-	pr_info("touch %ld pages with pagesz 0x%lx\n", len/pagesz, pagesz);
-
-	/* Access to the address will trigger hugetlb_fault() in kernel,
-	 * it will allocate and clear the huge page.*/
-	for (i = 0; i < len/pagesz; i++) {
-		*(volatile char *)addr = *addr;
-		addr += pagesz;
-	}
 
 	return 0;
 }
@@ -539,6 +683,50 @@ static bool hugetlb_reserve_pages(void)
 	return true;
 }
 
+/**
+ * @brief Parse the --mem_node option
+ *
+ * Bind the guest memory to one NUMA node. The huge pages are then
+ * reserved from and allocated on the pools of that node.
+ *
+ * @param opt NUMA node id string.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int hugetlb_parse_node(const char *opt)
+{
+	const char *lv_dir[HUGETLB_LV_MAX] = { SYS_NODE_LV1, SYS_NODE_LV2 };
+	char node_dir[MAX_PATH_LEN];
+	char *end;
+	int node, level, rc;
+
+	if (dm_strtoi(opt, &end, 10, &node) || *end != '\0' ||
+	    node < 0 || node >= NUMA_NODE_MAX)
+		return -1;
+
+	snprintf(node_dir, sizeof(node_dir), SYS_NODE_PATH, node);
+	if (access(node_dir, F_OK) != 0) {
+		pr_err("no hugepages of NUMA node %d\n", node);
+		return -1;
+	}
+
+	for (level = HUGETLB_LV1; level < HUGETLB_LV_MAX; level++) {
+		rc = snprintf(node_pages_path[level][0], MAX_PATH_LEN, "%s%s%s",
+			node_dir, lv_dir[level], SYS_NR_HUGEPAGES);
+		if (rc < 0 || rc >= MAX_PATH_LEN)
+			return -1;
+		rc = snprintf(node_pages_path[level][1], MAX_PATH_LEN, "%s%s%s",
+			node_dir, lv_dir[level], SYS_FREE_HUGEPAGES);
+		if (rc < 0 || rc >= MAX_PATH_LEN)
+			return -1;
+		hugetlb_priv[level].nr_pages_path = node_pages_path[level][0];
+		hugetlb_priv[level].free_pages_path = node_pages_path[level][1];
+	}
+	hugetlb_node = node;
+
+	return 0;
+}
+
 bool init_hugetlb(void)
 {
 	char path[MAX_PATH_LEN] = {0};
@@ -608,6 +796,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	int fd;
 	unsigned int seal_flag = F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL;
 	size_t mem_size_level;
+	uint64_t start;
 
 	mem_idx = 0;
 	memset(&mmap_mem_regions, 0, sizeof(mmap_mem_regions));
@@ -733,6 +922,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 		}
 	}
 	pr_info("mmap ptr 0x%p -> baseaddr 0x%p\n", ptr, ctx->baseaddr);
+	start = hugetlb_now_ms();
 
 	/* mmap lowmem */
 	if (mmap_hugetlbfs(ctx, 0, get_lowmem_param, adj_lowmem_param, NULL) < 0) {
@@ -760,6 +950,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 		pr_err("fbmem mmap failed");
 		goto err_lock;
 	}
+	pr_info("guest memory prefaulted in %lu ms\n", hugetlb_now_ms() - start);
 
 	/* resize the memfd to meet with the size requirement and add the
 	 * F_SEAL_SEAL flag
@@ -883,6 +1074,87 @@ vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 	return ret;
 }
 
+static struct vm_mmap_mem_region *
+vm_find_mmap_region(vm_paddr_t gpa, size_t len)
+{
+	int i;
+
+	for (i = 0; i < mem_idx; i++) {
+		if ((gpa >= mmap_mem_regions[i].gpa_start) &&
+			(gpa + len <= mmap_mem_regions[i].gpa_end))
+			return &mmap_mem_regions[i];
+	}
+	return NULL;
+}
+
+/* huge page size backing gpa, 0 if gpa is not guest memory */
+size_t
+vm_get_memory_pagesz(struct vmctx *ctx, vm_paddr_t gpa)
+{
+	struct vm_mmap_mem_region *region;
+
+	region = vm_find_mmap_region(gpa, 1);
+	return region ? region->pg_size : 0;
+}
+
+/*
+ * Return [gpa, gpa + len) of the guest memory to the host: unmap it from
+ * the guest and free its huge pages. The range has to be aligned to the
+ * huge pages backing it and must not be accessed by the guest until
+ * vm_populate_memory() is called for it.
+ */
+int
+vm_discard_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct vm_mmap_mem_region *region;
+	char *hva;
+	int err;
+
+	region = vm_find_mmap_region(gpa, len);
+	if (!region || ALIGN_CHECK(gpa, region->pg_size) ||
+	    ALIGN_CHECK(len, region->pg_size))
+		return -EINVAL;
+
+	hva = region->hva_base + (gpa - region->gpa_start);
+	if (vm_unmap_memseg_vma(ctx, len, gpa, (uint64_t)hva, PROT_ALL) < 0)
+		return -EFAULT;
+
+	if (fallocate(region->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			region->fd_offset + (gpa - region->gpa_start), len) < 0) {
+		err = errno;
+		pr_err("failed to free 0x%lx@0x%lx: %s\n", len, gpa,
+			strerror(err));
+		/* the pages are still there, give them back to the guest */
+		vm_map_memseg_vma(ctx, len, gpa, (uint64_t)hva, PROT_ALL);
+		return -err;
+	}
+
+	return 0;
+}
+
+/* Allocate the huge pages of a discarded range again and map it */
+int
+vm_populate_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct vm_mmap_mem_region *region;
+	char *hva;
+	int ret;
+
+	region = vm_find_mmap_region(gpa, len);
+	if (!region || ALIGN_CHECK(gpa, region->pg_size) ||
+	    ALIGN_CHECK(len, region->pg_size))
+		return -EINVAL;
+
+	hva = region->hva_base + (gpa - region->gpa_start);
+	ret = hugetlb_prefault(hva, len, region->pg_size);
+	if (ret < 0)
+		return ret;
+
+	if (vm_map_memseg_vma(ctx, len, gpa, (uint64_t)hva, PROT_ALL) < 0)
+		return -EFAULT;
+	return 0;
+}
+
 bool vm_allow_dmabuf(struct vmctx *ctx)
 {
 	uint32_t mem_flags;
@@ -8,38 +8,71 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <signal.h>
 
 #include "iothread.h"
+#include "atomic.h"
+#include "dm_string.h"
 #include "log.h"
 #include "mevent.h"
 
 
 #define MEVENT_MAX 64
 #define MAX_EVENT_NUM 64
+
+/*
+ * A pool of iothreads, each with its own epoll fd. Without
+ * --iothreads there is a single unpinned thread as before.
+ */
 struct iothread_ctx {
 	pthread_t tid;
+	int idx;
 	int epfd;
 	bool started;
 	pthread_mutex_t mtx;
+
+	bool pinned;
+	cpu_set_t cpuset;
+	char cpus[IOTHREAD_CPUS_LEN];
+
+	uint64_t events;
+	uint64_t busy_ns;
+	uint32_t nr_fds;
 };
-static struct iothread_ctx ioctx;
+
+static struct iothread_ctx ioctxs[IOTHREAD_NUM_MAX];
+static int iothread_cnt = 1;
+static int iothread_next;	/* round-robin cursor */
+
+static inline uint64_t
+iothread_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
 static void *
 io_thread(void *arg)
 {
+	struct iothread_ctx *ioctx = arg;
 	struct epoll_event eventlist[MEVENT_MAX];
 	struct iothread_mevent *aevp;
+	uint64_t start;
 	int i, n, status;
 	char buf[MAX_EVENT_NUM];
 
-	while(ioctx.started) {
-		n = epoll_wait(ioctx.epfd, eventlist, MEVENT_MAX, -1);
+	while(ioctx->started) {
+		n = epoll_wait(ioctx->epfd, eventlist, MEVENT_MAX, -1);
 		if (n < 0) {
 			if (errno == EINTR)
 				pr_info("%s: exit from epoll_wait\n", __func__);
@@ -54,7 +87,10 @@ io_thread(void *arg)
 				do {
 					status = read(aevp->fd, buf, sizeof(buf));
 				} while (status == MAX_EVENT_NUM);
+				start = iothread_now_ns();
 				(*aevp->run)(aevp->arg);
+				atomic_add_fetch(&ioctx->busy_ns, iothread_now_ns() - start);
+				atomic_add_fetch(&ioctx->events, 1);
 			}
 		}
 	}
@@ -63,44 +99,75 @@ io_thread(void *arg)
 }
 
 static int
-iothread_start(void)
+iothread_start(struct iothread_ctx *ioctx)
 {
-	pthread_mutex_lock(&ioctx.mtx);
+	char tname[16];
+	int ret;
 
-	if (ioctx.started) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	pthread_mutex_lock(&ioctx->mtx);
+
+	if (ioctx->started) {
+		pthread_mutex_unlock(&ioctx->mtx);
 		return 0;
 	}
 
-	if (pthread_create(&ioctx.tid, NULL, io_thread, NULL) != 0) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	if (pthread_create(&ioctx->tid, NULL, io_thread, ioctx) != 0) {
+		pthread_mutex_unlock(&ioctx->mtx);
 		pr_err("%s", "iothread create failed\r\n");
 		return -1;
 	}
-	ioctx.started = true;
-	pthread_setname_np(ioctx.tid, "iothread");
-	pthread_mutex_unlock(&ioctx.mtx);
-	pr_info("iothread started\n");
+	ioctx->started = true;
+	if (iothread_cnt > 1)
+		snprintf(tname, sizeof(tname), "iothread%d", ioctx->idx);
+	else
+		snprintf(tname, sizeof(tname), "iothread");
+	pthread_setname_np(ioctx->tid, tname);
+
+	if (ioctx->pinned) {
+		ret = pthread_setaffinity_np(ioctx->tid, sizeof(ioctx->cpuset),
+				&ioctx->cpuset);
+		if (ret != 0)
+			pr_err("%s: failed to pin %s to CPUs %s, error is %d\n",
+				__func__, tname, ioctx->cpus, ret);
+	}
+	pthread_mutex_unlock(&ioctx->mtx);
+	pr_info("%s started\n", tname);
 	return 0;
 }
 
 int
-iothread_add(int fd, struct iothread_mevent *aevt)
+iothread_add_to(int idx, int fd, struct iothread_mevent *aevt)
 {
+	struct iothread_ctx *ioctx;
 	struct epoll_event ee;
 	int ret;
+
+	if (idx >= iothread_cnt) {
+		pr_err("%s: no iothread %d, only %d\n", __func__, idx,
+			iothread_cnt);
+		return -1;
+	}
+	if (idx < 0) {
+		idx = atomic_fetch_add(&iothread_next, 1) % iothread_cnt;
+		if (idx < 0)
+			idx += iothread_cnt;
+	}
+	ioctx = &ioctxs[idx];
+
 	/* Create a epoll instance before the first fd is added.*/
 	ee.events = EPOLLIN;
 	ee.data.ptr = aevt;
-	ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_ADD, fd, &ee);
+	ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_ADD, fd, &ee);
 	if (ret < 0) {
 		pr_err("%s: failed to add fd, error is %d\n",
 			__func__, errno);
 		return ret;
 	}
+	aevt->ctx = ioctx;
+	atomic_add_fetch(&ioctx->nr_fds, 1);
 
 	/* Start the iothread after the first fd is added.*/
-	ret = iothread_start();
+	ret = iothread_start(ioctx);
 	if (ret < 0) {
 		pr_err("%s: failed to start iothread thread\n",
 			__func__);
@@ -109,57 +176,194 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 }
 
 int
-iothread_del(int fd)
+iothread_add(int fd, struct iothread_mevent *aevt)
+{
+	return iothread_add_to(-1, fd, aevt);
+}
+
+int
+iothread_del(int fd, struct iothread_mevent *aevt)
 {
+	struct iothread_ctx *ioctx = aevt->ctx;
 	int ret = 0;
 
-	if (ioctx.epfd) {
-		ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (ioctx && ioctx->epfd > 0) {
+		ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_DEL, fd, NULL);
 		if (ret < 0)
 			pr_err("%s: failed to delete fd from epoll fd, error is %d\n",
 				__func__, errno);
+		else {
+			atomic_sub_fetch(&ioctx->nr_fds, 1);
+			aevt->ctx = NULL;
+		}
 	}
 	return ret;
 }
 
+int
+iothread_num(void)
+{
+	return iothread_cnt;
+}
+
+int
+iothread_get_stats(int idx, struct iothread_stats *stats)
+{
+	struct iothread_ctx *ioctx;
+
+	if (idx < 0 || idx >= iothread_cnt)
+		return -1;
+
+	ioctx = &ioctxs[idx];
+	stats->events = atomic_load(&ioctx->events);
+	stats->busy_ns = atomic_load(&ioctx->busy_ns);
+	stats->nr_fds = atomic_load(&ioctx->nr_fds);
+	snprintf(stats->cpus, sizeof(stats->cpus), "%s", ioctx->cpus);
+	return 0;
+}
+
+/*
+ * Parse a CPU list like "2-3,6" into cpuset
+ */
+static int
+iothread_parse_cpus(const char *str, cpu_set_t *cpuset)
+{
+	char *cp = (char *)str;
+	int first, last, cpu;
+
+	CPU_ZERO(cpuset);
+	while (*cp != '\0') {
+		if (dm_strtoi(cp, &cp, 10, &first) || first < 0)
+			return -1;
+		last = first;
+		if (*cp == '-') {
+			if (dm_strtoi(cp + 1, &cp, 10, &last) || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, cpuset);
+
+		if (*cp == ',')
+			cp++;
+		else if (*cp != '\0')
+			return -1;
+	}
+
+	return CPU_COUNT(cpuset) ? 0 : -1;
+}
+
+/**
+ * @brief Parse the --iothreads option
+ *
+ * The format is <num>[@<cpus>[:<cpus>...]], where <cpus> is a CPU list
+ * like "2-3,6" that the corresponding iothread is pinned to. Threads
+ * without a CPU list are not pinned.
+ *
+ * @param optarg Pointer to parameters string.
+ *
+ * @return fail -1 success 0
+ */
+int
+acrn_parse_iothreads(const char *optarg)
+{
+	char *str, *cp, *cpus, *end;
+	int num, i;
+
+	str = strdup(optarg);
+	if (!str)
+		return -1;
+
+	cpus = str;
+	cp = strsep(&cpus, "@");
+	if (dm_strtoi(cp, &end, 10, &num) || *end != '\0' || num < 1 ||
+	    num > IOTHREAD_NUM_MAX) {
+		pr_err("%s: 1 to %d iothreads are supported\n", __func__,
+			IOTHREAD_NUM_MAX);
+		goto fail;
+	}
+
+	for (i = 0; cpus != NULL && i < num; i++) {
+		cp = strsep(&cpus, ":");
+		if (iothread_parse_cpus(cp, &ioctxs[i].cpuset) != 0) {
+			pr_err("%s: invalid CPU list %s\n", __func__, cp);
+			goto fail;
+		}
+		ioctxs[i].pinned = true;
+		snprintf(ioctxs[i].cpus, sizeof(ioctxs[i].cpus), "%s", cp);
+	}
+	if (cpus != NULL) {
+		pr_err("%s: more CPU lists than iothreads\n", __func__);
+		goto fail;
+	}
+
+	iothread_cnt = num;
+	free(str);
+	return 0;
+
+fail:
+	free(str);
+	return -1;
+}
+
 void
 iothread_deinit(void)
 {
+	struct iothread_ctx *ioctx;
 	void *jval;
+	int i;
 
-	if (ioctx.tid > 0) {
-		pthread_mutex_lock(&ioctx.mtx);
-		ioctx.started = false;
-		pthread_mutex_unlock(&ioctx.mtx);
-		pthread_kill(ioctx.tid, SIGCONT);
-		pthread_join(ioctx.tid, &jval);
-	}
-	if (ioctx.epfd > 0) {
-		close(ioctx.epfd);
-		ioctx.epfd = -1;
+	for (i = 0; i < iothread_cnt; i++) {
+		ioctx = &ioctxs[i];
+		if (ioctx->tid > 0) {
+			pthread_mutex_lock(&ioctx->mtx);
+			ioctx->started = false;
+			pthread_mutex_unlock(&ioctx->mtx);
+			pthread_kill(ioctx->tid, SIGCONT);
+			pthread_join(ioctx->tid, &jval);
+			ioctx->tid = 0;
+		}
+		if (ioctx->epfd > 0) {
+			close(ioctx->epfd);
+			ioctx->epfd = -1;
+		}
+		pthread_mutex_destroy(&ioctx->mtx);
 	}
-	pthread_mutex_destroy(&ioctx.mtx);
 	pr_info("iothread stop\n");
 }
 
 int
 iothread_init(void)
 {
+	struct iothread_ctx *ioctx;
 	pthread_mutexattr_t attr;
+	int i;
 
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&ioctx.mtx, &attr);
-	pthread_mutexattr_destroy(&attr);
 
-	ioctx.tid = 0;
-	ioctx.started = false;
-	ioctx.epfd = epoll_create1(0);
+	iothread_next = 0;
+	for (i = 0; i < iothread_cnt; i++) {
+		ioctx = &ioctxs[i];
+		pthread_mutex_init(&ioctx->mtx, &attr);
 
-	if (ioctx.epfd < 0) {
-		pr_err("%s: failed to create epoll fd, error is %d\r\n",
-			__func__, errno);
-		return -1;
+		ioctx->idx = i;
+		ioctx->tid = 0;
+		ioctx->started = false;
+		ioctx->events = 0;
+		ioctx->busy_ns = 0;
+		ioctx->nr_fds = 0;
+		ioctx->epfd = epoll_create1(0);
+
+		if (ioctx->epfd < 0) {
+			pr_err("%s: failed to create epoll fd, error is %d\r\n",
+				__func__, errno);
+			pthread_mutexattr_destroy(&attr);
+			return -1;
+		}
 	}
+	pthread_mutexattr_destroy(&attr);
+
 	return 0;
 }
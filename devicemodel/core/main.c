@@ -71,6 +71,8 @@
 #include "cmd_monitor.h"
 #include "vdisplay.h"
 #include "iothread.h"
+#include "block_if.h"
+#include "snapshot.h"
 
 #define	VM_MAXCPU		16	/* maximum virtual cpus */
 
@@ -107,6 +109,7 @@ static int virtio_msix = 1;
 static bool debugexit_enabled;
 static int pm_notify_channel;
 static bool cmd_monitor;
+static char *restore_file;
 
 static char *progname;
 static const int BSP;
@@ -152,9 +155,10 @@ usage(int code)
 		"       %*s [--enable_trusty] [--intr_monitor param_setting]\n"
 		"       %*s [--acpidev_pt HID] [--mmiodev_pt MMIO_Regions]\n"
 		"       %*s [--vtpm2 sock_path] [--virtio_poll interval]\n"
+		"       %*s [--iothreads num[@cpus[:cpus...]]] [--mem_node node]\n"
 		"       %*s [--cpu_affinity lapic_id] [--lapic_pt] [--rtvm] [--windows]\n"
 		"       %*s [--debugexit] [--logger_setting param_setting]\n"
-		"       %*s [--ssram] <vm>\n"
+		"       %*s [--blkstats_dump file] [--restore file] [--ssram] <vm>\n"
 		"       -B: bootargs for kernel\n"
 		"       -E: elf image path\n"
 		"       -h: help\n"
@@ -176,6 +180,9 @@ usage(int code)
 		"       --cmd_monitor: enable command monitor\n"
 		"            its params: unix domain socket path\n"
 		"       --virtio_poll: enable virtio poll mode with poll interval with ns\n"
+		"       --iothreads: number of iothreads, optionally pinned to CPU lists\n"
+		"            like 2-3,6 separated by ':', one per iothread\n"
+		"       --mem_node: NUMA node the guest memory is allocated from\n"
 		"       --acpidev_pt: ACPI device ID args: HID in ACPI Table\n"
 		"       --mmiodev_pt: MMIO resources args: physical MMIO regions\n"
 		"       --vtpm2: Virtual TPM2 args: sock_path=$PATH_OF_SWTPM_SOCKET\n"
@@ -184,12 +191,15 @@ usage(int code)
 		"       --logger_setting: params like console,level=4;kmsg,level=3\n"
 		"       --windows: support Oracle virtio-blk, virtio-net and virtio-input devices\n"
 		"            for windows guest with secure boot\n"
-		"       --virtio_msi: force virtio to use single-vector MSI\n",
+		"       --virtio_msi: force virtio to use single-vector MSI\n"
+		"       --blkstats_dump: file the block device statistics are appended to on SIGUSR1\n"
+		"       --restore: resume the VM from a snapshot file instead of booting it\n",
 		progname, (int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
-		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "");
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "");
 
 	exit(code);
 }
@@ -272,7 +282,9 @@ add_cpu(struct vmctx *ctx, int vcpu_num)
 		mt_vmm_info[i].mt_vcpu = i;
 	}
 
-	vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
+	/* a restored VM already got the vCPU contexts from the snapshot */
+	if (restore_file == NULL)
+		vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
 
 	error = pthread_create(&mt_vmm_info[0].mt_thr, NULL,
 	    start_thread, &mt_vmm_info[0]);
@@ -773,6 +785,8 @@ enum {
 	CMD_OPT_PART_INFO,
 	CMD_OPT_TRUSTY_ENABLE,
 	CMD_OPT_VIRTIO_POLL_ENABLE,
+	CMD_OPT_IOTHREADS,
+	CMD_OPT_MEM_NODE,
 	CMD_OPT_MAC_SEED,
 	CMD_OPT_DEBUGEXIT,
 	CMD_OPT_VMCFG,
@@ -790,6 +804,8 @@ enum {
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
 	CMD_OPT_FORCE_VIRTIO_MSI,
+	CMD_OPT_BLKSTATS_DUMP,
+	CMD_OPT_RESTORE,
 };
 
 static struct option long_options[] = {
@@ -819,6 +835,8 @@ static struct option long_options[] = {
 	{"enable_trusty",	no_argument,		0,
 					CMD_OPT_TRUSTY_ENABLE},
 	{"virtio_poll",		required_argument,	0, CMD_OPT_VIRTIO_POLL_ENABLE},
+	{"iothreads",		required_argument,	0, CMD_OPT_IOTHREADS},
+	{"mem_node",		required_argument,	0, CMD_OPT_MEM_NODE},
 	{"debugexit",		no_argument,		0, CMD_OPT_DEBUGEXIT},
 	{"intr_monitor",	required_argument,	0, CMD_OPT_INTR_MONITOR},
 	{"cmd_monitor",		required_argument,	0, CMD_OPT_CMD_MONITOR},
@@ -833,6 +851,8 @@ static struct option long_options[] = {
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
 	{"virtio_msi",		no_argument,		0, CMD_OPT_FORCE_VIRTIO_MSI},
+	{"blkstats_dump",	required_argument,	0, CMD_OPT_BLKSTATS_DUMP},
+	{"restore",		required_argument,	0, CMD_OPT_RESTORE},
 	{0,			0,			0,  0  },
 };
 
@@ -972,6 +992,14 @@ main(int argc, char *argv[])
 					optarg);
 			}
 			break;
+		case CMD_OPT_IOTHREADS:
+			if (acrn_parse_iothreads(optarg) != 0)
+				errx(EX_USAGE, "invalid iothreads %s", optarg);
+			break;
+		case CMD_OPT_MEM_NODE:
+			if (hugetlb_parse_node(optarg) != 0)
+				errx(EX_USAGE, "invalid NUMA node %s", optarg);
+			break;
 		case CMD_OPT_MAC_SEED:
 			pr_warn("The \"--mac_seed\" parameter is obsolete\n");
 			pr_warn("Please use the \"virtio-net,<device_type>=<name> mac_seed=<seed_string>\"\n");
@@ -1043,6 +1071,13 @@ main(int argc, char *argv[])
 		case CMD_OPT_FORCE_VIRTIO_MSI:
 			virtio_msix = 0;
 			break;
+		case CMD_OPT_BLKSTATS_DUMP:
+			if (blockif_set_stats_dump(optarg) != 0)
+				errx(EX_USAGE, "invalid blkstats_dump %s", optarg);
+			break;
+		case CMD_OPT_RESTORE:
+			restore_file = optarg;
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -1144,27 +1179,36 @@ main(int argc, char *argv[])
 			goto dev_fail;
 		}
 
-		/*
-		 * build the guest tables, MP etc.
-		 */
-		if (mptgen) {
-			error = mptable_build(ctx, guest_ncpus);
+		if (restore_file != NULL) {
+			pr_notice("vm_snapshot_restore: %s\n", restore_file);
+			error = vm_snapshot_restore(ctx, restore_file);
 			if (error) {
+				pr_err("vm_snapshot_restore failed\n");
 				goto vm_fail;
 			}
-		}
+		} else {
+			/*
+			 * build the guest tables, MP etc.
+			 */
+			if (mptgen) {
+				error = mptable_build(ctx, guest_ncpus);
+				if (error) {
+					goto vm_fail;
+				}
+			}
 
-		error = acpi_build(ctx, guest_ncpus);
-		if (error) {
-			pr_err("acpi_build failed, error=%d\n", error);
-			goto vm_fail;
-		}
+			error = acpi_build(ctx, guest_ncpus);
+			if (error) {
+				pr_err("acpi_build failed, error=%d\n", error);
+				goto vm_fail;
+			}
 
-		pr_notice("acrn_sw_load\n");
-		error = acrn_sw_load(ctx);
-		if (error) {
-			pr_err("acrn_sw_load failed, error=%d\n", error);
-			goto vm_fail;
+			pr_notice("acrn_sw_load\n");
+			error = acrn_sw_load(ctx);
+			if (error) {
+				pr_err("acrn_sw_load failed, error=%d\n", error);
+				goto vm_fail;
+			}
 		}
 
 		/*
@@ -1182,6 +1226,9 @@ main(int argc, char *argv[])
 			goto vm_fail;
 		}
 
+		/* a reset reboots the guest rather than restoring it again */
+		restore_file = NULL;
+
 		/* Make a copy for ctx */
 		_ctx = ctx;
 
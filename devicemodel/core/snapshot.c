@@ -0,0 +1,653 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Layout of a snapshot file:
+ *
+ *	0			struct snapshot_header, written last
+ *	SNAPSHOT_VCPU_OFFSET	struct acrn_vcpu_context, one per vCPU
+ *	region[i].offset	guest memory of region i, huge page aligned,
+ *				zero pages are left as holes
+ *	dev_offset		struct snapshot_dev records
+ *
+ * Guest memory can't be backed by the file itself: the hugetlb pages are
+ * pinned and mapped into the service VM address space when the VM is set
+ * up. Restore maps the file and copies only its data extents into the
+ * freshly allocated (zero) guest memory, so an idle guest loads quickly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "block_if.h"
+#include "snapshot.h"
+#include "macros.h"
+#include "log.h"
+
+#define SNAPSHOT_MAGIC		"ACRNSNAP"
+#define SNAPSHOT_VERSION	1U
+#define SNAPSHOT_MAX_REGIONS	3U
+#define SNAPSHOT_VCPU_OFFSET	4096UL
+#define SNAPSHOT_MEM_ALIGN	(2UL * MB)
+#define SNAPSHOT_PAGE_SIZE	4096UL
+#define SNAPSHOT_DRAIN_MS	5000
+
+struct snapshot_region {
+	uint64_t	gpa;
+	uint64_t	len;
+	uint64_t	offset;		/* in the file */
+};
+
+struct snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	vcpu_num;
+	/* must match the memory layout of the restoring VM */
+	uint64_t	lowmem;
+	uint64_t	highmem;
+	uint64_t	biosmem;
+	uint64_t	fbmem;
+	uint32_t	nregions;
+	uint32_t	ndevs;
+	uint64_t	vcpu_offset;
+	uint64_t	dev_offset;
+	uint64_t	dev_len;
+	struct snapshot_region region[SNAPSHOT_MAX_REGIONS];
+};
+
+/*
+ * One per PCI function, followed by msix_count MSI-X table entries and
+ * virtio_len bytes of virtio transport state.
+ */
+struct snapshot_dev {
+	uint8_t		bus;
+	uint8_t		slot;
+	uint8_t		func;
+	uint8_t		reserved;
+	uint32_t	len;		/* of the whole record, 8 byte aligned */
+	uint32_t	msix_count;
+	uint32_t	virtio_len;
+	char		name[PI_NAMESZ];
+	uint8_t		cfgdata[PCI_REGMAX + 1];
+};
+
+struct snapshot_devs {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+	uint32_t	ndevs;
+};
+
+struct snapshot_match {
+	struct snapshot_dev	*rec;
+	struct pci_vdev		*dev;
+};
+
+static uint64_t
+snapshot_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+static int
+snapshot_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("%s: pwrite failed, errno %d\n", __func__, errno);
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+snapshot_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			pr_err("%s: pread failed, errno %d\n", __func__,
+				n < 0 ? errno : EIO);
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static uint32_t
+snapshot_regions(struct vmctx *ctx, struct snapshot_region *region)
+{
+	uint32_t n = 0;
+
+	region[n].gpa = 0;
+	region[n++].len = ctx->lowmem;
+	if (ctx->highmem > 0) {
+		region[n].gpa = ctx->highmem_gpa_base;
+		region[n++].len = ctx->highmem;
+	}
+	/* the framebuffer sits right below the BIOS */
+	if (ctx->biosmem + ctx->fbmem > 0) {
+		region[n].gpa = 4 * GB - ctx->biosmem - ctx->fbmem;
+		region[n++].len = ctx->biosmem + ctx->fbmem;
+	}
+	return n;
+}
+
+/*
+ * The header comes from the file: its regions must be the ones of the VM,
+ * and the vCPU contexts, the regions and the device records must follow
+ * each other within the file.
+ */
+static int
+snapshot_check_layout(struct vmctx *ctx, int fd, const struct snapshot_header *hdr)
+{
+	struct snapshot_region expect[SNAPSHOT_MAX_REGIONS];
+	const struct snapshot_region *r;
+	struct stat st;
+	uint64_t size, end;
+	uint32_t i;
+
+	if (fstat(fd, &st) < 0) {
+		pr_err("%s: fstat failed, errno %d\n", __func__, errno);
+		return -1;
+	}
+	size = st.st_size;
+
+	end = hdr->vcpu_offset + (uint64_t)hdr->vcpu_num * sizeof(struct acrn_vcpu_context);
+	if (hdr->vcpu_offset != SNAPSHOT_VCPU_OFFSET || end > size ||
+	    hdr->nregions != snapshot_regions(ctx, expect))
+		goto bad;
+
+	for (i = 0; i < hdr->nregions; i++) {
+		r = &hdr->region[i];
+		if (r->gpa != expect[i].gpa || r->len != expect[i].len ||
+		    r->offset < end || r->offset % SNAPSHOT_MEM_ALIGN != 0 ||
+		    r->len > size || r->offset > size - r->len)
+			goto bad;
+		end = r->offset + r->len;
+	}
+
+	if (hdr->dev_offset < end || hdr->dev_len > size ||
+	    hdr->dev_offset > size - hdr->dev_len)
+		goto bad;
+	return 0;
+
+bad:
+	pr_err("%s: the snapshot layout doesn't match the VM or the file\n",
+		__func__);
+	return -1;
+}
+
+static bool
+snapshot_page_is_zero(const char *page)
+{
+	const uint64_t *p = (const uint64_t *)page;
+	size_t i;
+
+	for (i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(*p); i++)
+		if (p[i] != 0)
+			return false;
+	return true;
+}
+
+/* Write each run of non-zero pages at once, zero pages are left as holes */
+static int
+snapshot_save_memory(struct vmctx *ctx, int fd, struct snapshot_region *r)
+{
+	char *hva = ctx->baseaddr + r->gpa;
+	uint64_t pos = 0, end;
+
+	while (pos < r->len) {
+		while (pos < r->len && snapshot_page_is_zero(hva + pos))
+			pos += SNAPSHOT_PAGE_SIZE;
+		end = pos;
+		while (end < r->len && !snapshot_page_is_zero(hva + end))
+			end += SNAPSHOT_PAGE_SIZE;
+		if (end > pos && snapshot_pwrite(fd, hva + pos, end - pos,
+				r->offset + pos) < 0)
+			return -1;
+		pos = end;
+	}
+	return 0;
+}
+
+/* Copy the data extents of a region, the guest memory is still zero */
+static int
+snapshot_load_memory(struct vmctx *ctx, int fd, struct snapshot_region *r)
+{
+	char *map, *hva = ctx->baseaddr + r->gpa;
+	off_t pos = r->offset, end = r->offset + r->len, data, hole;
+
+	map = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fd, r->offset);
+	if (map == MAP_FAILED) {
+		pr_err("%s: mmap failed, errno %d\n", __func__, errno);
+		return -1;
+	}
+	madvise(map, r->len, MADV_SEQUENTIAL);
+
+	while (pos < end) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			/* no hole reporting, copy everything */
+			data = pos;
+			hole = end;
+		} else {
+			if (data >= end)
+				break;
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0 || hole > end)
+				hole = end;
+		}
+		memcpy(hva + (data - r->offset), map + (data - r->offset),
+			hole - data);
+		pos = hole;
+	}
+
+	munmap(map, r->len);
+	return 0;
+}
+
+static void
+snapshot_count_busy(struct blockif_ctxt *bc, const char *ident, void *arg)
+{
+	struct blockif_stats stats;
+
+	blockif_get_stats(bc, &stats);
+	*(uint32_t *)arg += stats.queued + stats.inflight;
+}
+
+/* The vCPUs are paused, wait for the block requests already submitted */
+static int
+snapshot_drain_io(void)
+{
+	uint32_t busy;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_DRAIN_MS; i++) {
+		busy = 0;
+		blockif_foreach(snapshot_count_busy, &busy);
+		if (busy == 0)
+			return 0;
+		usleep(1000);
+	}
+	pr_err("%s: %u block requests still pending\n", __func__, busy);
+	return -1;
+}
+
+/*
+ * Virtio devices without a quiesce op that touch the virtqueues only from
+ * the guest notifications, or from the monitor thread, or whose requests
+ * snapshot_drain_io() waits for.
+ */
+static const char *const snapshot_sync_virtio[] = {
+	"virtio-blk",
+	"virtio-balloon",
+	"virtio-rpmb",
+};
+
+static bool
+snapshot_virtio_quiescable(struct virtio_base *base, const char *name)
+{
+	size_t i;
+
+	if (base->vops->quiesce != NULL)
+		return true;
+	for (i = 0; i < ARRAY_SIZE(snapshot_sync_virtio); i++) {
+		if (strcmp(name, snapshot_sync_virtio[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+static int
+snapshot_check_dev(struct pci_vdev *dev, void *arg)
+{
+	struct virtio_base *base = virtio_get_base(dev);
+	const char *name = dev->dev_ops->class_name;
+
+	/*
+	 * Passthrough devices and vhost backends keep state out of the
+	 * Device Model, other virtio devices (gpu) don't use the common
+	 * transport. Iothreads, polling virtqueues and the backend threads
+	 * of the other virtio devices go on filling the virtqueues while
+	 * the vCPUs are paused.
+	 */
+	if (pci_vdev_is_passthru(dev) ||
+	    (base != NULL && base->backend_type != BACKEND_VBSU) ||
+	    (base != NULL && (base->iothread || base->poll_budget_us != 0)) ||
+	    (base != NULL && !snapshot_virtio_quiescable(base, name)) ||
+	    (base == NULL && strncmp(name, "virtio", 6) == 0)) {
+		pr_err("%s: %s at %x:%x.%x can't be saved\n", __func__,
+			name, dev->bus, dev->slot, dev->func);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+snapshot_quiesce_dev(struct pci_vdev *dev, void *arg)
+{
+	struct virtio_base *base = virtio_get_base(dev);
+
+	if (base != NULL)
+		virtio_quiesce(base, *(bool *)arg);
+	return 0;
+}
+
+static int
+snapshot_save_dev(struct pci_vdev *dev, void *arg)
+{
+	struct snapshot_devs *devs = arg;
+	struct virtio_base *base = virtio_get_base(dev);
+	struct snapshot_dev *rec;
+	size_t msix_len = 0, virtio_len = 0, len;
+	char *buf;
+
+	if (dev->msix.table != NULL)
+		msix_len = dev->msix.table_count *
+			sizeof(struct msix_table_entry);
+	if (base != NULL)
+		virtio_len = virtio_state_size(base);
+
+	len = ALIGN_UP(sizeof(*rec) + msix_len + virtio_len, 8UL);
+	if (devs->len + len > devs->size) {
+		buf = realloc(devs->buf, (devs->len + len) * 2);
+		if (buf == NULL)
+			return -1;
+		devs->buf = buf;
+		devs->size = (devs->len + len) * 2;
+	}
+
+	rec = (struct snapshot_dev *)(devs->buf + devs->len);
+	memset(rec, 0, len);
+	rec->bus = dev->bus;
+	rec->slot = dev->slot;
+	rec->func = dev->func;
+	rec->len = len;
+	rec->msix_count = msix_len / sizeof(struct msix_table_entry);
+	rec->virtio_len = virtio_len;
+	strncpy(rec->name, dev->name, PI_NAMESZ - 1);
+	memcpy(rec->cfgdata, dev->cfgdata, sizeof(rec->cfgdata));
+	memcpy(rec + 1, dev->msix.table, msix_len);
+	if (base != NULL)
+		virtio_get_state(base, (char *)(rec + 1) + msix_len);
+
+	devs->len += len;
+	devs->ndevs++;
+	return 0;
+}
+
+static int
+snapshot_match_dev(struct pci_vdev *dev, void *arg)
+{
+	struct snapshot_match *m = arg;
+
+	if (dev->bus != m->rec->bus || dev->slot != m->rec->slot ||
+	    dev->func != m->rec->func)
+		return 0;
+	m->dev = dev;
+	return 1;
+}
+
+static int
+snapshot_load_dev(struct vmctx *ctx, struct snapshot_dev *rec)
+{
+	struct snapshot_match m = { rec, NULL };
+	struct virtio_base *base;
+	size_t msix_len = rec->msix_count * sizeof(struct msix_table_entry);
+
+	pci_walk_vdev(snapshot_match_dev, &m);
+	if (m.dev == NULL || strncmp(m.dev->name, rec->name, PI_NAMESZ) != 0) {
+		pr_err("%s: no %s at %x:%x.%x\n", __func__, rec->name,
+			rec->bus, rec->slot, rec->func);
+		return -1;
+	}
+
+	pci_restore_cfgdata(ctx, m.dev, rec->cfgdata);
+
+	if (rec->msix_count > 0) {
+		if (m.dev->msix.table == NULL ||
+		    rec->msix_count != m.dev->msix.table_count)
+			goto mismatch;
+		memcpy(m.dev->msix.table, rec + 1, msix_len);
+	}
+
+	if (rec->virtio_len > 0) {
+		base = virtio_get_base(m.dev);
+		if (base == NULL || virtio_set_state(base,
+				(char *)(rec + 1) + msix_len,
+				rec->virtio_len) < 0)
+			goto mismatch;
+	}
+	return 0;
+
+mismatch:
+	pr_err("%s: state of %s doesn't match the device\n", __func__,
+		rec->name);
+	return -1;
+}
+
+int
+vm_snapshot_save(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct snapshot_devs devs;
+	struct acrn_vcpu_context vcpu_ctx;
+	uint64_t start, off;
+	uint32_t i;
+	int fd, ret = -1;
+	bool running, stop;
+
+	if (path == NULL || *path == '\0')
+		return -1;
+	if (pci_walk_vdev(snapshot_check_dev, NULL) != 0)
+		return -1;
+
+	/* a suspended VM is already paused and stays so */
+	switch (vm_get_suspend_mode()) {
+	case VM_SUSPEND_NONE:
+		running = true;
+		break;
+	case VM_SUSPEND_SUSPEND:
+		running = false;
+		break;
+	default:
+		pr_err("%s: the VM is being reset or shut down\n", __func__);
+		return -1;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		pr_err("%s: can't open %s, errno %d\n", __func__, path, errno);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&devs, 0, sizeof(devs));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.vcpu_num = ctx->vcpu_num;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem = ctx->highmem;
+	hdr.biosmem = ctx->biosmem;
+	hdr.fbmem = ctx->fbmem;
+	hdr.vcpu_offset = SNAPSHOT_VCPU_OFFSET;
+	hdr.nregions = snapshot_regions(ctx, hdr.region);
+
+	start = snapshot_now_ms();
+	vm_pause(ctx);
+	stop = true;
+	pci_walk_vdev(snapshot_quiesce_dev, &stop);
+	if (snapshot_drain_io() < 0)
+		goto out;
+
+	for (i = 0; i < hdr.vcpu_num; i++) {
+		memset(&vcpu_ctx, 0, sizeof(vcpu_ctx));
+		vcpu_ctx.vcpu_id = i;
+		if (vm_get_vcpu_context(ctx, &vcpu_ctx) < 0) {
+			pr_err("%s: can't get vcpu %u context\n", __func__, i);
+			goto out;
+		}
+		if (snapshot_pwrite(fd, &vcpu_ctx, sizeof(vcpu_ctx),
+				hdr.vcpu_offset + i * sizeof(vcpu_ctx)) < 0)
+			goto out;
+	}
+
+	off = ALIGN_UP(hdr.vcpu_offset + hdr.vcpu_num * sizeof(vcpu_ctx),
+			SNAPSHOT_MEM_ALIGN);
+	for (i = 0; i < hdr.nregions; i++) {
+		hdr.region[i].offset = off;
+		if (snapshot_save_memory(ctx, fd, &hdr.region[i]) < 0)
+			goto out;
+		off += ALIGN_UP(hdr.region[i].len, SNAPSHOT_MEM_ALIGN);
+	}
+
+	/* after the memory, the rings must not be ahead of what was saved */
+	if (pci_walk_vdev(snapshot_save_dev, &devs) != 0) {
+		pr_err("%s: can't save the device state\n", __func__);
+		goto out;
+	}
+	hdr.ndevs = devs.ndevs;
+	hdr.dev_offset = off;
+	hdr.dev_len = devs.len;
+	if (snapshot_pwrite(fd, devs.buf, devs.len, off) < 0 ||
+	    ftruncate(fd, off + devs.len) < 0)
+		goto out;
+
+	/* the header is written last, a partial file has no magic */
+	if (snapshot_pwrite(fd, &hdr, sizeof(hdr), 0) < 0 || fdatasync(fd) < 0)
+		goto out;
+
+	ret = 0;
+	pr_notice("VM snapshot saved to %s, paused %lu ms\n", path,
+		snapshot_now_ms() - start);
+out:
+	stop = false;
+	pci_walk_vdev(snapshot_quiesce_dev, &stop);
+	if (running)
+		vm_run(ctx);
+	free(devs.buf);
+	close(fd);
+	if (ret < 0)
+		unlink(path);
+	return ret;
+}
+
+int
+vm_snapshot_restore(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct snapshot_dev *rec;
+	struct acrn_vcpu_context vcpu_ctx;
+	uint64_t start = snapshot_now_ms();
+	char *buf = NULL;
+	size_t pos;
+	uint32_t i;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_err("%s: can't open %s, errno %d\n", __func__, path, errno);
+		return -1;
+	}
+
+	if (snapshot_pread(fd, &hdr, sizeof(hdr), 0) < 0)
+		goto out;
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SNAPSHOT_VERSION ||
+	    hdr.nregions > SNAPSHOT_MAX_REGIONS) {
+		pr_err("%s: %s is not a valid snapshot\n", __func__, path);
+		goto out;
+	}
+	if (hdr.vcpu_num != ctx->vcpu_num || hdr.lowmem != ctx->lowmem ||
+	    hdr.highmem != ctx->highmem || hdr.biosmem != ctx->biosmem ||
+	    hdr.fbmem != ctx->fbmem) {
+		pr_err("%s: VM configuration differs from the snapshot\n",
+			__func__);
+		goto out;
+	}
+	if (snapshot_check_layout(ctx, fd, &hdr) < 0)
+		goto out;
+
+	for (i = 0; i < hdr.nregions; i++)
+		if (snapshot_load_memory(ctx, fd, &hdr.region[i]) < 0)
+			goto out;
+
+	for (i = 0; i < hdr.vcpu_num; i++) {
+		if (snapshot_pread(fd, &vcpu_ctx, sizeof(vcpu_ctx),
+				hdr.vcpu_offset + i * sizeof(vcpu_ctx)) < 0)
+			goto out;
+		vcpu_ctx.vcpu_id = i;
+		if (vm_set_vcpu_context(ctx, &vcpu_ctx) < 0) {
+			pr_err("%s: can't set vcpu %u context\n", __func__, i);
+			goto out;
+		}
+	}
+
+	buf = malloc(hdr.dev_len);
+	if (buf == NULL && hdr.dev_len > 0)
+		goto out;
+	if (snapshot_pread(fd, buf, hdr.dev_len, hdr.dev_offset) < 0)
+		goto out;
+	for (pos = 0, i = 0; i < hdr.ndevs; i++, pos += rec->len) {
+		rec = (struct snapshot_dev *)(buf + pos);
+		if (pos + sizeof(*rec) > hdr.dev_len ||
+		    rec->len < sizeof(*rec) || pos + rec->len > hdr.dev_len ||
+		    sizeof(*rec) + rec->msix_count *
+			sizeof(struct msix_table_entry) +
+			rec->virtio_len > rec->len) {
+			pr_err("%s: corrupted device state\n", __func__);
+			goto out;
+		}
+		rec->name[PI_NAMESZ - 1] = '\0';
+		if (snapshot_load_dev(ctx, rec) < 0)
+			goto out;
+	}
+
+	ret = 0;
+	pr_notice("VM restored from %s in %lu ms\n", path,
+		snapshot_now_ms() - start);
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
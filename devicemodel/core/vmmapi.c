@@ -216,6 +216,7 @@ vm_create(const char *name, uint64_t req_buf, int *vcpu_num)
 	}
 
 	*vcpu_num = create_vm.vcpu_num;
+	ctx->vcpu_num = create_vm.vcpu_num;
 	ctx->vmid = create_vm.vmid;
 
 	return ctx;
@@ -368,6 +369,25 @@ vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	return error;
 }
 
+int
+vm_unmap_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot)
+{
+	struct acrn_vm_memmap memmap;
+	int error;
+	bzero(&memmap, sizeof(struct acrn_vm_memmap));
+	memmap.type = ACRN_MEMMAP_RAM;
+	memmap.vma_base = vma;
+	memmap.len = len;
+	memmap.user_vm_pa = gpa;
+	memmap.attr = prot;
+	error = ioctl(ctx->fd, ACRN_IOCTL_UNSET_MEMSEG, &memmap);
+	if (error) {
+		pr_err("ACRN_IOCTL_UNSET_MEMSEG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 int
 vm_setup_memory(struct vmctx *ctx, size_t memsize)
 {
@@ -705,6 +725,55 @@ vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_vcpu_regs *vcpu_regs)
 	return error;
 }
 
+int
+vm_get_vcpu_context(struct vmctx *ctx, struct acrn_vcpu_context *vcpu_ctx)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_GET_VCPU_CONTEXT, vcpu_ctx);
+	if (error) {
+		pr_err("ACRN_IOCTL_GET_VCPU_CONTEXT ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_vcpu_context(struct vmctx *ctx, struct acrn_vcpu_context *vcpu_ctx)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_VCPU_CONTEXT, vcpu_ctx);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_VCPU_CONTEXT ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_dirty_log(struct vmctx *ctx, bool enable)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_DIRTY_LOG, (__u64)enable);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_DIRTY_LOG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t len, uint64_t *bitmap)
+{
+	struct acrn_dirty_log dlog;
+	int error;
+
+	dlog.gpa = gpa;
+	dlog.size = len;
+	dlog.bitmap = (uint64_t)bitmap;
+	error = ioctl(ctx->fd, ACRN_IOCTL_GET_DIRTY_LOG, &dlog);
+	if (error) {
+		pr_err("ACRN_IOCTL_GET_DIRTY_LOG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 int
 vm_get_cpu_state(struct vmctx *ctx, void *state_buf)
 {
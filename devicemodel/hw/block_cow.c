@@ -0,0 +1,557 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Copy-on-write overlay images.
+ *
+ * The overlay is a sparse file laid out as
+ *
+ *   0              header, followed by the path of the base image
+ *   bitmap_offset  allocation bitmap, one bit per cluster, set if the
+ *                  cluster is in the overlay
+ *   data_offset    clusters, at data_offset + the guest offset
+ *
+ * Clusters are only ever allocated, so there is no mapping table: a
+ * cluster that was never written is a hole in the overlay and reads come
+ * from the base image, which is opened read-only and can be shared by the
+ * overlays of many guests. All the fields are little-endian.
+ *
+ * The first write to a cluster copies the parts of it it does not cover
+ * from the base. The bitmap is kept in memory and the dirty pages of it
+ * are only written on flush, after the data has been synced, so a set bit
+ * on disk always refers to data on disk.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_if.h"
+#include "block_cow.h"
+#include "atomic.h"
+#include "log.h"
+
+#define COW_MAGIC		"ACRNCOW"
+#define COW_VERSION		1U
+#define COW_HEADER_SIZE		4096UL
+#define COW_CLUSTER_BITS	16U	/* 64KiB clusters */
+#define COW_BITMAP_PAGE		4096UL
+
+struct cow_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	cluster_bits;
+	uint64_t	size;		/* of the virtual disk */
+	uint64_t	bitmap_offset;
+	uint64_t	data_offset;
+	uint32_t	backing_len;	/* the base path follows the header */
+	uint32_t	reserved;
+} __attribute__((packed));
+
+struct blockcow {
+	int		fd;		/* the overlay */
+	int		base_fd;
+	int		ro;
+	off_t		size;
+	uint32_t	cluster_bits;
+	off_t		bitmap_offset;
+	off_t		data_offset;
+
+	uint64_t	*bitmap;
+	size_t		bitmap_len;	/* in bytes, whole bitmap pages */
+	uint8_t		*dirty;		/* bitmap pages to write on flush */
+	int		nr_dirty;
+
+	/* serializes cluster allocations and flushes */
+	pthread_mutex_t	mtx;
+	char		*buf;		/* one cluster, under mtx */
+};
+
+static inline int
+cow_allocated(struct blockcow *cow, uint64_t cluster)
+{
+	return (atomic_load(&cow->bitmap[cluster / 64]) >> (cluster % 64)) & 1;
+}
+
+/* Called with cow->mtx held */
+static void
+cow_set_allocated(struct blockcow *cow, uint64_t first, uint64_t last)
+{
+	uint64_t c;
+	size_t page;
+
+	for (c = first; c <= last; c++) {
+		atomic_fetch_or(&cow->bitmap[c / 64], 1UL << (c % 64));
+		page = c / 8 / COW_BITMAP_PAGE;
+		if (!cow->dirty[page]) {
+			cow->dirty[page] = 1;
+			cow->nr_dirty++;
+		}
+	}
+}
+
+static size_t
+cow_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* Describe len bytes from skip on of iov in sub, return the entries used */
+static int
+cow_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+	      struct iovec *sub)
+{
+	size_t l;
+	int i, n;
+
+	for (i = 0, n = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = MIN(iov[i].iov_len - skip, len);
+		sub[n].iov_base = (char *)iov[i].iov_base + skip;
+		sub[n].iov_len = l;
+		n++;
+		len -= l;
+		skip = 0;
+	}
+	return n;
+}
+
+static void
+cow_iov_zero(const struct iovec *iov, int iovcnt, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memset((char *)iov[i].iov_base + skip, 0,
+		       iov[i].iov_len - skip);
+		skip = 0;
+	}
+}
+
+/* Called with cow->mtx held */
+static int
+cow_copy_base(struct blockcow *cow, off_t offset, size_t len)
+{
+	ssize_t n;
+
+	n = pread(cow->base_fd, cow->buf, len, offset);
+	if (n < 0)
+		return -1;
+	/* past the end of the base is a hole in the overlay already */
+	if (n == 0)
+		return 0;
+	if (pwrite(cow->fd, cow->buf, n, cow->data_offset + offset) != n) {
+		if (errno == 0)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write into clusters first to last, which were not in the overlay when
+ * checked. The parts of the first and the last one outside of the request
+ * are copied from the base before they are marked allocated.
+ */
+static int
+cow_alloc_write(struct blockcow *cow, const struct iovec *iov, int iovcnt,
+		off_t offset, size_t len, uint64_t first, uint64_t last)
+{
+	off_t start, end;
+	int head, tail, err;
+	ssize_t n;
+
+	start = first << cow->cluster_bits;
+	end = MIN((off_t)(last + 1) << cow->cluster_bits, cow->size);
+
+	err = 0;
+	pthread_mutex_lock(&cow->mtx);
+
+	/* another request may have allocated them meanwhile */
+	head = offset > start && !cow_allocated(cow, first);
+	tail = offset + len < end && !cow_allocated(cow, last);
+
+	if (head && cow_copy_base(cow, start, offset - start) < 0)
+		err = -1;
+	if (!err && tail &&
+	    cow_copy_base(cow, offset + len, end - offset - len) < 0)
+		err = -1;
+	if (!err) {
+		n = pwritev(cow->fd, iov, iovcnt, cow->data_offset + offset);
+		if (n != len) {
+			if (n >= 0)
+				errno = EIO;
+			err = -1;
+		}
+	}
+	if (!err)
+		cow_set_allocated(cow, first, last);
+
+	pthread_mutex_unlock(&cow->mtx);
+	return err;
+}
+
+/*
+ * Split [offset, offset + total) into runs of clusters that are all in
+ * the overlay or all in the base, return the length of the first run
+ */
+static size_t
+cow_run(struct blockcow *cow, off_t offset, size_t total, int *alloc,
+	uint64_t *first, uint64_t *last)
+{
+	uint64_t c;
+	off_t end;
+
+	c = offset >> cow->cluster_bits;
+	*first = c;
+	*alloc = cow_allocated(cow, c);
+	while ((off_t)(c + 1) << cow->cluster_bits < offset + total &&
+	       cow_allocated(cow, c + 1) == *alloc)
+		c++;
+	*last = c;
+
+	end = MIN((off_t)(c + 1) << cow->cluster_bits, offset + total);
+	return end - offset;
+}
+
+ssize_t
+blockcow_preadv(struct blockcow *cow, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	struct iovec sub[BLOCKIF_IOV_MAX];
+	uint64_t first, last;
+	size_t total, done, len;
+	ssize_t n;
+	int alloc, cnt;
+
+	total = cow_iov_len(iov, iovcnt);
+	if (offset < 0 || offset + total > cow->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (done = 0; done < total; done += len) {
+		len = cow_run(cow, offset + done, total - done, &alloc,
+			      &first, &last);
+		cnt = cow_iov_slice(iov, iovcnt, done, len, sub);
+		if (alloc)
+			n = preadv(cow->fd, sub, cnt,
+				   cow->data_offset + offset + done);
+		else
+			n = preadv(cow->base_fd, sub, cnt, offset + done);
+		if (n < 0)
+			return -1;
+		/* the base may be shorter than the disk */
+		if (n < len)
+			cow_iov_zero(sub, cnt, n);
+	}
+
+	return total;
+}
+
+ssize_t
+blockcow_pwritev(struct blockcow *cow, const struct iovec *iov, int iovcnt,
+		 off_t offset)
+{
+	struct iovec sub[BLOCKIF_IOV_MAX];
+	uint64_t first, last;
+	size_t total, done, len;
+	ssize_t n;
+	int alloc, cnt;
+
+	if (cow->ro) {
+		errno = EROFS;
+		return -1;
+	}
+
+	total = cow_iov_len(iov, iovcnt);
+	if (offset < 0 || offset + total > cow->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (done = 0; done < total; done += len) {
+		len = cow_run(cow, offset + done, total - done, &alloc,
+			      &first, &last);
+		cnt = cow_iov_slice(iov, iovcnt, done, len, sub);
+		if (alloc) {
+			n = pwritev(cow->fd, sub, cnt,
+				    cow->data_offset + offset + done);
+			if (n < 0)
+				return -1;
+			if (n != len) {
+				errno = EIO;
+				return -1;
+			}
+		} else if (cow_alloc_write(cow, sub, cnt, offset + done, len,
+					   first, last) < 0)
+			return -1;
+	}
+
+	return total;
+}
+
+/* Called with cow->mtx held */
+static int
+cow_write_bitmap(struct blockcow *cow)
+{
+	uint64_t page[COW_BITMAP_PAGE / sizeof(uint64_t)];
+	const uint64_t *words;
+	size_t i, j;
+
+	for (i = 0; i < cow->bitmap_len / COW_BITMAP_PAGE; i++) {
+		if (!cow->dirty[i])
+			continue;
+
+		words = cow->bitmap + i * ARRAY_SIZE(page);
+		for (j = 0; j < ARRAY_SIZE(page); j++)
+			page[j] = htole64(atomic_load(&words[j]));
+		if (pwrite(cow->fd, page, sizeof(page), cow->bitmap_offset +
+			   i * COW_BITMAP_PAGE) != sizeof(page))
+			return errno ? errno : EIO;
+
+		cow->dirty[i] = 0;
+		cow->nr_dirty--;
+	}
+	return 0;
+}
+
+/*
+ * Make the written data and then the bitmap durable. Returns 0 or an
+ * errno value.
+ */
+int
+blockcow_flush(struct blockcow *cow)
+{
+	int err;
+
+	err = 0;
+	pthread_mutex_lock(&cow->mtx);
+	if (fdatasync(cow->fd))
+		err = errno;
+	else if (cow->nr_dirty) {
+		err = cow_write_bitmap(cow);
+		if (!err && fdatasync(cow->fd))
+			err = errno;
+	}
+	pthread_mutex_unlock(&cow->mtx);
+
+	return err;
+}
+
+static int
+cow_format(int fd, const char *base)
+{
+	struct cow_header hdr;
+	char path[PATH_MAX];
+	uint64_t csize, bitmap_len;
+	off_t size, data_offset;
+	size_t plen;
+	int base_fd;
+
+	if (!realpath(base, path)) {
+		pr_err("blockcow: could not find base image %s\n", base);
+		return -1;
+	}
+	plen = strnlen(path, sizeof(path));
+	if (sizeof(hdr) + plen > COW_HEADER_SIZE) {
+		pr_err("blockcow: base image path %s too long\n", path);
+		return -1;
+	}
+
+	base_fd = open(path, O_RDONLY);
+	if (base_fd < 0) {
+		pr_err("blockcow: could not open base image %s\n", path);
+		return -1;
+	}
+	/* block devices report no st_size */
+	size = lseek(base_fd, 0, SEEK_END);
+	close(base_fd);
+	if (size <= 0 || (size & (DEV_BSIZE - 1))) {
+		pr_err("blockcow: %s size not correct, should be multiple of %d\n",
+			path, DEV_BSIZE);
+		return -1;
+	}
+
+	csize = 1UL << COW_CLUSTER_BITS;
+	bitmap_len = roundup(howmany(howmany(size, csize), 8), COW_BITMAP_PAGE);
+	data_offset = roundup(COW_HEADER_SIZE + bitmap_len, csize);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, COW_MAGIC, sizeof(COW_MAGIC));
+	hdr.version = htole32(COW_VERSION);
+	hdr.cluster_bits = htole32(COW_CLUSTER_BITS);
+	hdr.size = htole64(size);
+	hdr.bitmap_offset = htole64(COW_HEADER_SIZE);
+	hdr.data_offset = htole64(data_offset);
+	hdr.backing_len = htole32(plen);
+
+	/* the bitmap and the clusters start as holes */
+	if (ftruncate(fd, data_offset + size) < 0 ||
+	    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    pwrite(fd, path, plen, sizeof(hdr)) != plen ||
+	    fsync(fd) < 0) {
+		pr_err("blockcow: failed to format overlay, error is %d\n",
+			errno);
+		return -1;
+	}
+
+	pr_info("blockcow: created overlay on %s\n", path);
+	return 0;
+}
+
+struct blockcow *
+blockcow_open(int fd, const char *base, int ro)
+{
+	struct cow_header hdr;
+	char path[PATH_MAX], rbase[PATH_MAX];
+	struct blockcow *cow;
+	struct stat st;
+	uint64_t csize, nr_clusters;
+	size_t i, plen;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		pr_err("blockcow: the overlay must be a regular file\n");
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		if (base == NULL || ro) {
+			pr_err("blockcow: overlay is empty, cannot create it without a writable overlay and a base image\n");
+			return NULL;
+		}
+		if (cow_format(fd, base) < 0)
+			return NULL;
+	}
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, COW_MAGIC, sizeof(COW_MAGIC)) ||
+	    le32toh(hdr.version) != COW_VERSION) {
+		pr_err("blockcow: not an overlay image\n");
+		return NULL;
+	}
+
+	plen = le32toh(hdr.backing_len);
+	if (plen == 0 || plen >= sizeof(path) ||
+	    pread(fd, path, plen, sizeof(hdr)) != plen) {
+		pr_err("blockcow: invalid base image path in overlay\n");
+		return NULL;
+	}
+	path[plen] = '\0';
+
+	if (base && (!realpath(base, rbase) || strcmp(rbase, path))) {
+		pr_err("blockcow: overlay is based on %s, not %s\n", path, base);
+		return NULL;
+	}
+
+	cow = calloc(1, sizeof(struct blockcow));
+	if (cow == NULL) {
+		pr_err("blockcow: calloc failed\n");
+		return NULL;
+	}
+	cow->fd = fd;
+	cow->ro = ro;
+	cow->size = le64toh(hdr.size);
+	cow->cluster_bits = le32toh(hdr.cluster_bits);
+	cow->bitmap_offset = le64toh(hdr.bitmap_offset);
+	cow->data_offset = le64toh(hdr.data_offset);
+
+	if (cow->cluster_bits < 9 || cow->cluster_bits > 24 ||
+	    cow->size <= 0 || (cow->size & (DEV_BSIZE - 1))) {
+		pr_err("blockcow: invalid overlay geometry\n");
+		goto fail;
+	}
+	csize = 1UL << cow->cluster_bits;
+	nr_clusters = howmany(cow->size, csize);
+	cow->bitmap_len = roundup(howmany(nr_clusters, 8), COW_BITMAP_PAGE);
+	if (cow->bitmap_offset < COW_HEADER_SIZE ||
+	    cow->data_offset < cow->bitmap_offset + cow->bitmap_len) {
+		pr_err("blockcow: invalid overlay layout\n");
+		goto fail;
+	}
+
+	cow->base_fd = open(path, O_RDONLY);
+	if (cow->base_fd < 0) {
+		pr_err("blockcow: could not open base image %s\n", path);
+		goto fail;
+	}
+
+	cow->bitmap = malloc(cow->bitmap_len);
+	cow->dirty = calloc(cow->bitmap_len / COW_BITMAP_PAGE, 1);
+	cow->buf = malloc(csize);
+	if (!cow->bitmap || !cow->dirty || !cow->buf) {
+		pr_err("blockcow: out of memory\n");
+		goto fail_base;
+	}
+	if (pread(fd, cow->bitmap, cow->bitmap_len, cow->bitmap_offset) !=
+	    cow->bitmap_len) {
+		pr_err("blockcow: failed to read the allocation bitmap\n");
+		goto fail_base;
+	}
+	for (i = 0; i < cow->bitmap_len / sizeof(uint64_t); i++)
+		cow->bitmap[i] = le64toh(cow->bitmap[i]);
+
+	pthread_mutex_init(&cow->mtx, NULL);
+	pr_info("blockcow: overlay of %s, %lu bytes\n", path, cow->size);
+	return cow;
+
+fail_base:
+	close(cow->base_fd);
+fail:
+	free(cow->buf);
+	free(cow->dirty);
+	free(cow->bitmap);
+	free(cow);
+	return NULL;
+}
+
+off_t
+blockcow_size(struct blockcow *cow)
+{
+	return cow->size;
+}
+
+/* Flush and release the overlay, the caller closes its fd */
+void
+blockcow_close(struct blockcow *cow)
+{
+	int err;
+
+	if (!cow->ro) {
+		err = blockcow_flush(cow);
+		if (err)
+			pr_err("blockcow: failed to flush overlay, error is %d\n",
+				err);
+	}
+	close(cow->base_fd);
+	pthread_mutex_destroy(&cow->mtx);
+	free(cow->buf);
+	free(cow->dirty);
+	free(cow->bitmap);
+	free(cow);
+}
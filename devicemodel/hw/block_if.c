@@ -40,13 +40,16 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dm.h"
 #include "block_if.h"
+#include "block_cow.h"
 #include "ahci.h"
 #include "dm_string.h"
 #include "log.h"
+#include "mevent.h"
 
 /*
  * Notes:
@@ -66,6 +69,10 @@
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 #define MAX_DISCARD_SEGMENT	256
 
+/* bounce buffer of O_DIRECT requests that are not aligned */
+#define BLOCKIF_BOUNCE_SIZE	(256 * 1024)
+#define BLOCKIF_DIO_ALIGN	4096
+
 /*
  * Debug printf
  */
@@ -95,6 +102,20 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	uint64_t	     throttle_start;	/* ns, 0 if not throttled */
+	uint64_t	     enq_ns;
+	uint64_t	     start_ns;
+	uint64_t	     done_ns;
+	size_t		     bytes;
+	int		     err;
+};
+
+/* Token bucket of one I/O limit */
+struct blockif_bucket {
+	uint64_t	rate;		/* tokens per second, 0 if unlimited */
+	uint64_t	burst;		/* bucket size */
+	double		tokens;
+	uint64_t	last_ns;	/* last refill */
 };
 
 struct blockif_ctxt {
@@ -106,6 +127,7 @@ struct blockif_ctxt {
 	int			sub_file_assign;
 	off_t			sub_file_start_lba;
 	struct flock		fl;
+	struct blockcow		*cow;	/* copy-on-write overlay, or NULL */
 	int			sectsz;
 	int			psectsz;
 	int			psectoff;
@@ -125,8 +147,57 @@ struct blockif_ctxt {
 
 	/* write cache enable */
 	uint8_t			wce;
+
+	/*
+	 * O_DIRECT alignment of file offsets and of memory, 0 if the image
+	 * is not opened with O_DIRECT. Unaligned requests go through the
+	 * bounce buffers, one per worker at most, under mtx. Unaligned
+	 * writes read-modify-write the blocks at their ends, bounce_mtx
+	 * keeps two of them from doing it to the same block.
+	 */
+	int			dio_align;
+	int			dio_mem_align;
+	void			*bounce[BLOCKIF_NUMTHR];
+	int			nr_bounce;
+	pthread_mutex_t		bounce_mtx;
+
+	/* I/O limits and how often they held requests back, under mtx */
+	int			throttling;
+	struct blockif_bucket	qos[BLOCKIF_QOS_NR];
+	uint64_t		throttled[2];
+	uint64_t		throttled_ns[2];
+	uint32_t		nr_throttled;
+
+	/* request statistics, under mtx */
+	struct blockif_stats	stats;
+
+	char			ident[16];
+	LIST_ENTRY(blockif_ctxt) list;
+};
+
+const char *const blockif_op_names[BLOCKIF_OP_NR] = {
+	"read",
+	"write",
+	"flush",
+	"discard",
 };
 
+const char *const blockif_qos_names[BLOCKIF_QOS_NR] = {
+	"iops_rd",
+	"iops_wr",
+	"bps_rd",
+	"bps_wr",
+};
+
+/* all the open blockif contexts, for the monitor */
+static LIST_HEAD(, blockif_ctxt) blockif_list =
+	LIST_HEAD_INITIALIZER(blockif_list);
+static pthread_mutex_t blockif_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* where the statistics are appended on SIGUSR1, see blockif_set_stats_dump */
+static char *blockif_stats_path;
+static int blockif_stats_pipe[2] = {-1, -1};
+
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
 struct blockif_sig_elem {
@@ -144,6 +215,15 @@ struct discard_range {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static inline uint64_t
+blockif_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 static int
 blockif_flush_cache(struct blockif_ctxt *bc)
 {
@@ -151,7 +231,9 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 
 	err = 0;
 	if (!bc->wce) {
-		if (fsync(bc->fd))
+		if (bc->cow)
+			err = blockcow_flush(bc->cow);
+		else if (fsync(bc->fd))
 			err = errno;
 	}
 	return err;
@@ -186,6 +268,8 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		off = 1 << (sizeof(off_t) - 1);
 	}
 	be->block = off;
+	be->bytes = (op == BOP_DISCARD || op == BOP_FLUSH) ? 0 : off - breq->offset;
+	be->enq_ns = blockif_now_ns();
 	TAILQ_FOREACH(tbe, &bc->pendq, link) {
 		if (tbe->block == breq->offset)
 			break;
@@ -198,40 +282,186 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	}
 	if (tbe == NULL)
 		be->status = BST_PEND;
-	else
+	else {
 		be->status = BST_BLOCK;
+		bc->stats.blocked++;
+	}
 	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	bc->stats.queued++;
+	bc->stats.max_depth = MAX(bc->stats.max_depth,
+				  bc->stats.queued + bc->stats.inflight);
 	return (be->status == BST_PEND);
 }
 
+static void
+blockif_bucket_refill(struct blockif_bucket *b, uint64_t now)
+{
+	if (!b->rate)
+		return;
+	b->tokens += (double)(now - b->last_ns) * b->rate / 1000000000.0;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last_ns = now;
+}
+
+/* ns until b has tokens again */
+static uint64_t
+blockif_bucket_wait(struct blockif_bucket *b)
+{
+	if (!b->rate || b->tokens > 0)
+		return 0;
+	return (uint64_t)(-b->tokens * 1000000000.0 / b->rate) + 1;
+}
+
+/*
+ * Take the tokens for be if both buckets of its direction have some left.
+ * They may go below zero, so a request larger than the burst still runs
+ * and the next ones wait for it to be paid back. Returns 0 if be can run,
+ * otherwise the ns to wait.
+ */
+static uint64_t
+blockif_qos_admit(struct blockif_ctxt *bc, struct blockif_elem *be,
+		int dir, uint64_t now)
+{
+	struct blockif_bucket *iops, *bps;
+	uint64_t wait;
+
+	iops = &bc->qos[BLOCKIF_QOS_IOPS_RD + dir];
+	bps = &bc->qos[BLOCKIF_QOS_BPS_RD + dir];
+	blockif_bucket_refill(iops, now);
+	blockif_bucket_refill(bps, now);
+
+	wait = MAX(blockif_bucket_wait(iops), blockif_bucket_wait(bps));
+	if (wait)
+		return wait;
+
+	if (iops->rate)
+		iops->tokens -= 1;
+	if (bps->rate)
+		bps->tokens -= be->req->resid;
+	return 0;
+}
+
+/*
+ * Pick the first pending request that the I/O limits let run. Reads and
+ * writes are limited separately, and neither overtakes an earlier request
+ * of its own direction that is held back. If all are held back, wait_ns
+ * is set to when the first one may run.
+ */
 static int
-blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep,
+		uint64_t *wait_ns)
 {
 	struct blockif_elem *be;
+	uint64_t now, wait, min_wait;
+	int dir, held;
 
+	now = 0;
+	min_wait = 0;
+	held = 0;
 	TAILQ_FOREACH(be, &bc->pendq, link) {
-		if (be->status == BST_PEND)
+		if (be->status != BST_PEND)
+			continue;
+		if (!bc->throttling || (be->op != BOP_READ && be->op != BOP_WRITE))
+			break;
+
+		dir = (be->op == BOP_WRITE);
+		if (held & (1 << dir))
+			continue;
+		if (!now)
+			now = blockif_now_ns();
+		wait = blockif_qos_admit(bc, be, dir, now);
+		if (!wait)
 			break;
+
+		held |= 1 << dir;
+		if (!be->throttle_start) {
+			be->throttle_start = now;
+			bc->throttled[dir]++;
+			bc->nr_throttled++;
+		}
+		if (!min_wait || wait < min_wait)
+			min_wait = wait;
 	}
+	*wait_ns = min_wait;
 	if (be == NULL)
 		return 0;
+	if (be->throttle_start) {
+		bc->throttled_ns[be->op == BOP_WRITE] += now - be->throttle_start;
+		bc->nr_throttled--;
+		be->throttle_start = 0;
+	}
 	TAILQ_REMOVE(&bc->pendq, be, link);
 	be->status = BST_BUSY;
 	be->tid = t;
+	be->start_ns = now ? now : blockif_now_ns();
+	bc->stats.queued--;
+	bc->stats.inflight++;
 	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
 	*bep = be;
 	return 1;
 }
 
+static inline int
+blockif_hist_idx(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+
+	if (!us)
+		return 0;
+	return MIN(64 - __builtin_clzl(us), BLOCKIF_HIST_NR - 1);
+}
+
+/* Called with bc->mtx held */
+static void
+blockif_account(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_op_stats *st;
+
+	switch (be->op) {
+	case BOP_READ:
+		st = &bc->stats.op[BLOCKIF_OP_READ];
+		break;
+	case BOP_WRITE:
+		st = &bc->stats.op[BLOCKIF_OP_WRITE];
+		break;
+	case BOP_FLUSH:
+		st = &bc->stats.op[BLOCKIF_OP_FLUSH];
+		break;
+	case BOP_DISCARD:
+		st = &bc->stats.op[BLOCKIF_OP_DISCARD];
+		break;
+	default:
+		return;
+	}
+
+	st->ops++;
+	if (be->err)
+		st->errors++;
+	else
+		st->bytes += be->bytes;
+	st->queue_hist[blockif_hist_idx(be->start_ns - be->enq_ns)]++;
+	st->service_hist[blockif_hist_idx(be->done_ns - be->start_ns)]++;
+}
+
 static void
 blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
 	struct blockif_elem *tbe;
 
-	if (be->status == BST_DONE || be->status == BST_BUSY)
+	if (be->status == BST_DONE || be->status == BST_BUSY) {
 		TAILQ_REMOVE(&bc->busyq, be, link);
-	else
+		bc->stats.inflight--;
+		if (be->status == BST_DONE)
+			blockif_account(bc, be);
+	} else {
 		TAILQ_REMOVE(&bc->pendq, be, link);
+		bc->stats.queued--;
+	}
+	if (be->throttle_start) {
+		bc->nr_throttled--;
+		be->throttle_start = 0;
+	}
 	TAILQ_FOREACH(tbe, &bc->pendq, link) {
 		if (tbe->req->offset == be->block)
 			tbe->status = BST_PEND;
@@ -326,6 +556,157 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 	return 0;
 }
 
+static int
+blockif_dio_aligned(struct blockif_ctxt *bc, struct blockif_req *br, off_t off)
+{
+	int i;
+
+	if (off % bc->dio_align)
+		return 0;
+	for (i = 0; i < br->iovcnt; i++) {
+		if ((uintptr_t)br->iov[i].iov_base % bc->dio_mem_align ||
+		    br->iov[i].iov_len % bc->dio_align)
+			return 0;
+	}
+	return 1;
+}
+
+static void *
+blockif_bounce_get(struct blockif_ctxt *bc)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&bc->mtx);
+	if (bc->nr_bounce > 0)
+		buf = bc->bounce[--bc->nr_bounce];
+	pthread_mutex_unlock(&bc->mtx);
+
+	/* the pool grows up to one buffer per worker */
+	if (buf == NULL &&
+	    posix_memalign(&buf, MAX(bc->dio_mem_align, BLOCKIF_DIO_ALIGN),
+			   BLOCKIF_BOUNCE_SIZE))
+		buf = NULL;
+	return buf;
+}
+
+static void
+blockif_bounce_put(struct blockif_ctxt *bc, void *buf)
+{
+	pthread_mutex_lock(&bc->mtx);
+	bc->bounce[bc->nr_bounce++] = buf;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+/* Copy len bytes between buf and the request, from skip on in it */
+static void
+blockif_bounce_copy(struct blockif_req *br, size_t skip, char *buf,
+		size_t len, int to_req)
+{
+	size_t l;
+	int i;
+
+	for (i = 0; i < br->iovcnt && len > 0; i++) {
+		if (skip >= br->iov[i].iov_len) {
+			skip -= br->iov[i].iov_len;
+			continue;
+		}
+		l = MIN(br->iov[i].iov_len - skip, len);
+		if (to_req)
+			memcpy((char *)br->iov[i].iov_base + skip, buf, l);
+		else
+			memcpy(buf, (char *)br->iov[i].iov_base + skip, l);
+		buf += l;
+		len -= l;
+		skip = 0;
+	}
+}
+
+/* Read an aligned block into buf, zeroes past the end of the image */
+static int
+blockif_bounce_fill(struct blockif_ctxt *bc, char *buf, off_t off)
+{
+	ssize_t n;
+
+	n = pread(bc->fd, buf, bc->dio_align, off);
+	if (n < 0)
+		return -1;
+	if (n < bc->dio_align)
+		memset(buf + n, 0, bc->dio_align - n);
+	return 0;
+}
+
+/*
+ * Read or write an O_DIRECT request that is not aligned, through a bounce
+ * buffer, in chunks of aligned blocks that cover it.
+ */
+static ssize_t
+blockif_bounce_rw(struct blockif_ctxt *bc, struct blockif_req *br, off_t off,
+		int write)
+{
+	off_t pos, start, end, tail;
+	size_t total, done, n;
+	ssize_t ret;
+	char *buf;
+	int i;
+
+	buf = blockif_bounce_get(bc);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < br->iovcnt; i++)
+		total += br->iov[i].iov_len;
+
+	ret = 0;
+	if (write)
+		pthread_mutex_lock(&bc->bounce_mtx);
+	for (done = 0; done < total; done += n) {
+		pos = off + done;
+		start = pos - pos % bc->dio_align;
+		end = MIN(roundup(off + total, bc->dio_align),
+			  start + BLOCKIF_BOUNCE_SIZE);
+		n = MIN(end - pos, total - done);
+
+		if (!write) {
+			ret = pread(bc->fd, buf, end - start, start);
+			if (ret < 0)
+				break;
+			if (ret < pos - start + n) {
+				errno = EIO;
+				ret = -1;
+				break;
+			}
+			blockif_bounce_copy(br, done, buf + (pos - start), n, 1);
+			continue;
+		}
+
+		/* keep what the request does not cover of the end blocks */
+		tail = pos + n - (pos + n) % bc->dio_align;
+		if ((pos > start && blockif_bounce_fill(bc, buf, start) < 0) ||
+		    (pos + n < end && (tail > start || pos == start) &&
+		     blockif_bounce_fill(bc, buf + (tail - start), tail) < 0)) {
+			ret = -1;
+			break;
+		}
+		blockif_bounce_copy(br, done, buf + (pos - start), n, 0);
+		ret = pwrite(bc->fd, buf, end - start, start);
+		if (ret < 0)
+			break;
+		if (ret < end - start) {
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+	}
+	if (write)
+		pthread_mutex_unlock(&bc->bounce_mtx);
+
+	blockif_bounce_put(bc, buf);
+	return ret < 0 ? -1 : (ssize_t)total;
+}
+
 static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
@@ -337,7 +718,15 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
-		len = preadv(bc->fd, br->iov, br->iovcnt,
+		if (bc->cow)
+			len = blockcow_preadv(bc->cow, br->iov, br->iovcnt,
+					br->offset);
+		else if (bc->dio_align && !blockif_dio_aligned(bc, br,
+				br->offset + bc->sub_file_start_lba))
+			len = blockif_bounce_rw(bc, br,
+				br->offset + bc->sub_file_start_lba, 0);
+		else
+			len = preadv(bc->fd, br->iov, br->iovcnt,
 				 br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
@@ -350,7 +739,15 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 			break;
 		}
 
-		len = pwritev(bc->fd, br->iov, br->iovcnt,
+		if (bc->cow)
+			len = blockcow_pwritev(bc->cow, br->iov, br->iovcnt,
+					br->offset);
+		else if (bc->dio_align && !blockif_dio_aligned(bc, br,
+				br->offset + bc->sub_file_start_lba))
+			len = blockif_bounce_rw(bc, br,
+				br->offset + bc->sub_file_start_lba, 1);
+		else
+			len = pwritev(bc->fd, br->iov, br->iovcnt,
 				  br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
@@ -360,7 +757,9 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 		}
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
+		if (bc->cow)
+			err = blockcow_flush(bc->cow);
+		else if (fsync(bc->fd))
 			err = errno;
 		break;
 	case BOP_DISCARD:
@@ -371,6 +770,8 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 		break;
 	}
 
+	be->done_ns = blockif_now_ns();
+	be->err = err;
 	be->status = BST_DONE;
 
 	(*br->callback)(br, err);
@@ -381,6 +782,8 @@ blockif_thr(void *arg)
 {
 	struct blockif_ctxt *bc;
 	struct blockif_elem *be;
+	struct timespec ts;
+	uint64_t wait_ns;
 	pthread_t t;
 
 	bc = arg;
@@ -389,7 +792,7 @@ blockif_thr(void *arg)
 	pthread_mutex_lock(&bc->mtx);
 
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
+		while (blockif_dequeue(bc, t, &be, &wait_ns)) {
 			pthread_mutex_unlock(&bc->mtx);
 			blockif_proc(bc, be);
 			pthread_mutex_lock(&bc->mtx);
@@ -398,7 +801,15 @@ blockif_thr(void *arg)
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
 			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
+		if (wait_ns) {
+			/* throttled requests are pending, retry when they may run */
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			wait_ns += ts.tv_nsec;
+			ts.tv_sec += wait_ns / 1000000000UL;
+			ts.tv_nsec = wait_ns % 1000000000UL;
+			pthread_cond_timedwait(&bc->cond, &bc->mtx, &ts);
+		} else
+			pthread_cond_wait(&bc->cond, &bc->mtx);
 	}
 
 	pthread_mutex_unlock(&bc->mtx);
@@ -434,10 +845,56 @@ blockif_sigcont_handler(int signal)
 	}
 }
 
+static void
+blockif_stats_sig_handler(int signal)
+{
+	char c = 0;
+
+	/* only async-signal-safe work here, the dump runs in mevent */
+	if (write(blockif_stats_pipe[1], &c, 1) < 0)
+		return;
+}
+
+static void
+blockif_stats_dump_cb(int fd, enum ev_type t, void *arg)
+{
+	char buf[64];
+	FILE *fp;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	fp = fopen(blockif_stats_path, "a");
+	if (fp == NULL) {
+		pr_err("blockif: could not open %s for the statistics\n",
+			blockif_stats_path);
+		return;
+	}
+	blockif_dump_stats(fp);
+	fclose(fp);
+}
+
+static void
+blockif_stats_dump_init(void)
+{
+	if (pipe2(blockif_stats_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		pr_err("blockif: failed to create statistics pipe\n");
+		return;
+	}
+	if (mevent_add(blockif_stats_pipe[0], EVF_READ, blockif_stats_dump_cb,
+			NULL, NULL, NULL) == NULL) {
+		pr_err("blockif: failed to add statistics pipe to mevent\n");
+		return;
+	}
+	signal(SIGUSR1, blockif_stats_sig_handler);
+}
+
 static void
 blockif_init(void)
 {
 	signal(SIGCONT, blockif_sigcont_handler);
+	if (blockif_stats_path)
+		blockif_stats_dump_init();
 }
 
 /*
@@ -486,6 +943,69 @@ sub_file_unlock(struct blockif_ctxt *bc)
 	}
 }
 
+/*
+ * Find the O_DIRECT alignment of fd: the logical block size of a block
+ * device, what statx reports for a file, or BLOCKIF_DIO_ALIGN if it
+ * cannot tell.
+ */
+static void
+blockif_dio_probe(int fd, struct stat *sbuf, int *align, int *mem_align)
+{
+	int ssz;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+
+	*align = BLOCKIF_DIO_ALIGN;
+	*mem_align = BLOCKIF_DIO_ALIGN;
+	if (S_ISBLK(sbuf->st_mode)) {
+		if (!ioctl(fd, BLKSSZGET, &ssz) && ssz > 0) {
+			*align = ssz;
+			*mem_align = ssz;
+		}
+		return;
+	}
+#ifdef STATX_DIOALIGN
+	if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+	    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+		*align = stx.stx_dio_offset_align;
+		*mem_align = stx.stx_dio_mem_align;
+	}
+#endif
+}
+
+/*
+ * Parse an I/O limit, "<name>=<rate>[/<burst>]". Returns its index, or -1
+ * if cp is not one or is invalid.
+ */
+static int
+blockif_parse_qos(char *cp, uint64_t *rate, uint64_t *burst)
+{
+	char *name;
+	long r, b;
+	int i;
+
+	name = strsep(&cp, "=");
+	for (i = 0; i < BLOCKIF_QOS_NR; i++) {
+		if (!strcmp(name, blockif_qos_names[i]))
+			break;
+	}
+	if (i == BLOCKIF_QOS_NR || cp == NULL)
+		return -1;
+
+	if (dm_strtol(cp, &cp, 10, &r) || r <= 0)
+		return -1;
+	/* one second worth of I/O by default */
+	b = r;
+	if (*cp == '/' && (dm_strtol(cp + 1, &cp, 10, &b) || b <= 0))
+		return -1;
+	if (*cp != '\0')
+		return -1;
+
+	rate[i] = r;
+	burst[i] = b;
+	return i;
+}
 
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
@@ -494,22 +1014,34 @@ blockif_open(const char *optstr, const char *ident)
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
+	struct blockcow *cow;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
 	int fd, i, sectsz;
 	int writeback, ro, candiscard, ssopt, pssopt;
+	int direct, dio_align, dio_mem_align;
 	long sz;
 	long long b;
 	int err_code = -1;
 	off_t sub_file_start_lba, sub_file_size;
 	int sub_file_assign;
+	int use_cow, created = 0;
+	char *cow_base;
+	uint64_t qos_rate[BLOCKIF_QOS_NR], qos_burst[BLOCKIF_QOS_NR];
+	uint64_t now;
+	pthread_condattr_t cattr;
 	int max_discard_sectors, max_discard_seg, discard_sector_alignment;
 	off_t probe_arg[] = {0, 0};
 
 	pthread_once(&blockif_once, blockif_init);
 
 	fd = -1;
+	cow = NULL;
+	use_cow = 0;
+	cow_base = NULL;
+	memset(qos_rate, 0, sizeof(qos_rate));
+	memset(qos_burst, 0, sizeof(qos_burst));
 	ssopt = 0;
 	pssopt = 0;
 	ro = 0;
@@ -524,6 +1056,10 @@ blockif_open(const char *optstr, const char *ident)
 	/* writethru is on by default */
 	writeback = 0;
 
+	direct = 0;
+	dio_align = 0;
+	dio_mem_align = 0;
+
 	candiscard = 0;
 
 	/*
@@ -545,6 +1081,8 @@ blockif_open(const char *optstr, const char *ident)
 			writeback = 0;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "direct"))
+			direct = 1;
 		else if (!strncmp(cp, "discard", strlen("discard"))) {
 			strsep(&cp, "=");
 			if (cp != NULL) {
@@ -579,6 +1117,17 @@ blockif_open(const char *optstr, const char *ident)
 				sub_file_assign = 1;
 			else
 				goto err;
+		} else if (!strcmp(cp, "cow")) {
+			use_cow = 1;
+		} else if (!strncmp(cp, "cow=", strlen("cow="))) {
+			cow_base = cp + strlen("cow=");
+			use_cow = 1;
+		} else if (!strncmp(cp, "iops_", strlen("iops_")) ||
+			   !strncmp(cp, "bps_", strlen("bps_"))) {
+			if (blockif_parse_qos(cp, qos_rate, qos_burst) < 0) {
+				pr_err("Invalid I/O limit \"%s\"\n", cp);
+				goto err;
+			}
 		} else {
 			pr_err("Invalid device option \"%s\"\n", cp);
 			goto err;
@@ -593,6 +1142,11 @@ blockif_open(const char *optstr, const char *ident)
 	 */
 
 	fd = open(nopt, ro ? O_RDONLY : O_RDWR);
+	if (fd < 0 && use_cow && cow_base && errno == ENOENT && !ro) {
+		/* a new overlay is formatted on the base image */
+		fd = open(nopt, O_RDWR | O_CREAT | O_EXCL, 0600);
+		created = (fd >= 0);
+	}
 	if (fd < 0 && !ro) {
 		/* Attempt a r/w fail with a r/o open */
 		fd = open(nopt, O_RDONLY);
@@ -609,6 +1163,28 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 	}
 
+	if (use_cow) {
+		if (sub_file_assign) {
+			pr_err("range is not supported on overlay %s\n", nopt);
+			goto err;
+		}
+		if (candiscard) {
+			WPRINTF(("discard is not supported on overlay %s\n",
+				 nopt));
+			candiscard = 0;
+		}
+		if (direct) {
+			WPRINTF(("direct is not supported on overlay %s\n",
+				 nopt));
+			direct = 0;
+		}
+		cow = blockcow_open(fd, cow_base, ro);
+		if (cow == NULL) {
+			pr_err("Could not open overlay %s\n", nopt);
+			goto err;
+		}
+	}
+
 	/*
 	 * Deal with raw devices
 	 */
@@ -657,6 +1233,9 @@ blockif_open(const char *optstr, const char *ident)
 			}
 		}
 
+	} else if (cow) {
+		size = blockcow_size(cow);
+		psectsz = sbuf.st_blksize;
 	} else {
 		if (size < DEV_BSIZE || (size & (DEV_BSIZE - 1))) {
 			WPRINTF(("%s size not corret, should be multiple of %d\n",
@@ -666,6 +1245,29 @@ blockif_open(const char *optstr, const char *ident)
 		psectsz = sbuf.st_blksize;
 	}
 
+	/*
+	 * Bypass the host page cache. Requests that do not meet the O_DIRECT
+	 * alignment go through bounce buffers, the image must be made of
+	 * whole aligned blocks so that they never write past its end.
+	 */
+	if (direct) {
+		blockif_dio_probe(fd, &sbuf, &dio_align, &dio_mem_align);
+		i = ssopt ? ssopt : DEV_BSIZE;
+		if ((!sub_file_assign && (size % dio_align)) ||
+		    (sub_file_start_lba * i) % dio_align ||
+		    (sub_file_size * i) % dio_align) {
+			WPRINTF(("%s is not made of %d byte blocks, not using direct I/O\n",
+				 nopt, dio_align));
+			dio_align = 0;
+		} else if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) < 0) {
+			WPRINTF(("%s does not support direct I/O\n", nopt));
+			dio_align = 0;
+		} else if (psectsz < dio_align) {
+			/* let the guest know what is efficient */
+			psectsz = dio_align;
+		}
+	}
+
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
 		    ssopt > pssopt) {
@@ -720,6 +1322,7 @@ blockif_open(const char *optstr, const char *ident)
 	}
 
 	bc->fd = fd;
+	bc->cow = cow;
 	bc->isblk = S_ISBLK(sbuf.st_mode);
 	bc->candiscard = candiscard;
 	if (candiscard) {
@@ -737,8 +1340,25 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
 	bc->wce = writeback;
+	bc->dio_align = dio_align;
+	bc->dio_mem_align = dio_mem_align;
+	pthread_mutex_init(&bc->bounce_mtx, NULL);
+	now = blockif_now_ns();
+	for (i = 0; i < BLOCKIF_QOS_NR; i++) {
+		bc->qos[i].rate = qos_rate[i];
+		bc->qos[i].burst = qos_burst[i];
+		bc->qos[i].tokens = qos_burst[i];
+		bc->qos[i].last_ns = now;
+		if (qos_rate[i])
+			bc->throttling = 1;
+	}
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
 	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
+	/* throttled requests are retried at CLOCK_MONOTONIC deadlines */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&bc->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
 	TAILQ_INIT(&bc->freeq);
 	TAILQ_INIT(&bc->pendq);
 	TAILQ_INIT(&bc->busyq);
@@ -756,6 +1376,10 @@ blockif_open(const char *optstr, const char *ident)
 		pthread_setname_np(bc->btid[i], tname);
 	}
 
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_INSERT_HEAD(&blockif_list, bc, list);
+	pthread_mutex_unlock(&blockif_list_mtx);
+
 	/* free strdup memory */
 	if (nopt) {
 		free(nopt);
@@ -764,12 +1388,17 @@ blockif_open(const char *optstr, const char *ident)
 
 	return bc;
 err:
+	if (cow)
+		blockcow_close(cow);
+	if (fd >= 0)
+		close(fd);
+	/* an overlay left empty would be formatted on any base next time */
+	if (created)
+		unlink(nopt);
+
 	/* handle failure case: free strdup memory*/
 	if (nopt)
 		free(nopt);
-
-	if (fd >= 0)
-		close(fd);
 	return NULL;
 }
 
@@ -910,6 +1539,10 @@ blockif_close(struct blockif_ctxt *bc)
 
 	sub_file_unlock(bc);
 
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_REMOVE(bc, list);
+	pthread_mutex_unlock(&blockif_list_mtx);
+
 	/*
 	 * Stop the block i/o thread
 	 */
@@ -926,6 +1559,11 @@ blockif_close(struct blockif_ctxt *bc)
 	/*
 	 * Release resources
 	 */
+	if (bc->cow)
+		blockcow_close(bc->cow);
+	for (i = 0; i < bc->nr_bounce; i++)
+		free(bc->bounce[i]);
+	pthread_mutex_destroy(&bc->bounce_mtx);
 	close(bc->fd);
 	free(bc);
 
@@ -1055,7 +1693,118 @@ blockif_flush_all(struct blockif_ctxt *bc)
 	int err;
 
 	err=0;
-	if (fsync(bc->fd))
+	if (bc->cow)
+		err = blockcow_flush(bc->cow);
+	else if (fsync(bc->fd))
 		err = errno;
 	return err;
 }
+
+/*
+ * Get the I/O limits of bc and how much they delayed it. Returns -1 if no
+ * limit is set.
+ */
+int
+blockif_get_qos(struct blockif_ctxt *bc, struct blockif_qos_info *info)
+{
+	int i;
+
+	if (!bc->throttling)
+		return -1;
+
+	pthread_mutex_lock(&bc->mtx);
+	for (i = 0; i < BLOCKIF_QOS_NR; i++) {
+		info->rate[i] = bc->qos[i].rate;
+		info->burst[i] = bc->qos[i].burst;
+	}
+	for (i = 0; i < 2; i++) {
+		info->throttled[i] = bc->throttled[i];
+		info->throttled_ns[i] = bc->throttled_ns[i];
+	}
+	info->queued = bc->nr_throttled;
+	pthread_mutex_unlock(&bc->mtx);
+
+	return 0;
+}
+
+/* Call cb on each open blockif, with none being opened or closed meanwhile */
+void
+blockif_foreach(blockif_iter_cb cb, void *arg)
+{
+	struct blockif_ctxt *bc;
+
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_FOREACH(bc, &blockif_list, list)
+		cb(bc, bc->ident, arg);
+	pthread_mutex_unlock(&blockif_list_mtx);
+}
+
+void
+blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *stats)
+{
+	pthread_mutex_lock(&bc->mtx);
+	*stats = bc->stats;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+static void
+blockif_dump_hist(FILE *fp, const char *name, const uint64_t *hist)
+{
+	int i;
+
+	fprintf(fp, "    %-10s", name);
+	for (i = 0; i < BLOCKIF_HIST_NR; i++) {
+		if (!hist[i])
+			continue;
+		if (i == 0)
+			fprintf(fp, " <1:%lu", hist[i]);
+		else
+			fprintf(fp, " %lu:%lu", 1UL << (i - 1), hist[i]);
+	}
+	fprintf(fp, "\n");
+}
+
+static void
+blockif_dump_one(struct blockif_ctxt *bc, const char *ident, void *arg)
+{
+	struct blockif_stats st;
+	struct blockif_op_stats *ost;
+	FILE *fp = arg;
+	int i;
+
+	blockif_get_stats(bc, &st);
+	fprintf(fp, "dev %s queued %u inflight %u max_depth %u blocked %lu\n",
+		ident, st.queued, st.inflight, st.max_depth, st.blocked);
+	for (i = 0; i < BLOCKIF_OP_NR; i++) {
+		ost = &st.op[i];
+		if (!ost->ops)
+			continue;
+		fprintf(fp, "  %s ops %lu bytes %lu errors %lu\n",
+			blockif_op_names[i], ost->ops, ost->bytes, ost->errors);
+		blockif_dump_hist(fp, "queue_us", ost->queue_hist);
+		blockif_dump_hist(fp, "service_us", ost->service_hist);
+	}
+}
+
+/*
+ * Write the statistics of all the open blockifs as text. The histograms
+ * list "<bucket lower bound in us>:<count>" for the buckets in use.
+ */
+void
+blockif_dump_stats(FILE *fp)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(fp, "# blockif statistics at %ld\n", ts.tv_sec);
+	blockif_foreach(blockif_dump_one, fp);
+}
+
+/* Append the statistics to path each time the DM gets SIGUSR1 */
+int
+blockif_set_stats_dump(const char *path)
+{
+	free(blockif_stats_path);
+	blockif_stats_path = strdup(path);
+	return blockif_stats_path ? 0 : -1;
+}
@@ -2257,6 +2257,80 @@ pci_walk_lintr(int bus, pci_lintr_cb cb, void *arg)
 	}
 }
 
+/*
+ * Call 'cb' for each PCI function of all buses, stop at the first one
+ * that returns non-zero and return that value.
+ */
+int
+pci_walk_vdev(pci_vdev_cb cb, void *arg)
+{
+	struct businfo *bi;
+	struct pci_vdev *dev;
+	int bus, slot, func, ret;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				dev = bi->slotinfo[slot].si_funcs[func].fi_devi;
+				if (dev == NULL)
+					continue;
+				ret = cb(dev, arg);
+				if (ret != 0)
+					return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int
+pci_vdev_is_passthru(struct pci_vdev *dev)
+{
+	return is_pt_pci(dev);
+}
+
+/*
+ * Load a config space saved from the same device model, as if the guest
+ * wrote it: BARs first so that they are registered at their new address,
+ * then the capabilities and the rest of the header, the command register
+ * last so that the decoding is enabled on the final BARs.
+ */
+void
+pci_restore_cfgdata(struct vmctx *ctx, struct pci_vdev *dev,
+		    const uint8_t *cfgdata)
+{
+	uint32_t val;
+	int coff;
+
+	for (coff = PCIR_BAR(0); coff <= PCIR_BAR(PCI_BARMAX); coff += 4) {
+		if (dev->bar[(coff - PCIR_BAR(0)) / 4].type == PCIBAR_NONE)
+			continue;
+		val = *(const uint32_t *)(cfgdata + coff);
+		pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, coff, 4,
+			  &val);
+	}
+
+	/* capabilities and device specific registers */
+	for (coff = 0x40; coff <= PCI_REGMAX; coff += 4) {
+		val = *(const uint32_t *)(cfgdata + coff);
+		if (val != pci_get_cfgdata32(dev, coff))
+			pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func,
+				  coff, 4, &val);
+	}
+
+	val = cfgdata[PCIR_INTLINE];
+	pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, PCIR_INTLINE, 1,
+		  &val);
+	val = *(const uint16_t *)(cfgdata + PCIR_COMMAND);
+	pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, PCIR_COMMAND, 2,
+		  &val);
+}
+
 /*
  * Return 1 if the emulated device in 'slot' is a multi-function device.
  * Return 0 otherwise.
@@ -28,10 +28,12 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dm.h"
@@ -59,6 +61,9 @@
 static uint8_t virtio_poll_enabled;
 static size_t virtio_poll_interval;
 
+/* default poll budget, in poll intervals */
+#define VIRTIO_POLL_IDLE_ROUNDS	64
+
 static
 void iothread_handler(void *arg)
 {
@@ -106,12 +111,13 @@ virtio_set_iothread(struct virtio_base *base,
 			vq->viothrd.iomvt.run = iothread_handler;
 			vq->viothrd.iomvt.fd = vq->viothrd.kick_fd;
 
-			if (!iothread_add(vq->viothrd.kick_fd, &vq->viothrd.iomvt))
+			if (!iothread_add_to(base->iothread_idx, vq->viothrd.kick_fd,
+					&vq->viothrd.iomvt))
 				if (!virtio_register_ioeventfd(base, idx, true, vq->viothrd.kick_fd))
 					vq->viothrd.ioevent_started = true;
 		} else {
 			if (!virtio_register_ioeventfd(base, idx, false, vq->viothrd.kick_fd))
-				if (!iothread_del(vq->viothrd.kick_fd)) {
+				if (!iothread_del(vq->viothrd.kick_fd, &vq->viothrd.iomvt)) {
 					vq->viothrd.ioevent_started = false;
 					if (vq->viothrd.kick_fd) {
 						close(vq->viothrd.kick_fd);
@@ -122,60 +128,182 @@ virtio_set_iothread(struct virtio_base *base,
 	}
 }
 
-static void
-virtio_start_timer(struct acrn_timer *timer, time_t sec, time_t nsec)
+/*
+ * Position of the driver in the avail ring, changes when it posts new
+ * buffers. Packed rings have no avail index, there it is the next
+ * descriptor to fetch while one is available.
+ */
+static uint32_t
+vq_poll_pos(struct virtio_vq_info *vq)
 {
-	struct itimerspec ts;
-
-	/* setting the interval time */
-	ts.it_interval.tv_sec = 0;
-	ts.it_interval.tv_nsec = 0;
-	/* set the delay time it will be started when timer_setting */
-	ts.it_value.tv_sec = sec;
-	ts.it_value.tv_nsec = nsec;
-	if (acrn_timer_settime(timer, &ts) != 0) {
-		pr_err("acrn timer set time failed\n");
-		return;
-	}
+	if (vq_is_packed(vq))
+		return vq_has_descs(vq) ?
+			((uint32_t)vq->avail_wrap_counter << 16 | vq->last_avail) + 1 : 0;
+
+	return vq->avail->idx;
 }
 
 static void
-virtio_poll_timer(void *arg, uint64_t nexp)
+virtio_vq_dispatch(struct virtio_base *base, struct virtio_vq_info *vq)
 {
-	struct virtio_base *base;
-	struct virtio_ops *vops;
-	struct virtio_vq_info *vq;
-	const char *name;
-	int i;
+	struct virtio_ops *vops = base->vops;
 
-	base = arg;
-	vops = base->vops;
-	name = vops->name;
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (vops->qnotify)
+		(*vops->qnotify)(DEV_STRUCT(base), vq);
+	else
+		pr_err("%s: qnotify queue %d: missing vq/vops notify\r\n",
+			vops->name, vq->num);
+}
 
-	if (base->mtx)
-		pthread_mutex_lock(base->mtx);
+static inline uint64_t
+virtio_poll_now_us(void)
+{
+	struct timespec ts;
 
-	base->polling_in_progress = 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
 
-	for (i = 0; i < base->vops->nvq; i++) {
-		vq = &base->queues[i];
-		if(!vq_ring_ready(vq))
+/*
+ * Spin on the ring while the driver posts buffers, hand them to the
+ * device and go back to notifications once the device's poll budget
+ * passed without any. The base lock is only tried, reset holds it
+ * while it stops the poller.
+ */
+static void
+virtio_vq_poll(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct virtio_vq_poller *poller = &vq->poller;
+	struct timespec pause;
+	uint64_t last;
+	uint32_t pos;
+
+	pause.tv_sec = virtio_poll_interval / 1000000000UL;
+	pause.tv_nsec = virtio_poll_interval % 1000000000UL;
+
+	poller->polling = true;
+	vq_disable_notify(vq);
+	last = virtio_poll_now_us();
+	poller->pos = vq_poll_pos(vq) - 1;
+
+	while (!poller->stop) {
+		pos = vq_poll_pos(vq);
+		if (pos != poller->pos && vq_has_descs(vq)) {
+			if (base->mtx && pthread_mutex_trylock(base->mtx) != 0) {
+				sched_yield();
+				continue;
+			}
+			virtio_vq_dispatch(base, vq);
+			if (base->mtx)
+				pthread_mutex_unlock(base->mtx);
+			poller->pos = pos;
+			last = virtio_poll_now_us();
+		} else if (virtio_poll_now_us() - last >= base->poll_budget_us) {
+			/* idle, turn kicks back on and catch late buffers */
+			poller->polling = false;
+			vq_clear_used_ring_flags(base, vq);
+			atomic_thread_fence();
+			if (vq_poll_pos(vq) == poller->pos || !vq_has_descs(vq))
+				break;
+			poller->polling = true;
+			vq_disable_notify(vq);
 			continue;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		/* TODO: call notify when necessary */
-		if (vq->notify)
-			(*vq->notify)(DEV_STRUCT(base), vq);
-		else if (vops->qnotify)
-			(*vops->qnotify)(DEV_STRUCT(base), vq);
-		else
-			pr_err("%s: qnotify queue %d: missing vq/vops notify\r\n",
-				name, i);
+		}
+
+		nanosleep(&pause, NULL);
 	}
 
-	if (base->mtx)
-		pthread_mutex_unlock(base->mtx);
+	poller->polling = false;
+}
+
+static void *
+virtio_vq_poll_thread(void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_vq_poller *poller = &vq->poller;
+
+	pthread_mutex_lock(&poller->mtx);
+	for (;;) {
+		while (!poller->stop && !poller->kicked)
+			pthread_cond_wait(&poller->cond, &poller->mtx);
+		if (poller->stop)
+			break;
+		poller->kicked = false;
+		pthread_mutex_unlock(&poller->mtx);
+
+		virtio_vq_poll(vq->base, vq);
 
-	virtio_start_timer(&base->polling_timer, 0, virtio_poll_interval);
+		pthread_mutex_lock(&poller->mtx);
+	}
+	pthread_mutex_unlock(&poller->mtx);
+
+	return NULL;
+}
+
+static void
+virtio_vq_poll_kick(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct virtio_vq_poller *poller = &vq->poller;
+	char tname[MAXCOMLEN + 1];
+
+	if (!poller->started) {
+		pthread_mutex_init(&poller->mtx, NULL);
+		pthread_cond_init(&poller->cond, NULL);
+		poller->stop = false;
+		poller->kicked = false;
+		if (pthread_create(&poller->tid, NULL, virtio_vq_poll_thread,
+				   vq) != 0) {
+			pr_err("%s: failed to create poller of queue %d\n",
+				base->vops->name, vq->num);
+			return;
+		}
+		snprintf(tname, sizeof(tname), "%s-%d:%d poll%d",
+			base->vops->name, base->dev->slot, base->dev->func,
+			vq->num);
+		pthread_setname_np(poller->tid, tname);
+		poller->started = true;
+	}
+
+	pthread_mutex_lock(&poller->mtx);
+	poller->kicked = true;
+	pthread_cond_signal(&poller->cond);
+	pthread_mutex_unlock(&poller->mtx);
+}
+
+static void
+virtio_vq_poll_stop(struct virtio_vq_info *vq)
+{
+	struct virtio_vq_poller *poller = &vq->poller;
+
+	if (!poller->started)
+		return;
+
+	pthread_mutex_lock(&poller->mtx);
+	poller->stop = true;
+	pthread_cond_signal(&poller->cond);
+	pthread_mutex_unlock(&poller->mtx);
+	pthread_join(poller->tid, NULL);
+
+	pthread_cond_destroy(&poller->cond);
+	pthread_mutex_destroy(&poller->mtx);
+	poller->started = false;
+}
+
+/*
+ * Handle a kick of the driver. In poll mode it also hands the queue
+ * to its poller, further buffers are picked up without kicks.
+ */
+static void
+virtio_vq_kick(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	virtio_vq_dispatch(base, vq);
+
+	if (virtio_poll_enabled && base->poll_budget_us &&
+	    base->backend_type == BACKEND_VBSU && vq_ring_ready(vq) &&
+	    !vq->poller.polling)
+		virtio_vq_poll_kick(base, vq);
 }
 
 /**
@@ -211,6 +339,11 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 		queues[i].base = base;
 		queues[i].num = i;
 	}
+
+	base->iothread_idx = -1;
+	base->poll_budget_us = virtio_poll_interval * VIRTIO_POLL_IDLE_ROUNDS / 1000;
+	if (virtio_poll_enabled && base->poll_budget_us == 0)
+		base->poll_budget_us = 1;
 }
 
 /**
@@ -234,12 +367,13 @@ virtio_reset_dev(struct virtio_base *base)
 /* if (base->mtx) */
 /* assert(pthread_mutex_isowned_np(base->mtx)); */
 
-	acrn_timer_deinit(&base->polling_timer);
-	base->polling_in_progress = 0;
 	if (base->iothread)
 		virtio_set_iothread(base, false);
 
 	nvq = base->vops->nvq;
+	for (vq = base->queues, i = 0; i < nvq; vq++, i++)
+		virtio_vq_poll_stop(vq);
+
 	for (vq = base->queues, i = 0; i < nvq; vq++, i++) {
 		vq->flags = 0;
 		vq->last_avail = 0;
@@ -253,6 +387,14 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		vq->packed_desc = NULL;
+		vq->driver_event = NULL;
+		vq->device_event = NULL;
+		vq->used_idx = 0;
+		vq->used_since_signal = 0;
+		vq->last_chain_len = 0;
+		free(vq->chain_len);
+		vq->chain_len = NULL;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -394,6 +536,56 @@ error:
 	pr_err("%s: vq enable failed\n", __func__);
 }
 
+/*
+ * Packed ring flavour of virtio_vq_enable(): the desc, avail and used
+ * addresses are the descriptor ring and the driver and device event
+ * suppression areas.
+ * Return 0 on success and -1 when the ring cannot be mapped.
+ */
+static int
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t qsz = vq->qsize;
+	uint64_t phys;
+	void *vb;
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			qsz * sizeof(struct vring_packed_desc));
+	if (!vb)
+		return -1;
+	vq->packed_desc = vb;
+
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		return -1;
+	vq->driver_event = vb;
+
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		return -1;
+	vq->device_event = vb;
+
+	free(vq->chain_len);
+	vq->chain_len = calloc(qsz, sizeof(uint16_t));
+	if (!vq->chain_len)
+		return -1;
+
+	/* Both wrap counters start at 1 */
+	vq->last_avail = 0;
+	vq->avail_wrap_counter = true;
+	vq->used_idx = 0;
+	vq->used_wrap_counter = true;
+	vq->used_since_signal = 0;
+	vq->last_chain_len = 0;
+
+	return 0;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -412,6 +604,15 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & (1UL << VIRTIO_F_RING_PACKED)) {
+		if (virtio_vq_enable_packed(base, vq))
+			goto error;
+		vq->enabled = true;
+		mb();
+		vq->flags = VQ_ALLOC | VQ_PACKED;
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct vring_desc);
@@ -476,8 +677,141 @@ _vq_record(int i, volatile struct vring_desc *vd, struct vmctx *ctx,
 		flags[i] = vd->flags;
 	return 0;
 }
+
+/*
+ * Same as _vq_record(), for a descriptor of a packed ring.
+ */
+static inline int
+_vq_record_packed(int i, volatile struct vring_packed_desc *vd,
+		  struct vmctx *ctx, struct iovec *iov, int n_iov,
+		  uint16_t *flags) {
+
+	void *host_addr;
+
+	if (i >= n_iov)
+		return -1;
+	host_addr = paddr_guest2host(ctx, vd->addr, vd->len);
+	if (!host_addr)
+		return -1;
+	iov[i].iov_base = host_addr;
+	iov[i].iov_len = vd->len;
+	if (flags != NULL)
+		flags[i] = vd->flags;
+	return 0;
+}
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/*
+ * vq_getchain() for packed rings.
+ *
+ * The descriptors of a chain are consecutive ring slots starting at
+ * last_avail, linked by the NEXT flag, and the buffer id returned in
+ * *pidx is the id of the last one. An indirect descriptor points to a
+ * table of packed descriptors which are all part of the chain. Only the
+ * descriptor ring is read, so one request touches one guest region.
+ *
+ * The number of ring slots the chain took is kept per buffer id, as
+ * vq_relchain() must skip that many slots when writing the used entry.
+ */
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i = 0, ret;
+	u_int n_indir, j;
+	uint16_t idx, id = 0, dflags, ndesc = 0;
+	bool wrap;
+	volatile struct vring_packed_desc *vd, *vindir;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+	ctx = base->dev->vmctx;
+
+	idx = vq->last_avail;
+	wrap = vq->avail_wrap_counter;
+	if (!vq_packed_desc_avail(vq->packed_desc[idx].flags, wrap))
+		return 0;
+
+	/* Don't read the descriptors before seeing the AVAIL flag */
+	atomic_thread_fence();
+
+	for (;;) {
+		vd = &vq->packed_desc[idx];
+		dflags = vd->flags;
+		id = vd->id;
+		ndesc++;
+		if (++idx >= vq->qsize) {
+			idx = 0;
+			wrap = !wrap;
+		}
+
+		if ((dflags & VRING_DESC_F_INDIRECT) == 0) {
+			if (_vq_record_packed(i, vd, ctx, iov, n_iov, flags)) {
+				pr_err("%s: mapping to host failed\r\n", name);
+				goto fail;
+			}
+			i++;
+		} else if ((base->device_caps &
+		    (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0) {
+			pr_err("%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n", name);
+			goto fail;
+		} else {
+			n_indir = vd->len / sizeof(struct vring_packed_desc);
+			if ((vd->len & 0xf) || n_indir == 0) {
+				pr_err("%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n", name, (u_int)vd->len);
+				goto fail;
+			}
+			vindir = paddr_guest2host(ctx, vd->addr, vd->len);
+			if (!vindir) {
+				pr_err("%s cannot get host memory\r\n", name);
+				goto fail;
+			}
+			for (j = 0; j < n_indir; j++) {
+				if (_vq_record_packed(i, &vindir[j], ctx, iov,
+						n_iov, flags)) {
+					pr_err("%s: mapping to host failed\r\n", name);
+					goto fail;
+				}
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+
+		if ((dflags & VRING_DESC_F_NEXT) == 0)
+			break;
+		if (i > VQ_MAX_DESCRIPTORS || ndesc >= vq->qsize)
+			goto loopy;
+	}
+
+	if (id >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range, driver confused?\r\n",
+		    name, id);
+		goto fail;
+	}
+
+	*pidx = id;
+	vq->chain_len[id] = ndesc;
+	ret = i;
+	goto done;
+
+loopy:
+	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+fail:
+	/* Skip what we walked, as the split ring does for a bad chain */
+	ret = -1;
+done:
+	vq->last_avail = idx;
+	vq->avail_wrap_counter = wrap;
+	vq->last_chain_len = ndesc;
+	return ret;
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -530,6 +864,9 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	struct virtio_base *base;
 	const char *name;
 
+	if (vq_is_packed(vq))
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
 	base = vq->base;
 	name = base->vops->name;
 
@@ -654,7 +991,66 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	if (vq_is_packed(vq)) {
+		if (vq->last_avail < vq->last_chain_len) {
+			vq->last_avail += vq->qsize;
+			vq->avail_wrap_counter = !vq->avail_wrap_counter;
+		}
+		vq->last_avail -= vq->last_chain_len;
+		vq->last_chain_len = 0;
+	} else
+		vq->last_avail--;
+}
+
+/*
+ * Return the last n chains got by vq_getchain() to the available queue,
+ * ids[] holding their buffer ids in the order they were fetched.
+ */
+void
+vq_retchains(struct virtio_vq_info *vq, const uint16_t *ids, int n)
+{
+	uint16_t nslots = 0;
+	int i;
+
+	if (vq_is_packed(vq)) {
+		for (i = 0; i < n; i++)
+			nslots += vq->chain_len[ids[i]];
+		vq->last_chain_len = nslots;
+		vq_retchain(vq);
+	} else
+		vq->last_avail -= n;
+}
+
+/*
+ * vq_relchain() for packed rings: the used entry overwrites the next
+ * used slot of the descriptor ring, which is then advanced by the
+ * number of slots the chain took.
+ */
+static void
+vq_relchain_packed(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t dflags = 0, ndesc = 1;
+
+	vd = &vq->packed_desc[vq->used_idx];
+	vd->id = idx;
+	vd->len = iolen;
+	if (vq->used_wrap_counter)
+		dflags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+			 (1 << VRING_PACKED_DESC_F_USED);
+
+	/* id and len must be visible before the driver sees the flags */
+	atomic_thread_fence();
+	vd->flags = dflags;
+
+	if (idx < vq->qsize && vq->chain_len[idx] != 0)
+		ndesc = vq->chain_len[idx];
+	vq->used_idx += ndesc;
+	if (vq->used_idx >= vq->qsize) {
+		vq->used_idx -= vq->qsize;
+		vq->used_wrap_counter = !vq->used_wrap_counter;
+	}
+	vq->used_since_signal += ndesc;
 }
 
 /*
@@ -671,6 +1067,11 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	volatile struct vring_used *vuh;
 	volatile struct vring_used_elem *vue;
 
+	if (vq_is_packed(vq)) {
+		vq_relchain_packed(vq, idx, iolen);
+		return;
+	}
+
 	/*
 	 * Notes:
 	 *  - mask is N-1 where N is a power of 2 so computes x % N
@@ -706,6 +1107,49 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
  * processing -- it's possible that descriptors became available after
  * that point.  (It's also typically a constant 1/True as well.)
  */
+/*
+ * vq_endchains() for packed rings. The driver event suppression area
+ * either enables or disables interrupts, or, with EVENT_IDX, asks for
+ * one once the used index passes the descriptor in off_wrap.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct virtio_base *base;
+	uint16_t event_flags, off_wrap, event_idx, new_idx, old_idx;
+	int intr;
+
+	atomic_thread_fence();
+
+	base = vq->base;
+	new_idx = vq->used_idx;
+	old_idx = new_idx - vq->used_since_signal;
+	vq->used_since_signal = 0;
+	event_flags = vq->driver_event->flags;
+
+	if (used_all_avail &&
+	    (base->negotiated_caps & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)))
+		intr = 1;
+	else if (new_idx == old_idx ||
+		 event_flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		intr = 0;
+	else if (event_flags == VRING_PACKED_EVENT_FLAG_DESC &&
+		 (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		/* move an offset of the previous lap into our frame */
+		if (!!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+		    vq->used_wrap_counter)
+			event_idx -= vq->qsize;
+		intr = (uint16_t)(new_idx - event_idx - 1) <
+			(uint16_t)(new_idx - old_idx);
+	} else
+		intr = 1;
+
+	if (intr)
+		vq_interrupt(base, vq);
+}
+
 void
 vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 {
@@ -713,6 +1157,11 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	uint16_t event_idx, new_idx, old_idx;
 	int intr;
 
+	if (vq && vq_is_packed(vq)) {
+		vq_endchains_packed(vq, used_all_avail);
+		return;
+	}
+
 	if (!vq || !vq->used)
 		return;
 
@@ -755,21 +1204,22 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
  *
  * Driver should always use this helper function to clear used ring flags.
  * For virtio poll mode, in order to avoid trap, we should never really
- * clear used ring flags.
+ * clear used ring flags while the queue is polled; its poller turns
+ * notifications back on when the queue goes idle.
  *
  * @param base Pointer to struct virtio_base.
  * @param vq Pointer to struct virtio_vq_info.
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq)
 {
-	int backend_type = base->backend_type;
-	int polling_in_progress = base->polling_in_progress;
-
 	/* we should never unmask notification in polling mode */
-	if (virtio_poll_enabled && backend_type == BACKEND_VBSU && polling_in_progress == 1)
+	if (vq->poller.polling)
 		return;
 
-	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq_is_packed(vq))
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	else
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
 }
 
 struct config_reg {
@@ -1060,13 +1510,7 @@ bad:
 			goto done;
 		}
 		vq = &base->queues[value];
-		if (vq->notify)
-			(*vq->notify)(DEV_STRUCT(base), vq);
-		else if (vops->qnotify)
-			(*vops->qnotify)(DEV_STRUCT(base), vq);
-		else
-			pr_err("%s: qnotify queue %d: missing vq/vops notify\r\n",
-				name, (int)value);
+		virtio_vq_kick(base, vq);
 		break;
 	case VIRTIO_PCI_STATUS:
 		base->status = value;
@@ -1074,17 +1518,6 @@ bad:
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if ((value == 0) && (vops->reset))
 			(*vops->reset)(DEV_STRUCT(base));
-		if ((value & VIRTIO_CONFIG_S_DRIVER_OK) &&
-		     base->backend_type == BACKEND_VBSU &&
-		     virtio_poll_enabled) {
-			base->polling_timer.clockid = CLOCK_MONOTONIC;
-			acrn_timer_init(&base->polling_timer, virtio_poll_timer, base);
-			/* wait 5s to start virtio poll mode
-			 * skip vsbl and make sure device initialization completed
-			 * FIXME: Need optimization in the future
-			 */
-			virtio_start_timer(&base->polling_timer, 5, 0);
-		}
 		if (!virtio_poll_enabled &&
 			base->backend_type == BACKEND_VBSU &&
 			base->iothread) {
@@ -1518,14 +1951,14 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if ((base->status == 0) && (vops->reset))
 			(*vops->reset)(DEV_STRUCT(base));
-		if (base->backend_type == BACKEND_VBSU && base->iothread) {
+		if (!virtio_poll_enabled &&
+			base->backend_type == BACKEND_VBSU && base->iothread) {
 			if (value & VIRTIO_CONFIG_S_DRIVER_OK) {
 				virtio_set_iothread(base, true);
 			} else {
 				virtio_set_iothread(base, false);
 			}
 		}
-		/* TODO: virtio poll mode for modern devices */
 		break;
 	case VIRTIO_PCI_COMMON_Q_SELECT:
 		/*
@@ -1697,13 +2130,7 @@ virtio_notify_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 	}
 
 	vq = &base->queues[idx];
-	if (vq->notify)
-		(*vq->notify)(DEV_STRUCT(base), vq);
-	else if (vops->qnotify)
-		(*vops->qnotify)(DEV_STRUCT(base), vq);
-	else
-		pr_err("%s: qnotify queue %lu: missing vq/vops notify\r\n",
-			name, idx);
+	virtio_vq_kick(base, vq);
 }
 
 static uint32_t
@@ -1851,13 +2278,7 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		pthread_mutex_lock(base->mtx);
 
 	vq = &base->queues[idx];
-	if (vq->notify)
-		(*vq->notify)(DEV_STRUCT(base), vq);
-	else if (vops->qnotify)
-		(*vops->qnotify)(DEV_STRUCT(base), vq);
-	else
-		pr_err("%s: qnotify queue %lu: missing vq/vops notify\r\n",
-			name, idx);
+	virtio_vq_kick(base, vq);
 
 	if (base->mtx)
 		pthread_mutex_unlock(base->mtx);
@@ -1981,6 +2402,182 @@ acrn_parse_virtio_poll_interval(const char *optarg)
 	return 0;
 }
 
+int
+virtio_set_poll_budget(struct virtio_base *base, const char *opt)
+{
+	unsigned int budget;
+	char *end;
+
+	if (dm_strtoui(opt, &end, 10, &budget) ||
+	    (*end != '\0' && *end != ','))
+		return -1;
+
+	base->poll_budget_us = budget;
+	return 0;
+}
+
+/*
+ * Transport state of a virtio device for snapshots: what the guest
+ * negotiated and where each ring is, the rings themselves are in guest
+ * memory.
+ */
+struct virtio_vq_state {
+	uint16_t qsize;
+	uint16_t flags;
+	uint16_t msix_idx;
+	uint16_t last_avail;
+	uint16_t save_used;
+	uint16_t used_idx;
+	uint8_t	 enabled;
+	uint8_t	 avail_wrap_counter;
+	uint8_t	 used_wrap_counter;
+	uint8_t	 reserved;
+	uint32_t pfn;
+	uint32_t gpa_desc[2];
+	uint32_t gpa_avail[2];
+	uint32_t gpa_used[2];
+};
+
+struct virtio_state {
+	uint64_t negotiated_caps;
+	uint32_t nvq;
+	uint32_t device_feature_select;
+	uint32_t driver_feature_select;
+	uint16_t msix_cfg_idx;
+	uint8_t	 status;
+	uint8_t	 isr;
+	uint8_t	 config_generation;
+	uint8_t	 reserved[3];
+	int32_t	 curq;
+	struct virtio_vq_state vq[];
+};
+
+struct virtio_base *
+virtio_get_base(struct pci_vdev *dev)
+{
+	if (dev->dev_ops->vdev_barread != virtio_pci_read || dev->arg == NULL)
+		return NULL;
+
+	return (struct virtio_base *)dev->arg;
+}
+
+void
+virtio_quiesce(struct virtio_base *base, bool stop)
+{
+	if (base->vops->quiesce)
+		(*base->vops->quiesce)(DEV_STRUCT(base), stop);
+}
+
+size_t
+virtio_state_size(struct virtio_base *base)
+{
+	return sizeof(struct virtio_state) +
+		base->vops->nvq * sizeof(struct virtio_vq_state);
+}
+
+void
+virtio_get_state(struct virtio_base *base, void *buf)
+{
+	struct virtio_state *st = buf;
+	struct virtio_vq_state *vqs;
+	struct virtio_vq_info *vq;
+	int i;
+
+	memset(st, 0, virtio_state_size(base));
+	st->negotiated_caps = base->negotiated_caps;
+	st->nvq = base->vops->nvq;
+	st->device_feature_select = base->device_feature_select;
+	st->driver_feature_select = base->driver_feature_select;
+	st->msix_cfg_idx = base->msix_cfg_idx;
+	st->status = base->status;
+	st->isr = base->isr;
+	st->config_generation = base->config_generation;
+	st->curq = base->curq;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		vqs = &st->vq[i];
+		vqs->qsize = vq->qsize;
+		vqs->flags = vq->flags;
+		vqs->msix_idx = vq->msix_idx;
+		vqs->last_avail = vq->last_avail;
+		vqs->save_used = vq->save_used;
+		vqs->used_idx = vq->used_idx;
+		vqs->enabled = vq->enabled;
+		vqs->avail_wrap_counter = vq->avail_wrap_counter;
+		vqs->used_wrap_counter = vq->used_wrap_counter;
+		vqs->pfn = vq->pfn;
+		memcpy(vqs->gpa_desc, vq->gpa_desc, sizeof(vqs->gpa_desc));
+		memcpy(vqs->gpa_avail, vq->gpa_avail, sizeof(vqs->gpa_avail));
+		memcpy(vqs->gpa_used, vq->gpa_used, sizeof(vqs->gpa_used));
+	}
+}
+
+int
+virtio_set_state(struct virtio_base *base, const void *buf, size_t len)
+{
+	const struct virtio_state *st = buf;
+	const struct virtio_vq_state *vqs;
+	struct virtio_vq_info *vq;
+	struct virtio_ops *vops = base->vops;
+	int i;
+
+	if (len != virtio_state_size(base) || st->nvq != vops->nvq)
+		return -1;
+
+	virtio_reset_dev(base);
+	base->negotiated_caps = st->negotiated_caps;
+	if (vops->apply_features)
+		(*vops->apply_features)(DEV_STRUCT(base), base->negotiated_caps);
+
+	/* map the rings again, then go on from where the device was */
+	for (i = 0; i < vops->nvq; i++) {
+		vq = &base->queues[i];
+		vqs = &st->vq[i];
+		vq->qsize = vqs->qsize;
+		vq->msix_idx = vqs->msix_idx;
+		if (!(vqs->flags & VQ_ALLOC))
+			continue;
+
+		base->curq = i;
+		if (vqs->pfn) {
+			virtio_vq_init(base, vqs->pfn);
+		} else {
+			memcpy(vq->gpa_desc, vqs->gpa_desc, sizeof(vq->gpa_desc));
+			memcpy(vq->gpa_avail, vqs->gpa_avail,
+			       sizeof(vq->gpa_avail));
+			memcpy(vq->gpa_used, vqs->gpa_used, sizeof(vq->gpa_used));
+			virtio_vq_enable(base);
+		}
+		if (!vq_ring_ready(vq)) {
+			pr_err("%s: %s vq %d cannot be mapped\n", __func__,
+				vops->name, i);
+			return -1;
+		}
+
+		vq->last_avail = vqs->last_avail;
+		vq->save_used = vqs->save_used;
+		vq->used_idx = vqs->used_idx;
+		vq->avail_wrap_counter = vqs->avail_wrap_counter;
+		vq->used_wrap_counter = vqs->used_wrap_counter;
+	}
+
+	base->device_feature_select = st->device_feature_select;
+	base->driver_feature_select = st->driver_feature_select;
+	base->msix_cfg_idx = st->msix_cfg_idx;
+	base->isr = st->isr;
+	base->config_generation = st->config_generation;
+	base->curq = st->curq;
+	base->status = st->status;
+	if (vops->set_status)
+		(*vops->set_status)(DEV_STRUCT(base), base->status);
+	if (!virtio_poll_enabled && base->backend_type == BACKEND_VBSU &&
+	    base->iothread && (base->status & VIRTIO_CONFIG_S_DRIVER_OK))
+		virtio_set_iothread(base, true);
+
+	return 0;
+}
+
 int virtio_register_ioeventfd(struct virtio_base *base, int idx, bool is_register, int fd)
 {
 	struct acrn_ioeventfd ioeventfd = {0};
@@ -0,0 +1,548 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio balloon device emulation.
+ *
+ * The guest gives back 4K pages on the inflate queue and takes them again
+ * on the deflate queue. The guest memory is backed by huge pages, so a
+ * huge page is only returned to the host once all of its 4K pages are in
+ * the balloon: it is unmapped from the guest and punched out of the memfd.
+ * It is allocated and mapped again before the first of its pages leaves
+ * the balloon.
+ *
+ * The target size is set and the statistics are read through the command
+ * monitor, see vm_monitor_balloon().
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "monitor.h"
+#include "dm_string.h"
+
+#define VIRTIO_BALLOON_RINGSZ		128
+#define VIRTIO_BALLOON_MAXSEGS		256
+
+/* Feature bits */
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST	0
+#define VIRTIO_BALLOON_F_STATS_VQ	1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM	2
+
+#define VIRTIO_BALLOON_S_HOSTCAPS	\
+	((1UL << VIRTIO_BALLOON_F_MUST_TELL_HOST) |	\
+	 (1UL << VIRTIO_BALLOON_F_STATS_VQ) |		\
+	 (1UL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) |	\
+	 (1UL << VIRTIO_F_VERSION_1))
+
+/* The balloon always works in 4K pages */
+#define VIRTIO_BALLOON_PFN_SHIFT	12
+/* Huge pages that can be returned to the host */
+#define VIRTIO_BALLOON_CHUNK_SHIFT	21
+#define VIRTIO_BALLOON_CHUNK_SIZE	(1UL << VIRTIO_BALLOON_CHUNK_SHIFT)
+#define VIRTIO_BALLOON_CHUNK_PFNS	\
+	(1U << (VIRTIO_BALLOON_CHUNK_SHIFT - VIRTIO_BALLOON_PFN_SHIFT))
+
+enum {
+	VIRTIO_BALLOON_INFLATEQ,
+	VIRTIO_BALLOON_DEFLATEQ,
+	VIRTIO_BALLOON_STATSQ,
+	VIRTIO_BALLOON_MAXQ
+};
+
+struct virtio_balloon_config {
+	uint32_t num_pages;
+	uint32_t actual;
+	uint32_t free_page_hint_cmd_id;
+	uint32_t poison_val;
+} __attribute__((packed));
+
+struct virtio_balloon_stat {
+	uint16_t tag;
+	uint64_t val;
+} __attribute__((packed));
+
+struct virtio_balloon {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_BALLOON_MAXQ];
+	/* role of each queue, the ones of features not negotiated are gone */
+	int qrole[VIRTIO_BALLOON_MAXQ];
+	pthread_mutex_t mtx;
+	struct vmctx *ctx;
+	struct virtio_balloon_config config;
+	uint64_t features;
+
+	/* 4K pages in the balloon */
+	uint64_t *pfn_bitmap;
+	uint64_t nr_pfns;
+	uint64_t inflated;
+	/* pages in the balloon and discarded state of each huge page */
+	uint16_t *chunk_pfns;
+	uint64_t *chunk_discarded;
+	uint64_t nr_chunks;
+	uint64_t discarded;
+
+	/* held buffer of the stats queue, returned to ask for new stats */
+	bool stats_held;
+	uint16_t stats_idx;
+	bool stats_valid;
+	uint64_t stats[VM_BALLOON_NR_STATS];
+};
+
+static int virtio_balloon_debug;
+#define DPRINTF(params) do { if (virtio_balloon_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+/* The command monitor talks to the only balloon of the VM */
+static struct virtio_balloon *balloon_dev;
+
+static inline bool
+virtio_balloon_test_and_set(uint64_t *bitmap, uint64_t nr)
+{
+	uint64_t mask = 1UL << (nr & 63);
+	bool old = bitmap[nr >> 6] & mask;
+
+	bitmap[nr >> 6] |= mask;
+	return old;
+}
+
+static inline bool
+virtio_balloon_test_and_clear(uint64_t *bitmap, uint64_t nr)
+{
+	uint64_t mask = 1UL << (nr & 63);
+	bool old = bitmap[nr >> 6] & mask;
+
+	bitmap[nr >> 6] &= ~mask;
+	return old;
+}
+
+static void
+virtio_balloon_inflate_pfn(struct virtio_balloon *vb, uint64_t pfn)
+{
+	uint64_t chunk, gpa;
+
+	if (pfn >= vb->nr_pfns ||
+	    virtio_balloon_test_and_set(vb->pfn_bitmap, pfn))
+		return;
+
+	vb->inflated++;
+	chunk = pfn / VIRTIO_BALLOON_CHUNK_PFNS;
+	if (++vb->chunk_pfns[chunk] < VIRTIO_BALLOON_CHUNK_PFNS)
+		return;
+
+	/*
+	 * A driver without MUST_TELL_HOST may reuse the pages before it
+	 * deflates them, they only get tracked. Huge pages larger than a
+	 * chunk stay with the guest.
+	 */
+	if (!(vb->features & (1UL << VIRTIO_BALLOON_F_MUST_TELL_HOST)))
+		return;
+	gpa = chunk << VIRTIO_BALLOON_CHUNK_SHIFT;
+	if (vm_get_memory_pagesz(vb->ctx, gpa) != VIRTIO_BALLOON_CHUNK_SIZE)
+		return;
+	if (vm_discard_memory(vb->ctx, gpa, VIRTIO_BALLOON_CHUNK_SIZE) == 0) {
+		virtio_balloon_test_and_set(vb->chunk_discarded, chunk);
+		vb->discarded++;
+	}
+}
+
+static void
+virtio_balloon_populate_chunk(struct virtio_balloon *vb, uint64_t chunk)
+{
+	uint64_t gpa = chunk << VIRTIO_BALLOON_CHUNK_SHIFT;
+
+	if (!(vb->chunk_discarded[chunk >> 6] & (1UL << (chunk & 63))))
+		return;
+
+	/* Left discarded on failure, the next deflate or reset retries */
+	if (vm_populate_memory(vb->ctx, gpa, VIRTIO_BALLOON_CHUNK_SIZE) < 0) {
+		WPRINTF(("vtballoon: failed to give back 0x%lx to the guest\n",
+			gpa));
+		return;
+	}
+	virtio_balloon_test_and_clear(vb->chunk_discarded, chunk);
+	vb->discarded--;
+}
+
+static void
+virtio_balloon_deflate_pfn(struct virtio_balloon *vb, uint64_t pfn)
+{
+	uint64_t chunk;
+
+	if (pfn >= vb->nr_pfns ||
+	    !virtio_balloon_test_and_clear(vb->pfn_bitmap, pfn))
+		return;
+
+	vb->inflated--;
+	chunk = pfn / VIRTIO_BALLOON_CHUNK_PFNS;
+	vb->chunk_pfns[chunk]--;
+	virtio_balloon_populate_chunk(vb, chunk);
+}
+
+/* Give all the memory back to the guest and empty the balloon */
+static void
+virtio_balloon_release_all(struct virtio_balloon *vb)
+{
+	uint64_t chunk;
+
+	for (chunk = 0; chunk < vb->nr_chunks && vb->discarded; chunk++)
+		virtio_balloon_populate_chunk(vb, chunk);
+
+	memset(vb->pfn_bitmap, 0, ((vb->nr_pfns + 63) / 64) * sizeof(uint64_t));
+	memset(vb->chunk_pfns, 0, vb->nr_chunks * sizeof(uint16_t));
+	vb->inflated = 0;
+}
+
+static void
+virtio_balloon_notify_pages(struct virtio_balloon *vb, struct virtio_vq_info *vq,
+		bool inflate)
+{
+	struct iovec iov[VIRTIO_BALLOON_MAXSEGS];
+	uint16_t idx;
+	uint32_t *pfns;
+	size_t i, j, n;
+	int segs;
+
+	while (vq_has_descs(vq)) {
+		segs = vq_getchain(vq, &idx, iov, VIRTIO_BALLOON_MAXSEGS, NULL);
+		if (segs < 0) {
+			WPRINTF(("vtballoon: invalid descriptor chain\n"));
+			return;
+		}
+
+		for (i = 0; i < segs; i++) {
+			pfns = iov[i].iov_base;
+			n = iov[i].iov_len / sizeof(uint32_t);
+			for (j = 0; pfns && j < n; j++) {
+				if (inflate)
+					virtio_balloon_inflate_pfn(vb, pfns[j]);
+				else
+					virtio_balloon_deflate_pfn(vb, pfns[j]);
+			}
+		}
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_balloon_notify_stats(struct virtio_balloon *vb, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon_stat *stat;
+	struct iovec iov;
+	uint16_t idx;
+	size_t i, n;
+
+	while (vq_has_descs(vq)) {
+		if (vq_getchain(vq, &idx, &iov, 1, NULL) < 1) {
+			WPRINTF(("vtballoon: invalid stats buffer\n"));
+			return;
+		}
+
+		/* A buffer still held is outdated by the new one */
+		if (vb->stats_held)
+			vq_relchain(vq, vb->stats_idx, 0);
+
+		stat = iov.iov_base;
+		n = iov.iov_len / sizeof(*stat);
+		for (i = 0; stat && i < n; i++) {
+			if (stat[i].tag < VM_BALLOON_NR_STATS)
+				vb->stats[stat[i].tag] = stat[i].val;
+		}
+		vb->stats_valid = true;
+
+		/* Keep the buffer until the next stats are wanted */
+		vb->stats_held = true;
+		vb->stats_idx = idx;
+	}
+}
+
+static void
+virtio_balloon_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon *vb = vdev;
+
+	switch (vb->qrole[vq - vb->queues]) {
+	case VIRTIO_BALLOON_INFLATEQ:
+		virtio_balloon_notify_pages(vb, vq, true);
+		break;
+	case VIRTIO_BALLOON_DEFLATEQ:
+		virtio_balloon_notify_pages(vb, vq, false);
+		break;
+	case VIRTIO_BALLOON_STATSQ:
+		virtio_balloon_notify_stats(vb, vq);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+virtio_balloon_apply_features(void *vdev, uint64_t negotiated_features)
+{
+	struct virtio_balloon *vb = vdev;
+	int i, q = 0;
+
+	vb->features = negotiated_features;
+
+	/* The queues of features not negotiated are left out */
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		vb->qrole[i] = -1;
+	vb->qrole[q++] = VIRTIO_BALLOON_INFLATEQ;
+	vb->qrole[q++] = VIRTIO_BALLOON_DEFLATEQ;
+	if (negotiated_features & (1UL << VIRTIO_BALLOON_F_STATS_VQ))
+		vb->qrole[q++] = VIRTIO_BALLOON_STATSQ;
+}
+
+static void
+virtio_balloon_reset(void *vdev)
+{
+	struct virtio_balloon *vb = vdev;
+
+	DPRINTF(("vtballoon: device reset requested !\n"));
+	virtio_balloon_release_all(vb);
+	vb->config.actual = 0;
+	vb->stats_held = false;
+	vb->stats_valid = false;
+	virtio_balloon_apply_features(vb, 0);
+	virtio_reset_dev(&vb->base);
+}
+
+static int
+virtio_balloon_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_balloon *vb = vdev;
+
+	if (offset + size > sizeof(vb->config))
+		return -1;
+	memcpy(retval, (uint8_t *)&vb->config + offset, size);
+	return 0;
+}
+
+static int
+virtio_balloon_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	struct virtio_balloon *vb = vdev;
+
+	/* The driver reports actual and the poison value */
+	if ((offset == offsetof(struct virtio_balloon_config, actual) ||
+	     offset == offsetof(struct virtio_balloon_config, poison_val)) &&
+	    size == sizeof(uint32_t))
+		memcpy((uint8_t *)&vb->config + offset, &value, size);
+	else
+		DPRINTF(("vtballoon: write to readonly reg %d\n", offset));
+
+	return 0;
+}
+
+static struct virtio_ops virtio_balloon_ops = {
+	"virtio_balloon",		/* our name */
+	VIRTIO_BALLOON_MAXQ,		/* we support up to 3 virtqueues */
+	sizeof(struct virtio_balloon_config),	/* config reg size */
+	virtio_balloon_reset,		/* reset */
+	virtio_balloon_notify,		/* device-wide qnotify */
+	virtio_balloon_cfgread,		/* read virtio config */
+	virtio_balloon_cfgwrite,	/* write virtio config */
+	virtio_balloon_apply_features,	/* apply negotiated features */
+	NULL,				/* called on guest set status */
+};
+
+static int
+virtio_balloon_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *vb;
+	pthread_mutexattr_t attr;
+	uint64_t memsize;
+	int i, rc;
+
+	if (balloon_dev) {
+		WPRINTF(("vtballoon: only one balloon is supported\n"));
+		return -1;
+	}
+
+	vb = calloc(1, sizeof(struct virtio_balloon));
+	if (!vb) {
+		WPRINTF(("vtballoon: calloc returns NULL\n"));
+		return -1;
+	}
+
+	/* Track every 4K page up to the end of the guest memory */
+	memsize = ctx->highmem ? ctx->highmem_gpa_base + ctx->highmem : ctx->lowmem;
+	vb->ctx = ctx;
+	vb->nr_pfns = memsize >> VIRTIO_BALLOON_PFN_SHIFT;
+	vb->nr_chunks = (vb->nr_pfns + VIRTIO_BALLOON_CHUNK_PFNS - 1) /
+			VIRTIO_BALLOON_CHUNK_PFNS;
+	vb->pfn_bitmap = calloc((vb->nr_pfns + 63) / 64, sizeof(uint64_t));
+	vb->chunk_pfns = calloc(vb->nr_chunks, sizeof(uint16_t));
+	vb->chunk_discarded = calloc((vb->nr_chunks + 63) / 64, sizeof(uint64_t));
+	if (!vb->pfn_bitmap || !vb->chunk_pfns || !vb->chunk_discarded) {
+		WPRINTF(("vtballoon: failed to allocate the page tracking\n"));
+		goto fail;
+	}
+
+	/* init mutex attribute properly to avoid deadlock */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		DPRINTF(("vtballoon: mutexattr_settype failed with "
+					"error %d!\n", rc));
+	rc = pthread_mutex_init(&vb->mtx, &attr);
+	if (rc)
+		DPRINTF(("vtballoon: pthread_mutex_init failed with "
+					"error %d!\n", rc));
+
+	virtio_linkup(&vb->base, &virtio_balloon_ops, vb, dev, vb->queues,
+			BACKEND_VBSU);
+	vb->base.mtx = &vb->mtx;
+	vb->base.device_caps = VIRTIO_BALLOON_S_HOSTCAPS;
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		vb->queues[i].qsize = VIRTIO_BALLOON_RINGSZ;
+	virtio_balloon_apply_features(vb, 0);
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_MEMORY);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vb->base, virtio_uses_msix())) {
+		pthread_mutex_destroy(&vb->mtx);
+		goto fail;
+	}
+	virtio_set_io_bar(&vb->base, 0);
+	if (virtio_set_modern_bar(&vb->base, false)) {
+		pthread_mutex_destroy(&vb->mtx);
+		goto fail;
+	}
+
+	balloon_dev = vb;
+	return 0;
+
+fail:
+	free(vb->pfn_bitmap);
+	free(vb->chunk_pfns);
+	free(vb->chunk_discarded);
+	free(vb);
+	return -1;
+}
+
+static void
+virtio_balloon_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *vb;
+
+	if (dev->arg) {
+		vb = (struct virtio_balloon *)dev->arg;
+		pthread_mutex_lock(&vb->mtx);
+		balloon_dev = NULL;
+		virtio_balloon_release_all(vb);
+		pthread_mutex_unlock(&vb->mtx);
+
+		pthread_mutex_destroy(&vb->mtx);
+		free(vb->pfn_bitmap);
+		free(vb->chunk_pfns);
+		free(vb->chunk_discarded);
+		DPRINTF(("%s: free struct virtio_balloon!\n", __func__));
+		free(vb);
+		dev->arg = NULL;
+	}
+}
+
+/*
+ * devargs is empty to only query the balloon, or "<size>" with a K/M/G
+ * suffix to set its target size. The state of the balloon is returned
+ * in info.
+ */
+int
+vm_monitor_balloon(void *arg, char *devargs, struct vm_balloon_info *info)
+{
+	struct virtio_balloon *vb = balloon_dev;
+	struct virtio_vq_info *vq;
+	bool changed = false;
+	uint64_t target;
+	char *end;
+	int i, error = 0;
+
+	if (!vb)
+		return -ENODEV;
+
+	pthread_mutex_lock(&vb->mtx);
+	if (devargs && devargs[0] != '\0') {
+		if (dm_strtoul(devargs, &end, 10, &target)) {
+			error = -EINVAL;
+			goto out;
+		}
+		switch (*end) {
+		case 'G': case 'g':
+			target <<= 10;
+			/* fall through */
+		case 'M': case 'm':
+			target <<= 10;
+			/* fall through */
+		case 'K': case 'k':
+			target <<= 10;
+			end++;
+			break;
+		default:
+			break;
+		}
+		if (*end != '\0' || (target >> VIRTIO_BALLOON_PFN_SHIFT) > vb->nr_pfns) {
+			error = -EINVAL;
+			goto out;
+		}
+		vb->config.num_pages = target >> VIRTIO_BALLOON_PFN_SHIFT;
+		changed = true;
+	}
+
+	if (changed)
+		virtio_config_changed(&vb->base);
+
+	/* Hand the stats buffer back, the guest refills it */
+	if (vb->stats_held) {
+		for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++) {
+			if (vb->qrole[i] != VIRTIO_BALLOON_STATSQ)
+				continue;
+			vq = &vb->queues[i];
+			vq_relchain(vq, vb->stats_idx, 0);
+			vq_endchains(vq, 1);
+		}
+		vb->stats_held = false;
+	}
+
+	if (info) {
+		info->target = (uint64_t)vb->config.num_pages << VIRTIO_BALLOON_PFN_SHIFT;
+		info->actual = (uint64_t)vb->config.actual << VIRTIO_BALLOON_PFN_SHIFT;
+		info->returned = vb->discarded * VIRTIO_BALLOON_CHUNK_SIZE;
+		info->stats_valid = vb->stats_valid;
+		memcpy(info->stats, vb->stats, sizeof(info->stats));
+	}
+
+out:
+	pthread_mutex_unlock(&vb->mtx);
+	return error;
+}
+
+struct pci_vdev_ops pci_ops_virtio_balloon = {
+	.class_name	= "virtio-balloon",
+	.vdev_init	= virtio_balloon_init,
+	.vdev_deinit	= virtio_balloon_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_balloon);
@@ -163,6 +163,7 @@ struct virtio_blk {
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
 	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 	uint8_t original_wce;
+	bool use_packed;	/* offer VIRTIO_F_RING_PACKED */
 };
 
 static void virtio_blk_reset(void *);
@@ -394,7 +395,7 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 	 * requests in virtqueue.
 	 * */
 	do {
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_disable_notify(vq);
 		mb();
 		do {
 			virtio_blk_proc(blk, vq);
@@ -420,6 +421,9 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 	if (blockif_is_ro(blk->bc))
 		caps |= VIRTIO_BLK_F_RO;
 
+	if (blk->use_packed)
+		caps |= (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED);
+
 	return caps;
 }
 
@@ -465,9 +469,13 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *opts_tmp = NULL;
 	char *opts_start = NULL;
 	char *opt = NULL;
+	const char *opts_blk;
 	u_char digest[16];
 	struct virtio_blk *blk;
-	bool use_iothread;
+	bool use_iothread, use_packed;
+	const char *poll_budget = NULL;
+	int iothread_idx = -1;
+	char *end;
 	int i;
 	pthread_mutexattr_t attr;
 	int rc;
@@ -476,6 +484,7 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* Assume the bctxt is valid, until identified otherwise */
 	dummy_bctxt = false;
 	use_iothread = false;
+	use_packed = false;
 
 	if (opts == NULL) {
 		pr_err("virtio_blk: backing device required\n");
@@ -501,17 +510,35 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 	if (strstr(opts, "nodisk") == NULL) {
-		opt = strsep(&opts_tmp, ",");
-		if (strcmp("iothread", opt) == 0) {
-			use_iothread = true;
-		} else {
-			/* The opts_start is truncated by strsep, opts_tmp is also
-			 * changed by strsetp, so use opts which points to the
-			 * original parameter string
-			 */
-			opts_tmp = opts;
+		/*
+		 * "iothread[=<idx>]", "packed" and "poll_budget=<us>" may
+		 * precede the blockif options.
+		 * strsep truncates the token it stops at, so the blockif
+		 * options are taken from the original parameter string.
+		 */
+		opts_blk = opts;
+		while ((opt = strsep(&opts_tmp, ",")) != NULL) {
+			if (strcmp("iothread", opt) == 0)
+				use_iothread = true;
+			else if (strncmp("iothread=", opt, 9) == 0) {
+				if (dm_strtoi(opt + 9, &end, 10, &iothread_idx) ||
+				    *end != '\0' || iothread_idx < 0 || iothread_idx >= iothread_num()) {
+					pr_err("virtio_blk: invalid iothread index %s\n",
+						opt + 9);
+					free(opts_start);
+					return -1;
+				}
+				use_iothread = true;
+			}
+			else if (strcmp("packed", opt) == 0)
+				use_packed = true;
+			else if (strncmp("poll_budget=", opt, 12) == 0)
+				poll_budget = opts + (opt - opts_start) + 12;
+			else
+				break;
+			opts_blk = opts_tmp ? opts + (opts_tmp - opts_start) : "";
 		}
-		bctxt = blockif_open(opts_tmp, bident);
+		bctxt = blockif_open(opts_blk, bident);
 		if (bctxt == NULL) {
 			pr_err("Could not open backing file");
 			free(opts_start);
@@ -531,6 +558,7 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 
 	blk->bc = bctxt;
+	blk->use_packed = use_packed;
 	/* Update virtio-blk device struct of dummy ctxt*/
 	blk->dummy_bctxt = dummy_bctxt;
 
@@ -560,7 +588,16 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* init virtio struct and virtqueues */
 	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq, BACKEND_VBSU);
 	blk->base.iothread = use_iothread;
+	blk->base.iothread_idx = iothread_idx;
 	blk->base.mtx = &blk->mtx;
+	if (poll_budget && virtio_set_poll_budget(&blk->base, poll_budget)) {
+		pr_err("virtio_blk: invalid poll_budget\n");
+		/* call close only for valid bctxt */
+		if (!blk->dummy_bctxt)
+			blockif_close(blk->bc);
+		free(blk);
+		return -1;
+	}
 
 	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
 	/* blk->vq.vq_notify = we have no per-queue notify */
@@ -614,6 +651,18 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 	virtio_set_io_bar(&blk->base, 0);
 
+	/* the packed ring needs VERSION_1, i.e. the modern interface */
+	if (blk->use_packed)
+		blk->base.device_caps |= (1UL << VIRTIO_F_VERSION_1) |
+			(1UL << VIRTIO_F_RING_PACKED);
+	if (blk->use_packed && virtio_set_modern_bar(&blk->base, false)) {
+		pr_err("virtio_blk: failed to set modern bar\n");
+		if (!blk->dummy_bctxt)
+			blockif_close(blk->bc);
+		free(blk);
+		return -1;
+	}
+
 	/*
 	 * Register ops for virtio-blk Rescan
 	 */
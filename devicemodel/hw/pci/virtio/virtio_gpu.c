@@ -217,6 +217,12 @@ struct virtio_gpu_resource_2d {
 	pixman_image_t *image;
 	struct iovec *iov;
 	uint32_t iovcnt;
+	/* iov_off[i] is the offset of iov[i] in the backing,
+	 * iov_off[iovcnt] is the size of the backing.
+	 */
+	size_t *iov_off;
+	/* the image data is the backing itself */
+	bool mapped;
 	bool blob;
 	struct dma_buf_info *dma_info;
 	LIST_ENTRY(virtio_gpu_resource_2d) link;
@@ -445,6 +451,144 @@ virtio_gpu_set_status(void *vdev, uint64_t status)
 	gpu->base.status = status;
 }
 
+/*
+ * Index the backing of r2d by offset, so that a transfer finds the iov of
+ * a row without walking all the entries.
+ */
+static int
+virtio_gpu_index_backing(struct virtio_gpu_resource_2d *r2d)
+{
+	uint32_t i;
+
+	r2d->iov_off = malloc((r2d->iovcnt + 1) * sizeof(size_t));
+	if (!r2d->iov_off)
+		return -1;
+
+	r2d->iov_off[0] = 0;
+	for (i = 0; i < r2d->iovcnt; i++)
+		r2d->iov_off[i + 1] = r2d->iov_off[i] + r2d->iov[i].iov_len;
+	return 0;
+}
+
+/* Copy len bytes at offset of the backing of r2d to dst */
+static void
+virtio_gpu_copy_from_backing(struct virtio_gpu_resource_2d *r2d,
+		size_t offset, uint8_t *dst, size_t len)
+{
+	uint32_t lo, hi, i;
+	size_t skip, bytes;
+
+	if (!r2d->iov_off)
+		return;
+
+	/* the last entry that starts at or before offset */
+	lo = 0;
+	hi = r2d->iovcnt;
+	while (hi - lo > 1) {
+		i = (lo + hi) / 2;
+		if (r2d->iov_off[i] <= offset)
+			lo = i;
+		else
+			hi = i;
+	}
+
+	for (i = lo; (i < r2d->iovcnt) && (len > 0); i++) {
+		if (offset >= r2d->iov_off[i + 1])
+			continue;
+
+		skip = offset - r2d->iov_off[i];
+		bytes = r2d->iov[i].iov_len - skip;
+		if (bytes > len)
+			bytes = len;
+		/* the entries not mapped in the DM are holes */
+		if (r2d->iov[i].iov_base)
+			memcpy(dst, (uint8_t *)r2d->iov[i].iov_base + skip, bytes);
+		dst += bytes;
+		offset += bytes;
+		len -= bytes;
+	}
+}
+
+/*
+ * Use the backing as the image data if it is contiguous in the DM address
+ * space and has the layout of the image. Transfers to the host need no
+ * copy then.
+ */
+static void
+virtio_gpu_map_backing(struct virtio_gpu_resource_2d *r2d)
+{
+	pixman_image_t *image;
+	uint32_t stride, i;
+	uint8_t *base;
+
+	if (r2d->iovcnt == 0 || !r2d->image)
+		return;
+
+	base = r2d->iov[0].iov_base;
+	stride = r2d->width * (PIXMAN_FORMAT_BPP(r2d->format) / 8);
+	if (!base || ((uintptr_t)base & 0x3) || (stride & 0x3) ||
+	    (stride != pixman_image_get_stride(r2d->image)) ||
+	    (r2d->iov_off[r2d->iovcnt] < (size_t)stride * r2d->height))
+		return;
+
+	for (i = 1; i < r2d->iovcnt; i++) {
+		if ((uint8_t *)r2d->iov[i].iov_base != base + r2d->iov_off[i])
+			return;
+	}
+
+	image = pixman_image_create_bits(r2d->format, r2d->width, r2d->height,
+			(uint32_t *)base, stride);
+	if (!image)
+		return;
+
+	pixman_image_unref(r2d->image);
+	r2d->image = image;
+	r2d->mapped = true;
+}
+
+/*
+ * Give a mapped image its own data again, with the last content of the
+ * backing. The backing stays attached and is copied from on transfers.
+ */
+static void
+virtio_gpu_unmap_backing(struct virtio_gpu_resource_2d *r2d)
+{
+	pixman_image_t *image;
+
+	if (r2d->mapped && r2d->image) {
+		image = pixman_image_create_bits(r2d->format, r2d->width,
+				r2d->height, NULL, 0);
+		if (image) {
+			memcpy(pixman_image_get_data(image),
+				pixman_image_get_data(r2d->image),
+				(size_t)pixman_image_get_stride(r2d->image) * r2d->height);
+			pixman_image_unref(r2d->image);
+			r2d->image = image;
+		}
+	}
+	r2d->mapped = false;
+}
+
+/*
+ * Drop the backing of r2d. A mapped image gets its own data again, with
+ * the last content of the backing.
+ */
+static void
+virtio_gpu_release_backing(struct virtio_gpu_resource_2d *r2d)
+{
+	virtio_gpu_unmap_backing(r2d);
+
+	if (r2d->iov) {
+		free(r2d->iov);
+		r2d->iov = NULL;
+	}
+	if (r2d->iov_off) {
+		free(r2d->iov_off);
+		r2d->iov_off = NULL;
+	}
+	r2d->iovcnt = 0;
+}
+
 static void
 virtio_gpu_reset(void *vdev)
 {
@@ -466,10 +610,7 @@ virtio_gpu_reset(void *vdev)
 				r2d->blob = false;
 			}
 			LIST_REMOVE(r2d, link);
-			if (r2d->iov) {
-				free(r2d->iov);
-				r2d->iov = NULL;
-			}
+			virtio_gpu_release_backing(r2d);
 			free(r2d);
 		}
 	}
@@ -755,10 +896,7 @@ virtio_gpu_cmd_resource_unref(struct virtio_gpu_command *cmd)
 			r2d->blob = false;
 		}
 		LIST_REMOVE(r2d, link);
-		if (r2d->iov) {
-			free(r2d->iov);
-			r2d->iov = NULL;
-		}
+		virtio_gpu_release_backing(r2d);
 		free(r2d);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
@@ -802,6 +940,7 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 
 	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
 	if (r2d && req.nr_entries > 0) {
+		virtio_gpu_release_backing(r2d);
 		iov = malloc(req.nr_entries * sizeof(struct iovec));
 		if (!iov) {
 			resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
@@ -813,6 +952,8 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 		entries = calloc(req.nr_entries, sizeof(struct virtio_gpu_mem_entry));
 		if (!entries) {
 			free(iov);
+			r2d->iov = NULL;
+			r2d->iovcnt = 0;
 			resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
 			goto exit;
 		}
@@ -829,6 +970,12 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 			r2d->iov[i].iov_len = entries[i].length;
 		}
 		free(entries);
+		if (virtio_gpu_index_backing(r2d) < 0) {
+			virtio_gpu_release_backing(r2d);
+			resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+			goto exit;
+		}
+		virtio_gpu_map_backing(r2d);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
 		pr_err("%s: Illegal resource id %d\n", __func__, req.resource_id);
@@ -851,10 +998,8 @@ virtio_gpu_cmd_resource_detach_backing(struct virtio_gpu_command *cmd)
 	memset(&resp, 0, sizeof(resp));
 
 	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
-	if (r2d && r2d->iov) {
-		free(r2d->iov);
-		r2d->iov = NULL;
-	}
+	if (r2d)
+		virtio_gpu_release_backing(r2d);
 
 	cmd->iolen = sizeof(resp);
 	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
@@ -936,11 +1081,10 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 	struct virtio_gpu_transfer_to_host_2d req;
 	struct virtio_gpu_resource_2d *r2d;
 	struct virtio_gpu_ctrl_hdr resp;
-	uint32_t src_offset, dst_offset, stride, bpp, h;
+	uint32_t dst_offset, stride, bpp, h;
 	pixman_format_code_t format;
-	void *img_data, *dst, *src;
-	int i, done, bytes, total;
-	int width, height;
+	void *img_data;
+	uint32_t width, height;
 
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
@@ -970,38 +1114,35 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 		pr_err("%s: transfer bounds outside resource.\n", __func__);
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 	} else {
-		pixman_image_ref(r2d->image);
 		stride = pixman_image_get_stride(r2d->image);
 		format = pixman_image_get_format(r2d->image);
 		bpp = PIXMAN_FORMAT_BPP(format) / 8;
-		img_data = pixman_image_get_data(r2d->image);
 		width = (req.r.width < r2d->width) ? req.r.width : r2d->width;
 		height = (req.r.height < r2d->height) ? req.r.height : r2d->height;
-		for (h = 0; h < height; h++) {
-			src_offset = req.offset + stride * h;
-			dst_offset = (req.r.y + h) * stride + (req.r.x * bpp);
-			dst = img_data + dst_offset;
-			done = 0;
-			total = width * bpp;
-			for (i = 0; i < r2d->iovcnt; i++) {
-				if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
-					continue;
-				}
+		dst_offset = req.r.y * stride + (req.r.x * bpp);
 
-				if (src_offset < r2d->iov[i].iov_len) {
-					src = r2d->iov[i].iov_base + src_offset;
-					bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
-						 (total - done) : (r2d->iov[i].iov_len - src_offset);
-					memcpy((dst + done), src, bytes);
-					src_offset = 0;
-					done += bytes;
-					if (done >= total) {
-						break;
-					}
-				} else {
-					src_offset -= r2d->iov[i].iov_len;
-				}
-			}
+		/* The guest transfers from another place than the image rows:
+		 * moving the data inside the backing would overwrite memory the
+		 * guest still owns, copy into a host image instead.
+		 */
+		if (r2d->mapped && (req.offset != dst_offset))
+			virtio_gpu_unmap_backing(r2d);
+
+		pixman_image_ref(r2d->image);
+		img_data = pixman_image_get_data(r2d->image);
+		if (r2d->mapped) {
+			/* The backing is the image, nothing to copy */
+		} else if (width * bpp == stride) {
+			/* Whole rows, they are contiguous in the image */
+			virtio_gpu_copy_from_backing(r2d, req.offset,
+					(uint8_t *)img_data + dst_offset,
+					(size_t)stride * height);
+		} else {
+			for (h = 0; h < height; h++)
+				virtio_gpu_copy_from_backing(r2d,
+					req.offset + (size_t)stride * h,
+					(uint8_t *)img_data + dst_offset + stride * h,
+					width * bpp);
 		}
 		pixman_image_unref(r2d->image);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
@@ -1015,10 +1156,13 @@ static bool
 virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
 			      int scanout_id,
 			      int resource_id,
-			      struct virtio_gpu_rect *flush_rect)
+			      struct virtio_gpu_rect *flush_rect,
+			      struct surface *surf)
 {
 	struct virtio_gpu_scanout *gpu_scanout;
 	pixman_region16_t flush_region, final_region, scanout_region;
+	pixman_box16_t *box;
+	bool not_empty;
 
 	/* the scanout_id is already checked. So it is ignored in this function */
 	gpu_scanout = gpu->gpu_scanouts + scanout_id;
@@ -1045,10 +1189,21 @@ virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
 	/* if intersection_region is empty, it means that the scanout_region is not
 	 * covered by the flushed_region. And it is unnecessary to update
 	 */
-	if (pixman_region_not_empty(&final_region))
-		return true;
-	else
-		return false;
+	not_empty = pixman_region_not_empty(&final_region);
+
+	/* Only the intersection needs to be uploaded to the display */
+	if (not_empty && surf) {
+		box = pixman_region_extents(&final_region);
+		surf->damage.x = box->x1 - gpu_scanout->scanout_rect.x;
+		surf->damage.y = box->y1 - gpu_scanout->scanout_rect.y;
+		surf->damage.width = box->x2 - box->x1;
+		surf->damage.height = box->y2 - box->y1;
+	}
+	pixman_region_fini(&final_region);
+	pixman_region_fini(&scanout_region);
+	pixman_region_fini(&flush_region);
+
+	return not_empty;
 }
 
 static void
@@ -1079,7 +1234,8 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	if (r2d->blob) {
 		virtio_gpu_dmabuf_ref(r2d->dma_info);
 		for (i = 0; i < gpu->scanout_num; i++) {
-			if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
+			if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id,
+						&req.r, &surf))
 				continue;
 
 			surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
@@ -1094,7 +1250,8 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	pixman_image_ref(r2d->image);
 	bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
 	for (i = 0; i < gpu->scanout_num; i++) {
-		if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
+		if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id,
+					&req.r, &surf))
 			continue;
 
 		gpu_scanout = gpu->gpu_scanouts + i;
@@ -1309,6 +1466,11 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 						entries[i].length);
 				r2d->iov[i].iov_len = entries[i].length;
 			}
+			if (virtio_gpu_index_backing(r2d) < 0) {
+				virtio_gpu_release_backing(r2d);
+				pr_err("%s: failed to index backing of resource %d\n",
+					__func__, r2d->resource_id);
+			}
 		}
 
 		free(entries);
@@ -1924,10 +2086,7 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				r2d->blob = false;
 			}
 			LIST_REMOVE(r2d, link);
-			if (r2d->iov) {
-				free(r2d->iov);
-				r2d->iov = NULL;
-			}
+			virtio_gpu_release_backing(r2d);
 			free(r2d);
 		}
 	}
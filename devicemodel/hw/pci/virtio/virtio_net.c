@@ -46,14 +46,28 @@
 #include <linux/vhost.h>
 
 #include "dm.h"
+#include "atomic.h"
 #include "pci_core.h"
 #include "mevent.h"
 #include "virtio.h"
 #include "vhost.h"
 #include "dm_string.h"
+#include "timer.h"
 
 #define VIRTIO_NET_RINGSZ	1024
+#define VIRTIO_NET_CTLRINGSZ	64
 #define VIRTIO_NET_MAXSEGS	256
+/* packets received per tap wakeup before yielding to other events */
+#define VIRTIO_NET_RX_BATCH	64
+
+/*
+ * Largest frame the tap hands us, without and with guest GSO, used to
+ * size the set of merged rx buffers gathered for one packet.
+ */
+#define VIRTIO_NET_MAX_FRAME	(ETHER_MAX_LEN - ETHER_CRC_LEN + 4)
+#define VIRTIO_NET_MAX_GSO_FRAME	(65535 + ETHER_HDR_LEN + 4)
+/* at most this many rx chains are merged into one packet */
+#define VIRTIO_NET_MAX_MRG_BUFS	64
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -77,16 +91,30 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple rx/tx queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
 	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC))
 
+/*
+ * Checksum and segmentation offloads, offered only when the tap passes
+ * the virtio-net header through (IFF_VNET_HDR)
+ */
+#define VIRTIO_NET_S_OFFLOADCAPS   \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+	VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_HOST_ECN | VIRTIO_NET_F_GUEST_TSO4 | \
+	VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN)
+
 #define VIRTIO_NET_S_VHOSTCAPS      \
 	((1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
 	(1 << VIRTIO_RING_F_EVENT_IDX) | VIRTIO_NET_F_MRG_RXBUF | \
 	(1UL << VIRTIO_F_VERSION_1))
 
+/* offered on top of the above when more than one queue pair is set up */
+#define VIRTIO_NET_S_MQCAPS	(VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ)
+
 /* is address mcast/bcast? */
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01)
 
@@ -96,16 +124,34 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions. Queue pair N uses virtqueues 2N (rx) and 2N + 1
+ * (tx), the control queue follows the last pair and only exists when
+ * there is more than one pair.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_PAIRQ	2	/* virtqueues per pair */
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_MAX_PAIRS	8
+#define VIRTIO_NET_MAXQ	(VIRTIO_NET_MAX_PAIRS * VIRTIO_NET_PAIRQ + 1)
+
+/*
+ * Control queue commands, only multiqueue is supported
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_MQ	4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
 
 /*
  * Fixed network header size
@@ -132,49 +178,93 @@ static int virtio_net_debug;
  */
 struct vhost_net {
 	struct vhost_dev vdev;
-	struct vhost_vq vqs[VIRTIO_NET_MAXQ - 1];
+	struct vhost_vq vqs[VIRTIO_NET_PAIRQ];
 	int tapfd;
 	bool vhost_started;
 };
 
+struct virtio_net;
+
+/*
+ * Per queue pair struct: one tap queue serving one rx and one tx
+ * virtqueue, with its own rx event, tx thread and vhost instance.
+ */
+struct virtio_net_pair {
+	struct virtio_net *net;
+	int		idx;
+
+	int		tapfd;
+	bool		attached;	/* tap queue attached to the device */
+	struct mevent	*mevp;
+
+	int		rx_ready;
+	int		rx_stalled;	/* tap event off, waiting for rx buffers */
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+	int		rx_pending;	/* used entries not signaled yet */
+	bool		rx_timer_armed;
+	struct acrn_timer rx_timer;	/* flushes rx_pending */
+
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+
+	struct vhost_net *vhost_net;
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_ops ops;		/* nvq depends on the queue pairs */
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
+	struct virtio_net_pair pairs[VIRTIO_NET_MAX_PAIRS];
+	int		max_pairs;
+	int		curr_pairs;	/* pairs the driver enabled */
+	int		nr_mevp;	/* rx events not yet torn down */
 
-	int		rx_ready;
+	bool		tap_vnet_hdr;	/* tap reads/writes the virtio-net header */
 
 	volatile int	resetting;	/* set and checked outside lock */
-	volatile int	closing;	/* stop the tx i/o thread */
+	volatile int	closing;	/* stop the tx i/o threads */
 
 	uint64_t	features;	/* negotiated features */
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	int		rx_coal_frames;	/* signal once this many are pending */
+	int		rx_coal_usecs;	/* or this long after the first, 0: off */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	void (*virtio_net_rx)(struct virtio_net_pair *pair);
+	void (*virtio_net_tx)(struct virtio_net_pair *pair, struct iovec *iov,
 			     int iovcnt, int len);
 
-	struct vhost_net *vhost_net;
 	bool		use_vhost;
+	bool		use_packed;	/* offer VIRTIO_F_RING_PACKED */
 };
 
+static inline struct virtio_vq_info *
+virtio_net_pair_vq(struct virtio_net_pair *pair, int q)
+{
+	return &pair->net->queues[pair->idx * VIRTIO_NET_PAIRQ + q];
+}
+
+static inline struct virtio_net_pair *
+virtio_net_vq_pair(struct virtio_net *net, struct virtio_vq_info *vq)
+{
+	return &net->pairs[(vq - net->queues) / VIRTIO_NET_PAIRQ];
+}
+
 static void virtio_net_reset(void *vdev);
+static int virtio_net_tap_offload(struct virtio_net *net);
+static void virtio_net_rx_settimer(struct virtio_net_pair *pair, int usecs);
+static void virtio_net_rx_unstall(struct virtio_net_pair *pair);
 static void virtio_net_tx_stop(struct virtio_net *net);
 static int virtio_net_cfgread(void *vdev, int offset, int size,
 	uint32_t *retval);
@@ -182,6 +272,7 @@ static int virtio_net_cfgwrite(void *vdev, int offset, int size,
 	uint32_t value);
 static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
 static void virtio_net_set_status(void *vdev, uint64_t status);
+static void virtio_net_quiesce(void *vdev, bool stop);
 static void virtio_net_teardown(void *param);
 static struct vhost_net *vhost_net_init(struct virtio_base *base, int vhostfd,
 	int tapfd, int vq_idx);
@@ -191,7 +282,7 @@ static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	VIRTIO_NET_PAIRQ,		/* 2 virtqueues per pair, + control */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -199,6 +290,7 @@ static struct virtio_ops virtio_net_ops = {
 	virtio_net_cfgwrite,		/* write PCI config */
 	virtio_net_neg_features,	/* apply negotiated features */
 	virtio_net_set_status,		/* called on guest set status */
+	virtio_net_quiesce,		/* stop or restart tx/rx */
 };
 
 static int
@@ -268,36 +360,66 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_pair *pair)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	while (pair->tx_in_progress) {
+		pthread_mutex_unlock(&pair->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&pair->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_pair *pair)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&pair->rx_mtx);
+	while (pair->rx_in_progress) {
+		pthread_mutex_unlock(&pair->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&pair->rx_mtx);
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_unlock(&pair->rx_mtx);
+}
+
+/*
+ * Attach the tap queues of the first n pairs and detach the others, so
+ * the tap only steers packets to queues the driver is using.
+ */
+static void
+virtio_net_set_pairs(struct virtio_net *net, int n)
+{
+	struct virtio_net_pair *pair;
+	struct ifreq ifr;
+	bool attach;
+	int i;
+
+	for (i = 0; i < net->max_pairs && net->max_pairs > 1; i++) {
+		pair = &net->pairs[i];
+		attach = (i < n);
+		if (pair->tapfd < 0 || pair->attached == attach)
+			continue;
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(pair->tapfd, TUNSETQUEUE, &ifr) < 0)
+			WPRINTF(("vtnet: %s tap queue %d failed: %d\n",
+				attach ? "attach" : "detach", i, errno));
+		else
+			pair->attached = attach;
+	}
+	net->curr_pairs = n;
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -307,47 +429,98 @@ virtio_net_reset(void *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_pairs; i++) {
+		virtio_net_txwait(&net->pairs[i]);
+		virtio_net_rxwait(&net->pairs[i]);
+		net->pairs[i].rx_ready = 0;
+		net->pairs[i].rx_pending = 0;
+		if (net->pairs[i].rx_timer_armed)
+			virtio_net_rx_settimer(&net->pairs[i], 0);
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
+	net->features = 0;
+	(void)virtio_net_tap_offload(net);
+	virtio_net_set_pairs(net, 1);
 
 	net->resetting = 0;
 	net->closing = 0;
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Park the tx threads and the tap rx handler like a reset does, without
+ * resetting the rings. Pending rx interrupts are sent first, so the
+ * used rings are complete.
+ */
+static void
+virtio_net_quiesce(void *vdev, bool stop)
+{
+	struct virtio_net *net = vdev;
+	struct virtio_net_pair *pair;
+	int i;
+
+	net->resetting = stop;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		if (stop) {
+			virtio_net_txwait(pair);
+			virtio_net_rxwait(pair);
+			pthread_mutex_lock(&pair->rx_mtx);
+			if (pair->rx_pending) {
+				vq_endchains(virtio_net_pair_vq(pair, VIRTIO_NET_RXQ), 0);
+				pair->rx_pending = 0;
+			}
+			if (pair->rx_timer_armed)
+				virtio_net_rx_settimer(pair, 0);
+			pthread_mutex_unlock(&pair->rx_mtx);
+		} else {
+			/* catch what the guest posted before the pause */
+			pthread_mutex_lock(&pair->tx_mtx);
+			if (pair->tx_in_progress == 0)
+				pthread_cond_signal(&pair->tx_cond);
+			pthread_mutex_unlock(&pair->tx_mtx);
+			virtio_net_rx_unstall(pair);
+		}
+	}
+}
+
+/*
+ * Send signal to the tx I/O threads and wait till they exit
  */
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
+	struct virtio_net_pair *pair;
 	void *jval;
+	int i;
 
-	pthread_mutex_lock(&net->tx_mtx);
 	net->closing = 1;
-	pthread_cond_broadcast(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		pthread_mutex_lock(&pair->tx_mtx);
+		pthread_cond_broadcast(&pair->tx_cond);
+		pthread_mutex_unlock(&pair->tx_mtx);
 
-	pthread_join(net->tx_tid, &jval);
+		pthread_join(pair->tx_tid, &jval);
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_pair *pair, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (pair->tapfd == -1)
 		return;
 
 	/*
@@ -360,19 +533,10 @@ virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(pair->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
-/*
- *  Called when there is read activity on the tap file descriptor.
- * Each buffer posted by the guest is assumed to be able to contain
- * an entire ethernet frame + rx header.
- *  MP note: the dummybuf is only used for discarding frames, so there
- * is no need for it to be per-vtnet or locked.
- */
-static uint8_t dummybuf[2048];
-
 static inline struct iovec *
 rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 {
@@ -400,20 +564,108 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+/*
+ * Stop reading the tap until the guest posts rx buffers, so packets
+ * queue up in the tap instead of being dropped here. With vq set,
+ * ask the guest to kick us and catch buffers posted meanwhile.
+ */
+static void
+virtio_net_rx_unstall(struct virtio_net_pair *pair)
+{
+	if (atomic_xchg(&pair->rx_stalled, 0))
+		mevent_enable(pair->mevp);
+}
+
+static void
+virtio_net_rx_stall(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
+{
+	atomic_store(&pair->rx_stalled, 1);
+	mevent_disable(pair->mevp);
+
+	if (vq == NULL)
+		return;
+
+	vq_clear_used_ring_flags(&pair->net->base, vq);
+	/* memory barrier */
+	mb();
+	if (vq_has_descs(vq))
+		virtio_net_rx_unstall(pair);
+}
+
+static void
+virtio_net_rx_settimer(struct virtio_net_pair *pair, int usecs)
+{
+	struct itimerspec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = usecs / 1000000;
+	ts.it_value.tv_nsec = (usecs % 1000000) * 1000;
+	if (acrn_timer_settime(&pair->rx_timer, &ts) < 0)
+		WPRINTF(("vtnet: rx coalescing timer failed\n"));
+	pair->rx_timer_armed = (usecs != 0);
+}
+
+/*
+ * Account npkts newly used rx entries and interrupt the guest
+ * rx_coal_usecs after the first one, or earlier once rx_coal_frames are
+ * pending (only set together with rx_coal_usecs).
+ * Running out of buffers signals right away, the guest has to refill.
+ * Called with rx_mtx held.
+ */
+static void
+virtio_net_rx_notify(struct virtio_net_pair *pair, struct virtio_vq_info *vq,
+		     int npkts, int used_all_avail)
+{
+	struct virtio_net *net = pair->net;
+
+	pair->rx_pending += npkts;
+	if (used_all_avail || net->rx_coal_usecs == 0 ||
+	    (net->rx_coal_frames && pair->rx_pending >= net->rx_coal_frames)) {
+		vq_endchains(vq, used_all_avail);
+		pair->rx_pending = 0;
+		if (pair->rx_timer_armed)
+			virtio_net_rx_settimer(pair, 0);
+	} else if (pair->rx_pending && !pair->rx_timer_armed)
+		virtio_net_rx_settimer(pair, net->rx_coal_usecs);
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_rx_timer(void *param, uint64_t nexp)
 {
+	struct virtio_net_pair *pair = param;
+
+	pthread_mutex_lock(&pair->rx_mtx);
+	pair->rx_timer_armed = false;
+	if (pair->rx_pending && !pair->net->resetting) {
+		vq_endchains(virtio_net_pair_vq(pair, VIRTIO_NET_RXQ), 0);
+		pair->rx_pending = 0;
+	}
+	pthread_mutex_unlock(&pair->rx_mtx);
+}
+
+/*
+ *  Called when there is read activity on the tap file descriptor.
+ * Up to VIRTIO_NET_RX_BATCH packets are received per call and the
+ * guest is interrupted once for all of them.
+ */
+static void
+virtio_net_tap_rx(struct virtio_net_pair *pair)
+{
+	struct virtio_net *net = pair->net;
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
 	struct virtio_vq_info *vq;
+	uint16_t ids[VIRTIO_NET_MAX_MRG_BUFS];
+	size_t chain_len[VIRTIO_NET_MAX_MRG_BUFS];
+	size_t budget, space, ulen, left;
 	void *vrx;
-	int len, n;
-	uint16_t idx;
-	ssize_t ret;
+	ssize_t len;
+	int i, n, niov, nchains, used;
+	int npkts = 0;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	if (net->tapfd == -1) {
+	if (pair->tapfd == -1) {
 		WPRINTF(("vtnet: tapfd == -1\n"));
 		return;
 	}
@@ -422,141 +674,203 @@ virtio_net_tap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!pair->rx_ready || net->resetting) {
 		/*
-		 * Drop the packet and try later.
+		 * Leave the packet in the tap, the first rx kick
+		 * resumes receiving.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
-
+		virtio_net_rx_stall(pair, NULL);
 		return;
 	}
 
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = virtio_net_pair_vq(pair, VIRTIO_NET_RXQ);
 	if (!vq_has_descs(vq)) {
 		/*
-		 * Drop the packet and try later.  Interrupt on
-		 * empty, if that's negotiated.
+		 * Interrupt on empty, if that's negotiated, and
+		 * wait for the guest to post more buffers.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
-
-		vq_endchains(vq, 1);
+		virtio_net_rx_notify(pair, vq, 0, 1);
+		virtio_net_rx_stall(pair, vq);
 		return;
 	}
 
 	do {
 		/*
-		 * Get descriptor chain.
+		 * Get descriptor chains, enough of them to hold the
+		 * largest packet if merged rx bufs were negotiated.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-			WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
-			return;
-		}
+		budget = (net->features & (VIRTIO_NET_F_GUEST_TSO4 |
+				VIRTIO_NET_F_GUEST_TSO6)) ?
+			VIRTIO_NET_MAX_GSO_FRAME : VIRTIO_NET_MAX_FRAME;
+		budget += net->rx_vhdrlen;
+		nchains = 0;
+		niov = 0;
+		space = 0;
+		do {
+			n = vq_getchain(vq, &ids[nchains], &iov[niov],
+					VIRTIO_NET_MAXSEGS - niov, NULL);
+			if (n < 1 || n > VIRTIO_NET_MAXSEGS - niov) {
+				WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
+				if (nchains > 0)
+					vq_retchains(vq, ids, nchains);
+				goto done;
+			}
+			chain_len[nchains] = 0;
+			for (i = 0; i < n; i++)
+				chain_len[nchains] += iov[niov + i].iov_len;
+			space += chain_len[nchains];
+			niov += n;
+			nchains++;
+		} while (net->rx_merge && space < budget &&
+			 nchains < VIRTIO_NET_MAX_MRG_BUFS &&
+			 niov < VIRTIO_NET_MAXSEGS && vq_has_descs(vq));
+
 		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
+		 * Get a pointer to the rx header. With IFF_VNET_HDR the
+		 * tap fills it in along with the packet, otherwise the
+		 * packet goes to the data immediately following it.
 		 */
 		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-		if (riov == NULL)
-			return;
-
-		len = readv(net->tapfd, riov, n);
+		if (iov[0].iov_len < net->rx_vhdrlen) {
+			vq_retchains(vq, ids, nchains);
+			goto done;
+		}
+		if (net->tap_vnet_hdr) {
+			len = readv(pair->tapfd, iov, niov);
+		} else {
+			riov = rx_iov_trim(iov, &niov, net->rx_vhdrlen);
+			if (riov == NULL) {
+				vq_retchains(vq, ids, nchains);
+				goto done;
+			}
+			len = readv(pair->tapfd, riov, niov);
+			if (len >= 0) {
+				/*
+				 * The only valid field in the rx packet header
+				 * is the number of buffers, set below.
+				 */
+				memset(vrx, 0, net->rx_vhdrlen);
+				len += net->rx_vhdrlen;
+			}
+		}
 
-		if (len < 0 && errno == EWOULDBLOCK) {
+		if (len < 0) {
 			/*
 			 * No more packets, but still some avail ring
 			 * entries.  Interrupt if needed/appropriate.
 			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-			return;
+			if (errno != EWOULDBLOCK)
+				WPRINTF(("vtnet: tap read failed: %d\n", errno));
+			vq_retchains(vq, ids, nchains);
+			goto done;
 		}
 
+		/* Count the chains the packet landed in... */
+		for (used = 0, left = len; used < nchains &&
+				(used == 0 || left > 0); used++)
+			left -= (left < chain_len[used]) ? left : chain_len[used];
+
 		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * ... which the header tells if merged rx bufs were
+		 * negotiated, before the guest can see any of them.
 		 */
-		memset(vrx, 0, net->rx_vhdrlen);
-
 		if (net->rx_merge) {
 			struct virtio_net_rxhdr *vrxh;
 
 			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+			vrxh->vrh_bufs = used;
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release them in order, give back the ones the packet
+		 * did not need and handle more chains.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
-	} while (vq_has_descs(vq));
+		for (i = 0; i < used; i++) {
+			ulen = (len < chain_len[i]) ? len : chain_len[i];
+			vq_relchain(vq, ids[i], ulen);
+			len -= ulen;
+		}
+		if (used < nchains)
+			vq_retchains(vq, &ids[used], nchains - used);
+		npkts++;
+	} while (npkts < VIRTIO_NET_RX_BATCH && vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	virtio_net_rx_notify(pair, vq, npkts, !vq_has_descs(vq));
+	return;
+
+done:
+	virtio_net_rx_notify(pair, vq, npkts, 0);
 }
 
 static void
 virtio_net_rx_callback(int fd, enum ev_type type, void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_pair *pair = param;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&pair->rx_mtx);
+	pair->rx_in_progress = 1;
+	pair->net->virtio_net_rx(pair);
+	pair->rx_in_progress = 0;
+	pthread_mutex_unlock(&pair->rx_mtx);
 
 }
 
 static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
-	struct virtio_net *net = vdev;
+	struct virtio_net_pair *pair = virtio_net_vq_pair(vdev, vq);
 
 	/*
-	 * A qnotify means that the rx process can now begin
+	 * A qnotify means that the rx process can now begin, or go on
+	 * if it was waiting for buffers
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		if (vq->used != NULL) {
-			vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		}
+	if (pair->rx_ready == 0) {
+		pair->rx_ready = 1;
+		if (vq_ring_ready(vq))
+			vq_disable_notify(vq);
+	}
+	if (pair->rx_stalled && vq_has_descs(vq)) {
+		vq_disable_notify(vq);
+		virtio_net_rx_unstall(pair);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_proctx(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
+	struct virtio_net *net = pair->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS + 1], *tiov;
 	int i, n;
 	int plen, tlen;
 	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain chain of descriptors.  The packet follows the
+	 * header, which is the whole first descriptor for legacy
+	 * drivers but may share it with the packet for VERSION_1,
+	 * so we need to sum up two lengths: packet length and
+	 * transfer length.
 	 */
 	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
 	if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
 		WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", n));
 		return;
 	}
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
+	tlen = 0;
+	for (i = 0; i < n; i++)
 		tlen += iov[i].iov_len;
-	}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	/* With IFF_VNET_HDR the tap takes the header along */
+	tiov = net->tap_vnet_hdr ? iov : rx_iov_trim(iov, &n, net->rx_vhdrlen);
+	if (tiov != NULL) {
+		plen = tlen - net->rx_vhdrlen;
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
+		net->virtio_net_tx(pair, tiov, n, plen);
+	}
 
 	/* chain is processed, release it and set tlen */
 	vq_relchain(vq, idx, tlen);
@@ -565,7 +879,7 @@ virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
 static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
-	struct virtio_net *net = vdev;
+	struct virtio_net_pair *pair = virtio_net_vq_pair(vdev, vq);
 
 	/*
 	 * Any ring entries to process?
@@ -574,40 +888,41 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	vq_disable_notify(vq);
+	if (pair->tx_in_progress == 0)
+		pthread_cond_signal(&pair->tx_cond);
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 /*
- * Thread which will handle processing of TX desc
+ * Thread which will handle processing of TX desc of one queue pair
  */
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
+	struct virtio_net_pair *pair = param;
+	struct virtio_net *net = pair->net;
+	struct virtio_vq_info *vq = virtio_net_pair_vq(pair, VIRTIO_NET_TXQ);
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
 
 	while (!net->closing && !vq_ring_ready(vq))
-		pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		pthread_cond_wait(&pair->tx_cond, &pair->tx_mtx);
 
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&pair->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
-		net->tx_in_progress = 0;
+		pair->tx_in_progress = 0;
 
 		/*
 		 * Checking the avail ring here serves two purposes:
@@ -621,18 +936,18 @@ virtio_net_tx_thread(void *param)
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			pthread_cond_wait(&pair->tx_cond, &pair->tx_mtx);
 
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&pair->tx_mtx);
 				return NULL;
 			}
 		}
 
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_disable_notify(vq);
+		pair->tx_in_progress = 1;
+		pthread_mutex_unlock(&pair->tx_mtx);
 
 		do {
 			/*
@@ -640,7 +955,7 @@ virtio_net_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
-			virtio_net_proctx(net, vq);
+			virtio_net_proctx(pair, vq);
 		} while (vq_has_descs(vq));
 
 		/*
@@ -648,17 +963,81 @@ virtio_net_tx_thread(void *param)
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&pair->tx_mtx);
 	}
 }
 
-#ifdef notyet
+/*
+ * Handle one control command: the header and the command data are
+ * copied out of the readable descriptors, the last descriptor takes
+ * the one byte ack.
+ */
+static uint8_t
+virtio_net_ctl_cmd(struct virtio_net *net, struct iovec *iov, int n)
+{
+	struct virtio_net_ctrl_hdr hdr;
+	uint8_t buf[sizeof(hdr) + sizeof(uint16_t)];
+	uint16_t pairs;
+	size_t len, clen;
+	int i;
+
+	for (i = 0, len = 0; i < n - 1 && len < sizeof(buf); i++) {
+		clen = iov[i].iov_len;
+		if (clen > sizeof(buf) - len)
+			clen = sizeof(buf) - len;
+		memcpy(buf + len, iov[i].iov_base, clen);
+		len += clen;
+	}
+	if (len < sizeof(hdr))
+		return VIRTIO_NET_ERR;
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	if (hdr.class != VIRTIO_NET_CTRL_MQ ||
+	    hdr.cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+	    len < sizeof(buf)) {
+		DPRINTF(("vtnet: unsupported control command %d:%d\n\r",
+			hdr.class, hdr.cmd));
+		return VIRTIO_NET_ERR;
+	}
+
+	memcpy(&pairs, buf + sizeof(hdr), sizeof(pairs));
+	if (pairs < 1 || pairs > net->max_pairs) {
+		WPRINTF(("vtnet: invalid queue pairs %d\n", pairs));
+		return VIRTIO_NET_ERR;
+	}
+
+	DPRINTF(("vtnet: %d queue pairs enabled\n\r", pairs));
+	virtio_net_set_pairs(net, pairs);
+	return VIRTIO_NET_OK;
+}
+
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct iovec iov[4];
+	uint16_t idx;
+	uint8_t *ack;
+	int n;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, ARRAY_SIZE(iov), NULL);
+		if (n < 1)
+			break;
+		if (n < 2 || n > ARRAY_SIZE(iov) ||
+		    iov[n - 1].iov_len < sizeof(*ack)) {
+			WPRINTF(("vtnet: bad control chain, %d segs\n", n));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		ack = iov[n - 1].iov_base;
+		*ack = virtio_net_ctl_cmd(net, iov, n);
+		vq_relchain(vq, idx, sizeof(*ack));
+	}
+
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -737,8 +1116,13 @@ virtio_net_is_macvtap(char *devname, int *ifindex)
 	return true;
 }
 
+/*
+ * Ask for IFF_VNET_HDR on the tap, so the virtio-net header is passed
+ * through with each packet and the offloads can be negotiated. With
+ * multi_queue, each call opens one more queue of the same tap.
+ */
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, bool vnet_hdr, bool multi_queue)
 {
 	char tbuf[IFNAMSIZ];
 	int tunfd, rc, macvtap_index;
@@ -764,6 +1148,10 @@ virtio_net_tap_open(char *devname)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if (vnet_hdr)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	if (multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
 	if (*devname) {
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -782,12 +1170,97 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Tell the tap the header size and which offloads the guest accepts on
+ * receive, according to the negotiated features. Whatever subset of the
+ * offloads was negotiated, the tap may also run with none of them: it then
+ * hands in plain frames with an empty header, which every guest accepts.
+ * Returns -1 if the tap does not take the header at all.
+ */
+static int
+virtio_net_tap_offload(struct virtio_net *net)
+{
+	struct virtio_net_pair *pair;
+	unsigned int offload = 0;
+	int hdrlen = net->rx_vhdrlen;
+	int i;
+
+	if (!net->tap_vnet_hdr)
+		return 0;
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
+		if ((offload & (TUN_F_TSO4 | TUN_F_TSO6)) &&
+		    (net->features & VIRTIO_NET_F_GUEST_ECN))
+			offload |= TUN_F_TSO_ECN;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		if (pair->tapfd < 0)
+			continue;
+		if (ioctl(pair->tapfd, TUNSETVNETHDRSZ, &hdrlen) < 0) {
+			WPRINTF(("vtnet: tap vnet header setup failed: %d\n",
+				errno));
+			return -1;
+		}
+		if (ioctl(pair->tapfd, TUNSETOFFLOAD, offload) < 0) {
+			WPRINTF(("vtnet: tap refused offloads 0x%x: %d\n",
+				offload, errno));
+			if (offload == 0 ||
+			    ioctl(pair->tapfd, TUNSETOFFLOAD, 0) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Open one tap queue per queue pair, returns how many could be opened
+ */
+static int
+virtio_net_tap_open_pairs(struct virtio_net *net, char *devname)
+{
+	struct virtio_net_pair *pair;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		pair->tapfd = virtio_net_tap_open(devname, net->tap_vnet_hdr,
+			net->max_pairs > 1);
+		if (pair->tapfd == -1)
+			break;
+		pair->attached = true;
+	}
+
+	return i;
+}
+
+static void
+virtio_net_tap_close_pairs(struct virtio_net *net)
+{
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		if (net->pairs[i].tapfd >= 0) {
+			close(net->pairs[i].tapfd);
+			net->pairs[i].tapfd = -1;
+		}
+	}
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
 	char tbuf[IFNAMSIZ];
-	int vhost_fd = -1;
-	int rc;
+	struct virtio_net_pair *pair;
+	int vhost_fd;
+	int i, n, rc;
 
 	rc = snprintf(tbuf, IFNAMSIZ, "%s", devname);
 	if (rc < 0 || rc >= IFNAMSIZ) /* give warning if error or truncation happens */
@@ -796,51 +1269,89 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
+	/* vhost-net handles the header itself */
+	net->tap_vnet_hdr = !net->use_vhost;
+	n = virtio_net_tap_open_pairs(net, tbuf);
+	if (n > 0 && net->tap_vnet_hdr) {
+		if (virtio_net_tap_offload(net) == 0) {
+			net->base.device_caps |= VIRTIO_NET_S_OFFLOADCAPS;
+		} else {
+			/* the tap is too old for offloads, go without header */
+			net->tap_vnet_hdr = false;
+			virtio_net_tap_close_pairs(net);
+			n = virtio_net_tap_open_pairs(net, tbuf);
+		}
+	}
+	if (n == 0) {
 		WPRINTF(("open of tap device %s failed\n", tbuf));
 		return;
 	}
+	if (n < net->max_pairs) {
+		WPRINTF(("vtnet: only %d of %d tap queues opened\n", n,
+			net->max_pairs));
+		net->max_pairs = n;
+	}
 	DPRINTF(("open of tap device %s success!\n", tbuf));
 
-	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
-	 */
-	int opt = 1;
-
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
-	}
-
-	if (net->use_vhost) {
-		vhost_fd = open("/dev/vhost-net", O_RDWR);
-		if (vhost_fd < 0)
-			WPRINTF(("open of vhost-net failed\n"));
-		else {
-			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
-			if (!net->vhost_net) {
-				WPRINTF(("vhost_net_init failed, fallback "
-					"to userspace virtio\n"));
-				close(vhost_fd);
-				vhost_fd = -1;
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		int opt = 1;
+
+		if (ioctl(pair->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(pair->tapfd);
+			pair->tapfd = -1;
+			continue;
+		}
+
+		vhost_fd = -1;
+		if (net->use_vhost) {
+			vhost_fd = open("/dev/vhost-net", O_RDWR);
+			if (vhost_fd < 0)
+				WPRINTF(("open of vhost-net failed\n"));
+			else {
+				pair->vhost_net = vhost_net_init(&net->base,
+					vhost_fd, pair->tapfd,
+					i * VIRTIO_NET_PAIRQ);
+				if (!pair->vhost_net) {
+					WPRINTF(("vhost_net_init failed, fallback "
+						"to userspace virtio\n"));
+					close(vhost_fd);
+					vhost_fd = -1;
+				}
 			}
 		}
-	}
 
-	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net,
-				       virtio_net_teardown, net);
-		if (net->mevp == NULL) {
-			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+		if (vhost_fd < 0) {
+			pair->mevp = mevent_add(pair->tapfd, EVF_READ,
+					       virtio_net_rx_callback, pair,
+					       virtio_net_teardown, pair);
+			if (pair->mevp == NULL) {
+				WPRINTF(("Could not register event\n"));
+				close(pair->tapfd);
+				pair->tapfd = -1;
+				continue;
+			}
+			net->nr_mevp++;
+
+			pair->rx_timer.clockid = CLOCK_MONOTONIC;
+			if (net->rx_coal_usecs &&
+			    acrn_timer_init(&pair->rx_timer, virtio_net_rx_timer,
+					    pair) < 0) {
+				WPRINTF(("vtnet: no rx coalescing timer, "
+					"signal every batch\n"));
+				net->rx_coal_usecs = 0;
+			}
 		}
 	}
+
+	/* only the first pair is in use until the driver asks for more */
+	virtio_net_set_pairs(net, 1);
 }
 
 static int
@@ -851,6 +1362,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char nstr[80];
 	char tname[MAXCOMLEN + 1];
 	struct virtio_net *net = NULL;
+	struct virtio_net_pair *pair;
 	char *devopts = NULL;
 	char *name = NULL;
 	char *type = NULL;
@@ -858,9 +1370,10 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *tmp = NULL;
 	char *vtopts = NULL;
 	char *opt = NULL;
+	char *poll_budget = NULL;
 	int mac_provided;
 	pthread_mutexattr_t attr;
-	int rc;
+	int i, rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -886,7 +1399,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	 * Read the MAC address if specified
 	 */
 	mac_provided = 0;
-	net->vhost_net = NULL;
+	net->max_pairs = 1;
 	if (opts != NULL) {
 		int err;
 
@@ -902,6 +1415,39 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		while ((opt = strsep(&vtopts, ",")) != NULL) {
 			if (strcmp("vhost", opt) == 0)
 				net->use_vhost = true;
+			else if (strcmp("packed", opt) == 0)
+				net->use_packed = true;
+			else if (!strncmp(opt, "poll_budget=", 12))
+				poll_budget = opt + 12;
+			else if (!strncmp(opt, "rx_frames=", 10)) {
+				if (dm_strtoi(opt + 10, NULL, 10,
+					      &net->rx_coal_frames) ||
+				    net->rx_coal_frames < 0) {
+					pr_err("Invalid rx_frames %s\n", opt + 10);
+					free(devopts);
+					free(net);
+					return -1;
+				}
+			} else if (!strncmp(opt, "rx_usecs=", 9)) {
+				if (dm_strtoi(opt + 9, NULL, 10,
+					      &net->rx_coal_usecs) ||
+				    net->rx_coal_usecs < 0) {
+					pr_err("Invalid rx_usecs %s\n", opt + 9);
+					free(devopts);
+					free(net);
+					return -1;
+				}
+			} else if (!strncmp(opt, "mq=", 3)) {
+				if (dm_strtoi(opt + 3, NULL, 10, &net->max_pairs) ||
+				    net->max_pairs < 1 ||
+				    net->max_pairs > VIRTIO_NET_MAX_PAIRS) {
+					pr_err("Invalid queue pairs %s, 1 to %d\n",
+						opt + 3, VIRTIO_NET_MAX_PAIRS);
+					free(devopts);
+					free(net);
+					return -1;
+				}
+			}
 			else if (!strncmp(opt, "mac=", 4)) {
 				err = virtio_net_parsemac(opt,
 					net->config.mac);
@@ -915,24 +1461,55 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		}
 	}
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues,
+	/* The frame threshold only shortens the rx_usecs delay */
+	if (net->rx_coal_frames && !net->rx_coal_usecs) {
+		pr_err("rx_frames requires rx_usecs\n");
+		free(devopts);
+		free(net);
+		return -1;
+	}
+
+	/*
+	 * Each queue pair has its own rx and tx virtqueue, and thus its
+	 * own MSI-X vectors. The control queue is needed to switch pairs.
+	 */
+	net->ops = virtio_net_ops;
+	net->ops.nvq = net->max_pairs * VIRTIO_NET_PAIRQ +
+		(net->max_pairs > 1 ? 1 : 0);
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues,
 		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
+	if (poll_budget && virtio_set_poll_budget(&net->base, poll_budget)) {
+		pr_err("Invalid poll_budget %s\n", poll_budget);
+		free(devopts);
+		free(net);
+		return -1;
+	}
 	net->base.mtx = &net->mtx;
 	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
+	if (net->use_packed) {
+		if (net->use_vhost) {
+			WPRINTF(("vtnet: packed ring is not supported with vhost\n"));
+			net->use_packed = false;
+		} else
+			net->base.device_caps |= (1UL << VIRTIO_F_VERSION_1) |
+				(1UL << VIRTIO_F_RING_PACKED);
+	}
 
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		pair->net = net;
+		pair->idx = i;
+		pair->tapfd = -1;
+		virtio_net_pair_vq(pair, VIRTIO_NET_RXQ)->qsize = VIRTIO_NET_RINGSZ;
+		virtio_net_pair_vq(pair, VIRTIO_NET_RXQ)->notify = virtio_net_ping_rxq;
+		virtio_net_pair_vq(pair, VIRTIO_NET_TXQ)->qsize = VIRTIO_NET_RINGSZ;
+		virtio_net_pair_vq(pair, VIRTIO_NET_TXQ)->notify = virtio_net_ping_txq;
+	}
+	net->curr_pairs = 1;
 
 	/*
-	 * Attempt to open the tap device
+	 * Attempt to open the tap device, one queue per pair
 	 */
-	net->tapfd = -1;
 
 	if (!devopts) {
 		WPRINTF(("virtio_net: invalid optional argument\n"));
@@ -961,6 +1538,16 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		}
 	}
 
+	/* the tap may have given us fewer queues than asked for */
+	net->ops.nvq = net->max_pairs * VIRTIO_NET_PAIRQ +
+		(net->max_pairs > 1 ? 1 : 0);
+	if (net->max_pairs > 1) {
+		net->queues[net->ops.nvq - 1].qsize = VIRTIO_NET_CTLRINGSZ;
+		net->queues[net->ops.nvq - 1].notify = virtio_net_ping_ctlq;
+		net->base.device_caps |= VIRTIO_NET_S_MQCAPS;
+	}
+	net->config.max_virtqueue_pairs = net->max_pairs;
+
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
 	 * followed by an MD5 of the PCI slot/func number and dev name
@@ -1008,7 +1595,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	net->config.status = (opts == NULL || net->pairs[0].tapfd >= 0);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
@@ -1020,27 +1607,41 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* use BAR 0 to map config regs in IO space */
 	virtio_set_io_bar(&net->base, 0);
 
+	/* the packed ring needs VERSION_1, i.e. the modern interface */
+	if (net->use_packed && virtio_set_modern_bar(&net->base, false)) {
+		WPRINTF(("vtnet: failed to set modern bar\n"));
+		free(net);
+		return -1;
+	}
+
 	net->resetting = 0;
 	net->closing = 0;
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Initialize rx lock and tx semaphore & spawn one TX processing
+	 * thread per queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_pairs; i++) {
+		pair = &net->pairs[i];
+		pair->rx_in_progress = 0;
+		pthread_mutex_init(&pair->rx_mtx, NULL);
+
+		pair->tx_in_progress = 0;
+		pthread_mutex_init(&pair->tx_mtx, NULL);
+		pthread_cond_init(&pair->tx_cond, NULL);
+		pthread_create(&pair->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)pair);
+		if (net->max_pairs > 1)
+			snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d",
+				 dev->slot, dev->func, i);
+		else
+			snprintf(tname, sizeof(tname), "vtnet-%d:%d tx",
+				 dev->slot, dev->func);
+		pthread_setname_np(pair->tx_tid, tname);
+	}
 
 	return 0;
 }
@@ -1089,78 +1690,110 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 
 	if (!(net->features & VIRTIO_NET_F_MRG_RXBUF)) {
 		net->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		net->rx_vhdrlen -= 2;
+		/* non-merge rx header is 2 bytes shorter, except for VERSION_1 */
+		if (!(net->features & (1UL << VIRTIO_F_VERSION_1)))
+			net->rx_vhdrlen -= 2;
 	}
+
+	/*
+	 * The tap took the header when it was opened, so this only fails if
+	 * it changed under us. Its frames no longer match the guest's header
+	 * then, so the driver has to reset the device.
+	 */
+	if (virtio_net_tap_offload(net) < 0)
+		net->base.status |= VIRTIO_CONFIG_S_NEEDS_RESET;
 }
 
 static void
 virtio_net_set_status(void *vdev, uint64_t status)
 {
 	struct virtio_net *net = vdev;
-	int rc;
+	struct vhost_net *vhost_net;
+	int i, rc;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		vhost_net = net->pairs[i].vhost_net;
+		if (!vhost_net)
+			continue;
+
+		if (!vhost_net->vhost_started &&
+			(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+			if (net->pairs[i].mevp)
+				mevent_disable(net->pairs[i].mevp);
+
+			rc = vhost_net_start(vhost_net);
+			if (rc < 0)
+				WPRINTF(("vhost_net_start failed\n"));
+		} else if (vhost_net->vhost_started &&
+			((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
+			rc = vhost_net_stop(vhost_net);
+			if (rc < 0)
+				WPRINTF(("vhost_net_stop failed\n"));
+		}
+	}
+}
 
-	if (!net->vhost_net)
+/*
+ * Drop a reference taken by an rx event or by deinit, the last one
+ * frees the device.
+ */
+static void
+virtio_net_put(struct virtio_net *net)
+{
+	if (atomic_sub_fetch(&net->nr_mevp, 1) > 0)
 		return;
 
-	if (!net->vhost_net->vhost_started &&
-		(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		if (net->mevp)
-			mevent_disable(net->mevp);
-
-		rc = vhost_net_start(net->vhost_net);
-		if (rc < 0) {
-			WPRINTF(("vhost_net_start failed\n"));
-			return;
-		}
-	} else if (net->vhost_net->vhost_started &&
-		((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
-		rc = vhost_net_stop(net->vhost_net);
-		if (rc < 0)
-			WPRINTF(("vhost_net_stop failed\n"));
-	}
+	virtio_net_tap_close_pairs(net);
+	virtio_reset_dev(&net->base);
+	free(net);
 }
 
 static void
 virtio_net_teardown(void *param)
 {
-	struct virtio_net *net;
+	struct virtio_net_pair *pair;
 
-	net = (struct virtio_net *)param;
-	if (!net)
+	pair = (struct virtio_net_pair *)param;
+	if (!pair)
 		return;
 
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (pair->tapfd >= 0) {
+		close(pair->tapfd);
+		pair->tapfd = -1;
 	} else
-		pr_err("net->tapfd is -1!\n");
+		pr_err("pair->tapfd is -1!\n");
 
-	virtio_reset_dev(&net->base);
-	free(net);
+	virtio_net_put(pair->net);
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct virtio_net_pair *pair;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
 		virtio_net_tx_stop(net);
 
-		if (net->vhost_net) {
-			vhost_net_stop(net->vhost_net);
-			vhost_net_deinit(net->vhost_net);
-			free(net->vhost_net);
-			net->vhost_net = NULL;
-		}
+		/* hold the device until all rx events are torn down */
+		atomic_add_fetch(&net->nr_mevp, 1);
+		for (i = 0; i < net->max_pairs; i++) {
+			pair = &net->pairs[i];
+			if (pair->vhost_net) {
+				vhost_net_stop(pair->vhost_net);
+				vhost_net_deinit(pair->vhost_net);
+				free(pair->vhost_net);
+				pair->vhost_net = NULL;
+			}
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-		else
-			virtio_net_teardown(net);
+			acrn_timer_deinit(&pair->rx_timer);
+			if (pair->mevp != NULL)
+				mevent_delete(pair->mevp);
+		}
+		virtio_net_put(net);
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
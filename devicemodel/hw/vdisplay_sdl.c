@@ -33,6 +33,10 @@
 #define VDPY_MIN_HEIGHT 480
 #define transto_10bits(color) (uint16_t)(color * 1024 + 0.5)
 #define VSCREEN_MAX_NUM 2
+/* Frame interval if the refresh rate of the display is unknown */
+#define VDPY_FRAME_INTERVAL_NS	(1000000000 / 60)
+/* Idle screens are still redrawn at 30fps */
+#define VDPY_IDLE_INTERVAL_NS	33000000
 
 static unsigned char default_raw_argb[VDPY_DEFAULT_WIDTH * VDPY_DEFAULT_HEIGHT * 4];
 
@@ -76,6 +80,11 @@ struct vscreen {
 	EGLImage egl_img;
 	/* Record the update_time that is activated from guest_vm */
 	struct timespec last_time;
+	/* Presentation is capped to the refresh rate of the display */
+	uint64_t frame_interval;
+	bool present_pending;
+	/* A new texture needs the whole surface for the first update */
+	bool full_upload;
 };
 
 static struct display {
@@ -83,9 +92,10 @@ static struct display {
 	struct vscreen *vscrs;
 	int vscrs_num;
 	pthread_t tid;
-	/* Add one UI_timer(33ms) to render the buffers from guest_vm */
+	/* Add one UI_timer(one frame) to render the buffers from guest_vm */
 	struct acrn_timer ui_timer;
 	struct vdpy_display_bh ui_timer_bh;
+	uint64_t frame_interval;
 	// protect the request_list
 	pthread_mutex_t vdisplay_mutex;
 	// receive the signal that request is submitted
@@ -734,6 +744,7 @@ vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 	if (vscr->surf_tex == NULL) {
 		pr_err("Failed to create SDL_texture for surface.\n");
 	}
+	vscr->full_upload = true;
 
 	/* For the surf_switch, it will be updated in surface_update */
 	if (!surf) {
@@ -816,11 +827,46 @@ vdpy_cursor_position_transformation(struct display *vdpy, int scanout_id, SDL_Re
 	rect->h = (vscr->cur.height * vscr->height) / vscr->guest_height;
 }
 
+static uint64_t
+vdpy_elapsed_ns(struct timespec *since)
+{
+	struct timespec cur_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &cur_time);
+	return (cur_time.tv_sec - since->tv_sec) * 1000000000 +
+		cur_time.tv_nsec - since->tv_nsec;
+}
+
+static void
+vdpy_sdl_present(struct vscreen *vscr, int scanout_id)
+{
+	SDL_Rect cursor_rect;
+
+	sdl_gl_prepare_draw(vscr);
+	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
+
+	/* This should be handled after rendering the surface_texture.
+	 * Otherwise it will be hidden
+	 */
+	if (vscr->cur_tex) {
+		vdpy_cursor_position_transformation(&vdpy, scanout_id, &cursor_rect);
+		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
+				NULL, &cursor_rect);
+	}
+
+	SDL_RenderPresent(vscr->renderer);
+	vscr->present_pending = false;
+
+	/* update the rendering time */
+	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+}
+
 void
 vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 {
-	SDL_Rect cursor_rect;
+	SDL_Rect rect;
 	struct vscreen *vscr;
+	int bytes_pp;
 
 	if (handle != vdpy.s.n_connect) {
 		return;
@@ -842,27 +888,37 @@ vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 	}
 
 	vscr = vdpy.vscrs + scanout_id;
-	if (surf->surf_type == SURFACE_PIXMAN)
-		SDL_UpdateTexture(vscr->surf_tex, NULL,
-			  surf->pixel,
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		/* Only upload the damaged rectangle of the texture */
+		rect.x = 0;
+		rect.y = 0;
+		rect.w = vscr->guest_width;
+		rect.h = vscr->guest_height;
+		if (!vscr->full_upload &&
+		    surf->damage.width && surf->damage.height &&
+		    surf->damage.x < rect.w && surf->damage.y < rect.h) {
+			rect.x = surf->damage.x;
+			rect.y = surf->damage.y;
+			rect.w = SDL_min(surf->damage.width, rect.w - rect.x);
+			rect.h = SDL_min(surf->damage.height, rect.h - rect.y);
+		}
+		bytes_pp = PIXMAN_FORMAT_BPP(surf->surf_format) / 8;
+		SDL_UpdateTexture(vscr->surf_tex, &rect,
+			  (uint8_t *)surf->pixel + rect.y * surf->stride +
+			  rect.x * bytes_pp,
 			  surf->stride);
+		vscr->full_upload = false;
+	}
 
-	sdl_gl_prepare_draw(vscr);
-	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
-
-	/* This should be handled after rendering the surface_texture.
-	 * Otherwise it will be hidden
+	/* The damage of this frame is shown by the UI timer once the
+	 * frame interval has elapsed.
 	 */
-	if (vscr->cur_tex) {
-		vdpy_cursor_position_transformation(&vdpy, scanout_id, &cursor_rect);
-		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-				NULL, &cursor_rect);
+	if (vdpy_elapsed_ns(&vscr->last_time) < vscr->frame_interval) {
+		vscr->present_pending = true;
+		return;
 	}
 
-	SDL_RenderPresent(vscr->renderer);
-
-	/* update the rendering time */
-	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+	vdpy_sdl_present(vscr, scanout_id);
 }
 
 void
@@ -932,9 +988,7 @@ static void
 vdpy_sdl_ui_refresh(void *data)
 {
 	struct display *ui_vdpy;
-	struct timespec cur_time;
 	uint64_t elapsed_time;
-	SDL_Rect cursor_rect;
 	struct vscreen *vscr;
 	int i;
 
@@ -947,28 +1001,18 @@ vdpy_sdl_ui_refresh(void *data)
 		if (vscr->surf_tex == NULL)
 			continue;
 
-		clock_gettime(CLOCK_MONOTONIC, &cur_time);
-
-		elapsed_time = (cur_time.tv_sec - vscr->last_time.tv_sec) * 1000000000 +
-				cur_time.tv_nsec - vscr->last_time.tv_nsec;
-
-		/* the time interval is less than 10ms. Skip it */
-		if (elapsed_time < 10000000)
-			return;
-
-		sdl_gl_prepare_draw(vscr);
-		SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
+		elapsed_time = vdpy_elapsed_ns(&vscr->last_time);
 
-		/* This should be handled after rendering the surface_texture.
-		 * Otherwise it will be hidden
+		/* Show the pending damage once the frame interval elapses,
+		 * otherwise keep redrawing the idle screen at 30fps.
 		 */
-		if (vscr->cur_tex) {
-			vdpy_cursor_position_transformation(ui_vdpy, i, &cursor_rect);
-			SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-					NULL, &cursor_rect);
-		}
+		if (vscr->present_pending) {
+			if (elapsed_time < vscr->frame_interval)
+				continue;
+		} else if (elapsed_time < VDPY_IDLE_INTERVAL_NS)
+			continue;
 
-		SDL_RenderPresent(vscr->renderer);
+		vdpy_sdl_present(vscr, i);
 	}
 }
 
@@ -1024,6 +1068,7 @@ vdpy_calibrate_vscreen_geometry(struct vscreen *vscr)
 int
 vdpy_create_vscreen_window(struct vscreen *vscr)
 {
+	SDL_DisplayMode mode;
 	uint32_t win_flags;
 
 	win_flags = SDL_WINDOW_OPENGL |
@@ -1054,6 +1099,13 @@ vdpy_create_vscreen_window(struct vscreen *vscr)
 	pr_info("SDL display bind to screen %d: [%d,%d,%d,%d].\n", vscr->pscreen_id,
 			vscr->org_x, vscr->org_y, vscr->width, vscr->height);
 
+	if (SDL_GetCurrentDisplayMode(vscr->pscreen_id, &mode) == 0 &&
+	    mode.refresh_rate > 0)
+		vscr->frame_interval = 1000000000 / mode.refresh_rate;
+	else
+		vscr->frame_interval = VDPY_FRAME_INTERVAL_NS;
+	vscr->present_pending = false;
+
 	vscr->renderer = SDL_CreateRenderer(vscr->win, -1, 0);
 	if (vscr->renderer == NULL) {
 		pr_err("Failed to Create GL_Renderer \n");
@@ -1095,6 +1147,8 @@ vdpy_sdl_display_thread(void *data)
 			goto sdl_fail;
 		}
 		clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+		if (i == 0 || vscr->frame_interval < vdpy.frame_interval)
+			vdpy.frame_interval = vscr->frame_interval;
 	}
 	sdl_gl_display_init();
 	pthread_mutex_init(&vdpy.vdisplay_mutex, NULL);
@@ -1107,11 +1161,11 @@ vdpy_sdl_display_thread(void *data)
 	vdpy.ui_timer.clockid = CLOCK_MONOTONIC;
 	acrn_timer_init(&vdpy.ui_timer, vdpy_sdl_ui_timer, &vdpy);
 	ui_timer_spec.it_interval.tv_sec = 0;
-	ui_timer_spec.it_interval.tv_nsec = 33000000;
+	ui_timer_spec.it_interval.tv_nsec = vdpy.frame_interval;
 	/* Wait for 5s to start the timer */
 	ui_timer_spec.it_value.tv_sec = 5;
 	ui_timer_spec.it_value.tv_nsec = 0;
-	/* Start one periodic timer to refresh UI based on 30fps */
+	/* Start one periodic timer to refresh UI at the fastest display rate */
 	acrn_timer_settime(&vdpy.ui_timer, &ui_timer_spec);
 
 	pr_info("SDL display thread is created\n");
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Copy-on-write overlay images for blockif. An overlay keeps the clusters
+ * written by the guest, the others are read from a read-only base image
+ * that may be shared by many guests.
+ */
+
+#ifndef _BLOCK_COW_H_
+#define _BLOCK_COW_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct blockcow;
+
+/*
+ * Open the overlay on fd. An empty overlay is formatted on top of base
+ * first, otherwise base may be NULL or must match the one in the overlay.
+ */
+struct blockcow *blockcow_open(int fd, const char *base, int ro);
+off_t	blockcow_size(struct blockcow *cow);
+ssize_t	blockcow_preadv(struct blockcow *cow, const struct iovec *iov,
+			int iovcnt, off_t offset);
+ssize_t	blockcow_pwritev(struct blockcow *cow, const struct iovec *iov,
+			 int iovcnt, off_t offset);
+int	blockcow_flush(struct blockcow *cow);
+void	blockcow_close(struct blockcow *cow);
+
+#endif /* _BLOCK_COW_H_ */
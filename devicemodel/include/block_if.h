@@ -36,6 +36,8 @@
 #ifndef _BLOCK_IF_H_
 #define _BLOCK_IF_H_
 
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/uio.h>
 #include <sys/unistd.h>
 
@@ -50,7 +52,62 @@ struct blockif_req {
 	void		*param;
 };
 
+/* I/O limits, set with <name>=<rate>[/<burst>] in the blockif options */
+enum blockif_qos {
+	BLOCKIF_QOS_IOPS_RD,
+	BLOCKIF_QOS_IOPS_WR,
+	BLOCKIF_QOS_BPS_RD,
+	BLOCKIF_QOS_BPS_WR,
+	BLOCKIF_QOS_NR
+};
+
+extern const char *const blockif_qos_names[BLOCKIF_QOS_NR];
+
+struct blockif_qos_info {
+	uint64_t	rate[BLOCKIF_QOS_NR];	/* per second, 0 if unlimited */
+	uint64_t	burst[BLOCKIF_QOS_NR];
+	uint64_t	throttled[2];		/* reads, writes delayed */
+	uint64_t	throttled_ns[2];	/* total time they were delayed */
+	uint32_t	queued;			/* requests delayed right now */
+};
+
+/* Request statistics, by operation */
+enum blockif_op_type {
+	BLOCKIF_OP_READ,
+	BLOCKIF_OP_WRITE,
+	BLOCKIF_OP_FLUSH,
+	BLOCKIF_OP_DISCARD,
+	BLOCKIF_OP_NR
+};
+
+/*
+ * Bucket 0 counts latencies under 1us, bucket n those in [2^(n-1), 2^n)
+ * us, the last one everything above
+ */
+#define BLOCKIF_HIST_NR		24
+
+extern const char *const blockif_op_names[BLOCKIF_OP_NR];
+
+struct blockif_op_stats {
+	uint64_t	ops;
+	uint64_t	bytes;
+	uint64_t	errors;
+	uint64_t	queue_hist[BLOCKIF_HIST_NR];	/* submitted to started */
+	uint64_t	service_hist[BLOCKIF_HIST_NR];	/* started to completed */
+};
+
+struct blockif_stats {
+	struct blockif_op_stats op[BLOCKIF_OP_NR];
+	uint32_t	queued;		/* waiting for a worker now */
+	uint32_t	inflight;	/* being processed now */
+	uint32_t	max_depth;	/* most queued and in flight at once */
+	uint64_t	blocked;	/* waited for an overlapping request */
+};
+
 struct blockif_ctxt;
+typedef void (*blockif_iter_cb)(struct blockif_ctxt *bc, const char *ident,
+				void *arg);
+
 struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
 off_t	blockif_size(struct blockif_ctxt *bc);
 void	blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
@@ -72,5 +129,10 @@ int	blockif_flush_all(struct blockif_ctxt *bc);
 int	blockif_max_discard_sectors(struct blockif_ctxt *bc);
 int	blockif_max_discard_seg(struct blockif_ctxt *bc);
 int	blockif_discard_sector_alignment(struct blockif_ctxt *bc);
+int	blockif_get_qos(struct blockif_ctxt *bc, struct blockif_qos_info *info);
+void	blockif_foreach(blockif_iter_cb cb, void *arg);
+void	blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *stats);
+void	blockif_dump_stats(FILE *fp);
+int	blockif_set_stats_dump(const char *path);
 
 #endif /* _BLOCK_IF_H_ */
@@ -7,13 +7,37 @@
 #ifndef	_iothread_CTX_H_
 #define	_iothread_CTX_H_
 
+#include <stdint.h>
+
+#define IOTHREAD_NUM_MAX	16
+#define IOTHREAD_CPUS_LEN	64
+
+struct iothread_ctx;
+
 struct iothread_mevent {
 	void (*run)(void *);
 	void *arg;
 	int fd;
+	struct iothread_ctx *ctx;	/* thread the event was added to */
 };
+
+struct iothread_stats {
+	uint64_t events;	/* run callbacks */
+	uint64_t busy_ns;	/* time spent in run callbacks */
+	uint32_t nr_fds;	/* fds currently served */
+	char cpus[IOTHREAD_CPUS_LEN];	/* CPU list it is pinned to, "" if none */
+};
+
+/*
+ * Add fd to iothread idx of the pool, or to the next one round-robin
+ * if idx is negative.
+ */
+int iothread_add_to(int idx, int fd, struct iothread_mevent *aevt);
 int iothread_add(int fd, struct iothread_mevent *aevt);
-int iothread_del(int fd);
+int iothread_del(int fd, struct iothread_mevent *aevt);
+int iothread_num(void);
+int iothread_get_stats(int idx, struct iothread_stats *stats);
+int acrn_parse_iothreads(const char *optarg);
 int iothread_init(void);
 void iothread_deinit(void);
 
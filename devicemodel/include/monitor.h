@@ -15,6 +15,9 @@
 #ifndef MONITOR_H
 #define MONITOR_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 int monitor_init(struct vmctx *ctx);
 void monitor_close(void);
 
@@ -36,4 +39,17 @@ unsigned get_wakeup_reason(void);
 int set_wakeup_timer(time_t t);
 int acrn_parse_intr_monitor(const char *opt);
 int vm_monitor_blkrescan(void *arg, char *devargs);
+
+/* Guest memory statistics of virtio-balloon, indexed by the virtio tag */
+#define VM_BALLOON_NR_STATS	10
+
+struct vm_balloon_info {
+	uint64_t target;	/* balloon size requested, in bytes */
+	uint64_t actual;	/* balloon size reported by the guest */
+	uint64_t returned;	/* memory given back to the host */
+	bool stats_valid;
+	uint64_t stats[VM_BALLOON_NR_STATS];
+};
+
+int vm_monitor_balloon(void *arg, char *devargs, struct vm_balloon_info *info);
 #endif
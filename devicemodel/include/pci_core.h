@@ -306,6 +306,7 @@ uint32_t get_gpu_rsvmem_size(void);
 
 typedef void (*pci_lintr_cb)(int b, int s, int pin, int pirq_pin,
 			     int ioapic_irq, void *arg);
+typedef int (*pci_vdev_cb)(struct pci_vdev *dev, void *arg);
 
 int	init_pci(struct vmctx *ctx);
 void	deinit_pci(struct vmctx *ctx);
@@ -389,6 +390,10 @@ int	pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size,
 uint64_t pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset, int size);
 int	pci_count_lintr(int bus);
 void	pci_walk_lintr(int bus, pci_lintr_cb cb, void *arg);
+int	pci_walk_vdev(pci_vdev_cb cb, void *arg);
+int	pci_vdev_is_passthru(struct pci_vdev *dev);
+void	pci_restore_cfgdata(struct vmctx *ctx, struct pci_vdev *dev,
+			    const uint8_t *cfgdata);
 void	pci_write_dsdt(void);
 int	pci_bus_configured(int bus);
 int	emulate_pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus,
@@ -81,6 +81,10 @@
 	_IO(ACRN_IOCTL_TYPE, 0x15)
 #define ACRN_IOCTL_SET_VCPU_REGS	\
 	_IOW(ACRN_IOCTL_TYPE, 0x16, struct acrn_vcpu_regs)
+#define ACRN_IOCTL_GET_VCPU_CONTEXT	\
+	_IOWR(ACRN_IOCTL_TYPE, 0x17, struct acrn_vcpu_context)
+#define ACRN_IOCTL_SET_VCPU_CONTEXT	\
+	_IOW(ACRN_IOCTL_TYPE, 0x18, struct acrn_vcpu_context)
 
 /* IRQ and Interrupts */
 #define ACRN_IOCTL_INJECT_MSI		\
@@ -107,6 +111,10 @@
 	_IOW(ACRN_IOCTL_TYPE, 0x41, struct acrn_vm_memmap)
 #define ACRN_IOCTL_UNSET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x42, struct acrn_vm_memmap)
+#define ACRN_IOCTL_SET_DIRTY_LOG	\
+	_IOW(ACRN_IOCTL_TYPE, 0x43, __u64)
+#define ACRN_IOCTL_GET_DIRTY_LOG	\
+	_IOW(ACRN_IOCTL_TYPE, 0x44, struct acrn_dirty_log)
 
 /* PCI assignment*/
 #define ACRN_IOCTL_SET_PTDEV_INTR	\
@@ -211,6 +219,50 @@ struct acrn_ptdev_irq {
 	} intx;
 };
 
+#define ACRN_VCPU_CONTEXT_GPRS	40U
+
+/**
+ * @brief architectural state of a vCPU of a paused VM
+ *
+ * Read by ACRN_IOCTL_GET_VCPU_CONTEXT and written back unchanged by
+ * ACRN_IOCTL_SET_VCPU_CONTEXT when a snapshot is restored. Only vcpu_id
+ * is meaningful to the device model.
+ */
+struct acrn_vcpu_context {
+	/** the virtual CPU ID */
+	uint16_t vcpu_id;
+	uint16_t reserved[3];
+	/** pc, general purpose registers and trap state */
+	uint64_t gprs[ACRN_VCPU_CONTEXT_GPRS];
+	/** VS-mode CSRs */
+	uint64_t sstatus;
+	uint64_t sepc;
+	uint64_t sip;
+	uint64_t sie;
+	uint64_t stvec;
+	uint64_t sscratch;
+	uint64_t stval;
+	uint64_t scause;
+	uint64_t satp;
+	/** absolute deadline of the vCPU timer, 0 if not armed */
+	uint64_t timer_deadline;
+};
+
+/**
+ * @brief get and clear the dirty page log of a range of guest RAM
+ *
+ * Used by ACRN_IOCTL_GET_DIRTY_LOG once ACRN_IOCTL_SET_DIRTY_LOG started
+ * the logging. gpa and size are multiples of 256K.
+ */
+struct acrn_dirty_log {
+	/** guest physical address of the first page */
+	uint64_t gpa;
+	/** size of the range in bytes */
+	uint64_t size;
+	/** user address of the bitmap, one bit per 4K page from gpa on */
+	uint64_t bitmap;
+};
+
 /**
  * @brief data strcture to notify hypervisor ioreq is handled
  */
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Snapshot of a running User VM to a file: the vCPU contexts, the state
+ * of the emulated PCI devices and guest memory. A Device Model started
+ * with the same command line and --restore resumes the VM from it.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+struct vmctx;
+
+/*
+ * Pause the VM, save it to path and let it run again, unless it was
+ * already paused in a suspend.
+ * Return 0 on success, -1 on error.
+ */
+int	vm_snapshot_save(struct vmctx *ctx, const char *path);
+
+/*
+ * Load a snapshot into a created VM whose devices are initialized and
+ * whose memory is still zero. The VM runs from the snapshot when started.
+ * Return 0 on success, -1 on error.
+ */
+int	vm_snapshot_restore(struct vmctx *ctx, const char *path);
+
+#endif /* _SNAPSHOT_H_ */
@@ -69,6 +69,15 @@ struct surface {
 		uint32_t surf_fourcc;
 		uint32_t dmabuf_offset;
 	} dma_info;
+	/* The changed rectangle relative to x/y, an empty one means
+	 * that the whole surface is changed.
+	 */
+	struct {
+		uint32_t x;
+		uint32_t y;
+		uint32_t width;
+		uint32_t height;
+	} damage;
 };
 
 struct cursor {
@@ -220,6 +220,7 @@ enum {
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
 #define	VIRTIO_DEV_CONSOLE	0x1003
+#define	VIRTIO_DEV_BALLOON	0x1002
 #define	VIRTIO_DEV_RANDOM	0x1005
 #define	VIRTIO_DEV_GPU		0x1050
 #define	VIRTIO_DEV_VSOCK	0x1053
@@ -347,6 +348,7 @@ struct virtio_base {
 	struct virtio_ops *vops;	/**< virtio operations */
 	int	flags;			/**< VIRTIO_* flags from above */
 	bool	iothread;
+	int	iothread_idx;		/**< iothread of the pool, -1 for round-robin */
 	pthread_mutex_t *mtx;		/**< POSIX mutex, if any */
 	struct pci_vdev *dev;		/**< PCI device instance */
 	uint64_t negotiated_caps;	/**< negotiated capabilities */
@@ -364,8 +366,7 @@ struct virtio_base {
 	uint32_t driver_feature_select;	/**< current selected guest feature */
 	int cfg_coff;			/**< PCI cfg access capability offset */
 	int backend_type;               /**< VBSU, VBSK or VHOST */
-	struct acrn_timer polling_timer; /**< timer for polling mode */
-	int polling_in_progress;        /**< The polling status */
+	uint32_t poll_budget_us;	/**< idle time a polling vq spins, 0: no polling */
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -399,10 +400,14 @@ struct virtio_ops {
 				/**< to apply negotiated features */
 	void    (*set_status)(void *, uint64_t);
 				/**< called to set device status */
+	void    (*quiesce)(void *, bool);
+				/**< to stop (true) and restart (false) the
+				     backend I/O threads, NULL if none */
 };
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed ring layout (VIRTIO_F_RING_PACKED) */
 /**
  * @brief Virtqueue data structure
  *
@@ -431,6 +436,23 @@ struct virtio_iothread {
 	void (*iothread_run)(void *, struct virtio_vq_info *);
 };
 
+/*
+ * Adaptive poller of one virtqueue, used in virtio poll mode. A kick
+ * wakes it up, it then keeps notifications off and spins on the ring
+ * while the driver posts buffers, and turns them back on after the
+ * device's poll budget passed without new buffers.
+ */
+struct virtio_vq_poller {
+	pthread_t tid;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool started;		/**< thread is running */
+	bool stop;		/**< ask the thread to exit */
+	bool kicked;		/**< kick seen, start polling */
+	volatile bool polling;	/**< spinning, notifications are off */
+	uint32_t pos;		/**< avail position seen last */
+};
+
 struct virtio_vq_info {
 	uint16_t qsize;		/**< size of this queue (a power of 2) */
 	void	(*notify)(void *, struct virtio_vq_info *);
@@ -447,6 +469,7 @@ struct virtio_vq_info {
 
 	uint32_t pfn;		/**< PFN of virt queue (not shifted!) */
 	struct virtio_iothread viothrd;
+	struct virtio_vq_poller poller;
 
 	volatile struct vring_desc *desc;
 				/**< descriptor array */
@@ -459,6 +482,26 @@ struct virtio_vq_info {
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	/*
+	 * Packed ring only: desc/avail/used above are unused, the guest
+	 * gives the descriptor ring and the two event suppression areas
+	 * in gpa_desc, gpa_avail and gpa_used instead. last_avail is the
+	 * next descriptor to fetch.
+	 */
+	volatile struct vring_packed_desc *packed_desc;
+				/**< the packed descriptor ring */
+	volatile struct vring_packed_desc_event *driver_event;
+				/**< written by the driver, suppresses interrupts */
+	volatile struct vring_packed_desc_event *device_event;
+				/**< written by us, suppresses notifications */
+	bool avail_wrap_counter;	/**< wrap counter of last_avail */
+	bool used_wrap_counter;	/**< wrap counter of used_idx */
+	uint16_t used_idx;	/**< next descriptor to write back as used */
+	uint16_t used_since_signal;
+				/**< descriptors used since the last vq_endchains */
+	uint16_t last_chain_len;	/**< descriptors of the last vq_getchain */
+	uint16_t *chain_len;	/**< descriptors of each buffer id in flight */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -480,6 +523,32 @@ vq_ring_ready(struct virtio_vq_info *vq)
 	return ((vq->flags & VQ_ALLOC) == VQ_ALLOC);
 }
 
+/**
+ * @brief Does this ring use the packed layout?
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return true if VIRTIO_F_RING_PACKED was negotiated for the ring.
+ */
+static inline bool
+vq_is_packed(struct virtio_vq_info *vq)
+{
+	return ((vq->flags & VQ_PACKED) == VQ_PACKED);
+}
+
+/*
+ * A packed descriptor is available when its AVAIL flag matches the
+ * wrap counter and its USED flag does not.
+ */
+static inline bool
+vq_packed_desc_avail(uint16_t flags, bool wrap_counter)
+{
+	bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+	bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+	return (avail == wrap_counter) && (used != wrap_counter);
+}
+
 /**
  * @brief Are there "available" descriptors?
  *
@@ -493,7 +562,10 @@ static inline bool
 vq_has_descs(struct virtio_vq_info *vq)
 {
 	bool ret = false;
-	if (vq_ring_ready(vq) && vq->last_avail != vq->avail->idx) {
+	if (vq_ring_ready(vq) && vq_is_packed(vq)) {
+		ret = vq_packed_desc_avail(vq->packed_desc[vq->last_avail].flags,
+				vq->avail_wrap_counter);
+	} else if (vq_ring_ready(vq) && vq->last_avail != vq->avail->idx) {
 		if ((uint16_t)((u_int)vq->avail->idx - vq->last_avail) > vq->qsize)
 			pr_err ("%s: no valid descriptor\n", vq->base->vops->name);
 		else
@@ -578,6 +650,75 @@ void virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
  */
 int acrn_parse_virtio_poll_interval(const char *optarg);
 
+/**
+ * @brief Set the poll budget of a device from a "poll_budget=<us>" option.
+ *
+ * The budget is how long a virtqueue of the device keeps polling
+ * without new buffers before it goes back to notifications. 0 never
+ * polls. Without the option a device polls for
+ * VIRTIO_POLL_IDLE_ROUNDS poll intervals when poll mode is enabled.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param opt Pointer to the option value.
+ *
+ * @return fail -1 success 0
+ */
+int virtio_set_poll_budget(struct virtio_base *base, const char *opt);
+
+/**
+ * @brief Get the virtio device behind a PCI device.
+ *
+ * @param dev Pointer to struct pci_vdev.
+ *
+ * @return the virtio_base of a virtio-pci device, NULL for other devices.
+ */
+struct virtio_base *virtio_get_base(struct pci_vdev *dev);
+
+/**
+ * @brief Stop or restart the I/O the backend does on its own.
+ *
+ * Once stopped, and with the vCPUs paused, the device doesn't touch guest
+ * memory or its rings until restarted.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param stop true to stop, false to restart.
+ */
+void virtio_quiesce(struct virtio_base *base, bool stop);
+
+/**
+ * @brief Size of the transport state saved by virtio_get_state().
+ *
+ * @param base Pointer to struct virtio_base.
+ *
+ * @return size in bytes.
+ */
+size_t virtio_state_size(struct virtio_base *base);
+
+/**
+ * @brief Save the transport state of a device for a snapshot.
+ *
+ * The negotiated features, the ring addresses and the ring indices of
+ * the device side are saved, the rings are part of guest memory. The
+ * device should be idle.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param buf Buffer of virtio_state_size() bytes.
+ */
+void virtio_get_state(struct virtio_base *base, void *buf);
+
+/**
+ * @brief Load a transport state saved by virtio_get_state().
+ *
+ * Guest memory must already hold the rings of the snapshot.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param buf Pointer to the saved state.
+ * @param len Size of the saved state.
+ *
+ * @return 0 on success and -1 if the state does not fit the device.
+ */
+int virtio_set_state(struct virtio_base *base, const void *buf, size_t len);
+
 /**
  * @brief Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
@@ -653,6 +794,18 @@ int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
  */
 void vq_retchain(struct virtio_vq_info *vq);
 
+/**
+ * @brief Return the last n chains to the available queue.
+ *
+ * Like vq_retchain() for several chains at once, e.g. when a packet
+ * needed fewer merged buffers than fetched.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param ids Buffer ids of the chains, in the order they were fetched.
+ * @param n Number of chains.
+ */
+void vq_retchains(struct virtio_vq_info *vq, const uint16_t *ids, int n);
+
 /**
  * @brief Return specified request chain to the guest,
  * setting its I/O length to the provided value.
@@ -679,13 +832,30 @@ void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
  *
  * Driver should always use this helper function to clear used ring flags.
  * For virtio poll mode, in order to avoid trap, we should never really
- * clear used ring flags.
+ * clear used ring flags while the queue is polled; its poller turns
+ * notifications back on when the queue goes idle.
  *
  * @param base Pointer to struct virtio_base.
  * @param vq Pointer to struct virtio_vq_info.
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
 
+/**
+ * @brief Ask the guest not to notify us about new buffers on the ring.
+ *
+ * Undone by vq_clear_used_ring_flags().
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+static inline void
+vq_disable_notify(struct virtio_vq_info *vq)
+{
+	if (vq_is_packed(vq))
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	else
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
 /**
  * @brief Handle PCI configuration space reads.
  *
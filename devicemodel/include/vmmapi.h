@@ -48,6 +48,7 @@
 struct vmctx {
 	int     fd;
 	int     vmid;
+	int     vcpu_num;
 	int     ioreq_client;
 	uint32_t lowmem_limit;
 	uint64_t highmem_gpa_base;
@@ -94,6 +95,9 @@ struct vm_mem_region {
 };
 bool	vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 			     struct vm_mem_region *ret_region);
+size_t	vm_get_memory_pagesz(struct vmctx *ctx, vm_paddr_t gpa);
+int	vm_discard_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
+int	vm_populate_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
 bool    vm_allow_dmabuf(struct vmctx *ctx);
 /*
  * Create a device memory segment identified by 'segid'.
@@ -119,10 +123,13 @@ void	vm_destroy(struct vmctx *ctx);
 int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	uint64_t vma, int prot);
+int	vm_unmap_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot);
 int	vm_setup_memory(struct vmctx *ctx, size_t len);
 void	vm_unsetup_memory(struct vmctx *ctx);
 bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
+int	hugetlb_parse_node(const char *opt);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
@@ -151,6 +158,18 @@ int	vm_remove_hv_vdev(struct vmctx *ctx, struct acrn_vdev *dev);
 int	acrn_parse_cpu_affinity(char *arg);
 uint64_t vm_get_cpu_affinity_dm(void);
 int	vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_vcpu_regs *cpu_regs);
+int	vm_get_vcpu_context(struct vmctx *ctx,
+			    struct acrn_vcpu_context *vcpu_ctx);
+int	vm_set_vcpu_context(struct vmctx *ctx,
+			    struct acrn_vcpu_context *vcpu_ctx);
+/*
+ * Dirty page log of guest RAM: only the writes of the vCPUs are logged,
+ * not the ones of the device model to guest memory. bitmap holds one bit
+ * per 4K page of [gpa, gpa + len), both 256K aligned.
+ */
+int	vm_set_dirty_log(struct vmctx *ctx, bool enable);
+int	vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t len,
+			 uint64_t *bitmap);
 
 int	vm_get_cpu_state(struct vmctx *ctx, void *state_buf);
 int	vm_intr_monitor(struct vmctx *ctx, void *intr_buf);
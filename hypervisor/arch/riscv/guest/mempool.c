@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2026 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <rtl.h>
+#include <logmsg.h>
+#include <asm/board.h>
+#include <asm/page.h>
+#include <asm/pgtable.h>
+#include <asm/mem.h>
+#include <asm/lib/spinlock.h>
+#include <asm/guest/mempool.h>
+
+#define VM_MEM_POOL_GRANULES	(CONFIG_VM_MEM_POOL_SIZE >> VM_MEM_POOL_GRANULE_SHIFT)
+#define VM_MEM_POOL_PAGES	(CONFIG_VM_MEM_POOL_SIZE >> PAGE_SHIFT)
+
+/* one bit per granule, set when the granule is allocated */
+static uint64_t vm_mem_bitmap[(VM_MEM_POOL_GRANULES + 63UL) >> 6U];
+/*
+ * One bit per 4K page, the dirty log of the VMs. Each VM owns the bits of
+ * its own RAM, a granule is 8 whole words.
+ */
+static uint64_t vm_mem_dirty[(VM_MEM_POOL_PAGES + 63UL) >> 6U];
+static uint64_t vm_mem_free_granules;
+static spinlock_t vm_mem_lock;
+
+static inline bool granule_used(uint64_t idx)
+{
+	return (vm_mem_bitmap[idx >> 6U] & (1UL << (idx & 63UL))) != 0UL;
+}
+
+static void set_granules(uint64_t start, uint64_t num, bool used)
+{
+	uint64_t i;
+
+	for (i = start; i < (start + num); i++) {
+		if (used) {
+			vm_mem_bitmap[i >> 6U] |= (1UL << (i & 63UL));
+		} else {
+			vm_mem_bitmap[i >> 6U] &= ~(1UL << (i & 63UL));
+		}
+	}
+}
+
+void init_vm_mem_pool(void)
+{
+	spinlock_init(&vm_mem_lock);
+	(void)memset(vm_mem_bitmap, 0U, sizeof(vm_mem_bitmap));
+	vm_mem_free_granules = VM_MEM_POOL_GRANULES;
+
+	pr_info("VM memory pool: 0x%lx - 0x%lx, %lu granules",
+		CONFIG_VM_MEM_POOL_START, CONFIG_VM_MEM_POOL_START + CONFIG_VM_MEM_POOL_SIZE,
+		vm_mem_free_granules);
+}
+
+/**
+ * @brief Allocate physically contiguous guest RAM from the pool
+ *
+ * The region is cleared, so nothing of the previous owner of the granules
+ * reaches the new VM.
+ *
+ * @param size Size in bytes, rounded up to the pool granule.
+ *
+ * @return HPA of the allocated region, INVALID_HPA if no large enough
+ *         contiguous range is free.
+ */
+uint64_t alloc_vm_mem(uint64_t size)
+{
+	uint64_t num = (size + VM_MEM_POOL_GRANULE - 1UL) >> VM_MEM_POOL_GRANULE_SHIFT;
+	uint64_t idx, run = 0UL;
+	uint64_t hpa = INVALID_HPA;
+
+	if ((num != 0UL) && (num <= VM_MEM_POOL_GRANULES)) {
+		spinlock_obtain(&vm_mem_lock);
+		if (num <= vm_mem_free_granules) {
+			/* first fit */
+			for (idx = 0UL; idx < VM_MEM_POOL_GRANULES; idx++) {
+				if (granule_used(idx)) {
+					run = 0UL;
+				} else {
+					run++;
+					if (run == num) {
+						set_granules(idx + 1UL - num, num, true);
+						vm_mem_free_granules -= num;
+						hpa = CONFIG_VM_MEM_POOL_START +
+							((idx + 1UL - num) << VM_MEM_POOL_GRANULE_SHIFT);
+						break;
+					}
+				}
+			}
+		}
+		spinlock_release(&vm_mem_lock);
+	}
+
+	if (hpa == INVALID_HPA) {
+		pr_err("%s: no 0x%lx bytes contiguous memory in the pool", __func__, size);
+	} else {
+		(void)memset(hpa2hva(hpa), 0U, num << VM_MEM_POOL_GRANULE_SHIFT);
+	}
+
+	return hpa;
+}
+
+/**
+ * @pre hpa and size are what alloc_vm_mem() was called with and returned
+ */
+void free_vm_mem(uint64_t hpa, uint64_t size)
+{
+	uint64_t num = (size + VM_MEM_POOL_GRANULE - 1UL) >> VM_MEM_POOL_GRANULE_SHIFT;
+	uint64_t start;
+
+	if ((hpa >= CONFIG_VM_MEM_POOL_START) &&
+			((hpa + (num << VM_MEM_POOL_GRANULE_SHIFT)) <= (CONFIG_VM_MEM_POOL_START + CONFIG_VM_MEM_POOL_SIZE))) {
+		start = (hpa - CONFIG_VM_MEM_POOL_START) >> VM_MEM_POOL_GRANULE_SHIFT;
+		spinlock_obtain(&vm_mem_lock);
+		set_granules(start, num, false);
+		vm_mem_free_granules += num;
+		spinlock_release(&vm_mem_lock);
+	} else {
+		pr_err("%s: 0x%lx is not in the pool", __func__, hpa);
+	}
+}
+
+uint64_t vm_mem_pool_free_size(void)
+{
+	return vm_mem_free_granules << VM_MEM_POOL_GRANULE_SHIFT;
+}
+
+/**
+ * @brief Dirty log bits of the pool pages from hpa on
+ *
+ * @return pointer to the word holding the bit of hpa, bit 0 for a granule
+ *         aligned hpa, NULL if hpa is not in the pool.
+ */
+uint64_t *vm_mem_dirty_bitmap(uint64_t hpa)
+{
+	uint64_t *bitmap = NULL;
+
+	if ((hpa >= CONFIG_VM_MEM_POOL_START) && (hpa < (CONFIG_VM_MEM_POOL_START + CONFIG_VM_MEM_POOL_SIZE))) {
+		bitmap = &vm_mem_dirty[(hpa - CONFIG_VM_MEM_POOL_START) >> (PAGE_SHIFT + 6U)];
+	}
+
+	return bitmap;
+}
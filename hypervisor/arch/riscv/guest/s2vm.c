@@ -19,6 +19,7 @@
 #include <asm/smp.h>
 #include <asm/cpumask.h>
 #include <asm/guest/vm.h>
+#include <asm/guest/mempool.h>
 
 unsigned int s2vm_inital_level;
 
@@ -105,6 +106,16 @@ void s2pt_flush_guest(struct acrn_vm *vm)
 	}
 }
 
+/*
+ * Flush the stage-2 translations of [gpa, gpa + size) of this VM only.
+ */
+void s2pt_flush_range(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	const struct memory_ops *mem_ops = &vm->arch_vm.s2pt_mem_ops;
+
+	mem_ops->flush_tlb_range(mem_ops->info, gpa, size);
+}
+
 static int s2pt_setup_satp(struct acrn_vm *vm)
 {
 	uint64_t satp;
@@ -150,9 +161,11 @@ void s2pt_add_mr(struct acrn_vm *vm, uint64_t *vpn3_page,
 
 	spin_lock(&vm->s2pt_lock);
 	mmu_add(vpn3_page, hpa, gpa, size, prot, &vm->arch_vm.s2pt_mem_ops);
+	/* pieces mapped next to existing ones may complete a large page */
+	(void)mmu_collapse(vpn3_page, gpa, size, &vm->arch_vm.s2pt_mem_ops);
 	spin_unlock(&vm->s2pt_lock);
 
-	s2pt_flush_guest(vm);
+	s2pt_flush_range(vm, gpa, size);
 }
 
 void s2pt_modify_mr(struct acrn_vm *vm, uint64_t *vpn3_page,
@@ -166,10 +179,12 @@ void s2pt_modify_mr(struct acrn_vm *vm, uint64_t *vpn3_page,
 	spin_lock(&vm->s2pt_lock);
 
 	mmu_modify_or_del(vpn3_page, gpa, size, local_prot, prot_clr, &(vm->arch_vm.s2pt_mem_ops), MR_MODIFY);
+	/* restoring the rights of a split range makes it uniform again */
+	(void)mmu_collapse(vpn3_page, gpa, size, &vm->arch_vm.s2pt_mem_ops);
 
 	spin_unlock(&vm->s2pt_lock);
 
-	s2pt_flush_guest(vm);
+	s2pt_flush_range(vm, gpa, size);
 }
 /**
  * @pre [gpa,gpa+size) has been mapped into host physical memory region
@@ -184,7 +199,180 @@ void s2pt_del_mr(struct acrn_vm *vm, uint64_t *vpn3_page, uint64_t gpa, uint64_t
 
 	spin_unlock(&vm->s2pt_lock);
 
-	s2pt_flush_guest(vm);
+	s2pt_flush_range(vm, gpa, size);
+}
+
+/*
+ * Dirty page logging of the RAM of a post-launched VM: the RAM is write
+ * protected in stage-2, the first write of a vCPU to each 4K page faults,
+ * sets the bit of the page in the log and makes the page writable again.
+ * Writes of the hypervisor and of the Service VM to the guest RAM are not
+ * logged.
+ *
+ * The log owns the write permission of the RAM while it runs: it can't be
+ * started while a RAM page is write protected for another reason, so that
+ * stopping it can make the whole RAM writable again.
+ */
+static uint64_t *dirty_log_bitmap(struct acrn_vm *vm)
+{
+	return vm_mem_dirty_bitmap(get_vm_config(vm->vm_id)->memory.start_hpa);
+}
+
+/*
+ * @return true if no page mapped in [gpa, gpa + size) is write protected
+ *
+ * @pre vm->s2pt_lock is held
+ */
+static bool s2pt_range_writable(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	const uint64_t *entry;
+	uint64_t addr = gpa, pg_size;
+	bool writable = true;
+
+	while (writable && (addr < (gpa + size))) {
+		entry = lookup_address((uint64_t *)get_s2pt_entry(vm), addr, &pg_size,
+				&vm->arch_vm.s2pt_mem_ops);
+		if (entry == NULL) {
+			/* a hole, such as memory given back by a balloon */
+			pg_size = PAGE_SIZE;
+		} else if ((*entry & PAGE_W) == 0UL) {
+			writable = false;
+		} else {
+			/* writable leaf */
+		}
+		addr = (addr & ~(pg_size - 1UL)) + pg_size;
+	}
+
+	return writable;
+}
+
+/**
+ * @brief Start or stop logging the writes to the RAM of a VM
+ *
+ * Starting clears the log. Stopping makes the whole RAM writable and
+ * merges it back into large pages.
+ *
+ * @return 0 on success, -EINVAL if the RAM is not from the VM memory pool,
+ *         -EBUSY if a RAM page is already write protected when starting.
+ */
+int32_t s2pt_set_dirty_log(struct acrn_vm *vm, bool enable)
+{
+	const struct kernel_info *kinfo = &vm->sw.kernel_info;
+	uint64_t *vpn3_page = (uint64_t *)get_s2pt_entry(vm);
+	uint64_t *bitmap = dirty_log_bitmap(vm);
+	int32_t ret = -EINVAL;
+
+	if ((bitmap != NULL) && (kinfo->mem_size_gpa != 0UL)) {
+		spin_lock(&vm->s2pt_lock);
+		if (!enable && !vm->arch_vm.dirty_log) {
+			/* not started, nothing to give back */
+			ret = 0;
+		} else if (enable) {
+			/* a restart finds only the pages it protected itself */
+			if (vm->arch_vm.dirty_log ||
+					s2pt_range_writable(vm, kinfo->mem_start_gpa, kinfo->mem_size_gpa)) {
+				(void)memset(bitmap, 0U, kinfo->mem_size_gpa >> (PAGE_SHIFT + 3U));
+				mmu_modify_or_del(vpn3_page, kinfo->mem_start_gpa, kinfo->mem_size_gpa,
+					0UL, PAGE_W, &vm->arch_vm.s2pt_mem_ops, MR_MODIFY);
+				vm->arch_vm.dirty_log = true;
+				ret = 0;
+			} else {
+				ret = -EBUSY;
+			}
+		} else {
+			mmu_modify_or_del(vpn3_page, kinfo->mem_start_gpa, kinfo->mem_size_gpa,
+				PAGE_W, 0UL, &vm->arch_vm.s2pt_mem_ops, MR_MODIFY);
+			(void)mmu_collapse(vpn3_page, kinfo->mem_start_gpa, kinfo->mem_size_gpa,
+				&vm->arch_vm.s2pt_mem_ops);
+			vm->arch_vm.dirty_log = false;
+			ret = 0;
+		}
+		spin_unlock(&vm->s2pt_lock);
+
+		if (ret == 0) {
+			s2pt_flush_range(vm, kinfo->mem_start_gpa, kinfo->mem_size_gpa);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Handle a stage-2 store fault at gpa
+ *
+ * Only a fault on a mapped RAM page is a logged write: while the log runs,
+ * the log is the only one to write protect RAM. A page made writable by
+ * another vCPU meanwhile just needs a retry. Faults on unmapped pages are
+ * left to the caller.
+ *
+ * @return true if the fault was a logged write to RAM, the vCPU just has
+ *         to retry the instruction.
+ */
+bool s2pt_dirty_log_fault(struct acrn_vm *vm, uint64_t gpa)
+{
+	const struct kernel_info *kinfo = &vm->sw.kernel_info;
+	const uint64_t *entry;
+	uint64_t *bitmap;
+	uint64_t page, pg_size;
+	bool handled = false;
+
+	if (vm->arch_vm.dirty_log && (gpa >= kinfo->mem_start_gpa) &&
+			(gpa < (kinfo->mem_start_gpa + kinfo->mem_size_gpa))) {
+		bitmap = dirty_log_bitmap(vm);
+		page = (gpa - kinfo->mem_start_gpa) >> PAGE_SHIFT;
+
+		spin_lock(&vm->s2pt_lock);
+		entry = lookup_address((uint64_t *)get_s2pt_entry(vm), gpa, &pg_size,
+				&vm->arch_vm.s2pt_mem_ops);
+		/* another vCPU may have stopped the log meanwhile */
+		if (vm->arch_vm.dirty_log && (entry != NULL)) {
+			if ((*entry & PAGE_W) == 0UL) {
+				bitmap[page >> 6U] |= 1UL << (page & 63UL);
+				mmu_modify_or_del((uint64_t *)get_s2pt_entry(vm), gpa & PAGE_MASK, PAGE_SIZE,
+					PAGE_W, 0UL, &vm->arch_vm.s2pt_mem_ops, MR_MODIFY);
+			}
+			handled = true;
+		}
+		spin_unlock(&vm->s2pt_lock);
+
+		if (handled) {
+			s2pt_flush_range(vm, gpa & PAGE_MASK, PAGE_SIZE);
+		}
+	}
+
+	return handled;
+}
+
+/**
+ * @brief Move the log of nr_words * 64 pages from gpa on to log
+ *
+ * The pages written since the last call are write protected again, the
+ * stale translations are flushed before returning so that any later
+ * write is logged again.
+ *
+ * @pre vm->arch_vm.dirty_log
+ * @pre gpa is 64 pages aligned to the start of the RAM and the range is
+ *      inside the RAM
+ */
+void s2pt_get_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t *log, uint64_t nr_words)
+{
+	const struct kernel_info *kinfo = &vm->sw.kernel_info;
+	uint64_t *bitmap = dirty_log_bitmap(vm) + ((gpa - kinfo->mem_start_gpa) >> (PAGE_SHIFT + 6U));
+	uint64_t i, span = 64UL << PAGE_SHIFT;
+
+	spin_lock(&vm->s2pt_lock);
+	for (i = 0UL; i < nr_words; i++) {
+		log[i] = bitmap[i];
+		if (log[i] != 0UL) {
+			bitmap[i] = 0UL;
+			/* the other pages of the span are still write protected */
+			mmu_modify_or_del((uint64_t *)get_s2pt_entry(vm), gpa + (i * span), span,
+				0UL, PAGE_W, &vm->arch_vm.s2pt_mem_ops, MR_MODIFY);
+		}
+	}
+	spin_unlock(&vm->s2pt_lock);
+
+	s2pt_flush_range(vm, gpa, nr_words * span);
 }
 
 /**
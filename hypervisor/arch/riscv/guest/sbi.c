@@ -19,6 +19,7 @@
 #include <asm/guest/vcpu.h>
 #include <asm/guest/vm.h>
 #include <asm/guest/vclint.h>
+#include <asm/guest/vuart.h>
 #include "sbi.h"
 #include "rpmi.h"
 #include "tee.h"
@@ -380,18 +381,27 @@ static void sbi_mpxy_send_msg_with_resp(struct acrn_vcpu *vcpu, struct cpu_regs
 	uint64_t msg_id = regs->a1;
 	uint64_t *ret = &regs->a0;
 
-	if (channel_id == 0 || channel_id == 1) {
-		tee_switch(vcpu);
-	} else if ((channel_id & 0x10) != 0 && msg_id == RPMI_REQFWD_RETRI_MESG) {
-		tee_switch(vcpu);
-	} else if ((channel_id & 0x10) != 0 && msg_id == RPMI_REQFWD_COMPL_MESG) {
-		struct rpmi_reqfwd_request *p = (struct rpmi_reqfwd_request *)vcpu->mpxy.base;
-		tee_answer_ree(vcpu);
-		p->compl_status = SBI_SUCCESS;
-		p->compl_num = 0x1;
-	}
+	int32_t err = 0;
 
-	*ret = SBI_SUCCESS;
+	if (channel_id == TEE_SHM_CHANNEL_ID) {
+		*ret = (uint64_t)(int64_t)tee_shm_handler(vcpu, msg_id);
+	} else if (channel_id == VUART_RING_CHANNEL_ID) {
+		*ret = (uint64_t)(int64_t)vuart_ring_handler(vcpu, msg_id);
+	} else {
+		if (channel_id == 0 || channel_id == 1) {
+			err = tee_switch(vcpu);
+		} else if ((channel_id & 0x10) != 0 && msg_id == RPMI_REQFWD_RETRI_MESG) {
+			err = tee_switch(vcpu);
+		} else if ((channel_id & 0x10) != 0 && msg_id == RPMI_REQFWD_COMPL_MESG) {
+			struct rpmi_reqfwd_request *p = (struct rpmi_reqfwd_request *)vcpu->mpxy.base;
+			err = tee_answer_ree(vcpu);
+			p->compl_status = (err == 0) ? SBI_SUCCESS : SBI_EFAILURE;
+			p->compl_num = 0x1;
+		}
+
+		/* The companion was not switched to or not answered */
+		*ret = (uint64_t)(int64_t)((err == 0) ? SBI_SUCCESS : SBI_EFAILURE);
+	}
 }
 
 static void sbi_mpxy_handler(struct acrn_vcpu *vcpu, struct cpu_regs *regs)
@@ -12,6 +12,9 @@
 #include <asm/lib/string.h>
 #include <asm/guest/vm.h>
 #include <asm/guest/virq.h>
+#include <asm/guest/s2vm.h>
+#include <asm/mem.h>
+#include <schedule.h>
 #include <logmsg.h>
 #include "tee.h"
 #include "sbi.h"
@@ -31,11 +34,101 @@ void prepare_tee_vm_memmap(struct acrn_vm *vm, const struct acrn_vm_config *vm_c
 {
 }
 
+#define TEE_SHM_REE_MAPPED	(1U << 0U)
+#define TEE_SHM_TEE_MAPPED	(1U << 1U)
+
+/* One ring per companion vCPU pair, indexed by the TEE VM id and vcpu_id */
+static struct tee_shm_ring tee_shm_rings[CONFIG_MAX_VM_NUM][MAX_VCPUS_PER_VM];
+static uint32_t tee_shm_mapped[CONFIG_MAX_VM_NUM][MAX_VCPUS_PER_VM];
+
 static struct acrn_vm *get_companion_vm(struct acrn_vm *vm)
 {
 	return get_vm_from_vmid(get_vm_config(vm->vm_id)->companion_vm_id);
 }
 
+/* Both VMs of a TEE/REE pair share the rings of the TEE VM */
+static uint16_t tee_pair_id(struct acrn_vm *vm)
+{
+	return is_tee_vm(vm) ? vm->vm_id : get_vm_config(vm->vm_id)->companion_vm_id;
+}
+
+/*
+ * Hand the pCPU over to the companion vCPU. The companion resumes right
+ * after its own switch request, so no register of it is touched here.
+ */
+static void tee_handoff(struct acrn_vcpu *vcpu, struct acrn_vcpu *companion)
+{
+	handoff_thread(&vcpu->thread_obj, &companion->thread_obj);
+}
+
+static int32_t tee_shm_register(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	uint16_t pair_id = tee_pair_id(vm);
+	struct tee_shm_ring *ring = &tee_shm_rings[pair_id][vcpu->vcpu_id];
+	uint32_t *mapped = &tee_shm_mapped[pair_id][vcpu->vcpu_id];
+	const struct kernel_info *kinfo = &vm->sw.kernel_info;
+	uint32_t side = is_tee_vm(vm) ? TEE_SHM_TEE_MAPPED : TEE_SHM_REE_MAPPED;
+	uint64_t gpa;
+	int32_t ret = SBI_EINVAL_ADDR;
+
+	if ((pair_id < CONFIG_MAX_VM_NUM) && (vcpu->mpxy.base != NULL)) {
+		gpa = *vcpu->mpxy.base;
+		/* The ring must replace a page aligned range of the guest's own RAM */
+		if (((gpa & PAGE_MASK) == gpa) && (gpa >= kinfo->mem_start_gpa) &&
+				((gpa + TEE_SHM_RING_SIZE) <= (kinfo->mem_start_gpa + kinfo->mem_size_gpa)) &&
+				((*mapped & side) == 0U)) {
+			if (*mapped == 0U) {
+				(void)memset(ring, 0U, sizeof(*ring));
+				ring->hdr.magic = TEE_SHM_RING_MAGIC;
+				ring->hdr.version = TEE_SHM_RING_VERSION;
+			}
+
+			/* Back the guest range with the shared ring instead of its own RAM */
+			s2pt_del_mr(vm, vm->arch_vm.s2ptp, gpa, TEE_SHM_RING_SIZE);
+			s2pt_add_mr(vm, vm->arch_vm.s2ptp, hva2hpa(ring), gpa, TEE_SHM_RING_SIZE,
+					PAGE_V | PAGE_RW_RW);
+			*mapped |= side;
+			pr_info("VM%u vCPU%u: TEE shm ring mapped at gpa 0x%lx",
+					vm->vm_id, vcpu->vcpu_id, gpa);
+			ret = SBI_SUCCESS;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Handle a message on the zero-copy TEE/REE channel.
+ *
+ * The payload never leaves the shared ring; CALL and RETURN only switch
+ * to the companion vCPU once both sides have the ring mapped.
+ *
+ * @return SBI status to return to the guest
+ */
+int32_t tee_shm_handler(struct acrn_vcpu *vcpu, uint64_t msg_id)
+{
+	struct acrn_vcpu *companion;
+	uint16_t pair_id = tee_pair_id(vcpu->vm);
+	int32_t ret = SBI_EINVAL_PARAM;
+
+	if (msg_id == TEE_SHM_MSG_REGISTER) {
+		ret = tee_shm_register(vcpu);
+	} else if (((msg_id == TEE_SHM_MSG_CALL) && is_ree_vm(vcpu->vm)) ||
+			((msg_id == TEE_SHM_MSG_RETURN) && is_tee_vm(vcpu->vm))) {
+		if ((pair_id >= CONFIG_MAX_VM_NUM) ||
+				(tee_shm_mapped[pair_id][vcpu->vcpu_id] != (TEE_SHM_REE_MAPPED | TEE_SHM_TEE_MAPPED))) {
+			ret = SBI_EDENIED;
+		} else {
+			companion = vcpu_from_vid(get_companion_vm(vcpu->vm), vcpu->vcpu_id);
+			tee_handoff(vcpu, companion);
+			ret = SBI_SUCCESS;
+		}
+	}
+
+	return ret;
+}
+
 int32_t tee_answer_ree(struct acrn_vcpu *vcpu)
 {
 	struct acrn_vm *ree_vm;
@@ -56,15 +149,13 @@ int32_t tee_answer_ree(struct acrn_vcpu *vcpu)
 		uint64_t *rc = &ree_regs->a0;
 		uint64_t *val = &ree_regs->a1;
 
-		while (d == NULL)  {
-			mb();
-			d = (uint8_t *)ree_vcpu->mpxy.base;
+		/* REE has not set up its MPXY shared memory yet, nowhere to answer */
+		if (d != NULL) {
+			memcpy(d, mm + sizeof(uint64_t), msg_data_len - sizeof(uint64_t));
+			*rc = SBI_SUCCESS;
+			*val = msg_data_len - sizeof(uint64_t);
+			ret = 0;
 		}
-
-		memcpy(d, mm + sizeof(uint64_t), msg_data_len - sizeof(uint64_t));
-		*rc = SBI_SUCCESS;
-		*val = msg_data_len - sizeof(uint64_t);
-		ret = 0;
 	} else {
 		pr_fatal("No REE vCPU running on this pCPU%u, \n", get_pcpu_id());
 	}
@@ -83,8 +174,7 @@ static int32_t tee_switch_to_ree(struct acrn_vcpu *vcpu)
 	ree_vcpu = vcpu_from_vid(ree_vm, vcpu->vcpu_id);
 
 	if (ree_vcpu != NULL) {
-		sleep_thread(&vcpu->thread_obj);
-		wake_thread(&ree_vcpu->thread_obj);
+		tee_handoff(vcpu, ree_vcpu);
 		ret = 0;
 	} else {
 		pr_fatal("No REE vCPU running on this pCPU%u, \n", get_pcpu_id());
@@ -114,23 +204,20 @@ static int32_t ree_switch_to_tee(struct acrn_vcpu *vcpu)
 		uint64_t *val = &tee_regs->a1;
 
 		uint8_t *d;
-		sleep_thread(&vcpu->thread_obj);
 
-		while (p == NULL)  {
-			mb();
-			p = (struct rpmi_reqfwd_request *)tee_vcpu->mpxy.base;
-		}
-		p->retri_status = SBI_SUCCESS;
-		p->retri_remain = 0;
-		p->retri_returned = msg_data_len;
-		*rc = SBI_SUCCESS;
-		*val = msg_data_len;
-
-		d = &p->retri_mesg;
-		memcpy(d, mm, msg_data_len);
-		wake_thread(&tee_vcpu->thread_obj);
+		if (p != NULL) {
+			p->retri_status = SBI_SUCCESS;
+			p->retri_remain = 0;
+			p->retri_returned = msg_data_len;
+			*rc = SBI_SUCCESS;
+			*val = msg_data_len;
 
-		ret = 0;
+			d = &p->retri_mesg;
+			memcpy(d, mm, msg_data_len);
+			tee_handoff(vcpu, tee_vcpu);
+
+			ret = 0;
+		}
 	} else {
 		pr_fatal("No TEE vCPU running on this pCPU%u, \n", get_pcpu_id());
 	}
@@ -10,7 +10,52 @@
 #ifndef __RISCV_TEE_H__
 #define __RISCV_TEE_H__
 
+#include <asm/page.h>
+
+/*
+ * ACRN specific MPXY channel carrying a zero-copy message ring between the
+ * companion TEE and REE vCPUs. Both guests register the same hypervisor owned
+ * ring pages into their guest physical address space, requests/responses are
+ * produced and consumed in place, and the hypervisor only hands the pCPU over
+ * to the companion vCPU.
+ */
+#define TEE_SHM_CHANNEL_ID	0x20U
+
+#define TEE_SHM_MSG_REGISTER	0x01U	/* mpxy shm[0]: GPA to map the ring at */
+#define TEE_SHM_MSG_CALL	0x02U	/* REE posted requests, switch to TEE */
+#define TEE_SHM_MSG_RETURN	0x03U	/* TEE posted responses, switch to REE */
+
+#define TEE_SHM_RING_MAGIC	0x52454554U	/* "TEER" */
+#define TEE_SHM_RING_VERSION	1U
+#define TEE_SHM_RING_PAGES	4U
+#define TEE_SHM_RING_SIZE	(TEE_SHM_RING_PAGES * PAGE_SIZE)
+#define TEE_SHM_RING_SLOTS	8U
+
+struct tee_shm_desc {
+	uint32_t offset;	/* payload offset from the start of data[] */
+	uint32_t len;		/* payload length in bytes */
+	int32_t status;
+	uint32_t cookie;	/* opaque, echoed from request to response */
+};
+
+struct tee_shm_ring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t req_prod;	/* written by REE */
+	uint32_t req_cons;	/* written by TEE */
+	uint32_t resp_prod;	/* written by TEE */
+	uint32_t resp_cons;	/* written by REE */
+	struct tee_shm_desc req[TEE_SHM_RING_SLOTS];
+	struct tee_shm_desc resp[TEE_SHM_RING_SLOTS];
+};
+
+struct tee_shm_ring {
+	struct tee_shm_ring_hdr hdr;
+	uint8_t data[TEE_SHM_RING_SIZE - sizeof(struct tee_shm_ring_hdr)];
+} __aligned(PAGE_SIZE);
+
 int32_t tee_switch(struct acrn_vcpu *vcpu);
 int32_t tee_answer_ree(struct acrn_vcpu *vcpu);
+int32_t tee_shm_handler(struct acrn_vcpu *vcpu, uint64_t msg_id);
 
 #endif
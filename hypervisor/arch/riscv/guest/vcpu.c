@@ -26,6 +26,9 @@
 #include <asm/current.h>
 #include <asm/boot.h>
 #include <asm/smp.h>
+#include <timer.h>
+#include <asm/timer.h>
+#include <acrn_hv_defs.h>
 
 /* stack_frame is linked with the sequence of stack operation in arch_switch_to() */
 struct stack_frame {
@@ -191,6 +194,7 @@ static void vcpu_reset_internal(struct acrn_vcpu *vcpu, enum reset_mode mode)
 
 	vcpu->launched = false;
 	vcpu->arch.nr_sipi = 0U;
+	vcpu->arch.context_loaded = false;
 
 	vcpu->arch.exception_info.exception = VECTOR_INVALID;
 	vcpu->arch.cur_context = NORMAL_WORLD;
@@ -247,6 +251,72 @@ void set_vcpu_regs(struct acrn_vcpu *vcpu, struct cpu_regs *vcpu_gp_regs)
 	}
 }
 
+/**
+ * @pre vcpu != NULL && vctx != NULL
+ * @pre vcpu->state != VCPU_RUNNING
+ */
+void get_vcpu_context(struct acrn_vcpu *vcpu, struct acrn_vcpu_context *vctx)
+{
+	const struct run_context *ctx = &(vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx);
+	const struct hv_timer *timer = &(vcpu_vclint(vcpu)->vtimer[vcpu->vcpu_id].timer);
+
+	(void)memset((void *)vctx->gprs, 0U, sizeof(vctx->gprs));
+	(void)memcpy_s((void *)vctx->gprs, sizeof(vctx->gprs),
+			(const void *)&(ctx->cpu_gp_regs), sizeof(struct cpu_regs));
+	vctx->sstatus = ctx->sstatus;
+	vctx->sepc = ctx->sepc;
+	vctx->sip = ctx->sip;
+	vctx->sie = ctx->sie;
+	vctx->stvec = ctx->stvec;
+	vctx->sscratch = ctx->sscratch;
+	vctx->stval = ctx->stval;
+	vctx->scause = ctx->scause;
+	vctx->satp = ctx->satp;
+	vctx->timer_deadline = timer_is_started(timer) ? timer->timeout : 0UL;
+}
+
+/**
+ * Load a context saved by get_vcpu_context(). An armed timer fires at once
+ * on the next entry, as the time base may differ from the one of the save.
+ *
+ * The trap frame fields that the hypervisor owns are not taken from vctx:
+ * hstatus, htval, htinst and orig_a0 are kept, and only SPP of status is
+ * loaded, so the guest goes back to VS-mode or VU-mode and nowhere else.
+ *
+ * @pre vcpu != NULL && vctx != NULL
+ * @pre vcpu->state != VCPU_RUNNING
+ */
+void set_vcpu_context(struct acrn_vcpu *vcpu, const struct acrn_vcpu_context *vctx)
+{
+	struct run_context *ctx = &(vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx);
+	struct cpu_regs regs = ctx->cpu_gp_regs.regs;
+	uint64_t status = vctx->gprs[OFFSET_REG_STATUS / sizeof(uint64_t)];
+
+	(void)memcpy_s((void *)&(ctx->cpu_gp_regs), sizeof(struct cpu_regs),
+			(const void *)vctx->gprs, sizeof(struct cpu_regs));
+	ctx->cpu_gp_regs.regs.status = (regs.status & ~SSTATUS_SPP) | (status & SSTATUS_SPP);
+	ctx->cpu_gp_regs.regs.hstatus = regs.hstatus;
+	ctx->cpu_gp_regs.regs.htval = regs.htval;
+	ctx->cpu_gp_regs.regs.htinst = regs.htinst;
+	ctx->cpu_gp_regs.regs.orig_a0 = regs.orig_a0;
+	ctx->sstatus = vctx->sstatus;
+	ctx->sepc = vctx->sepc;
+	ctx->sip = vctx->sip;
+	ctx->sie = vctx->sie;
+	ctx->stvec = vctx->stvec;
+	ctx->sscratch = vctx->sscratch;
+	ctx->stval = vctx->stval;
+	ctx->scause = vctx->scause;
+	ctx->satp = vctx->satp;
+
+	/* keep the loaded context when init_vmcs() runs on the first entry */
+	vcpu->arch.context_loaded = true;
+
+	if (vctx->timer_deadline != 0UL) {
+		vclint_write_tmr(vcpu_vclint(vcpu), vcpu->vcpu_id, min(vctx->timer_deadline, get_tick()));
+	}
+}
+
 void init_vcpu_protect_mode_regs(struct acrn_vcpu *vcpu, uint64_t vgdt_base_gpa)
 {
 }
@@ -472,7 +542,17 @@ int create_vcpu(struct acrn_vm *vm, uint16_t vcpu_id)
 	uint16_t pcpu_id;
 	char thread_name[16];
 
-	pcpu_id = vcpu_id + vm->vm_id * CONFIG_MAX_VCPU;
+	if (vm->hw.cpu_affinity != 0UL) {
+		/* vCPU n runs on the n-th pCPU of the affinity */
+		uint64_t affinity = vm->hw.cpu_affinity;
+
+		for (i = 0; i < (int32_t)vm->hw.created_vcpus; i++) {
+			affinity &= (affinity - 1UL);
+		}
+		pcpu_id = (uint16_t)ffs64(affinity);
+	} else {
+		pcpu_id = vcpu_id + vm->vm_id * CONFIG_MAX_VCPU;
+	}
 
 	/*
 	 * vcpu->vcpu_id = vm->hw.created_vcpus;
@@ -34,6 +34,16 @@ void arch_fire_hsm_interrupt(void)
 	vplic_accept_intr(vcpu, get_hsm_notification_vector(), true);
 }
 
+/**
+ * Called from the debug console timer, and once when it is set up: raise the
+ * THRE held back for short bursts. The ring channel is only offered from then
+ * on, as nothing drains the console rings without that timer.
+ */
+void arch_flush_vuarts(void)
+{
+	vuart_flush_thre();
+}
+
 /**
  * Dummy handler, riscv doesn't support pio.
  */
@@ -140,6 +150,11 @@ int32_t mmio_access_vmexit_handler(struct acrn_vcpu *vcpu)
 	else
 		gpa = gva;
 
+	/* a logged write to RAM, the vCPU retries it on the now writable page */
+	if ((exit_qual == HX_EXIT_PF_GUEST_STORE) && s2pt_dirty_log_fault(vcpu->vm, gpa)) {
+		return 0;
+	}
+
 	io_req->io_type = ACRN_IOREQ_TYPE_MMIO;
 
 	/* Specify if read or write operation */
@@ -23,9 +23,20 @@
 #include <asm/image.h>
 #include <asm/guest/vuart.h>
 #include <asm/guest/vpci.h>
+#include <asm/guest/guest_memory.h>
+#include <asm/guest/mempool.h>
 #include <vmcs9900.h>
+#ifdef CONFIG_KTEST
+#include "../ktest/bench.h"
+#endif
 
 static struct acrn_vm vm_array[CONFIG_MAX_VM_NUM] __aligned(PAGE_SIZE);
+
+/*
+ * The first STATIC_VM_NUM entries of vm_configs are built in, the rest are
+ * filled in at runtime for the VMs created by HC_CREATE_VM.
+ */
+#define STATIC_VM_NUM	2U
 struct acrn_vm_config vm_configs[CONFIG_MAX_VM_NUM] = {
 	{
 		.load_order = SERVICE_VM,
@@ -57,6 +68,10 @@ struct acrn_vm_config vm_configs[CONFIG_MAX_VM_NUM] = {
 struct acrn_vm *sos_vm = &vm_array[0];
 struct acrn_vm *uos_vm = &vm_array[1];
 
+/* VM ids in use, the ids of the static VMs are never handed out */
+static uint64_t vm_id_bitmap = (1UL << STATIC_VM_NUM) - 1UL;
+static spinlock_t vm_id_lock;
+
 #define RV64_BIMAGE_MAGIC0 0x5643534952
 #define RV64_BIMAGE_MAGIC1 0x05435352
 
@@ -95,6 +110,32 @@ bool is_service_vm(const struct acrn_vm *vm)
 void get_vm_lock(struct acrn_vm *vm) { }
 void put_vm_lock(struct acrn_vm *vm) { }
 
+static uint16_t alloc_vm_id(void)
+{
+	uint16_t vm_id, ret = ACRN_INVALID_VMID;
+
+	spinlock_obtain(&vm_id_lock);
+	for (vm_id = STATIC_VM_NUM; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		if ((vm_id_bitmap & (1UL << vm_id)) == 0UL) {
+			vm_id_bitmap |= (1UL << vm_id);
+			ret = vm_id;
+			break;
+		}
+	}
+	spinlock_release(&vm_id_lock);
+
+	return ret;
+}
+
+static void free_vm_id(uint16_t vm_id)
+{
+	if (vm_id >= STATIC_VM_NUM) {
+		spinlock_obtain(&vm_id_lock);
+		vm_id_bitmap &= ~(1UL << vm_id);
+		spinlock_release(&vm_id_lock);
+	}
+}
+
 static void kernel_load(struct kernel_info *info)
 {
 	paddr_t load_addr;
@@ -164,6 +205,25 @@ static void init_vm_sw_load(struct acrn_vm *vm)
 	kernel_header_parse(kinfo);
 }
 
+/*
+ * The static VMs run their boot loaded images in place, so their RAM is
+ * identity mapped at the image location.
+ */
+static void init_static_vm_memmap(struct acrn_vm *vm)
+{
+	struct kernel_info *kinfo = &vm->sw.kernel_info;
+	struct dtb_info *dinfo = &vm->sw.dtb_info;
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	kinfo->mem_start_gpa = kinfo->kernel_addr;
+	kinfo->mem_size_gpa = kinfo->kernel_len;
+	dinfo->dtb_start_gpa = dinfo->dtb_addr;
+	dinfo->dtb_size_gpa = dinfo->dtb_len;
+
+	vm_config->memory.start_hpa = kinfo->kernel_addr;
+	vm_config->memory.size = kinfo->kernel_len;
+}
+
 void prepare_sos_vm(void)
 {
 	memset(sos_vm, 0, sizeof(struct acrn_vm));
@@ -177,6 +237,7 @@ void prepare_sos_vm(void)
 	pr_info("%s stage 2 transation table location: 0x%lx ", __func__, (uint64_t *)(sos_vm->arch_vm.s2ptp));
 #endif
 	init_vm_sw_load(sos_vm);
+	init_static_vm_memmap(sos_vm);
 }
 
 static void init_uos_load(struct acrn_vm *vm)
@@ -213,6 +274,7 @@ void prepare_uos_vm(void)
 	pr_info("%s stage 2 transation table location: 0x%lx ", __func__, (uint64_t *)(uos_vm->arch_vm.s2ptp));
 #endif
 	init_uos_load(uos_vm);
+	init_static_vm_memmap(uos_vm);
 }
 
 static void dtb_load(struct dtb_info *info)
@@ -237,7 +299,7 @@ static void dtb_load(struct dtb_info *info)
 static void allocate_guest_memory(struct acrn_vm *vm, struct kernel_info *info)
 {
 	uint64_t gpa = info->mem_start_gpa;
-	uint64_t hpa = gpa;
+	uint64_t hpa = get_vm_config(vm->vm_id)->memory.start_hpa;
 	s2pt_add_mr(vm, vm->arch_vm.s2ptp, hpa, gpa, info->mem_size_gpa, PAGE_V | PAGE_RW_RW | PAGE_X);
 }
 
@@ -288,14 +350,13 @@ int create_vm(struct acrn_vm *vm)
 	struct kernel_info *kinfo= &vm->sw.kernel_info;
 	struct dtb_info *dinfo= &vm->sw.dtb_info;
 	struct acrn_vm_config *vm_config;
+	uint16_t nr_vcpus = CONFIG_MAX_VCPU;
 	int ret, i;
 
 	vm->hw.created_vcpus = 0U;
-
-	kinfo->mem_start_gpa = kinfo->kernel_addr;
-	kinfo->mem_size_gpa = kinfo->kernel_len;
-	dinfo->dtb_start_gpa = dinfo->dtb_addr;
-	dinfo->dtb_size_gpa = dinfo->dtb_len;
+	if (vm->hw.cpu_affinity != 0UL) {
+		nr_vcpus = (uint16_t)bit_weight(vm->hw.cpu_affinity);
+	}
 
 	vm_config = get_vm_config(vm->vm_id);
 
@@ -322,7 +383,7 @@ int create_vm(struct acrn_vm *vm)
 	if (is_service_vm(vm))
 		vplic_init(vm);
 
-	for (i = 0 ; i < CONFIG_MAX_VCPU; /*vm->max_vcpu*/ i++) {
+	for (i = 0 ; i < nr_vcpus; /*vm->max_vcpu*/ i++) {
 		ret = create_vcpu(vm, i);
 		pr_info("create_vcpu\n");
 	}
@@ -367,6 +428,11 @@ int create_vm(struct acrn_vm *vm)
 
 	/* Create virtual uart;*/
 	init_vuarts(vm, vm_config->vuart);
+#ifdef CONFIG_KTEST
+	if (!is_service_vm(vm)) {
+		ktest_bench_init(vm);
+	}
+#endif
 	vm->state = VM_CREATED;
  
 	return 0;
@@ -374,11 +440,15 @@ int create_vm(struct acrn_vm *vm)
 
 int32_t shutdown_vm(struct acrn_vm *vm)
 {
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
 	/* Only allow shutdown paused vm */
 	vm->state = VM_POWERED_OFF;
 
-	/* TODO: only have one core */
-	offline_vcpu(&vm->hw.vcpu[0]);
+	foreach_vcpu(i, vm, vcpu) {
+		offline_vcpu(vcpu);
+	}
 
 	deinit_vuarts(vm);
 
@@ -388,8 +458,13 @@ int32_t shutdown_vm(struct acrn_vm *vm)
 
 void pause_vm(struct acrn_vm *vm)
 {
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
 	/* For RTVM, we can only pause its vCPUs when it is powering off by itself */
-	zombie_vcpu(&vm->hw.vcpu[0], VCPU_ZOMBIE);
+	foreach_vcpu(i, vm, vcpu) {
+		zombie_vcpu(vcpu, VCPU_ZOMBIE);
+	}
 	vm->state = VM_PAUSED;
 }
 
@@ -400,6 +475,7 @@ int32_t reset_vm(struct acrn_vm *vm)
 	}
 
 	reset_vm_ioreqs(vm);
+	reset_vuarts(vm);
 	vm->state = VM_CREATED;
 
 	return 0;
@@ -418,6 +494,165 @@ void start_sos_vm(void)
 	start_vm(sos_vm);
 }
 
+/**
+ * @brief Create a post-launched VM on request of the Service VM
+ *
+ * The VM id is allocated dynamically and the guest RAM is carved from the VM
+ * memory pool, it starts at POST_VM_RAM_GPA so stage-2 is not an identity
+ * mapping. vCPU n runs on the n-th pCPU set in cv->cpu_affinity. Kernel and
+ * DTB are loaded by load_vm_image() before the VM is started.
+ *
+ * @param cv VM creation parameters from the Service VM
+ * @param mem_size guest RAM size in bytes, POST_VM_DEFAULT_MEM_SIZE if 0
+ * @param rtn_vm the created VM
+ *
+ * @pre cv != NULL && rtn_vm != NULL
+ * @return 0 on success, -EINVAL on bad parameters, -EBUSY if no VM id is
+ *         free, -ENOMEM if the pool has no room for the guest RAM.
+ */
+int32_t create_post_vm(const struct acrn_vm_creation *cv, uint64_t mem_size, struct acrn_vm **rtn_vm)
+{
+	struct acrn_vm *vm;
+	struct acrn_vm_config *vm_config;
+	struct kernel_info *kinfo;
+	struct dtb_info *dinfo;
+	uint64_t valid_pcpus = (1UL << CONFIG_NR_CPUS) - 1UL;
+	uint64_t size, hpa;
+	uint16_t vm_id;
+	int32_t ret = -EINVAL;
+
+	size = (mem_size != 0UL) ? mem_size : POST_VM_DEFAULT_MEM_SIZE;
+	size = (size + VM_MEM_POOL_GRANULE - 1UL) & ~(VM_MEM_POOL_GRANULE - 1UL);
+
+	if ((cv->cpu_affinity != 0UL) && ((cv->cpu_affinity & ~valid_pcpus) == 0UL) &&
+			(bit_weight(cv->cpu_affinity) <= MAX_VCPUS_PER_VM) && (size > POST_VM_DTB_SIZE)) {
+		vm_id = alloc_vm_id();
+		if (vm_id == ACRN_INVALID_VMID) {
+			ret = -EBUSY;
+		} else {
+			hpa = alloc_vm_mem(size);
+			if (hpa == INVALID_HPA) {
+				free_vm_id(vm_id);
+				ret = -ENOMEM;
+			} else {
+				vm_config = get_vm_config(vm_id);
+				(void)memset(vm_config, 0U, sizeof(struct acrn_vm_config));
+				vm_config->load_order = POST_LAUNCHED_VM;
+				vm_config->severity = SEVERITY_STANDARD_VM;
+				(void)strncpy_s(vm_config->name, MAX_VM_OS_NAME_LEN,
+						(const char *)cv->name, MAX_VM_NAME_LEN);
+				vm_config->cpu_affinity = cv->cpu_affinity;
+				vm_config->companion_vm_id = ACRN_INVALID_VMID;
+				vm_config->memory.start_hpa = hpa;
+				vm_config->memory.size = size;
+				vm_config->vuart[0].type = VUART_MMIO;
+				vm_config->vuart[0].addr.base = CONFIG_UART_BASE;
+				vm_config->vuart[0].irq = UART_IRQ;
+
+				vm = get_vm_from_vmid(vm_id);
+				(void)memset(vm, 0U, sizeof(struct acrn_vm));
+				vm->vm_id = vm_id;
+				vm->hw.cpu_affinity = cv->cpu_affinity;
+#ifndef CONFIG_MACRN
+				init_s2pt_mem_ops(&vm->arch_vm.s2pt_mem_ops, vm->vm_id);
+				vm->arch_vm.s2ptp = vm->arch_vm.s2pt_mem_ops.get_pml4_page(vm->arch_vm.s2pt_mem_ops.info);
+#endif
+				kinfo = &vm->sw.kernel_info;
+				kinfo->mem_start_gpa = POST_VM_RAM_GPA;
+				kinfo->mem_size_gpa = size;
+				dinfo = &vm->sw.dtb_info;
+				dinfo->dtb_start_gpa = POST_VM_RAM_GPA + size - POST_VM_DTB_SIZE;
+				dinfo->dtb_size_gpa = POST_VM_DTB_SIZE;
+				/* a1 of the boot vCPU, so it is a GPA here */
+				dinfo->dtb_addr = dinfo->dtb_start_gpa;
+
+				pr_info("VM%hu: RAM gpa 0x%lx hpa 0x%lx size 0x%lx",
+						vm_id, kinfo->mem_start_gpa, hpa, size);
+				ret = create_vm(vm);
+				if (ret == 0) {
+					*rtn_vm = vm;
+				} else {
+					destroy_post_vm(vm);
+				}
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Tear down a VM created by create_post_vm() and release its resources
+ *
+ * @pre vm != NULL && is_postlaunched_vm(vm)
+ */
+void destroy_post_vm(struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+	struct kernel_info *kinfo = &vm->sw.kernel_info;
+
+	(void)shutdown_vm(vm);
+	s2pt_del_mr(vm, vm->arch_vm.s2ptp, kinfo->mem_start_gpa, kinfo->mem_size_gpa);
+	free_vm_mem(vm_config->memory.start_hpa, vm_config->memory.size);
+	(void)memset(vm_config, 0U, sizeof(struct acrn_vm_config));
+	free_vm_id(vm->vm_id);
+}
+
+/**
+ * @brief Copy a kernel or DTB image from the Service VM into a created VM
+ *
+ * The kernel goes to the start of the guest RAM and the DTB to the last
+ * POST_VM_DTB_SIZE bytes of it, the copy is done page by page since the
+ * source is only contiguous in the Service VM's GPA space.
+ *
+ * @pre vm != NULL && src_vm != NULL && img != NULL
+ * @return 0 on success, -EINVAL on a bad image or VM state, -EFAULT if the
+ *         source or destination is not mapped.
+ */
+int32_t load_vm_image(struct acrn_vm *vm, struct acrn_vm *src_vm, const struct acrn_vm_image *img)
+{
+	struct kernel_info *kinfo = &vm->sw.kernel_info;
+	struct dtb_info *dinfo = &vm->sw.dtb_info;
+	uint64_t dst_gpa = 0UL, max_size = 0UL;
+	uint64_t off, len;
+	void *src;
+	int32_t ret = -EINVAL;
+
+	if (img->type == VM_IMAGE_KERNEL) {
+		dst_gpa = kinfo->mem_start_gpa + kinfo->text_offset;
+		max_size = dinfo->dtb_start_gpa - dst_gpa;
+	} else if (img->type == VM_IMAGE_DTB) {
+		dst_gpa = dinfo->dtb_start_gpa;
+		max_size = dinfo->dtb_size_gpa;
+	}
+
+	if (is_created_vm(vm) && (img->size != 0UL) && (img->size <= max_size)) {
+		ret = 0;
+		for (off = 0UL; (off < img->size) && (ret == 0); off += len) {
+			len = PAGE_SIZE - ((img->service_vm_gpa + off) & (PAGE_SIZE - 1UL));
+			len = min(len, img->size - off);
+			src = gpa2hva(src_vm, img->service_vm_gpa + off);
+			if (src == NULL) {
+				ret = -EFAULT;
+			} else if (copy_to_gpa(vm, src, dst_gpa + off, (uint32_t)len) != 0) {
+				ret = -EFAULT;
+			}
+		}
+
+		if (ret == 0) {
+			if (img->type == VM_IMAGE_KERNEL) {
+				kinfo->kernel_len = img->size;
+			} else {
+				dinfo->dtb_len = img->size;
+			}
+			pr_info("VM%hu: loaded %s of 0x%lx bytes to gpa 0x%lx", vm->vm_id,
+					(img->type == VM_IMAGE_KERNEL) ? "kernel" : "dtb", img->size, dst_gpa);
+		}
+	}
+
+	return ret;
+}
+
 void update_vm_vclint_state(struct acrn_vm *vm)
 {
 }
@@ -14,12 +14,17 @@
 #include <asm/guest/vm.h>
 #include <asm/guest/vmexit.h>
 #include <asm/guest/virq.h>
+#include <asm/guest/guest_memory.h>
+#include <asm/guest/s2vm.h>
 #include <acrn_hv_defs.h>
 #include <hypercall.h>
 #include <trace.h>
 #include <logmsg.h>
 #include "sbi.h"
 
+static int32_t hcall_batch(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	uint64_t param1, uint64_t param2);
+
 int32_t hcall_set_irqline(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 	__unused uint64_t param1, uint64_t param2)
 {
@@ -36,14 +41,273 @@ int32_t hcall_set_irqline(__unused struct acrn_vcpu *vcpu, struct acrn_vm *targe
 	return ret;
 }
 
-static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_id)
+/**
+ * @brief create virtual machine
+ *
+ * Create a post-launched VM with a dynamically allocated VM id, its guest
+ * RAM is taken from the hypervisor VM memory pool.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 guest physical address. This gpa points to
+ *              struct acrn_vm_creation, vmid and vcpu_num are filled in
+ *              on return
+ * @param param2 guest RAM size in bytes, 0 for the default size
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_create_vm(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+	uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vm *tgt_vm = NULL;
+	struct acrn_vm_creation cv;
+	int32_t ret = -1;
+
+	if (copy_from_gpa(vm, &cv, param1, sizeof(cv)) == 0) {
+		if (create_post_vm(&cv, param2, &tgt_vm) == 0) {
+			/* return a relative vm_id from Service VM view */
+			cv.vmid = vmid_2_rel_vmid(vm->vm_id, tgt_vm->vm_id);
+			cv.vcpu_num = tgt_vm->hw.created_vcpus;
+		} else {
+			pr_err("HCALL: Create VM failed");
+			cv.vmid = ACRN_INVALID_VMID;
+		}
+
+		ret = copy_to_gpa(vm, &cv, param1, sizeof(cv));
+	}
+
+	return ret;
+}
+
+/**
+ * @brief destroy virtual machine
+ *
+ * Destroy a paused post-launched VM and return its memory to the pool.
+ *
+ * @param target_vm Pointer to target VM data structure
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_destroy_vm(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, __unused uint64_t param2)
+{
+	int32_t ret = -1;
+
+	if (is_paused_vm(target_vm)) {
+		destroy_post_vm(target_vm);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief start virtual machine
+ *
+ * A created VM needs a kernel image or a vCPU context restored by
+ * HC_SET_VCPU_CONTEXT, a paused VM resumes where it stopped.
+ *
+ * @param target_vm Pointer to target VM data structure
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_start_vm(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, __unused uint64_t param2)
+{
+	int32_t ret = -1;
+
+	if ((is_created_vm(target_vm) && ((target_vm->sw.kernel_info.kernel_len != 0UL) ||
+			vcpu_from_vid(target_vm, BSP_CPU_ID)->arch.context_loaded)) ||
+			is_paused_vm(target_vm)) {
+		start_vm(target_vm);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief pause virtual machine
+ *
+ * @param target_vm Pointer to target VM data structure
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_pause_vm(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, __unused uint64_t param2)
+{
+	int32_t ret = -1;
+
+	if (!is_poweroff_vm(target_vm)) {
+		pause_vm(target_vm);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief load a kernel or DTB image into a created virtual machine
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vm_image
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+static int32_t hcall_vm_load_image(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vm_image img;
+	int32_t ret = -1;
+
+	if (copy_from_gpa(vm, &img, param2, sizeof(img)) == 0) {
+		ret = load_vm_image(target_vm, vm, &img);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief get the context of a vCPU of a paused virtual machine
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vcpu_context, vcpu_id is the input
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+static int32_t hcall_get_vcpu_context(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu_context vctx;
+	int32_t ret = -1;
+
+	if (is_paused_vm(target_vm) && (copy_from_gpa(vm, &vctx, param2, sizeof(vctx)) == 0)) {
+		if (vctx.vcpu_id < target_vm->hw.created_vcpus) {
+			get_vcpu_context(vcpu_from_vid(target_vm, vctx.vcpu_id), &vctx);
+			ret = copy_to_gpa(vm, &vctx, param2, sizeof(vctx));
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief set the context of a vCPU of a paused or not yet started virtual machine
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vcpu_context returned by HC_GET_VCPU_CONTEXT
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+static int32_t hcall_set_vcpu_context(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu_context vctx;
+	int32_t ret = -1;
+
+	if ((is_paused_vm(target_vm) || is_created_vm(target_vm)) &&
+			(copy_from_gpa(vm, &vctx, param2, sizeof(vctx)) == 0)) {
+		if (vctx.vcpu_id < target_vm->hw.created_vcpus) {
+			set_vcpu_context(vcpu_from_vid(target_vm, vctx.vcpu_id), &vctx);
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief start or stop logging the guest writes to the RAM of a virtual machine
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 1 to start logging with an empty log, 0 to stop
+ *
+ * Logging can't start while a page of the RAM is write protected.
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+static int32_t hcall_set_dirty_log(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, uint64_t param2)
+{
+	int32_t ret = -1;
+
+	if (!is_poweroff_vm(target_vm)) {
+		ret = s2pt_set_dirty_log(target_vm, param2 != 0UL);
+	}
+
+	return ret;
+}
+
+#define DIRTY_LOG_CHUNK_WORDS	32UL
+
+/**
+ * @brief get and clear the dirty page log of a range of the RAM of a virtual machine
+ *
+ * The pages are write protected again when their bits are returned, a
+ * page written after that is logged again.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_dirty_log
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+static int32_t hcall_get_dirty_log(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+	__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	const struct kernel_info *kinfo = &target_vm->sw.kernel_info;
+	struct acrn_dirty_log dlog;
+	uint64_t log[DIRTY_LOG_CHUNK_WORDS];
+	uint64_t span = ACRN_DIRTY_LOG_WORD_PAGES * PAGE_SIZE;
+	uint64_t words, off, n;
+	int32_t ret = -1;
+
+	if (target_vm->arch_vm.dirty_log && (copy_from_gpa(vm, &dlog, param2, sizeof(dlog)) == 0) &&
+			((dlog.gpa & (span - 1UL)) == 0UL) && ((dlog.size & (span - 1UL)) == 0UL) &&
+			(dlog.gpa >= kinfo->mem_start_gpa) && (dlog.size <= kinfo->mem_size_gpa) &&
+			((dlog.gpa - kinfo->mem_start_gpa) <= (kinfo->mem_size_gpa - dlog.size))) {
+		words = dlog.size / span;
+		ret = 0;
+		for (off = 0UL; (off < words) && (ret == 0); off += n) {
+			n = min(words - off, DIRTY_LOG_CHUNK_WORDS);
+			s2pt_get_dirty_log(target_vm, dlog.gpa + (off * span), log, n);
+			ret = copy_to_gpa(vm, log, dlog.bitmap_gpa + (off * sizeof(uint64_t)),
+				n * sizeof(uint64_t));
+		}
+	}
+
+	return ret;
+}
+
+static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_id,
+	uint64_t param1, uint64_t param2)
 {
 	struct acrn_vm *sos_vm = vcpu->vm;
 	struct acrn_vm *target_vm;
-	/* hypercall param1 from guest*/
-	uint64_t param1 = vcpu_get_gpreg(vcpu, CPU_REG_A0);
-	/* hypercall param2 from guest*/
-	uint64_t param2 = vcpu_get_gpreg(vcpu, CPU_REG_A1);
 	/* hypercall param1 is a relative vm id from SOS view */
 	uint16_t relative_vm_id = (uint16_t)param1;
 	uint16_t vm_id = rel_vmid_2_vmid(sos_vm->vm_id, relative_vm_id);
@@ -51,9 +315,6 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 
 	if (vm_id < CONFIG_MAX_VM_NUM) {
 		target_vm = get_vm_from_vmid(vm_id);
-		if (hypcall_id == HC_CREATE_VM) {
-			target_vm->vm_id = vm_id;
-		}
 	}
 
 	switch (hypcall_id) {
@@ -65,6 +326,10 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 		ret = hcall_set_callback_vector(vcpu, sos_vm, param1, param2);
 		break;
 
+	case HC_BATCH:
+		ret = hcall_batch(vcpu, sos_vm, param1, param2);
+		break;
+
 	case HC_CREATE_VM:
 		ret = hcall_create_vm(vcpu, sos_vm, param1, param2);
 		break;
@@ -101,6 +366,27 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 		ret = 0;
 		break;
 
+	case HC_VM_LOAD_IMAGE:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_vm_load_image(vcpu, target_vm, param1, param2);
+		}
+		break;
+
+	case HC_GET_VCPU_CONTEXT:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_get_vcpu_context(vcpu, target_vm, param1, param2);
+		}
+		break;
+
+	case HC_SET_VCPU_CONTEXT:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_set_vcpu_context(vcpu, target_vm, param1, param2);
+		}
+		break;
+
 	case HC_SET_VCPU_REGS:
 		/* param1: relative vmid to sos, vm_id: absolute vmid */
 		if (is_valid_postlaunched_vmid(vm_id)) {
@@ -143,6 +429,20 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 		ret = hcall_set_vm_memory_regions(vcpu, sos_vm, param1, param2);
 		break;
 
+	case HC_VM_SET_DIRTY_LOG:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_set_dirty_log(vcpu, target_vm, param1, param2);
+		}
+		break;
+
+	case HC_VM_GET_DIRTY_LOG:
+		/* param1: relative vmid to sos, vm_id: absolute vmid */
+		if (is_valid_postlaunched_vmid(vm_id)) {
+			ret = hcall_get_dirty_log(vcpu, target_vm, param1, param2);
+		}
+		break;
+
 	case HC_VM_WRITE_PROTECT_PAGE:
 		/* param1: relative vmid to sos, vm_id: absolute vmid */
 		if (is_valid_postlaunched_vmid(vm_id)) {
@@ -226,6 +526,56 @@ static int32_t dispatch_sos_hypercall(struct acrn_vcpu *vcpu, uint64_t hypcall_i
 	return ret;
 }
 
+/**
+ * @brief Execute a batch of Service VM hypercalls with one exit
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 guest physical address of the struct acrn_hc_batch_entry array,
+ *               the array must not cross a page boundary
+ * @param param2 number of entries in the array
+ *
+ * Entries are executed in order, and the return value of each one is written
+ * back to its result field in place. A failing entry does not stop the batch.
+ * Each entry is copied before it is checked and run, the Service VM may change
+ * the array meanwhile.
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 if the batch was executed, -EINVAL if the array is invalid.
+ */
+static int32_t hcall_batch(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+	uint64_t param1, uint64_t param2)
+{
+	struct acrn_hc_batch_entry entry;
+	uint64_t size = param2 * sizeof(struct acrn_hc_batch_entry);
+	uint64_t i, gpa;
+	int32_t ret = -EINVAL;
+
+	if ((param2 != 0UL) && (param2 <= ACRN_HC_BATCH_MAX_ENTRIES) &&
+			((param1 & PAGE_MASK) == ((param1 + size - 1UL) & PAGE_MASK)) &&
+			(gpa2hva(vcpu->vm, param1) != NULL)) {
+		for (i = 0UL; i < param2; i++) {
+			gpa = param1 + (i * sizeof(struct acrn_hc_batch_entry));
+			if (copy_from_gpa(vcpu->vm, &entry, gpa, sizeof(entry)) != 0) {
+				break;
+			}
+
+			if (entry.hc_id == HC_BATCH) {
+				entry.result = -EINVAL;
+			} else {
+				entry.result = dispatch_sos_hypercall(vcpu, entry.hc_id,
+						entry.param1, entry.param2);
+			}
+			(void)copy_to_gpa(vcpu->vm, &entry.result,
+					gpa + offsetof(struct acrn_hc_batch_entry, result),
+					sizeof(entry.result));
+		}
+		ret = 0;
+	}
+
+	return ret;
+}
+
 #define VMCALL_TYPE_HYPERCALL 0x0A000000
 /*
  * Pass return value to SOS by register rax.
@@ -255,7 +605,8 @@ int32_t vmcall_vmexit_handler(struct acrn_vcpu *vcpu)
 		 ret = -ENODEV;
 	} else if (is_service_vm(vm)) {
 		/* Dispatch the hypercall handler */
-		ret = dispatch_sos_hypercall(vcpu, hypcall_id);
+		ret = dispatch_sos_hypercall(vcpu, hypcall_id,
+				vcpu_get_gpreg(vcpu, CPU_REG_A0), vcpu_get_gpreg(vcpu, CPU_REG_A1));
 	} else {
 		pr_err("hypercall 0x%lx is only allowed from SOS_VM!\n", hypcall_id);
 		vcpu_inject_ud(vcpu);
@@ -28,7 +28,9 @@ static void init_guest_state(struct acrn_vcpu *vcpu)
 {
 	struct guest_cpu_context *ctx = &vcpu->arch.contexts[vcpu->arch.cur_context];
 
-	vcpu_set_gpreg(vcpu, OFFSET_REG_A0, vcpu->vcpu_id);
+	if (!vcpu->arch.context_loaded) {
+		vcpu_set_gpreg(vcpu, OFFSET_REG_A0, vcpu->vcpu_id);
+	}
 	cpu_csr_write(vsstatus, ctx->run_ctx.sstatus);
 	cpu_csr_write(vsepc, ctx->run_ctx.sepc);
 	cpu_csr_write(vsip, ctx->run_ctx.sip);
@@ -95,6 +97,11 @@ static void init_host_state(struct acrn_vcpu *vcpu)
 	/* must set the SPP in order to enter into guest s-mode */
 	value64 = 0x2000C2100;
 	cpu_csr_set(sstatus, value64);
+	if (vcpu->arch.context_loaded) {
+		/* a loaded context only decides between VS-mode and VU-mode */
+		value64 = (value64 & ~SSTATUS_SPP) |
+			(ctx->run_ctx.cpu_gp_regs.regs.status & SSTATUS_SPP);
+	}
 	ctx->run_ctx.cpu_gp_regs.regs.status = value64;
 
 	value64 = 0x444;
@@ -32,12 +32,30 @@
 #include <console.h>
 #include <asm/guest/vuart.h>
 #include <asm/guest/vm.h>
+#include <asm/guest/s2vm.h>
+#include <asm/lib/string.h>
+#include <asm/system.h>
+#include <asm/mem.h>
+#include <asm/sbi.h>
 #include <logmsg.h>
 
 #define init_vuart_lock(vu)	spinlock_init(&((vu)->lock))
 #define obtain_vuart_lock(vu, flags)	spinlock_irqsave_obtain(&((vu)->lock), &(flags))
 #define release_vuart_lock(vu, flags)	spinlock_irqrestore_release(&((vu)->lock), (flags))
 
+/* Short bursts in a row after which THRE is raised per THR write again */
+#define VUART_THR_SHORT_BURSTS	4U
+
+/* Shared ring of the console vUART (vuart[0]), indexed by vm_id */
+static struct vuart_ring vuart_rings[CONFIG_MAX_VM_NUM];
+
+/*
+ * Set by the first vuart_flush_thre(), i.e. once the console timer runs: THR
+ * writes are coalesced and the console rings are drained from then on. There
+ * is no such timer in release builds.
+ */
+static bool vuart_flushed;
+
 static inline void reset_fifo(struct vuart_fifo *fifo)
 {
 	fifo->rindex = 0U;
@@ -92,23 +110,88 @@ static inline bool fifo_isfull(const struct vuart_fifo *fifo)
 	return ret;
 }
 
+/*
+ * The ring header lives in guest RAM: the guest owned indices are read once
+ * and only ever used masked, so a misbehaving guest can corrupt its own
+ * console stream but not make the hypervisor access outside the ring.
+ */
+static inline uint32_t ring_index(const volatile uint32_t *idx)
+{
+	return *idx;
+}
+
+static inline bool ring_rx_enabled(const struct acrn_vuart *vu)
+{
+	return (vu->ring != NULL) && ((ring_index(&vu->ring->hdr.flags) & VUART_RING_F_RX) != 0U);
+}
+
+static inline bool ring_rx_pending(const struct acrn_vuart *vu)
+{
+	return ring_rx_enabled(vu) &&
+		(ring_index(&vu->ring->hdr.rx_prod) != ring_index(&vu->ring->hdr.rx_cons));
+}
+
+static void ring_putchar(struct vuart_ring *ring, char ch)
+{
+	uint32_t prod = ring_index(&ring->hdr.rx_prod);
+	uint32_t cons = ring_index(&ring->hdr.rx_cons);
+
+	/* Drop the character when the guest does not keep up, as a real UART would */
+	if ((prod - cons) < VUART_RING_RX_SIZE) {
+		ring->rx[prod & (VUART_RING_RX_SIZE - 1U)] = ch;
+		wmb();
+		ring->hdr.rx_prod = prod + 1U;
+	}
+}
+
+static char ring_getchar(struct vuart_ring *ring)
+{
+	uint32_t prod = ring_index(&ring->hdr.tx_prod);
+	uint32_t cons = ring_index(&ring->hdr.tx_cons);
+	char c = -1;
+
+	if ((prod - cons) > VUART_RING_TX_SIZE) {
+		/* Bogus producer index, resynchronize */
+		ring->hdr.tx_cons = prod;
+	} else if (prod != cons) {
+		rmb();
+		c = ring->tx[cons & (VUART_RING_TX_SIZE - 1U)];
+		ring->hdr.tx_cons = cons + 1U;
+	}
+	return c;
+}
+
 void vuart_putchar(struct acrn_vuart *vu, char ch)
 {
 	uint64_t rflags;
 
 	obtain_vuart_lock(vu, rflags);
-	fifo_putchar(&vu->rxfifo, ch);
-	vu->lsr |= LSR_DR;
+	if (ring_rx_enabled(vu)) {
+		ring_putchar(vu->ring, ch);
+	} else {
+		fifo_putchar(&vu->rxfifo, ch);
+		vu->lsr |= LSR_DR;
+	}
 	release_vuart_lock(vu, rflags);
 }
 
+/*
+ * Called from the console timer until it returns -1: the legacy TX FIFO is
+ * printed first, then whatever the guest queued on the shared ring.
+ */
 char vuart_getchar(struct acrn_vuart *vu)
 {
 	uint64_t rflags;
-	char c;
+	char c = -1;
 
 	obtain_vuart_lock(vu, rflags);
-	c = fifo_getchar(&vu->txfifo);
+	if (fifo_numchars(&vu->txfifo) > 0U) {
+		c = fifo_getchar(&vu->txfifo);
+	} else if (vu->ring != NULL) {
+		c = ring_getchar(vu->ring);
+	} else {
+		/* nothing to print */
+	}
 	release_vuart_lock(vu, rflags);
 	return c;
 }
@@ -136,7 +219,7 @@ static uint8_t vuart_intr_reason(struct acrn_vuart *vu)
 
 	if (((vu->lsr & LSR_INT_ANY) != 0U) && ((vu->ier & IER_ELSI) != 0U)) {
 		ret = IIR_RLS;
-	} else if (((vu->lsr & LSR_DR) != 0U) && ((vu->ier & IER_ERBFI) != 0U)) {
+	} else if ((((vu->lsr & LSR_DR) != 0U) || ring_rx_pending(vu)) && ((vu->ier & IER_ERBFI) != 0U)) {
 		ret = IIR_RXRDY;
 	} else if (vu->thre_int_pending && ((vu->ier & IER_ETBEI) != 0U)) {
 		ret = IIR_TXRDY;
@@ -165,6 +248,74 @@ void vuart_toggle_intr(struct acrn_vuart *vu)
 	}
 }
 
+/*
+ * A THRE interrupt per THR write makes a guest with the FIFO enabled take an
+ * interrupt for every character although it loads up to a FIFO's worth per
+ * THRE. Report THRE once per VUART_THR_BURST writes instead; a shorter burst
+ * is either the end of the output (ETBEI gets cleared) or is caught by the
+ * next vuart_flush_thre(). Without it, THRE is raised for every write.
+ *
+ * @return true if THRE should be raised for this write
+ */
+static bool thr_burst_done(struct acrn_vuart *vu)
+{
+	bool ret = true;
+
+	if (vuart_flushed && vu->thr_coalesce &&
+			((vu->fcr & FCR_FIFOE) != 0U) && ((vu->ier & IER_ETBEI) != 0U)) {
+		vu->thr_burst++;
+		if (vu->thr_burst < VUART_THR_BURST) {
+			ret = false;
+		} else {
+			vu->thr_burst = 0U;
+			vu->thr_short_bursts = 0U;
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Raise THRE for the bursts left short since the last call
+ *
+ * Called periodically from the console timer, for the vUARTs of all VMs
+ * whether they are attached to the console or connected to another vUART.
+ */
+void vuart_flush_thre(void)
+{
+	struct acrn_vm *vm;
+	struct acrn_vuart *vu;
+	uint64_t rflags;
+	uint16_t vm_id;
+	uint8_t i;
+
+	vuart_flushed = true;
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		for (i = 0U; i < MAX_VUART_NUM_PER_VM; i++) {
+			vu = &vm->vuart[i];
+			obtain_vuart_lock(vu, rflags);
+			if (vu->active && (vu->thr_burst != 0U)) {
+				/*
+				 * Less than a burst was written with ETBEI still on, signal
+				 * THRE now. A guest doing so every time waits for THRE after
+				 * each write: stop coalescing for it.
+				 */
+				vu->thr_burst = 0U;
+				vu->thr_short_bursts++;
+				if (vu->thr_short_bursts >= VUART_THR_SHORT_BURSTS) {
+					vu->thr_coalesce = false;
+				}
+				vu->thre_int_pending = true;
+				vuart_toggle_intr(vu);
+			}
+			release_vuart_lock(vu, rflags);
+		}
+	}
+}
+
 static bool send_to_target(struct acrn_vuart *vu, uint8_t value_u8)
 {
 	uint64_t rflags;
@@ -265,12 +416,17 @@ static void write_reg(struct acrn_vuart *vu, uint16_t reg, uint8_t value_u8)
 			} else {
 				fifo_putchar(&vu->txfifo, (char)value_u8);
 			}
-			vu->thre_int_pending = true;
+			if (thr_burst_done(vu)) {
+				vu->thre_int_pending = true;
+			}
 			break;
 		case UART16550_IER:
 			if (((vu->ier & IER_ETBEI) == 0U) && ((value_u8 & IER_ETBEI) != 0U)) {
 				vu->thre_int_pending = true;
 			}
+			if ((value_u8 & IER_ETBEI) == 0U) {
+				vu->thr_burst = 0U;
+			}
 			/*
 			 * Apply mask so that bits 4-7 are 0
 			 * Also enables bits 0-3 only if they're 1
@@ -344,10 +500,12 @@ static void vuart_write_reg(struct acrn_vuart *vu, uint16_t offset, uint8_t valu
 	if (((vu->mcr & MCR_LOOPBACK) == 0U) && ((vu->lcr & LCR_DLAB) == 0U)
 		&& (offset == UART16550_THR) && (target_vu != NULL)) {
 		if (!send_to_target(target_vu, value_u8)) {
-			/* FIFO is not full, raise THRE interrupt */
+			/* FIFO is not full, raise THRE interrupt at the end of the burst */
 			obtain_vuart_lock(vu, rflags);
-			vu->thre_int_pending = true;
-			vuart_toggle_intr(vu);
+			if (thr_burst_done(vu)) {
+				vu->thre_int_pending = true;
+				vuart_toggle_intr(vu);
+			}
 			release_vuart_lock(vu, rflags);
 		}
 	} else {
@@ -492,11 +650,66 @@ static void setup_vuart(struct acrn_vm *vm, uint16_t vuart_idx)
 	init_fifo(vu);
 	init_vuart_lock(vu);
 	vu->thre_int_pending = true;
+	vu->thr_burst = 0U;
+	vu->thr_short_bursts = 0U;
+	vu->thr_coalesce = true;
+	vu->ring = NULL;
+	vu->ring_gpa = 0UL;
 	vu->ier = 0U;
 	vuart_toggle_intr(vu);
 	vu->target_vu = NULL;
 }
 
+/**
+ * @brief Handle a message on the console vUART ring channel.
+ *
+ * REGISTER backs a page aligned range of the guest's own RAM with the ring
+ * of its console vUART. It can be done once per VM boot, reset_vuarts()
+ * gives the range back to the RAM. Without the console timer to drain the
+ * ring, the guest is told to keep using the 16550 registers.
+ *
+ * @return SBI status to return to the guest
+ */
+int32_t vuart_ring_handler(struct acrn_vcpu *vcpu, uint64_t msg_id)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vuart *vu = &vm->vuart[0];
+	struct vuart_ring *ring = &vuart_rings[vm->vm_id];
+	const struct kernel_info *kinfo = &vm->sw.kernel_info;
+	uint64_t gpa, rflags;
+	int32_t ret = SBI_EINVAL_PARAM;
+
+	if (msg_id == VUART_RING_MSG_REGISTER) {
+		ret = SBI_EINVAL_ADDR;
+		if (!vu->active || !vuart_flushed) {
+			ret = SBI_ENOTSUPP;
+		} else if (vu->ring != NULL) {
+			ret = SBI_EDENIED;
+		} else if (vcpu->mpxy.base != NULL) {
+			gpa = *vcpu->mpxy.base;
+			if (((gpa & PAGE_MASK) == gpa) && (gpa >= kinfo->mem_start_gpa) &&
+					((gpa + VUART_RING_SIZE) <= (kinfo->mem_start_gpa + kinfo->mem_size_gpa))) {
+				(void)memset(ring, 0U, sizeof(*ring));
+				ring->hdr.magic = VUART_RING_MAGIC;
+				ring->hdr.version = VUART_RING_VERSION;
+
+				s2pt_del_mr(vm, vm->arch_vm.s2ptp, gpa, VUART_RING_SIZE);
+				s2pt_add_mr(vm, vm->arch_vm.s2ptp, hva2hpa(ring), gpa, VUART_RING_SIZE,
+						PAGE_V | PAGE_RW_RW);
+
+				obtain_vuart_lock(vu, rflags);
+				vu->ring = ring;
+				vu->ring_gpa = gpa;
+				release_vuart_lock(vu, rflags);
+				pr_info("VM%u: console vuart ring mapped at gpa 0x%lx", vm->vm_id, gpa);
+				ret = SBI_SUCCESS;
+			}
+		}
+	}
+
+	return ret;
+}
+
 void init_vuarts(struct acrn_vm *vm, const struct vuart_config *vu_config)
 {
 	uint8_t i;
@@ -515,6 +728,41 @@ void init_vuarts(struct acrn_vm *vm, const struct vuart_config *vu_config)
 	}
 }
 
+/**
+ * @brief Bring the vUARTs of a VM being reset back to their boot state
+ *
+ * The guest range the console ring was mapped at is backed by the VM RAM
+ * again, so the rebooted guest can register the ring anew.
+ */
+void reset_vuarts(struct acrn_vm *vm)
+{
+	const struct kernel_info *kinfo = &vm->sw.kernel_info;
+	struct acrn_vuart *vu;
+	uint64_t hpa, rflags;
+	uint8_t i;
+
+	for (i = 0U; i < MAX_VUART_NUM_PER_VM; i++) {
+		vu = &vm->vuart[i];
+		if (vu->active) {
+			if (vu->ring != NULL) {
+				hpa = get_vm_config(vm->vm_id)->memory.start_hpa +
+					(vu->ring_gpa - kinfo->mem_start_gpa);
+				s2pt_del_mr(vm, vm->arch_vm.s2ptp, vu->ring_gpa, VUART_RING_SIZE);
+				s2pt_add_mr(vm, vm->arch_vm.s2ptp, hpa, vu->ring_gpa, VUART_RING_SIZE,
+						PAGE_V | PAGE_RW_RW | PAGE_X);
+			}
+
+			obtain_vuart_lock(vu, rflags);
+			vu->ring = NULL;
+			vu->ring_gpa = 0UL;
+			vu->thr_burst = 0U;
+			vu->thr_short_bursts = 0U;
+			vu->thr_coalesce = true;
+			release_vuart_lock(vu, rflags);
+		}
+	}
+}
+
 void deinit_vuarts(struct acrn_vm *vm)
 {
 	uint8_t i;
@@ -522,5 +770,6 @@ void deinit_vuarts(struct acrn_vm *vm)
 	for (i = 0U; i < MAX_VUART_NUM_PER_VM; i++) {
 		if (vm->vuart[i].active)
 			vm->vuart[i].active = false;
+		vm->vuart[i].ring = NULL;
 	}
 }
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2026 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <ticks.h>
+#include <sprintf.h>
+#include <asm/board.h>
+#include <asm/sbi.h>
+#include <asm/guest/vm.h>
+#include <asm/guest/s2vm.h>
+#include <asm/mem.h>
+#include <io_req.h>
+#include <uart16550.h>
+#include "bench.h"
+
+/*
+ * Exit and IPI round-trip microbenchmarks.
+ *
+ * ktest_bench() runs in the ktest guest before it drops to U mode, times
+ * each operation with cpu_ticks() and prints one CSV row per benchmark on
+ * the guest's emulated UART:
+ *
+ *   # ktest-bench v1 tickrate_khz=<khz> iterations=<n>
+ *   name,iterations,min_ticks,avg_ticks,max_ticks,avg_ns,errors
+ */
+
+#define SIP_SSIP	(1UL << 1U)
+
+struct bench_stat {
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+	uint32_t iters;
+	uint32_t errors;
+};
+
+struct bench_case {
+	const char *name;
+	/* one measured operation, returns false if it did not complete */
+	bool (*run)(void);
+	void (*cleanup)(void);
+};
+
+/*
+ * RAM page of the ktest guest that stage-2 maps read-only: each store to it
+ * takes a stage-2 store fault, emulated by the null handler. The ktest guest
+ * runs the hypervisor image with RAM identity mapped and no guest paging, so
+ * the guest reaches the page at its hypervisor address.
+ */
+static uint8_t bench_s2_page[PAGE_SIZE] __aligned(PAGE_SIZE);
+
+static int32_t bench_null_access_handler(struct io_request *io_req, __unused void *private_data)
+{
+	struct acrn_mmio_request *mmio = &io_req->reqs.mmio_request;
+
+	if (mmio->direction == ACRN_IOREQ_DIR_READ) {
+		mmio->value = 0UL;
+	}
+
+	return 0;
+}
+
+void ktest_bench_init(struct acrn_vm *vm)
+{
+	uint64_t gpa = hva2hpa(bench_s2_page);
+
+	register_mmio_emulation_handler(vm, bench_null_access_handler, KTEST_BENCH_MMIO_BASE,
+			KTEST_BENCH_MMIO_BASE + KTEST_BENCH_MMIO_SIZE, NULL, false);
+
+	s2pt_modify_mr(vm, vm->arch_vm.s2ptp, gpa, PAGE_SIZE, 0UL, PAGE_W);
+	register_mmio_emulation_handler(vm, bench_null_access_handler, gpa,
+			gpa + PAGE_SIZE, NULL, false);
+}
+
+static sbi_ret bench_ecall(uint64_t arg0, uint64_t func, uint64_t ext)
+{
+	sbi_ret ret;
+
+	register uint64_t a0 asm ("a0") = arg0;
+	register uint64_t a1 asm ("a1") = 0UL;
+	register uint64_t a6 asm ("a6") = func;
+	register uint64_t a7 asm ("a7") = ext;
+
+	asm volatile (
+		"ecall \n\t"
+		:"+r" (a0), "+r" (a1)
+		:"r" (a6), "r" (a7)
+		: "memory"
+	);
+
+	ret.error = a0;
+	ret.value = a1;
+
+	return ret;
+}
+
+static inline uint8_t bench_mmio_read8(uint64_t addr)
+{
+	return *(volatile uint8_t *)addr;
+}
+
+static inline void bench_mmio_write8(uint64_t addr, uint8_t val)
+{
+	*(volatile uint8_t *)addr = val;
+}
+
+static bool bench_sbi_ecall(void)
+{
+	return bench_ecall(0UL, SBI_TYPE_BASE_GET_SPEC_VERSION, SBI_ID_BASE).error == SBI_SUCCESS;
+}
+
+static bool bench_mmio_load(void)
+{
+	(void)bench_mmio_read8(CONFIG_UART_BASE + UART16550_LSR);
+	return true;
+}
+
+static bool bench_mmio_store(void)
+{
+	bench_mmio_write8(CONFIG_UART_BASE + UART16550_SCR, 0x5aU);
+	return true;
+}
+
+/* same trap and MMIO dispatch as mmio_load, without any device emulation */
+static bool bench_mmio_null_load(void)
+{
+	(void)bench_mmio_read8(KTEST_BENCH_MMIO_BASE);
+	return true;
+}
+
+/* stage-2 store fault on a mapped RAM page, emulated as a write to nothing */
+static bool bench_s2pt_store_fault(void)
+{
+	*(volatile uint64_t *)bench_s2_page = 0UL;
+	return true;
+}
+
+/* self vIPI: from the SBI send until the guest sees SSIP pending */
+static bool bench_vipi(void)
+{
+	uint64_t hartid, sip;
+	uint32_t spin = 0U;
+
+	asm volatile ("csrr %0, sscratch" : "=r"(hartid));
+	(void)bench_ecall(1UL << hartid, SBI_TYPE_IPI_SEND_IPI, SBI_ID_IPI);
+	do {
+		asm volatile ("csrr %0, sip" : "=r"(sip));
+		spin++;
+	} while (((sip & SIP_SSIP) == 0UL) && (spin < KTEST_BENCH_SPIN_LIMIT));
+	asm volatile ("csrc sip, %0" :: "r"(SIP_SSIP));
+
+	return (sip & SIP_SSIP) != 0UL;
+}
+
+static bool bench_timer_program(void)
+{
+	uint64_t deadline = cpu_ticks() + ((uint64_t)cpu_tickrate() * 1000UL);
+
+	return bench_ecall(deadline, SBI_TYPE_TIME_SET_TIMER, SBI_ID_TIMER).error == SBI_SUCCESS;
+}
+
+static void bench_timer_cleanup(void)
+{
+	(void)bench_ecall(~0UL, SBI_TYPE_TIME_SET_TIMER, SBI_ID_TIMER);
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "sbi_ecall",		bench_sbi_ecall,	NULL },
+	{ "mmio_load",		bench_mmio_load,	NULL },
+	{ "mmio_store",		bench_mmio_store,	NULL },
+	{ "mmio_null_load",	bench_mmio_null_load,	NULL },
+	{ "s2pt_store_fault",	bench_s2pt_store_fault,	NULL },
+	{ "vipi",		bench_vipi,		NULL },
+	{ "timer_program",	bench_timer_program,	bench_timer_cleanup },
+};
+
+static void bench_puts(const char *s)
+{
+	while (*s != '\0') {
+		while ((bench_mmio_read8(CONFIG_UART_BASE + UART16550_LSR) & LSR_THRE) == 0U) {
+		}
+		bench_mmio_write8(CONFIG_UART_BASE + UART16550_THR, (uint8_t)*s);
+		s++;
+	}
+}
+
+static void bench_run_case(const struct bench_case *bc, struct bench_stat *st)
+{
+	uint64_t start, delta;
+	uint32_t i;
+
+	st->min = ~0UL;
+	st->max = 0UL;
+	st->total = 0UL;
+	st->iters = 0U;
+	st->errors = 0U;
+
+	for (i = 0U; i < KTEST_BENCH_WARMUP; i++) {
+		(void)bc->run();
+	}
+
+	for (i = 0U; i < KTEST_BENCH_ITERATIONS; i++) {
+		start = cpu_ticks();
+		if (bc->run()) {
+			delta = cpu_ticks() - start;
+			st->total += delta;
+			st->iters++;
+			if (delta < st->min) {
+				st->min = delta;
+			}
+			if (delta > st->max) {
+				st->max = delta;
+			}
+		} else {
+			st->errors++;
+		}
+	}
+
+	if (bc->cleanup != NULL) {
+		bc->cleanup();
+	}
+
+	if (st->iters == 0U) {
+		st->min = 0UL;
+	}
+}
+
+void ktest_bench(void)
+{
+	struct bench_stat st;
+	char line[128];
+	uint64_t avg, avg_ns, khz = cpu_tickrate();
+	uint32_t i;
+
+	snprintf(line, sizeof(line), "# ktest-bench v1 tickrate_khz=%lu iterations=%u\r\n",
+			khz, KTEST_BENCH_ITERATIONS);
+	bench_puts(line);
+	bench_puts("name,iterations,min_ticks,avg_ticks,max_ticks,avg_ns,errors\r\n");
+
+	for (i = 0U; i < ARRAY_SIZE(bench_cases); i++) {
+		bench_run_case(&bench_cases[i], &st);
+		avg = (st.iters != 0U) ? (st.total / st.iters) : 0UL;
+		avg_ns = (khz != 0UL) ? ((st.total * 1000000UL) / khz / ((st.iters != 0U) ? st.iters : 1U)) : 0UL;
+		snprintf(line, sizeof(line), "%s,%u,%lu,%lu,%lu,%lu,%u\r\n", bench_cases[i].name,
+				st.iters, st.min, avg, st.max, avg_ns, st.errors);
+		bench_puts(line);
+	}
+	bench_puts("# ktest-bench end\r\n");
+}
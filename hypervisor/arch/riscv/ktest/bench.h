@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2026 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __RISCV_KTEST_BENCH_H__
+#define __RISCV_KTEST_BENCH_H__
+
+/*
+ * GPA of the null device used by the mmio_null_load benchmark. It lies
+ * above any RAM of the ktest VM, so it is never mapped in stage-2 and
+ * every access takes the MMIO dispatch path to a handler doing nothing.
+ */
+#define KTEST_BENCH_MMIO_BASE	0x100000000UL
+#define KTEST_BENCH_MMIO_SIZE	0x1000UL
+
+#define KTEST_BENCH_ITERATIONS	1000U
+#define KTEST_BENCH_WARMUP	16U
+/* Upper bound of polls for an injected interrupt before giving up */
+#define KTEST_BENCH_SPIN_LIMIT	1000000U
+
+struct acrn_vm;
+
+/* hypervisor side, sets up the devices the benchmarks exercise */
+void ktest_bench_init(struct acrn_vm *vm);
+/* guest side, runs on the BSP of the ktest guest in VS mode */
+void ktest_bench(void);
+
+#endif /* __RISCV_KTEST_BENCH_H__ */
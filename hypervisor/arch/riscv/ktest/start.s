@@ -34,6 +34,7 @@ _vkernel:
 #	call early_printk
 	lw a0, g_vcpus
 	call smp_start_cpus
+	call ktest_bench
 	li a0, 0x100
 	csrc sstatus, a0
 	la a0, guest
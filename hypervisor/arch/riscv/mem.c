@@ -115,6 +115,11 @@ static void map_mem(void)
 	mmu_add((uint64_t *)acrn_vpn3, BOARD_HV_RAM_START, BOARD_HV_RAM_START, BOARD_HV_RAM_SIZE,
 		PAGE_V | PAGE_ATTR_PMA | PAGE_U,
 		&ppt_mem_ops);
+
+	/* guest RAM pool, accessed by the hypervisor when loading guest images */
+	mmu_add((uint64_t *)acrn_vpn3, CONFIG_VM_MEM_POOL_START, CONFIG_VM_MEM_POOL_START,
+		CONFIG_VM_MEM_POOL_SIZE, PAGE_V | PAGE_ATTR_PMA,
+		&ppt_mem_ops);
 }
 
 static void clear_table(void *table)
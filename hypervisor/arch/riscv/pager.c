@@ -13,6 +13,9 @@
 #include <asm/pgtable.h>
 #include <asm/page.h>
 #include <asm/vm_config.h>
+#include <asm/tlb.h>
+#include <asm/smp.h>
+#include <asm/cpumask.h>
 
 #define VPN3_PAGE_NUM(size)	1UL
 #define VPN2_PAGE_NUM(size)	(((size) + VPN3_SIZE - 1UL) >> VPN3_SHIFT)
@@ -26,6 +29,7 @@ static struct page vm_vpn1_pages[CONFIG_MAX_VM_NUM][VPN1_PAGE_NUM(CONFIG_GUEST_A
 static struct page vm_vpn0_pages[CONFIG_MAX_VM_NUM][VPN0_PAGE_NUM(CONFIG_GUEST_ADDRESS_SPACE_SIZE)] __aligned(PAGE_SIZE);
 
 static union pgtable_pages_info s2pt_pages_info[CONFIG_MAX_VM_NUM];
+static struct pgtable_stats s2pt_stats[CONFIG_MAX_VM_NUM];
 #endif
 
 static inline bool large_page_support(enum _page_table_level level)
@@ -85,6 +89,29 @@ uint64_t *satp_to_vpn3_page(uint64_t satp)
 	return (uint64_t *)((satp & SATP_PPN_MASK) << 12);
 }
 
+/*
+ * Ranges above PGTABLE_FLUSH_MAX_PAGES pages are flushed as a whole
+ * address space instead of page by page.
+ */
+#define PGTABLE_FLUSH_MAX_PAGES	64UL
+
+static void ppt_flush_tlb_range(__unused const union pgtable_pages_info *info, uint64_t va, uint64_t size)
+{
+	uint64_t addr;
+
+	if ((size >> PTE_SHIFT) > PGTABLE_FLUSH_MAX_PAGES) {
+		flush_tlb_asid(0UL);
+	} else {
+		for (addr = va; addr < (va + size); addr += PTE_SIZE) {
+			flush_tlb_addr(addr);
+		}
+	}
+
+	if (smp_ops != NULL) {
+		smp_ops->rfence(cpu_online_map, va, size);
+	}
+}
+
 static inline void nop_tweak_exe_right(uint64_t *entry __attribute__((unused))) {}
 static inline void nop_recover_exe_right(uint64_t *entry __attribute__((unused))) {}
 
@@ -122,6 +149,8 @@ const struct memory_ops ppt_mem_ops = {
 	.clflush_pagewalk = ppt_clflush_pagewalk,
 	.tweak_exe_right = nop_tweak_exe_right,
 	.recover_exe_right = nop_recover_exe_right,
+	.flush_tlb_range = ppt_flush_tlb_range,
+	.stats = NULL,
 };
 
 #ifndef CONFIG_MACRN
@@ -168,6 +197,28 @@ static inline uint64_t s2pt_pgentry_present(uint64_t pte)
 	return pte & PAGE_V;
 }
 
+/*
+ * Only the VMID of this VM is flushed, the stage-2 translations of the
+ * other VMs stay cached.
+ */
+static void s2pt_flush_tlb_range(const union pgtable_pages_info *info, uint64_t gpa, uint64_t size)
+{
+	uint64_t vmid = info->s2pt.vmid;
+	uint64_t addr;
+
+	if ((size >> PTE_SHIFT) > PGTABLE_FLUSH_MAX_PAGES) {
+		flush_guest_tlb_vmid(vmid);
+	} else {
+		for (addr = gpa; addr < (gpa + size); addr += PTE_SIZE) {
+			flush_guest_tlb_gpa(addr, vmid);
+		}
+	}
+
+	if (smp_ops != NULL) {
+		smp_ops->hfence(cpu_online_map, gpa, size);
+	}
+}
+
 void init_s2pt_mem_ops(struct memory_ops *mem_ops, uint16_t vm_id)
 {
 	s2pt_pages_info[vm_id].s2pt.top_address_space = CONFIG_GUEST_ADDRESS_SPACE_SIZE;
@@ -175,6 +226,8 @@ void init_s2pt_mem_ops(struct memory_ops *mem_ops, uint16_t vm_id)
 	s2pt_pages_info[vm_id].s2pt.vpn2_base = vm_vpn2_pages[vm_id];
 	s2pt_pages_info[vm_id].s2pt.vpn1_base = vm_vpn1_pages[vm_id];
 	s2pt_pages_info[vm_id].s2pt.vpn0_base = vm_vpn0_pages[vm_id];
+	s2pt_pages_info[vm_id].s2pt.vmid = vm_id;
+	(void)memset(&s2pt_stats[vm_id], 0U, sizeof(struct pgtable_stats));
 
 	mem_ops->info = &s2pt_pages_info[vm_id];
 	mem_ops->get_default_access_right = s2pt_get_default_access_right;
@@ -187,5 +240,7 @@ void init_s2pt_mem_ops(struct memory_ops *mem_ops, uint16_t vm_id)
 	mem_ops->large_page_support = large_page_support;
 	mem_ops->tweak_exe_right = nop_tweak_exe_right;
 	mem_ops->recover_exe_right = nop_recover_exe_right;
+	mem_ops->flush_tlb_range = s2pt_flush_tlb_range;
+	mem_ops->stats = &s2pt_stats[vm_id];
 }
 #endif
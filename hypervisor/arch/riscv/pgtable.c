@@ -47,9 +47,28 @@ static inline void construct_pte(uint64_t *ptep, uint64_t paddr, uint64_t prot,
 	//pr_dbg("non level-3 pte: %lx", paddr | (prot & ~PAGE_TABLE));
 }
 
+static inline void stat_leaves(const struct memory_ops *mem_ops, enum pgtable_leaf_size sz, uint64_t add, uint64_t sub)
+{
+	if (mem_ops->stats != NULL) {
+		mem_ops->stats->leaves[sz] += add;
+		mem_ops->stats->leaves[sz] -= sub;
+	}
+}
+
+static inline void flush_tlb_range(const struct memory_ops *mem_ops, uint64_t vaddr, uint64_t size)
+{
+	if (mem_ops->flush_tlb_range != NULL) {
+		mem_ops->flush_tlb_range(mem_ops->info, vaddr, size);
+	}
+}
+
 /*
  * Split a large page table into next level page table.
  *
+ * The new table maps the same range with the same attributes as the
+ * large leaf, one level down: a 1G leaf becomes 512 2M leaves and a 2M
+ * leaf becomes 512 4K leaves.
+ *
  * @pre: level could only VPN2 or VPN1
  */
 static void split_large_page(uint64_t *pte, enum _page_table_level level,
@@ -58,18 +77,21 @@ static void split_large_page(uint64_t *pte, enum _page_table_level level,
 	uint64_t *pbase;
 	uint64_t ref_paddr, paddr, paddrinc;
 	uint64_t i, ref_prot;
+	enum pgtable_leaf_size sz;
 
+	ref_paddr = pgentry_paddr(*pte);
+	ref_prot = (*pte) & ~PTE_PPN_MASK;
 	switch (level) {
 	case VPN2:
-		ref_paddr = (*pte) & VPN2_PFN_MASK;
 		paddrinc = VPN1_SIZE;
-		ref_prot = (*pte) & ~VPN2_PFN_MASK;
+		vaddr &= VPN2_MASK;
+		sz = PGT_LEAF_1G;
 		pbase = (uint64_t *)mem_ops->get_pd_page(mem_ops->info, vaddr);
 		break;
 	default:	/* VPN1 */
-		ref_paddr = (*pte) & VPN1_PFN_MASK;
 		paddrinc = PTE_SIZE;
-		ref_prot = (*pte) & ~VPN1_PFN_MASK;
+		vaddr &= VPN1_MASK;
+		sz = PGT_LEAF_2M;
 		mem_ops->recover_exe_right(&ref_prot);
 		pbase = (uint64_t *)mem_ops->get_pt_page(mem_ops->info, vaddr);
 		break;
@@ -79,21 +101,27 @@ static void split_large_page(uint64_t *pte, enum _page_table_level level,
 
 	paddr = ref_paddr;
 	for (i = 0UL; i < PTRS_PER_PTE; i++) {
-		if (level == VPN1) {
-			construct_pgentry(pbase + i, (void *)paddr, ref_prot, mem_ops);
-		} else {
-			construct_pte(pbase + i, paddr, ref_prot, mem_ops);
-		}
+		set_pgentry(pbase + i, ((paddr >> PTE_SHIFT) << PTE_PPN_SHIFT) | ref_prot, mem_ops);
 		paddr += paddrinc;
 	}
 
-	ref_prot = mem_ops->get_default_access_right();
-	construct_pgentry(pte, (void *)pbase, ref_prot, mem_ops);
+	construct_pgentry(pte, (void *)pbase, mem_ops->get_default_access_right(), mem_ops);
 
-	/* TODO: flush the TLB */
+	stat_leaves(mem_ops, sz, 0UL, 1UL);
+	stat_leaves(mem_ops, sz - 1, PTRS_PER_PTE, 0UL);
+	if (mem_ops->stats != NULL) {
+		mem_ops->stats->splits++;
+	}
+
+	/*
+	 * The translations are unchanged, only the cached large leaf must go
+	 * before a caller modifies part of the range. Any address inside the
+	 * large page hits that TLB entry, so flushing the first page does.
+	 */
+	flush_tlb_range(mem_ops, vaddr, PTE_SIZE);
 }
 
-static inline void local_modify_or_del_pte(uint64_t *pte,
+static inline void local_modify_or_del_pte(uint64_t *pte, enum pgtable_leaf_size sz,
 		uint64_t prot_set, uint64_t prot_clr, uint32_t type, const struct memory_ops *mem_ops)
 {
 	uint64_t new_pte = *pte;
@@ -103,6 +131,7 @@ static inline void local_modify_or_del_pte(uint64_t *pte,
 		set_pgentry(pte, new_pte, mem_ops);
 	} else if (type == MR_DEL) {
 		set_pgentry(pte, 0, mem_ops);
+		stat_leaves(mem_ops, sz, 0UL, 1UL);
 	} else {
 		pr_warn("not support such modify type: %d, DO NOTHING!!", type);
 	}
@@ -131,7 +160,7 @@ static void modify_or_del_pte(const uint64_t *vpn1, uint64_t vaddr_start, uint64
 				pr_dbg("%s, vaddr: 0x%lx pte is not present.", __func__, vaddr);
 			}
 		} else {
-			local_modify_or_del_pte(pte, prot_set, prot_clr, type, mem_ops);
+			local_modify_or_del_pte(pte, PGT_LEAF_4K, prot_set, prot_clr, type, mem_ops);
 		}
 
 		vaddr += PTE_SIZE;
@@ -169,7 +198,7 @@ static void modify_or_del_vpn1(const uint64_t *vpn2, uint64_t vaddr_start, uint6
 				if ((vaddr_next > vaddr_end) || (!mem_aligned_check(vaddr, VPN1_SIZE))) {
 					split_large_page(vpn1, VPN1, vaddr, mem_ops);
 				} else {
-					local_modify_or_del_pte(vpn1, prot_set, prot_clr, type, mem_ops);
+					local_modify_or_del_pte(vpn1, PGT_LEAF_2M, prot_set, prot_clr, type, mem_ops);
 					if (vaddr_next < vaddr_end) {
 						vaddr = vaddr_next;
 						continue;
@@ -213,9 +242,9 @@ static void modify_or_del_vpn2(const uint64_t *vpn3, uint64_t vaddr_start, uint6
 			if (vpn_large(*vpn2) != 0UL) {
 				if ((vaddr_next > vaddr_end) ||
 						(!mem_aligned_check(vaddr, VPN2_SIZE))) {
-					split_large_page(vpn2, VPN3, vaddr, mem_ops);
+					split_large_page(vpn2, VPN2, vaddr, mem_ops);
 				} else {
-					local_modify_or_del_pte(vpn2, prot_set, prot_clr, type, mem_ops);
+					local_modify_or_del_pte(vpn2, PGT_LEAF_1G, prot_set, prot_clr, type, mem_ops);
 					if (vaddr_next < vaddr_end) {
 						vaddr = vaddr_next;
 						continue;
@@ -289,6 +318,7 @@ static void add_pte(const uint64_t *vpn1, uint64_t paddr_start, uint64_t vaddr_s
 			pr_dbg("%s, pte 0x%lx is already present!", __func__, vaddr);
 		} else {
 			construct_pte(pte, paddr, prot, mem_ops);
+			stat_leaves(mem_ops, PGT_LEAF_4K, 1UL, 0UL);
 		}
 		paddr += PTE_SIZE;
 		vaddr += PTE_SIZE;
@@ -327,6 +357,7 @@ static void add_vpn1(const uint64_t *vpn2, uint64_t paddr_start, uint64_t vaddr_
 					(vaddr_next <= vaddr_end)) {
 					mem_ops->tweak_exe_right(&prot);
 					construct_pte(vpn1, paddr, prot, mem_ops);
+					stat_leaves(mem_ops, PGT_LEAF_2M, 1UL, 0UL);
 					if (vaddr_next < vaddr_end) {
 						paddr += (vaddr_next - vaddr);
 						vaddr = vaddr_next;
@@ -375,6 +406,7 @@ static void add_vpn2(const uint64_t *vpn3, uint64_t paddr_start, uint64_t vaddr_
 					(vaddr_next <= vaddr_end)) {
 					mem_ops->tweak_exe_right(&prot);
 					construct_pte(vpn2, paddr, prot, mem_ops);
+					stat_leaves(mem_ops, PGT_LEAF_1G, 1UL, 0UL);
 					if (vaddr_next < vaddr_end) {
 						paddr += (vaddr_next - vaddr);
 						vaddr = vaddr_next;
@@ -477,3 +509,94 @@ const uint64_t *lookup_address(uint64_t *vpn3_page, uint64_t addr, uint64_t *pg_
 
 	return pret;
 }
+
+/*
+ * Replace the table pointed by entry with one large leaf if its 512
+ * entries are leaves with the same attributes mapping one physically
+ * contiguous, naturally aligned range.
+ *
+ * @pre: level could only VPN2 or VPN1, entry points to a next level table
+ */
+static bool collapse_table(uint64_t *entry, enum _page_table_level level,
+		uint64_t vaddr, const struct memory_ops *mem_ops)
+{
+	const uint64_t *table = vpn_to_vaddr(entry);
+	uint64_t child_size = (level == VPN2) ? VPN1_SIZE : PTE_SIZE;
+	enum pgtable_leaf_size sz = (level == VPN2) ? PGT_LEAF_1G : PGT_LEAF_2M;
+	uint64_t attr_mask = ~(PTE_PPN_MASK | PAGE_A | PAGE_D);
+	uint64_t base, attr, ad, i;
+	bool uniform;
+
+	base = pgentry_paddr(table[0]);
+	attr = table[0] & attr_mask;
+	ad = table[0] & (PAGE_A | PAGE_D);
+	uniform = (vpn_large(table[0]) != 0UL) && mem_aligned_check(base, child_size * PTRS_PER_PTE);
+	for (i = 1UL; uniform && (i < PTRS_PER_PTE); i++) {
+		uniform = (vpn_large(table[i]) != 0UL) && ((table[i] & attr_mask) == attr) &&
+			(pgentry_paddr(table[i]) == (base + (i * child_size)));
+		ad |= table[i] & (PAGE_A | PAGE_D);
+	}
+
+	if (uniform) {
+		set_pgentry(entry, ((base >> PTE_SHIFT) << PTE_PPN_SHIFT) | attr | ad, mem_ops);
+		stat_leaves(mem_ops, sz - 1, 0UL, PTRS_PER_PTE);
+		stat_leaves(mem_ops, sz, 1UL, 0UL);
+		if (mem_ops->stats != NULL) {
+			mem_ops->stats->promotions++;
+		}
+		/* every small page of the range may be cached */
+		flush_tlb_range(mem_ops, vaddr, child_size * PTRS_PER_PTE);
+	}
+
+	return uniform;
+}
+
+/*
+ * Promote the page tables covering [vaddr_base, vaddr_base + size) to 2M
+ * and 1G leaves wherever a whole table maps a contiguous range with one
+ * set of attributes, e.g. after a split region got its original rights
+ * back or was mapped piecewise. The enclosing 1G regions are scanned.
+ *
+ * Return the number of promoted tables.
+ */
+uint64_t mmu_collapse(uint64_t *vpn3_page, uint64_t vaddr_base, uint64_t size,
+		const struct memory_ops *mem_ops)
+{
+	uint64_t vaddr = vaddr_base & VPN1_MASK;
+	uint64_t vaddr_end = vaddr_base + size;
+	uint64_t promoted = 0UL;
+	uint64_t *vpn3, *vpn2, *vpn1;
+	bool all_leaves;
+
+	while (vaddr < vaddr_end) {
+		uint64_t region = vaddr & VPN2_MASK;
+		uint64_t region_end = region + VPN2_SIZE;
+
+		vpn3 = vpn3_offset(vpn3_page, vaddr);
+		if (mem_ops->pgentry_present(*vpn3) != 0UL) {
+			vpn2 = vpn2_offset(vpn3, vaddr);
+			if ((mem_ops->pgentry_present(*vpn2) != 0UL) && (vpn_large(*vpn2) == 0UL)) {
+				for (; (vaddr < region_end) && (vaddr < vaddr_end); vaddr += VPN1_SIZE) {
+					vpn1 = vpn1_offset(vpn2, vaddr);
+					if (mem_ops->large_page_support(VPN1) &&
+							(mem_ops->pgentry_present(*vpn1) != 0UL) &&
+							(vpn_large(*vpn1) == 0UL) &&
+							collapse_table(vpn1, VPN1, vaddr, mem_ops)) {
+						promoted++;
+					}
+				}
+
+				all_leaves = mem_ops->large_page_support(VPN2);
+				for (vpn1 = vpn_to_vaddr(vpn2); all_leaves && (vpn1 < (vpn_to_vaddr(vpn2) + PTRS_PER_VPN1)); vpn1++) {
+					all_leaves = (vpn_large(*vpn1) != 0UL);
+				}
+				if (all_leaves && collapse_table(vpn2, VPN2, region, mem_ops)) {
+					promoted++;
+				}
+			}
+		}
+		vaddr = region_end;
+	}
+
+	return promoted;
+}
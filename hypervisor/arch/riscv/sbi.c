@@ -86,7 +86,7 @@ static void send_rfence_mask(uint64_t dest_mask, uint64_t addr, uint64_t size)
 {
 	sbi_ret ret;
 
-	ret = sbi_ecall(dest_mask, 0, 0, 0, 0, 0, SBI_TYPE_RFENCE_SFNECE_VMA, SBI_ID_RFENCE);
+	ret = sbi_ecall(dest_mask, 0, addr, size, 0, 0, SBI_TYPE_RFENCE_SFNECE_VMA, SBI_ID_RFENCE);
 	if (ret.error != SBI_SUCCESS)
 		pr_err("%s: %lx", __func__, ret.error);
 
@@ -97,7 +97,7 @@ static void send_hfence_mask(uint64_t dest_mask, uint64_t addr, uint64_t size)
 {
 	sbi_ret ret;
 
-	ret = sbi_ecall(dest_mask, 0, 0, 0, 0, 0, SBI_TYPE_RFENCE_HFNECE_GVMA, SBI_ID_RFENCE);
+	ret = sbi_ecall(dest_mask, 0, addr, size, 0, 0, SBI_TYPE_RFENCE_HFNECE_GVMA, SBI_ID_RFENCE);
 	if (ret.error != SBI_SUCCESS)
 		pr_err("%s: %lx", __func__, ret.error);
 
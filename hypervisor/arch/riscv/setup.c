@@ -21,6 +21,7 @@
 #include <asm/notify.h>
 #include <asm/guest/vm.h>
 #include <asm/guest/s2vm.h>
+#include <asm/guest/mempool.h>
 #include <debug/console.h>
 #include <debug/logmsg.h>
 #include <debug/shell.h>
@@ -67,6 +68,7 @@ void start_acrn(uint32_t cpu, unsigned long boot_phys_offset,
 	setup_virt_paging();
 	init_sched(cpu);
 
+	init_vm_mem_pool();
 	pr_info("prepare sos");
 	prepare_sos_vm();
 	pr_info("create vm");
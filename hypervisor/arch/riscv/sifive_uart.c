@@ -6,9 +6,13 @@
 
 #include <acrn/config.h>
 #include <types.h>
+#include <asm/lib/spinlock.h>
 
 #define UART_BASE (volatile unsigned char *)0x10010000
 
+/* serializes the writers of uart16550_puts() */
+static spinlock_t uart_tx_lock;
+
 #define UART_REG_TXFIFO		0
 #define UART_REG_RXFIFO		1
 #define UART_REG_TXCTRL		2
@@ -116,14 +120,19 @@ char uart16550_getc(void)
 size_t uart16550_puts(const char *buf, uint32_t len)
 {
 	int i = 0;
+	uint64_t rflags;
+
 	if (buf == 0)
 		return 0;
 
+	/* keep the strings of concurrent writers whole */
+	spinlock_irqsave_obtain(&uart_tx_lock, &rflags);
 	for (i = 0U; i < len; i++) {
 		if (buf[i] == '\n')
 			put_char('\r');
 		put_char(buf[i]);
 	}
+	spinlock_irqrestore_release(&uart_tx_lock, rflags);
 
 	return len;
 }
@@ -8,9 +8,13 @@
  */
 
 #include <types.h>
+#include <asm/lib/spinlock.h>
 
 #define UART_BASE (volatile uint8_t *)0x10000000
 
+/* serializes the writers of uart16550_puts() */
+static spinlock_t uart_tx_lock;
+
 static void write8(volatile unsigned char *addr, char c)
 {
 	*addr = c;
@@ -49,14 +53,19 @@ char uart16550_getc(void)
 size_t uart16550_puts(const char *buf, uint32_t len)
 {
 	int i = 0;
+	uint64_t rflags;
+
 	if (buf == 0)
 		return 0;
 
+	/* keep the strings of concurrent writers whole */
+	spinlock_irqsave_obtain(&uart_tx_lock, &rflags);
 	for (i = 0U; i < len; i++) {
 		if (buf[i] == '\n')
 			put_char('\r');
 		put_char(buf[i]);
 	}
+	spinlock_irqrestore_release(&uart_tx_lock, rflags);
 
 	return len;
 }
@@ -33,6 +33,11 @@ void arch_fire_hsm_interrupt(void)
 	vlapic_set_intr(vcpu, get_hsm_notification_vector(), LAPIC_TRIG_EDGE);
 }
 
+void arch_flush_vuarts(void)
+{
+	/* THR writes are not coalesced on x86, nothing is held back */
+}
+
 /**
  * @brief General complete-work for port I/O emulation
  *
@@ -86,7 +86,10 @@ void default_idle(__unused struct thread_object *obj)
 		} else if (need_shutdown_vm(pcpu_id)) {
 			shutdown_vm_from_idle(pcpu_id);
 		} else {
-			cpu_do_idle();
+			/* one deferred log message per round, idle once none is left */
+			if (!flush_logmsg()) {
+				cpu_do_idle();
+			}
 		}
 	}
 }
@@ -164,6 +164,12 @@ static struct thread_object *sched_iorr_pick_next(struct sched_control *ctl)
 		runqueue_add_tail(current);
 	}
 
+	/* A direct handoff target goes first, accounted as any other pick */
+	if ((ctl->handoff_obj != NULL) && is_inqueue(ctl->handoff_obj)) {
+		runqueue_remove(ctl->handoff_obj);
+		runqueue_add_head(ctl->handoff_obj);
+	}
+
 	/*
 	 * Pick the next runnable sched object
 	 * 1) get the first item in runqueue firstly
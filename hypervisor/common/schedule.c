@@ -73,6 +73,7 @@ void init_sched(uint16_t pcpu_id)
 	spinlock_init(&ctl->scheduler_lock);
 	ctl->flags = 0UL;
 	ctl->curr_obj = NULL;
+	ctl->handoff_obj = NULL;
 	ctl->pcpu_id = pcpu_id;
 #ifdef CONFIG_SCHED_NOOP
 	ctl->scheduler = &sched_noop;
@@ -158,9 +159,11 @@ void schedule(void)
 	uint64_t rflag;
 
 	obtain_schedule_lock(pcpu_id, &rflag);
+	/* pick_next sees a pending handoff as a hint in ctl->handoff_obj */
 	if (ctl->scheduler->pick_next != NULL) {
 		next = ctl->scheduler->pick_next(ctl);
 	}
+	ctl->handoff_obj = NULL;
 	bitmap_clear_lock(NEED_RESCHEDULE, &ctl->flags);
 
 	/* If we picked different sched object, switch context */
@@ -234,6 +237,52 @@ void wake_thread(struct thread_object *obj)
 	release_schedule_lock(pcpu_id, rflag);
 }
 
+/**
+ * @brief Put prev to sleep and hand its pCPU over to next directly.
+ *
+ * When both threads live on the same pCPU, next is passed to the scheduler's
+ * pick_next as a hint, which a scheduler supporting it (IORR) runs next with
+ * its usual accounting. Otherwise this is equivalent to sleep_thread(prev)
+ * followed by wake_thread(next).
+ *
+ * @pre prev != NULL && next != NULL
+ */
+void handoff_thread(struct thread_object *prev, struct thread_object *next)
+{
+	uint16_t pcpu_id = prev->pcpu_id;
+	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
+	struct acrn_scheduler *scheduler = get_scheduler(pcpu_id);
+	uint64_t rflag;
+
+	if (next->pcpu_id != pcpu_id) {
+		sleep_thread(prev);
+		wake_thread(next);
+	} else {
+		obtain_schedule_lock(pcpu_id, &rflag);
+		if (scheduler->sleep != NULL) {
+			scheduler->sleep(prev);
+		}
+		if (is_running(prev)) {
+			prev->be_blocking = true;
+		} else {
+			set_thread_status(prev, THREAD_STS_BLOCKED);
+		}
+
+		if (is_blocked(next) || next->be_blocking) {
+			if (scheduler->wake != NULL) {
+				scheduler->wake(next);
+			}
+			if (is_blocked(next)) {
+				set_thread_status(next, THREAD_STS_RUNNABLE);
+			}
+			next->be_blocking = false;
+		}
+		ctl->handoff_obj = next;
+		make_reschedule_request(pcpu_id);
+		release_schedule_lock(pcpu_id, rflag);
+	}
+}
+
 void yield_current(void)
 {
 	make_reschedule_request(get_pcpu_id());
@@ -11,6 +11,7 @@
 #include <timer.h>
 #include <ticks.h>
 #include <logmsg.h>
+#include <common/sbuf.h>
 #include <acrn_hv_defs.h>
 #include <asm/guest/vm.h>
 #include <console.h>
@@ -163,6 +164,11 @@ static void console_timer_callback(__unused void *data)
 {
 	struct acrn_vuart *vu;
 
+	/* Wake up the readers of the trace and log sbufs */
+	sbuf_notify_readers();
+	/* Flush what the vUARTs held back for this timer */
+	arch_flush_vuarts();
+
 	/* Kick HV-Shell and Uart-Console tasks */
 	vu = vuart_console_active();
 	if (vu != NULL) {
@@ -188,6 +194,9 @@ void console_setup_timer(void)
 	/* Start an periodic timer */
 	if (add_timer(&console_timer) != 0) {
 		pr_err("Failed to add console kick timer");
+	} else {
+		/* The vUARTs are flushed periodically from now on */
+		arch_flush_vuarts();
 	}
 }
 
@@ -19,91 +19,381 @@
  * bsp/uefi/clearlinux/acrn.conf: hvlog=2M@0x1FE00000
  */
 
+/*
+ * Deferred logging
+ *
+ * Formatting a message and polling it out of the UART can stall the
+ * calling pCPU for milliseconds, often inside a vmexit handler. In deferred
+ * mode do_logmsg() only records the format string, the time stamp and the
+ * raw arguments into a lock-free ring of the calling pCPU. The idle thread
+ * of any pCPU, the lowest priority thread of the hypervisor, formats the
+ * records and writes them to NPK, the console and the memory log, one
+ * record per call: the hypervisor doesn't preempt, the idle thread checks
+ * for a thread to schedule between the records. Records are dropped, and
+ * the drops reported, while all the pCPUs stay busy.
+ *
+ * Fatal messages, and all messages before an idle thread first drains the
+ * rings, are still formatted and written synchronously.
+ */
+#define LOG_RECORD_MAX_ARGS	6U
+#define LOG_RECORD_STR_SIZE	96U
+#define LOG_RING_SIZE		64U	/* records, power of 2 */
+
+struct log_record {
+	const char *fmt;
+	uint64_t ticks;
+	uint32_t seq;
+	uint32_t severity;
+	uint64_t args[LOG_RECORD_MAX_ARGS];
+	char thread[16];
+	/* copies of the %s arguments, which may not live until formatted */
+	char str[LOG_RECORD_STR_SIZE];
+};
+
+/*
+ * Written by its own pCPU with interrupts disabled, drained by the owner of
+ * logmsg_ctl.draining.
+ */
+struct log_ring {
+	uint32_t head;		/* next record to write */
+	uint32_t tail;		/* next record to format */
+	uint32_t dropped;	/* records lost because the ring was full */
+	uint32_t reported;	/* dropped records already reported */
+	struct log_record recs[LOG_RING_SIZE];
+} __aligned(64);
+
 struct acrn_logmsg_ctl {
 	int32_t seq;
+	/* serializes the NPK and memory log outputs */
 	spinlock_t lock;
+	bool deferred;
+	/* set once an idle thread drains the rings */
+	bool drain_ready;
+	/* non-zero while the rings are drained, owned by the first taker */
+	int32_t draining;
 };
 
 static struct acrn_logmsg_ctl logmsg_ctl;
+static struct log_ring log_rings[MAX_PCPU_NUM];
+/* only used by the owner of logmsg_ctl.draining */
+static char drain_buf[LOG_MESSAGE_MAX_SIZE];
 
 void init_logmsg()
 {
 	logmsg_ctl.seq = 0;
+	logmsg_ctl.draining = 0;
+#ifdef CONFIG_LOG_DEFERRED
+	logmsg_ctl.deferred = true;
+#else
+	logmsg_ctl.deferred = false;
+#endif
 
 	spinlock_init(&(logmsg_ctl.lock));
 }
 
-void do_logmsg(uint32_t severity, const char *fmt, ...)
+void set_logmsg_deferred(bool deferred)
 {
-	va_list args;
-	uint64_t timestamp, rflags;
-	uint16_t pcpu_id;
-	bool do_console_log;
-	bool do_mem_log;
-	bool do_npk_log;
-	char *buffer;
-	struct thread_object *current;
+	logmsg_ctl.deferred = deferred;
+}
+
+bool is_logmsg_deferred(void)
+{
+	return logmsg_ctl.deferred;
+}
 
-	do_console_log = (severity <= console_loglevel);
-	do_mem_log = (severity <= mem_loglevel);
-	do_npk_log = (severity <= npk_loglevel);
+/*
+ * Write a formatted message to the enabled outputs.
+ *
+ * The UART output, which polls every character out, is written without
+ * logmsg_ctl.lock, the UART driver serializes the writers with its TX lock.
+ */
+static void log_output(uint16_t pcpu_id, uint32_t severity, const char *buffer)
+{
+	uint32_t i, msg_len = strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE);
+	struct shared_buf *sbuf;
+	uint64_t rflags;
 
-	if (!do_console_log && !do_mem_log && !do_npk_log) {
-		return;
+	/* Check whether output to stdout */
+	if (severity <= console_loglevel) {
+		printf("%s\n\r", buffer);
 	}
 
-	/* Get time-stamp value */
-	timestamp = cpu_ticks();
+	spinlock_irqsave_obtain(&(logmsg_ctl.lock), &rflags);
 
-	/* Scale time-stamp appropriately */
-	timestamp = ticks_to_us(timestamp);
+	/* Check whether output to NPK */
+	if (severity <= npk_loglevel) {
+		npk_log_write(buffer, msg_len);
+	}
 
-	/* Get CPU ID */
-	pcpu_id = get_pcpu_id();
-	buffer = per_cpu(logbuf, pcpu_id);
-	current = sched_get_current(pcpu_id);
+	/* Check whether output to memory */
+	if (severity <= mem_loglevel) {
+		sbuf = per_cpu(sbuf, pcpu_id)[ACRN_HVLOG];
 
+		/* If sbuf is not ready, we just drop the massage */
+		if ((sbuf != NULL) && (msg_len > 0U)) {
+			for (i = 0U; i < (((msg_len - 1U) / LOG_ENTRY_SIZE) + 1U);
+					i++) {
+				(void)sbuf_put_watermark(pcpu_id, ACRN_HVLOG, (uint8_t *)buffer +
+							(i * LOG_ENTRY_SIZE));
+			}
+		}
+	}
+
+	spinlock_irqrestore_release(&(logmsg_ctl.lock), rflags);
+}
+
+static uint32_t log_format_header(char *buffer, uint64_t ticks, uint16_t pcpu_id,
+		const char *thread, uint32_t severity, uint32_t seq)
+{
 	(void)memset(buffer, 0U, LOG_MESSAGE_MAX_SIZE);
 	/* Put time-stamp, CPU ID and severity into buffer */
 	snprintf(buffer, LOG_MESSAGE_MAX_SIZE, "[%luus][cpu=%hu][%s][sev=%u][seq=%u]:",
-			timestamp, pcpu_id, current->name, severity, atomic_inc_return(&logmsg_ctl.seq));
+			ticks_to_us(ticks), pcpu_id, thread, severity, seq);
 
-	/* Put message into remaining portion of local buffer */
-	va_start(args, fmt);
-	vsnprintf(buffer + strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE),
-		LOG_MESSAGE_MAX_SIZE
-		- strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE), fmt, args);
-	va_end(args);
+	return strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE);
+}
 
-	/* Check whether output to NPK */
-	if (do_npk_log) {
-		npk_log_write(buffer, strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE));
+/* flags, width, precision and length modifiers known by do_print(), '*' aside */
+static inline bool log_is_modifier(char c)
+{
+	return ((c >= '0') && (c <= '9')) || (c == '-') || (c == '+') || (c == ' ') ||
+		(c == '#') || (c == '.') || (c == 'h') || (c == 'l');
+}
+
+/*
+ * Save the arguments of fmt into rec, copying the strings.
+ *
+ * All the arguments are saved as 64-bit values, integers and pointers take
+ * one full register or stack slot each when passed to a variadic function.
+ * A '*' width or precision takes an argument of its own.
+ *
+ * @return false if fmt has more than LOG_RECORD_MAX_ARGS arguments
+ */
+static bool log_save_args(struct log_record *rec, const char *fmt, va_list args)
+{
+	const char *p, *s;
+	uint32_t n = 0U, off = 0U, len;
+	bool is_str;
+
+	for (p = fmt; *p != '\0'; p++) {
+		if (*p != '%') {
+			continue;
+		}
+		p++;
+		if (*p == '%') {
+			continue;
+		}
+		while (log_is_modifier(*p) || (*p == '*')) {
+			if (*p == '*') {
+				if (n >= LOG_RECORD_MAX_ARGS) {
+					return false;
+				}
+				rec->args[n] = __builtin_va_arg(args, uint64_t);
+				n++;
+			}
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		if (n >= LOG_RECORD_MAX_ARGS) {
+			return false;
+		}
+
+		is_str = (*p == 's');
+		if (!is_str) {
+			rec->args[n] = __builtin_va_arg(args, uint64_t);
+		} else {
+			s = __builtin_va_arg(args, const char *);
+			if (s == NULL) {
+				rec->args[n] = 0UL;
+			} else {
+				len = strnlen_s(s, LOG_RECORD_STR_SIZE - 1U - off);
+				(void)memcpy_s(&rec->str[off], LOG_RECORD_STR_SIZE - off, s, len);
+				rec->str[off + len] = '\0';
+				rec->args[n] = (uint64_t)&rec->str[off];
+				off += len;
+				/* the rest of the strings are truncated to "" */
+				if (off < (LOG_RECORD_STR_SIZE - 1U)) {
+					off++;
+				}
+			}
+		}
+		n++;
 	}
 
-	/* Check whether output to stdout */
-	if (do_console_log) {
-		spinlock_irqsave_obtain(&(logmsg_ctl.lock), &rflags);
+	return true;
+}
 
-		/* Send buffer to stdout */
-		printf("%s\n\r", buffer);
+/*
+ * @return false if the message has to be written synchronously
+ */
+static bool log_record(uint16_t pcpu_id, uint32_t severity, uint64_t ticks,
+		const char *thread, const char *fmt, va_list args)
+{
+	struct log_ring *ring = &log_rings[pcpu_id];
+	struct log_record *rec;
+	uint64_t rflags;
+	uint32_t head;
+	bool ret = true;
 
-		spinlock_irqrestore_release(&(logmsg_ctl.lock), rflags);
+	/* Interrupts may log on this pCPU as well */
+	CPU_INT_ALL_DISABLE(&rflags);
+	head = ring->head;
+	if ((head - *(volatile uint32_t *)&ring->tail) >= LOG_RING_SIZE) {
+		ring->dropped++;
+	} else {
+		rec = &ring->recs[head & (LOG_RING_SIZE - 1U)];
+		if (log_save_args(rec, fmt, args)) {
+			rec->fmt = fmt;
+			rec->ticks = ticks;
+			rec->severity = severity;
+			rec->seq = (uint32_t)atomic_inc_return(&logmsg_ctl.seq);
+			(void)strncpy_s(rec->thread, sizeof(rec->thread), thread, sizeof(rec->thread) - 1U);
+
+			/* make sure the record is written before it is published */
+			cpu_write_memory_barrier();
+			ring->head = head + 1U;
+		} else {
+			ret = false;
+		}
 	}
+	CPU_INT_ALL_RESTORE(rflags);
 
-	/* Check whether output to memory */
-	if (do_mem_log) {
-		uint32_t i, msg_len;
-		struct shared_buf *sbuf = per_cpu(sbuf, pcpu_id)[ACRN_HVLOG];
+	return ret;
+}
 
-		/* If sbuf is not ready, we just drop the massage */
-		if (sbuf != NULL) {
-			msg_len = strnlen_s(buffer, LOG_MESSAGE_MAX_SIZE);
+/*
+ * Format and write up to budget records of the rings, a drop report counts
+ * as a record.
+ *
+ * @pre the caller owns logmsg_ctl.draining
+ * @return true if records are left in the rings
+ */
+static bool log_drain(uint32_t budget)
+{
+	struct log_ring *ring;
+	struct log_record *rec;
+	uint32_t head, tail, dropped, len, done = 0U;
+	uint16_t pcpu_id;
+	bool more = false;
 
-			for (i = 0U; i < (((msg_len - 1U) / LOG_ENTRY_SIZE) + 1U);
-					i++) {
-				(void)sbuf_put(sbuf, (uint8_t *)buffer +
-							(i * LOG_ENTRY_SIZE));
-			}
+	for (pcpu_id = 0U; pcpu_id < MAX_PCPU_NUM; pcpu_id++) {
+		ring = &log_rings[pcpu_id];
+
+		dropped = *(volatile uint32_t *)&ring->dropped;
+		if ((dropped != ring->reported) && (done < budget)) {
+			snprintf(drain_buf, LOG_MESSAGE_MAX_SIZE, "[cpu=%hu]: %u log messages dropped",
+					pcpu_id, dropped - ring->reported);
+			ring->reported = dropped;
+			log_output(pcpu_id, LOG_WARNING, drain_buf);
+			done++;
+		}
+
+		head = *(volatile uint32_t *)&ring->head;
+		/* read the records only after their head */
+		cpu_memory_barrier();
+		for (tail = ring->tail; (tail != head) && (done < budget); tail++) {
+			rec = &ring->recs[tail & (LOG_RING_SIZE - 1U)];
+			len = log_format_header(drain_buf, rec->ticks, pcpu_id, rec->thread,
+					rec->severity, rec->seq);
+			snprintf(drain_buf + len, LOG_MESSAGE_MAX_SIZE - len, rec->fmt,
+					rec->args[0], rec->args[1], rec->args[2],
+					rec->args[3], rec->args[4], rec->args[5]);
+
+			/* the record is formatted, give it back before the slow output */
+			cpu_memory_barrier();
+			ring->tail = tail + 1U;
+
+			log_output(pcpu_id, rec->severity, drain_buf);
+			done++;
+		}
+		if ((tail != head) || (*(volatile uint32_t *)&ring->dropped != ring->reported)) {
+			more = true;
+		}
+	}
+
+	return more;
+}
+
+/* @return true if logmsg_ctl.draining is taken */
+static inline bool log_drain_get(void)
+{
+	bool ret = true;
+
+	if (atomic_inc_return(&logmsg_ctl.draining) != 1) {
+		(void)atomic_dec_return(&logmsg_ctl.draining);
+		ret = false;
+	}
+
+	return ret;
+}
+
+static inline void log_drain_put(void)
+{
+	(void)atomic_dec_return(&logmsg_ctl.draining);
+}
+
+/*
+ * Called by the idle threads, another pCPU already draining is left alone.
+ * Writes a single record so that a woken thread waits for one at most.
+ */
+bool flush_logmsg(void)
+{
+	bool more = false;
+
+	logmsg_ctl.drain_ready = true;
+
+	if (log_drain_get()) {
+		more = log_drain(1U);
+		log_drain_put();
+	}
+
+	return more;
+}
+
+void do_logmsg(uint32_t severity, const char *fmt, ...)
+{
+	va_list args;
+	uint64_t timestamp;
+	uint16_t pcpu_id;
+	uint32_t len;
+	bool recorded = false;
+	char *buffer;
+	struct thread_object *current;
+
+	if ((severity > console_loglevel) && (severity > mem_loglevel) && (severity > npk_loglevel)) {
+		return;
+	}
+
+	/* Get time-stamp value */
+	timestamp = cpu_ticks();
+
+	/* Get CPU ID */
+	pcpu_id = get_pcpu_id();
+	current = sched_get_current(pcpu_id);
+
+	if (logmsg_ctl.deferred && logmsg_ctl.drain_ready && (severity > LOG_FATAL)) {
+		va_start(args, fmt);
+		recorded = log_record(pcpu_id, severity, timestamp, current->name, fmt, args);
+		va_end(args);
+	}
+
+	if (!recorded) {
+		buffer = per_cpu(logbuf, pcpu_id);
+		len = log_format_header(buffer, timestamp, pcpu_id, current->name, severity,
+				(uint32_t)atomic_inc_return(&logmsg_ctl.seq));
+
+		/* Put message into remaining portion of local buffer */
+		va_start(args, fmt);
+		vsnprintf(buffer + len, LOG_MESSAGE_MAX_SIZE - len, fmt, args);
+		va_end(args);
+
+		/* Write what was logged before a fatal message first, if no one else is */
+		if ((severity <= LOG_FATAL) && log_drain_get()) {
+			(void)log_drain(~0U);
+			log_drain_put();
 		}
+		log_output(pcpu_id, severity, buffer);
 	}
 }
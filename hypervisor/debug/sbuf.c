@@ -14,14 +14,90 @@
 #include <errno.h>
 #include <asm/cpu.h>
 #include <asm/per_cpu.h>
+#include <common/sbuf.h>
+
+/* Only the trace and log readers set a watermark, the field is reserved in the other sbufs */
+static inline bool sbuf_has_watermark(uint32_t sbuf_id)
+{
+	return (sbuf_id == ACRN_TRACE) || (sbuf_id == ACRN_HVLOG);
+}
+
+static uint32_t sbuf_used(const struct shared_buf *sbuf)
+{
+	uint32_t used;
+
+	stac();
+	used = (sbuf->tail >= sbuf->head) ? (sbuf->tail - sbuf->head) :
+			(sbuf->size - sbuf->head + sbuf->tail);
+	clac();
+
+	return used;
+}
+
+/*
+ * Put data into the sbuf_id sbuf of pcpu_id, which is a trace or log sbuf,
+ * and flag the pCPU when the fill level crosses the watermark set by the
+ * reader. The notification is sent later by sbuf_notify_readers(): the
+ * caller may hold the locks that sending it takes.
+ *
+ * @pre sbuf_has_watermark(sbuf_id) && per_cpu(sbuf, pcpu_id)[sbuf_id] != NULL
+ */
+uint32_t sbuf_put_watermark(uint16_t pcpu_id, uint32_t sbuf_id, uint8_t *data)
+{
+	struct shared_buf *sbuf = per_cpu(sbuf, pcpu_id)[sbuf_id];
+	uint32_t before, ret, watermark;
+
+	before = sbuf_used(sbuf);
+	ret = sbuf_put(sbuf, data);
+
+	stac();
+	watermark = sbuf->watermark;
+	clac();
+	if ((ret != 0U) && (watermark != 0U) && (before < watermark) &&
+			(sbuf_used(sbuf) >= watermark)) {
+		per_cpu(sbuf_notify, pcpu_id) = true;
+	}
+
+	return ret;
+}
+
+/*
+ * Called by the console timer, sends one notification for all the pCPUs
+ * flagged by sbuf_put_watermark().
+ */
+void sbuf_notify_readers(void)
+{
+	uint16_t pcpu_id;
+	bool notify = false;
+
+	for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+		if (per_cpu(sbuf_notify, pcpu_id)) {
+			per_cpu(sbuf_notify, pcpu_id) = false;
+			notify = true;
+		}
+	}
+
+	if (notify) {
+		arch_fire_hsm_interrupt();
+	}
+}
 
 int32_t sbuf_share_setup(uint16_t pcpu_id, uint32_t sbuf_id, uint64_t *hva)
 {
+	struct shared_buf *sbuf = (struct shared_buf *)hva;
+
 	if ((pcpu_id >= get_pcpu_nums()) || (sbuf_id >= ACRN_SBUF_PER_PCPU_ID_MAX)) {
 		return -EINVAL;
 	}
 
-	per_cpu(sbuf, pcpu_id)[sbuf_id] = (struct shared_buf *) hva;
+	/* Wake the reader up when the buffer is half full by default */
+	stac();
+	if ((sbuf != NULL) && sbuf_has_watermark(sbuf_id) && (sbuf->watermark == 0U)) {
+		sbuf->watermark = sbuf->size / 2U;
+	}
+	clac();
+
+	per_cpu(sbuf, pcpu_id)[sbuf_id] = sbuf;
 	pr_info("%s share sbuf for pCPU[%u] with sbuf_id[%u] setup successfully",
 			__func__, pcpu_id, sbuf_id);
 
@@ -52,10 +52,14 @@ static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv
 static int32_t shell_show_vioapic_info(int32_t argc, char **argv);
 static int32_t shell_show_ioapic_info(__unused int32_t argc, __unused char **argv);
 static int32_t shell_loglevel(int32_t argc, char **argv);
+static int32_t shell_logmode(int32_t argc, char **argv);
 static int32_t shell_cpuid(int32_t argc, char **argv);
 static int32_t shell_reboot(int32_t argc, char **argv);
 static int32_t shell_rdmsr(int32_t argc, char **argv);
 static int32_t shell_wrmsr(int32_t argc, char **argv);
+#ifdef CONFIG_RISCV64
+static int32_t shell_s2pt_stat(int32_t argc, char **argv);
+#endif
 
 static struct shell_cmd shell_cmds[] = {
 	{
@@ -136,6 +140,12 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_LOG_LVL_HELP,
 		.fcn		= shell_loglevel,
 	},
+	{
+		.str		= SHELL_CMD_LOG_MODE,
+		.cmd_param	= SHELL_CMD_LOG_MODE_PARAM,
+		.help_str	= SHELL_CMD_LOG_MODE_HELP,
+		.fcn		= shell_logmode,
+	},
 	{
 		.str		= SHELL_CMD_CPUID,
 		.cmd_param	= SHELL_CMD_CPUID_PARAM,
@@ -160,6 +170,14 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_WRMSR_HELP,
 		.fcn		= shell_wrmsr,
 	},
+#ifdef CONFIG_RISCV64
+	{
+		.str		= SHELL_CMD_S2PT_STAT,
+		.cmd_param	= SHELL_CMD_S2PT_STAT_PARAM,
+		.help_str	= SHELL_CMD_S2PT_STAT_HELP,
+		.fcn		= shell_s2pt_stat,
+	},
+#endif
 };
 
 /* for function key: up/down/right/left/home/end and delete key */
@@ -1303,6 +1321,23 @@ static int32_t shell_loglevel(int32_t argc, char **argv)
 	return 0;
 }
 
+static int32_t shell_logmode(int32_t argc, char **argv)
+{
+	int32_t ret = 0;
+
+	if (argc == 1) {
+		shell_puts(is_logmsg_deferred() ? "deferred\r\n" : "sync\r\n");
+	} else if ((argc == 2) && (strcmp(argv[1], "sync") == 0)) {
+		set_logmsg_deferred(false);
+	} else if ((argc == 2) && (strcmp(argv[1], "deferred") == 0)) {
+		set_logmsg_deferred(true);
+	} else {
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
 #ifdef CONFIG_RISCV64
 static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv)
 {
@@ -1320,6 +1355,49 @@ static int32_t shell_cpuid(int32_t argc, char **argv) { return 0; }
 static int32_t shell_reboot(__unused int32_t argc, __unused char **argv) { return 0; }
 static int32_t shell_rdmsr(int32_t argc, char **argv) { return 0; }
 static int32_t shell_wrmsr(int32_t argc, char **argv) { return 0; }
+
+static void dump_s2pt_stat(const struct acrn_vm *vm)
+{
+	char temp_str[MAX_STR_SIZE];
+	const struct pgtable_stats *st = vm->arch_vm.s2pt_mem_ops.stats;
+
+	if (st != NULL) {
+		snprintf(temp_str, MAX_STR_SIZE, "%-5hu %-10lu %-10lu %-10lu %-10lu %-10lu\r\n", vm->vm_id,
+			st->leaves[PGT_LEAF_4K], st->leaves[PGT_LEAF_2M], st->leaves[PGT_LEAF_1G],
+			st->splits, st->promotions);
+		shell_puts(temp_str);
+	}
+}
+
+static int32_t shell_s2pt_stat(int32_t argc, char **argv)
+{
+	struct acrn_vm *vm;
+	uint16_t vm_id;
+	int32_t status = 0;
+
+	if (argc > 2) {
+		status = -EINVAL;
+	} else {
+		shell_puts("\r\nVM_ID 4K         2M         1G         SPLITS     PROMOTIONS"
+			   "\r\n===== ========== ========== ========== ========== ==========\r\n");
+		if (argc == 2) {
+			vm_id = sanitize_vmid((uint16_t)strtol_deci(argv[1]));
+			vm = get_vm_from_vmid(vm_id);
+			if (!is_poweroff_vm(vm)) {
+				dump_s2pt_stat(vm);
+			}
+		} else {
+			for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+				vm = get_vm_from_vmid(vm_id);
+				if (!is_poweroff_vm(vm)) {
+					dump_s2pt_stat(vm);
+				}
+			}
+		}
+	}
+
+	return status;
+}
 #else
 static void get_ptdev_info(char *str_arg, size_t str_max)
 {
@@ -101,6 +101,11 @@ struct shell {
 #define SHELL_CMD_LOG_LVL_HELP		"No argument: get the level of logging for the console, memory and npk. Set "\
 					"the level by giving (up to) 3 parameters between 0 and 6 (verbose)"
 
+#define SHELL_CMD_LOG_MODE		"logmode"
+#define SHELL_CMD_LOG_MODE_PARAM	"[sync|deferred]"
+#define SHELL_CMD_LOG_MODE_HELP		"No argument: get the logging mode. sync formats and writes each message on "\
+					"the logging CPU, deferred records it and lets the console timer write it"
+
 #define SHELL_CMD_CPUID			"cpuid"
 #define SHELL_CMD_CPUID_PARAM		"<leaf> [subleaf]"
 #define SHELL_CMD_CPUID_HELP		"Display the CPUID leaf [subleaf], in hexadecimal"
@@ -113,4 +118,9 @@ struct shell {
 #define SHELL_CMD_WRMSR_PARAM		"[-p<pcpu_id>]	<msr_index> <value>"
 #define SHELL_CMD_WRMSR_HELP		"Write value (in hexadecimal) to the MSR at msr_index (in hexadecimal) for CPU"\
 					" ID pcpu_id"
+
+#define SHELL_CMD_S2PT_STAT		"s2pt_stat"
+#define SHELL_CMD_S2PT_STAT_PARAM	"[vm_id]"
+#define SHELL_CMD_S2PT_STAT_HELP	"Show the number of 4K/2M/1G stage-2 leaves, splits and promotions of "\
+					"one or all VMs"
 #endif /* SHELL_PRIV_H */
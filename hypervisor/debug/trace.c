@@ -8,6 +8,7 @@
 #include <asm/per_cpu.h>
 #include <ticks.h>
 #include <trace.h>
+#include <common/sbuf.h>
 
 #define TRACE_CUSTOM			0xFCU
 #define TRACE_FUNC_ENTER		0xFDU
@@ -50,13 +51,11 @@ static inline bool trace_check(uint16_t cpu_id)
 
 static inline void trace_put(uint16_t cpu_id, uint32_t evid, uint32_t n_data, struct trace_entry *entry)
 {
-	struct shared_buf *sbuf = per_cpu(sbuf, cpu_id)[ACRN_TRACE];
-
 	entry->tsc = cpu_ticks();
 	entry->id = evid;
 	entry->n_data = (uint8_t)n_data;
 	entry->cpu = (uint8_t)cpu_id;
-	(void)sbuf_put(sbuf, (uint8_t *)entry);
+	(void)sbuf_put_watermark(cpu_id, ACRN_TRACE, (uint8_t *)entry);
 }
 
 void TRACE_2L(uint32_t evid, uint64_t e, uint64_t f)
@@ -34,6 +34,7 @@
 #define CONFIG_MEM_LOGLEVEL_DEFAULT 5U
 #define CONFIG_NPK_LOGLEVEL_DEFAULT 5U
 #define CONFIG_CONSOLE_LOGLEVEL_DEFAULT 5U
+#define CONFIG_LOG_DEFERRED 1
 #define CONFIG_CONSOLE_DEFAULT_VM 65535U
 #define CONFIG_VUART_TIMER_PCPU 0U
 
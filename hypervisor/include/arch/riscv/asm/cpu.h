@@ -125,6 +125,9 @@ struct cpu_regs {
 	uint64_t orig_a0;
 };
 
+/* status.SPP of a guest trap frame: sret returns to VS-mode rather than VU-mode */
+#define SSTATUS_SPP		(1UL << 8U)
+
 #define OFFSET_REG_IP		offsetof(struct cpu_regs, ip)
 #define OFFSET_REG_RA		offsetof(struct cpu_regs, ra)
 #define OFFSET_REG_SP		offsetof(struct cpu_regs, sp)
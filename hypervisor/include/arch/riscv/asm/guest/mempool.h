@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2026 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __RISCV_MEMPOOL_H__
+#define __RISCV_MEMPOOL_H__
+
+#include <types.h>
+
+/*
+ * Guest RAM of dynamically created VMs is carved from a board defined
+ * host memory region. It is handed out in 2M granules so that each
+ * chunk is naturally aligned for large stage-2 mappings.
+ */
+#define VM_MEM_POOL_GRANULE_SHIFT	21U
+#define VM_MEM_POOL_GRANULE		(1UL << VM_MEM_POOL_GRANULE_SHIFT)
+
+extern void init_vm_mem_pool(void);
+extern uint64_t alloc_vm_mem(uint64_t size);
+extern void free_vm_mem(uint64_t hpa, uint64_t size);
+extern uint64_t vm_mem_pool_free_size(void);
+extern uint64_t *vm_mem_dirty_bitmap(uint64_t hpa);
+
+#endif /* __RISCV_MEMPOOL_H__ */
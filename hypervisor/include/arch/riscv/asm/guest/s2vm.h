@@ -13,6 +13,7 @@
 #include <asm/lib/spinlock.h>
 #include <asm/current.h>
 #include <asm/pgtable.h>
+#include <errno.h>
 
 #define S2PT_PFN_HIGH_MASK      0xFFFF000000000000UL
 
@@ -32,6 +33,10 @@ extern void s2pt_modify_mr(struct acrn_vm *vm, uint64_t *vpn3_page, uint64_t gpa
 				uint64_t size, uint64_t prot_set, uint64_t prot_clr);
 extern void s2vm_restore_state(struct acrn_vcpu *vcpu);
 extern void s2pt_flush_guest(struct acrn_vm *vm);
+extern void s2pt_flush_range(struct acrn_vm *vm, uint64_t gpa, uint64_t size);
+extern int32_t s2pt_set_dirty_log(struct acrn_vm *vm, bool enable);
+extern bool s2pt_dirty_log_fault(struct acrn_vm *vm, uint64_t gpa);
+extern void s2pt_get_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t *log, uint64_t nr_words);
 #else
 static inline void setup_virt_paging(void) {}
 static inline uint64_t local_gpa2hpa(struct acrn_vm *vm, uint64_t gpa, uint32_t *size)
@@ -54,6 +59,16 @@ static inline void s2pt_modify_mr(struct acrn_vm *vm, uint64_t *vpn3_page, uint6
 				uint64_t size, uint64_t prot_set, uint64_t prot_clr) {}
 static inline void s2vm_restore_state(struct acrn_vcpu *vcpu) {}
 static inline void s2pt_flush_guest(struct acrn_vm *vm) {}
+static inline void s2pt_flush_range(struct acrn_vm *vm, uint64_t gpa, uint64_t size) {}
+static inline int32_t s2pt_set_dirty_log(struct acrn_vm *vm, bool enable)
+{
+	return -EINVAL;
+}
+static inline bool s2pt_dirty_log_fault(struct acrn_vm *vm, uint64_t gpa)
+{
+	return false;
+}
+static inline void s2pt_get_dirty_log(struct acrn_vm *vm, uint64_t gpa, uint64_t *log, uint64_t nr_words) {}
 #endif
 
 #endif /* __RISCV_S2VM_H__ */
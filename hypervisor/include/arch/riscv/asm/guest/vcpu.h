@@ -117,6 +117,9 @@ struct acrn_vcpu_arch {
 	uint8_t lapic_mask;
 	uint32_t nrexits;
 
+	/* run_ctx was loaded by set_vcpu_context(), init_vmcs() must keep it */
+	bool context_loaded;
+
 	/* VCPU context state information */
 	uint64_t exit_reason;
 	uint64_t exit_qualification;
@@ -215,6 +218,9 @@ extern void vcpu_reset_eoi_exit_bitmaps(struct acrn_vcpu *vcpu);
 extern void vcpu_set_eoi_exit_bitmap(struct acrn_vcpu *vcpu, uint32_t vector);
 extern void vcpu_clear_eoi_exit_bitmap(struct acrn_vcpu *vcpu, uint32_t vector);
 extern void set_vcpu_regs(struct acrn_vcpu *vcpu, struct cpu_regs *vcpu_regs);
+struct acrn_vcpu_context;
+extern void get_vcpu_context(struct acrn_vcpu *vcpu, struct acrn_vcpu_context *vctx);
+extern void set_vcpu_context(struct acrn_vcpu *vcpu, const struct acrn_vcpu_context *vctx);
 extern void reset_vcpu_regs(struct acrn_vcpu *vcpu);
 extern void init_vcpu_protect_mode_regs(struct acrn_vcpu *vcpu, uint64_t vgdt_base_gpa);
 extern void set_vcpu_startup_entry(struct acrn_vcpu *vcpu, uint64_t entry);
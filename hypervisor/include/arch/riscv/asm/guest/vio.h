@@ -37,5 +37,6 @@ extern void emulate_pio_complete(struct acrn_vcpu *vcpu, const struct io_request
 extern void allow_guest_pio_access(struct acrn_vm *vm, uint16_t port_address, uint32_t nbytes);
 extern void deny_guest_pio_access(struct acrn_vm *vm, uint16_t port_address, uint32_t nbytes);
 extern void arch_fire_hsm_interrupt(void);
+extern void arch_flush_vuarts(void);
 
 #endif /* __RISCV_VIO_H__ */
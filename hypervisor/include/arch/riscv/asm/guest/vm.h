@@ -25,6 +25,11 @@
 #include <asm/vm_config.h>
 #include <asm/pgtable.h>
 
+/* guest physical memory layout of the VMs created by HC_CREATE_VM */
+#define POST_VM_RAM_GPA			0x80000000UL
+#define POST_VM_DEFAULT_MEM_SIZE	0x10000000UL
+#define POST_VM_DTB_SIZE		0x200000UL
+
 enum reset_mode {
 	POWER_ON_RESET,		/* reset by hardware Power-on */
 	COLD_RESET,		/* hardware cold reset */
@@ -117,6 +122,8 @@ struct vm_arch {
 	void *sworld_s2ptp;
 	uint64_t s2pt_satp;
 	struct memory_ops s2pt_mem_ops;
+	/* RAM is write protected in stage-2, writes are logged */
+	bool dirty_log;
 
 	struct acrn_vpic vpic;      /* Virtual PIC */
 	enum vm_vlapic_mode vlapic_mode; /* Represents vLAPIC mode across vCPUs*/
@@ -229,6 +236,9 @@ extern int32_t reset_vm(struct acrn_vm *vm);
 extern int32_t create_vm(struct acrn_vm *vm);
 extern void prepare_sos_vm(void);
 extern void prepare_uos_vm(void);
+extern int32_t create_post_vm(const struct acrn_vm_creation *cv, uint64_t mem_size, struct acrn_vm **rtn_vm);
+extern void destroy_post_vm(struct acrn_vm *vm);
+extern int32_t load_vm_image(struct acrn_vm *vm, struct acrn_vm *src_vm, const struct acrn_vm_image *img);
 extern void launch_vms(uint16_t pcpu_id);
 extern bool is_poweroff_vm(const struct acrn_vm *vm);
 extern bool is_created_vm(const struct acrn_vm *vm);
@@ -9,6 +9,9 @@
 
 #include <asm/lib/spinlock.h>
 #include <asm/vm_config.h>
+#include <asm/page.h>
+
+struct acrn_vcpu;
 
 #define	UART_MEM_ADDR		CONFIG_UART_BASE
 #define	UART_MEM_REGION		UART_MEM_ADDR + CONFIG_UART_SIZE
@@ -17,6 +20,52 @@
 #define TX_BUF_SIZE		8192U
 #define INVAILD_VUART_IDX	0xFFU
 
+/* THR writes per THRE interrupt while the guest has the FIFO enabled */
+#define VUART_THR_BURST		16U
+
+/*
+ * ACRN specific MPXY channel to register a byte ring shared with the console
+ * vUART. A paravirtual console/earlycon driver produces TX bytes into it and
+ * consumes RX bytes from it without trapping on the 16550 registers; the
+ * hypervisor drains TX on the console timer and fills RX from the physical
+ * UART. The 16550 registers stay functional, TX from both paths is printed.
+ * Without the console timer (release builds) REGISTER is not supported.
+ */
+#define VUART_RING_CHANNEL_ID	0x21U
+
+#define VUART_RING_MSG_REGISTER	0x01U	/* mpxy shm[0]: GPA to map the ring at */
+
+#define VUART_RING_MAGIC	0x54524155U	/* "UART" */
+#define VUART_RING_VERSION	1U
+#define VUART_RING_SIZE		PAGE_SIZE
+#define VUART_RING_TX_SIZE	2048U
+#define VUART_RING_RX_SIZE	1024U
+
+/* Guest owned flags */
+#define VUART_RING_F_RX		(1U << 0U)	/* deliver RX into the ring, not RBR */
+
+struct vuart_ring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t tx_prod;	/* written by guest */
+	uint32_t tx_cons;	/* written by hypervisor */
+	uint32_t rx_prod;	/* written by hypervisor */
+	uint32_t rx_cons;	/* written by guest */
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/*
+ * Indices are free running, masked by the power of two ring sizes. With
+ * VUART_RING_F_RX set, RX data raises the vUART interrupt as IIR_RXRDY if
+ * IER_ERBFI is enabled; the guest reads IIR after draining the ring.
+ */
+struct vuart_ring {
+	struct vuart_ring_hdr hdr;
+	char tx[VUART_RING_TX_SIZE];
+	char rx[VUART_RING_RX_SIZE];
+} __aligned(PAGE_SIZE);
+
 struct vuart_fifo {
 	char *buf;
 	uint32_t rindex;	/* index to read from */
@@ -45,6 +94,11 @@ struct acrn_vuart {
 	char vuart_rx_buf[RX_BUF_SIZE];
 	char vuart_tx_buf[TX_BUF_SIZE];
 	bool thre_int_pending;  /* THRE interrupt pending */
+	uint32_t thr_burst;	/* THR writes since the last THRE interrupt */
+	uint32_t thr_short_bursts; /* consecutive bursts ended by the console drain */
+	bool thr_coalesce;	/* one THRE per VUART_THR_BURST writes */
+	struct vuart_ring *ring; /* shared ring, NULL until registered */
+	uint64_t ring_gpa;	/* guest RAM range the ring is mapped over */
 	bool active;
 	struct acrn_vuart *target_vu; /* Pointer to target vuart */
 	struct acrn_vm *vm;
@@ -53,9 +107,12 @@ struct acrn_vuart {
 };
 
 void init_vuarts(struct acrn_vm *vm, const struct vuart_config *vu_config);
+void reset_vuarts(struct acrn_vm *vm);
 void deinit_vuarts(struct acrn_vm *vm);
 void vuart_toggle_intr(struct acrn_vuart *vu);
 
 void vuart_putchar(struct acrn_vuart *vu, char ch);
 char vuart_getchar(struct acrn_vuart *vu);
+void vuart_flush_thre(void);
+int32_t vuart_ring_handler(struct acrn_vcpu *vcpu, uint64_t msg_id);
 #endif /* __RISCV_VUART_H__ */
@@ -25,6 +25,8 @@
 
 struct per_cpu_region {
 	struct shared_buf *sbuf[ACRN_SBUF_PER_PCPU_ID_MAX];
+	/* a trace or log sbuf crossed its watermark, see sbuf_put_watermark() */
+	bool sbuf_notify;
 	char logbuf[LOG_MESSAGE_MAX_SIZE];
 	uint32_t npk_log_ref;
 	uint64_t irq_count[NR_IRQS];
@@ -36,6 +36,8 @@
 
 #define PTE_ENTRY_COUNT				  512
 #define PTE_ADDR_MASK_BLOCK_ENTRY		(0xFFFFFFFFFULL << 10)
+#define PTE_PPN_SHIFT				10U
+#define PTE_PPN_MASK				(0xFFFFFFFFFFFUL << PTE_PPN_SHIFT)
 
 #define PAGE_ATTR_MASK				  (((uint64_t)0x3) << 61)
 #define PAGE_ATTR_PMA				   (0x0)
@@ -180,9 +182,24 @@ union pgtable_pages_info {
 		struct page *vpn2_base;
 		struct page *vpn1_base;
 		struct page *vpn0_base;
+		uint16_t vmid;
 	} s2pt;
 };
 
+enum pgtable_leaf_size {
+	PGT_LEAF_4K = 0,
+	PGT_LEAF_2M,
+	PGT_LEAF_1G,
+	PGT_LEAF_MAX,
+};
+
+/* mapping statistics of one page table, kept up to date by the mmu_* code */
+struct pgtable_stats {
+	uint64_t leaves[PGT_LEAF_MAX];	/* present leaf entries per page size */
+	uint64_t splits;		/* large leaves split into next level tables */
+	uint64_t promotions;		/* uniform tables collapsed into large leaves */
+};
+
 struct memory_ops {
 	union pgtable_pages_info *info;
 	bool (*large_page_support)(enum _page_table_level level);
@@ -196,6 +213,9 @@ struct memory_ops {
 	void (*clflush_pagewalk)(const void *p);
 	void (*tweak_exe_right)(uint64_t *entry);
 	void (*recover_exe_right)(uint64_t *entry);
+	/* invalidate the TLB entries of [vaddr, vaddr + size) on all pCPUs */
+	void (*flush_tlb_range)(const union pgtable_pages_info *info, uint64_t vaddr, uint64_t size);
+	struct pgtable_stats *stats;	/* optional, NULL if not tracked */
 };
 
 static inline uint64_t round_page_up(uint64_t addr)
@@ -286,6 +306,12 @@ static inline uint64_t vpn_large(uint64_t vpn)
 	return (vpn & PAGE_V) && ((vpn & PAGE_TYPE_MASK) != PAGE_TYPE_TABLE);
 }
 
+/* physical address a leaf entry maps */
+static inline uint64_t pgentry_paddr(uint64_t pte)
+{
+	return ((pte & PTE_PPN_MASK) >> PTE_PPN_SHIFT) << PTE_SHIFT;
+}
+
 extern void mmu_add(uint64_t *pml4_page, uint64_t paddr_base, uint64_t vaddr_base,
 		uint64_t size, uint64_t prot, const struct memory_ops *mem_ops);
 
@@ -295,6 +321,9 @@ extern void mmu_modify_or_del(uint64_t *pml4_page, uint64_t vaddr_base, uint64_t
 extern const uint64_t *lookup_address(uint64_t *vpn3_page, uint64_t addr, uint64_t *pg_size,
 					const struct memory_ops *mem_ops);
 
+extern uint64_t mmu_collapse(uint64_t *vpn3_page, uint64_t vaddr_base, uint64_t size,
+		const struct memory_ops *mem_ops);
+
 #define pgtable_get_mfn(pte)	((pte).walk.base)
 #define pgtable_set_mfn(pte, mfn)  ((pte).walk.base = mfn)
 
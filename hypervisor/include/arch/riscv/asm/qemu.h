@@ -45,4 +45,8 @@
 #define CONFIG_UOS_DTB_SIZE		0x200000
 #define CONFIG_PHY_UART_IRQ		33
 
+/* guest RAM pool of the VMs created by HC_CREATE_VM, needs -m 3G or more */
+#define CONFIG_VM_MEM_POOL_START	0x100000000UL
+#define CONFIG_VM_MEM_POOL_SIZE		0x40000000UL
+
 #endif /* __RISCV_QEMU_H__ */
@@ -38,4 +38,8 @@
 #define CONFIG_UOS_DTB_SIZE		0x200000
 #define CONFIG_PHY_UART_IRQ		33
 
+/* guest RAM pool of the VMs created by HC_CREATE_VM */
+#define CONFIG_VM_MEM_POOL_START	0x181000000UL
+#define CONFIG_VM_MEM_POOL_SIZE		0x7F000000UL
+
 #endif /* __RISCV_SIFIVE_UNMACTCHED_H__ */
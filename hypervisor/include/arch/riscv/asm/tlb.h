@@ -37,6 +37,18 @@ STLB_HELPER(flush_guest_tlb_local);
 HTLB_HELPER(flush_guest_tlb_local);
 STLB_HELPER(flush_acrn_tlb_local);
 
+/* stage-2 translations of one guest physical address of a VMID */
+static inline void flush_guest_tlb_gpa(uint64_t gpa, uint64_t vmid)
+{
+	asm volatile("hfence.gvma %0, %1":: "r"(gpa >> 2U), "r"(vmid): "memory");
+}
+
+/* all stage-2 translations of a VMID */
+static inline void flush_guest_tlb_vmid(uint64_t vmid)
+{
+	asm volatile("hfence.gvma x0, %0":: "r"(vmid): "memory");
+}
+
 static inline void  __flush_acrn_tlb_entry(uint64_t va)
 {
 	asm volatile("sfence.vma;" : : "r" (va>>PAGE_SHIFT) : "memory");
@@ -85,4 +85,9 @@ void deny_guest_pio_access(struct acrn_vm *vm, uint16_t port_address, uint32_t n
  */
 void arch_fire_hsm_interrupt(void);
 
+/**
+ * @brief Flush the vUART state held back for the console timer
+ */
+void arch_flush_vuarts(void);
+
 #endif /* IO_EMUL_H */
@@ -612,31 +612,11 @@ static inline int32_t hcall_get_api_version(struct acrn_vcpu *vcpu, struct acrn_
 	return -1;
 }
 
-static inline int32_t hcall_create_vm(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
-{
-	return -1;
-}
-
-static inline int32_t hcall_destroy_vm(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
-{
-	return -1;
-}
-
 static inline int32_t hcall_reset_vm(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
 {
 	return -1;
 }
 
-static inline int32_t hcall_start_vm(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
-{
-	return -1;
-}
-
-static inline int32_t hcall_pause_vm(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
-{
-	return -1;
-}
-
 static inline int32_t hcall_set_vcpu_regs(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
 {
 	return -1;
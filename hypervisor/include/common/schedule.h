@@ -72,6 +72,7 @@ struct sched_control {
 	uint16_t pcpu_id;
 	uint64_t flags;
 	struct thread_object *curr_obj;
+	struct thread_object *handoff_obj;	/* pick_next hint for the next schedule() */
 	spinlock_t scheduler_lock;	/* to protect sched_control and thread_object */
 	struct acrn_scheduler *scheduler;
 	void *priv;
@@ -144,6 +145,7 @@ void run_thread(struct thread_object *obj);
 void sleep_thread(struct thread_object *obj);
 void sleep_thread_sync(struct thread_object *obj);
 void wake_thread(struct thread_object *obj);
+void handoff_thread(struct thread_object *prev, struct thread_object *next);
 void yield_current(void);
 void schedule(void);
 
@@ -47,6 +47,16 @@ void asm_assert(int32_t line, const char *file, const char *txt);
 
 void init_logmsg(void);
 
+/*
+ * In deferred mode messages other than fatal ones are recorded unformatted
+ * into a ring of the calling pCPU, and formatted and written out later by
+ * flush_logmsg() from the idle threads. It returns true while records are
+ * left.
+ */
+void set_logmsg_deferred(bool deferred);
+bool is_logmsg_deferred(void);
+bool flush_logmsg(void);
+
 /*
  * @pre the severity > 0
  */
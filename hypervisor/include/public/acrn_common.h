@@ -786,7 +786,8 @@ struct shared_buf {
 	uint32_t head;		/* offset from base, to read */
 	uint32_t tail;		/* offset from base, to write */
 	uint32_t flags;
-	uint32_t reserved;
+	uint32_t watermark;	/* trace and hvlog: fill level in bytes to notify at, 0 if none;
+				 * reserved in the other sbufs */
 	uint32_t overrun_cnt;	/* count of overrun */
 	uint32_t size;		/* ele_num * ele_size */
 	uint32_t padding[6];
@@ -29,6 +29,7 @@
 #define HC_GET_API_VERSION          BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x00UL)
 #define HC_SERVICE_VM_OFFLINE_CPU   BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x01UL)
 #define HC_SET_CALLBACK_VECTOR      BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x02UL)
+#define HC_BATCH                    BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x03UL)
 
 /* VM management */
 #define HC_ID_VM_BASE               0x10UL
@@ -39,6 +40,9 @@
 #define HC_CREATE_VCPU              BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x04UL)
 #define HC_RESET_VM                 BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x05UL)
 #define HC_SET_VCPU_REGS            BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x06UL)
+#define HC_VM_LOAD_IMAGE            BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x07UL)
+#define HC_GET_VCPU_CONTEXT         BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x08UL)
+#define HC_SET_VCPU_CONTEXT         BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x09UL)
 
 /* IRQ and Interrupts */
 #define HC_ID_IRQ_BASE              0x20UL
@@ -60,6 +64,8 @@
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
 #define HC_VM_WRITE_PROTECT_PAGE    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x03UL)
 #define HC_SETUP_SBUF               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x04UL)
+#define HC_VM_SET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x05UL)
+#define HC_VM_GET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x06UL)
 
 /* PCI assignment*/
 #define HC_ID_PCI_BASE              0x50UL
@@ -168,6 +174,88 @@ struct set_regions {
 	uint64_t regions_gpa;
 } __aligned(8);
 
+/**
+ * @brief One hypercall of a batch, used for HC_BATCH hypercall
+ *
+ * The Service VM fills an array of these in one page and passes its gpa
+ * and the number of entries as param1/param2 of HC_BATCH. The hypervisor
+ * executes the entries in order and writes each return value back.
+ */
+struct acrn_hc_batch_entry {
+	/** hypercall id, HC_BATCH itself is not allowed */
+	uint64_t hc_id;
+
+	/** hypercall param1 */
+	uint64_t param1;
+
+	/** hypercall param2 */
+	uint64_t param2;
+
+	/** return value of this hypercall, filled by the hypervisor */
+	int64_t result;
+} __aligned(8);
+
+/** The entry array of HC_BATCH must not cross a 4K guest page */
+#define ACRN_HC_BATCH_PAGE_SHIFT	12U
+#define ACRN_HC_BATCH_PAGE_SIZE		(1U << ACRN_HC_BATCH_PAGE_SHIFT)
+#define ACRN_HC_BATCH_MAX_ENTRIES	(ACRN_HC_BATCH_PAGE_SIZE / sizeof(struct acrn_hc_batch_entry))
+
+/**
+ * @brief Info to load a guest image, used for HC_VM_LOAD_IMAGE hypercall
+ *
+ * The image is copied from the Service VM's memory into the target VM's RAM,
+ * the kernel to the start of RAM and the DTB to the last 2M of RAM.
+ */
+struct acrn_vm_image {
+#define VM_IMAGE_KERNEL	0U
+#define VM_IMAGE_DTB	1U
+	/** image type: VM_IMAGE_KERNEL or VM_IMAGE_DTB */
+	uint32_t type;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** Service VM's guest physical address of the image */
+	uint64_t service_vm_gpa;
+
+	/** size of the image */
+	uint64_t size;
+} __aligned(8);
+
+#define ACRN_VCPU_CONTEXT_GPRS	40U
+
+/**
+ * @brief Architectural state of a paused vCPU
+ *
+ * Used by HC_GET_VCPU_CONTEXT and HC_SET_VCPU_CONTEXT to snapshot and restore
+ * a post-launched VM. The layout follows the hypervisor's vCPU context and is
+ * opaque to the Service VM, which only saves it and hands it back.
+ */
+struct acrn_vcpu_context {
+	/** the virtual CPU ID */
+	uint16_t vcpu_id;
+
+	/** Reserved */
+	uint16_t reserved[3];
+
+	/** pc, general purpose registers and the trap state of the last exit */
+	uint64_t gprs[ACRN_VCPU_CONTEXT_GPRS];
+
+	/** VS-mode CSRs */
+	uint64_t sstatus;
+	uint64_t sepc;
+	uint64_t sip;
+	uint64_t sie;
+	uint64_t stvec;
+	uint64_t sscratch;
+	uint64_t stval;
+	uint64_t scause;
+	uint64_t satp;
+
+	/** absolute deadline of the vCPU timer, 0 if not armed */
+	uint64_t timer_deadline;
+} __aligned(8);
+
 /**
  * @brief Info to change guest one page write protect permission
  *
@@ -186,6 +274,28 @@ struct wp_data {
 	uint64_t gpa;
 } __aligned(8);
 
+/** pages covered by one uint64_t of a dirty log bitmap */
+#define ACRN_DIRTY_LOG_WORD_PAGES	64UL
+
+/**
+ * @brief Info to get and clear the dirty page log of a VM
+ *
+ * the parameter for HC_VM_GET_DIRTY_LOG hypercall
+ */
+struct acrn_dirty_log {
+	/** guest physical address of the first page, 256K aligned */
+	uint64_t gpa;
+
+	/** size of the range in bytes, a multiple of 256K */
+	uint64_t size;
+
+	/**
+	 * Service VM guest physical address of the bitmap, one bit per 4K
+	 * page, bit 0 of the first uint64_t is the page at gpa
+	 */
+	uint64_t bitmap_gpa;
+} __aligned(8);
+
 /**
  * Setup parameter for share buffer, used for HC_SETUP_SBUF hypercall
  */
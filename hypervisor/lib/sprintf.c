@@ -423,6 +423,8 @@ void do_print(const char *fmt_arg, struct print_param *param,
 	char ch;
 	/* temp. pointer to the start of an analysed character sequence */
 	const char *start;
+	/* a '*' width or precision */
+	int32_t arg;
 
 	/* main loop: analyse until there are no more characters */
 	while ((*fmt) != '\0') {
@@ -458,11 +460,31 @@ void do_print(const char *fmt_arg, struct print_param *param,
 			 *   - get the length modifier
 			 */
 			fmt = get_flags(fmt, &(param->vars.flags));
-			fmt = get_param(fmt, &(param->vars.width));
+			if (*fmt == '*') {
+				/* the width is the next argument, negative left justifies */
+				arg = __builtin_va_arg(args, int32_t);
+				if (arg < 0) {
+					param->vars.flags |= PRINT_FLAG_LEFT_JUSTIFY;
+					/* negated as unsigned, INT_MIN has no positive int32_t */
+					param->vars.width = 0U - (uint32_t)arg;
+				} else {
+					param->vars.width = (uint32_t)arg;
+				}
+				fmt++;
+			} else {
+				fmt = get_param(fmt, &(param->vars.width));
+			}
 
 			if (*fmt == '.') {
 				fmt++;
-				fmt = get_param(fmt, &(param->vars.precision));
+				if (*fmt == '*') {
+					/* a negative precision is ignored */
+					arg = __builtin_va_arg(args, int32_t);
+					param->vars.precision = (arg < 0) ? 0U : (uint32_t)arg;
+					fmt++;
+				} else {
+					fmt = get_param(fmt, &(param->vars.precision));
+				}
 			}
 
 			fmt = get_length_modifier(fmt, &(param->vars.flags),
@@ -7,6 +7,9 @@
 #include <types.h>
 
 void init_logmsg() {}
+void set_logmsg_deferred(__unused bool deferred) {}
+bool is_logmsg_deferred(void) { return false; }
+bool flush_logmsg(void) { return false; }
 void do_logmsg(__unused uint32_t severity, __unused const char *fmt, ...) {}
 void printf(__unused const char *fmt, ...) {}
 void vprintf(__unused const char *fmt, __unused va_list args) {}
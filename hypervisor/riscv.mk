@@ -192,6 +192,7 @@ BOOT_C_SRCS += arch/riscv/guest/vplic.c
 BOOT_C_SRCS += arch/riscv/guest/vmexit.c
 BOOT_C_SRCS += arch/riscv/guest/vmcall.c
 BOOT_C_SRCS += arch/riscv/guest/guest_memory.c
+BOOT_C_SRCS += arch/riscv/guest/mempool.c
 BOOT_C_SRCS += arch/riscv/guest/instr_emul.c
 BOOT_C_SRCS += arch/riscv/guest/tee.c
 
@@ -224,6 +225,7 @@ BOOT_C_SRCS += dm/io_req.c
 ifdef CONFIG_KTEST
 BOOT_C_SRCS += arch/riscv/ktest/app.c
 BOOT_C_SRCS += arch/riscv/ktest/smp.c
+BOOT_C_SRCS += arch/riscv/ktest/bench.c
 endif
 
 BOOT_C_OBJS := $(patsubst %.c,$(HV_OBJDIR)/%.o,$(BOOT_C_SRCS))
@@ -11,6 +11,8 @@
 #include <signal.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include "android_events.h"
 #include "strutils.h"
 #include "cmdutils.h"
@@ -21,6 +23,8 @@
 #include "vmrecord.h"
 
 #define VM_WARNING_LINES 2000
+/* re-read the histories at least every so many polls without inotify news */
+#define VM_HISTORY_RECHECK 16
 
 #define ANDROID_DATA_PAR_NAME "data"
 #define ANDROID_EVT_KEY_LEN 20
@@ -33,6 +37,12 @@ static const char *android_img = "/data/android/android.img";
 static const char *android_histpath = "logs/history_event";
 char *loop_dev;
 
+/* the polling timer may fire again before the previous refresh is done */
+static pthread_mutex_t history_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int img_inotify_fd = -1;
+static int img_inotify_wd = -1;
+static int img_unchanged_polls;
+
 /* Find the next event that needs to be synced.
  * There is a history_event file in User VM side, it records User VM's events in
  * real-time. Generally, the cursor point to the first unsynchronized line.
@@ -107,10 +117,78 @@ static char *next_vm_event(const char *cursor, const char *data,
 	return line_to_sync;
 }
 
+/* Drop the cached history, it is read again from the head */
+static void reset_vm_history(struct vm_t *vm)
+{
+	int i;
+
+	free(vm->history_data);
+	vm->history_data = NULL;
+	vm->history_len = 0;
+	for (i = 0; i < SENDER_MAX; i++)
+		vm->history_offset[i] = 0;
+}
+
+/*
+ * The histories are files in the image of the guest. Use inotify on the
+ * image to skip reading them when the guest wrote nothing since the last
+ * poll, and fall back to reading them each poll if the image can't be
+ * watched.
+ */
+static int vm_img_changed(void)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	ssize_t len;
+
+	if (img_inotify_fd < 0) {
+		img_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (img_inotify_fd < 0)
+			return 1;
+	}
+	if (img_inotify_wd < 0) {
+		img_inotify_wd = inotify_add_watch(img_inotify_fd, android_img,
+						   IN_MODIFY | IN_CLOSE_WRITE |
+						   IN_DELETE_SELF |
+						   IN_MOVE_SELF);
+		/* everything may have changed before the watch */
+		return 1;
+	}
+
+	while ((len = read(img_inotify_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+		char *p;
+
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			/* the image is gone, watch the new one next time */
+			if (ev->mask & IN_IGNORED)
+				img_inotify_wd = -1;
+		}
+		changed = 1;
+	}
+
+	if (!changed && ++img_unchanged_polls < VM_HISTORY_RECHECK)
+		return 0;
+
+	img_unchanged_polls = 0;
+	return 1;
+}
+
+/*
+ * Bring the cached history of each vm up to date. Only the part appended
+ * since the last poll is read, unless the file was replaced or truncated.
+ */
 static int get_vms_history(const struct sender_t *sender)
 {
 	struct vm_t *vm;
 	unsigned long size;
+	ext2_ino_t ino;
+	__u32 gen;
+	char *tail;
+	char *data;
 	int ret;
 	int id;
 
@@ -121,27 +199,64 @@ static int get_vms_history(const struct sender_t *sender)
 		if (e2fs_open(loop_dev, &vm->datafs) == -1)
 			continue;
 
-		if (e2fs_read_file_by_fpath(vm->datafs, android_histpath,
-					    (void **)&vm->history_data,
-					    &size) == -1) {
+		if (e2fs_stat_file_by_fpath(vm->datafs, android_histpath,
+					    &ino, &gen, &size) == -1) {
 			LOGE("failed to get vm_history from (%s).\n", vm->name);
-			vm->history_data = NULL;
+			reset_vm_history(vm);
 			e2fs_close(vm->datafs);
 			vm->datafs = NULL;
 			continue;
 		}
 
+		if (ino != vm->history_ino || gen != vm->history_gen ||
+		    size < vm->history_len) {
+			if (vm->history_data)
+				LOGW("vm_history of (%s) is replaced\n",
+				     vm->name);
+			reset_vm_history(vm);
+			vm->history_ino = ino;
+			vm->history_gen = gen;
+		}
+
+		if (size > vm->history_len) {
+			if (e2fs_read_file_range(vm->datafs, ino,
+						 vm->history_len,
+						 (void **)&tail,
+						 &size) == -1) {
+				LOGE("failed to read vm_history from (%s).\n",
+				     vm->name);
+				e2fs_close(vm->datafs);
+				vm->datafs = NULL;
+				continue;
+			}
+
+			if (tail) {
+				data = realloc(vm->history_data,
+					       vm->history_len + size + 1);
+				if (!data) {
+					LOGE("out of memory\n");
+					free(tail);
+					e2fs_close(vm->datafs);
+					vm->datafs = NULL;
+					continue;
+				}
+				memcpy(data + vm->history_len, tail, size + 1);
+				free(tail);
+				vm->history_data = data;
+				vm->history_len += size;
+			}
+		}
+
 		e2fs_close(vm->datafs);
 		vm->datafs = NULL;
 
-		if (!size) {
+		if (!vm->history_len) {
 			LOGE("empty vm_history from (%s).\n", vm->name);
-			vm->history_data = NULL;
 			continue;
 		}
 
 		/* warning large history file once */
-		if (size == vm->history_size[sender->id])
+		if (vm->history_len == vm->history_size[sender->id])
 			continue;
 
 		ret = strcnt(vm->history_data, '\n');
@@ -149,7 +264,7 @@ static int get_vms_history(const struct sender_t *sender)
 			LOGW("File too large, (%d) lines in (%s) of (%s)\n",
 			     ret, android_histpath, vm->name);
 
-		vm->history_size[sender->id] = size;
+		vm->history_size[sender->id] = vm->history_len;
 	}
 
 	return 0;
@@ -174,14 +289,18 @@ static void detect_new_events(struct sender_t *sender)
 		char *start;
 		char *last_key;
 		char *line_to_sync;
+		char *synced;
 
 		if (!vm || !vm->history_data)
 			continue;
 
 		data = vm->history_data;
-		data_size = vm->history_size[sender->id];
+		data_size = vm->history_len;
 		last_key = &vm->last_evt_detected[sender->id][0];
-		if (*last_key) {
+		if (vm->history_offset[sender->id]) {
+			/* lines before the offset have been searched */
+			start = data + vm->history_offset[sender->id];
+		} else if (*last_key) {
 			start = strstr(data, last_key);
 			if (start == NULL) {
 				LOGW("no synced id (%s), sync from head\n",
@@ -208,8 +327,11 @@ static void detect_new_events(struct sender_t *sender)
 
 			len = strlinelen(line_to_sync,
 					 data + data_size - line_to_sync);
-			if (len == -1)
+			if (len == -1) {
+				/* not completely written, search it again */
+				start = line_to_sync - 1;
 				break;
+			}
 
 			start = strchr(line_to_sync, '\n');
 			if (str_split_ere(line_to_sync, len + 1, vm_format,
@@ -235,6 +357,13 @@ static void detect_new_events(struct sender_t *sender)
 					  vmkey) == -1)
 				LOGE("failed to new vm record\n");
 		}
+
+		/* the next search starts from the last complete line */
+		if (!line_to_sync && start)
+			start = memrchr(start, '\n', data + data_size - start);
+		synced = start;
+		if (synced && synced > data)
+			vm->history_offset[sender->id] = synced - data;
 	}
 
 }
@@ -295,8 +424,7 @@ static void fire_detected_events(struct sender_t *sender,
 			continue;
 
 		hist_line = get_line(vmkey, strnlen(vmkey, sizeof(vmkey)),
-				     vm->history_data,
-				     vm->history_size[sender->id],
+				     vm->history_data, vm->history_len,
 				     vm->history_data, &len);
 		if (!hist_line) {
 			vmrecord_mark(&sender->vmrecord, vmkey,
@@ -412,9 +540,6 @@ static char *setup_loop_dev(void)
 void refresh_vm_history(struct sender_t *sender,
 		int (*fn)(const char*, size_t, const struct vm_t *))
 {
-	struct vm_t *vm;
-	int id;
-
 	if (!sender)
 		return;
 
@@ -430,23 +555,17 @@ void refresh_vm_history(struct sender_t *sender,
 		return;
 	}
 
+	pthread_mutex_lock(&history_mtx);
 	get_last_evt_detected(sender);
-	get_vms_history(sender);
+	if (vm_img_changed())
+		get_vms_history(sender);
 
 	/* read events from vmrecords and mark them as ongoing */
 	fire_detected_events(sender, fn);
 
-	/* add events to vmrecords */
+	/* add events to vmrecords, the history is kept for the next poll */
 	detect_new_events(sender);
-
-	for_each_vm(id, vm, conf) {
-		if (!vm)
-			continue;
-		if (vm->history_data) {
-			free(vm->history_data);
-			vm->history_data = NULL;
-		}
-	}
+	pthread_mutex_unlock(&history_mtx);
 }
 
 int android_event_analyze(const char *msg, size_t len, char **result,
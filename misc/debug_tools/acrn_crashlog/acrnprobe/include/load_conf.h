@@ -47,7 +47,13 @@ struct vm_t {
 
 	ext2_filsys	datafs;
 	unsigned long	history_size[SENDER_MAX];
+	/* history read so far, only the appended part is read each time */
 	char		*history_data;
+	unsigned long	history_len;
+	ext2_ino_t	history_ino;
+	__u32		history_gen;
+	/* where the next new event is searched from */
+	unsigned long	history_offset[SENDER_MAX];
 	char		last_evt_detected[SENDER_MAX][SHORT_KEY_LENGTH + 1];
 };
 
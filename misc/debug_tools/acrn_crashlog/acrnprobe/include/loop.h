@@ -13,6 +13,10 @@ int e2fs_dump_file_by_fpath(ext2_filsys fs, const char *in_fp,
 			const char *out_fp);
 int e2fs_read_file_by_fpath(ext2_filsys fs, const char *in_fp,
 			 void **out_data, unsigned long *size);
+int e2fs_read_file_range(ext2_filsys fs, ext2_ino_t ino, unsigned long offset,
+			 void **out_data, unsigned long *size);
+int e2fs_stat_file_by_fpath(ext2_filsys fs, const char *in_fp,
+			 ext2_ino_t *ino, __u32 *gen, unsigned long *size);
 int e2fs_dump_dir_by_dpath(ext2_filsys fs, const char *in_dp,
 			const char *out_dp, int *count);
 int e2fs_open(const char *dev, ext2_filsys *outfs);
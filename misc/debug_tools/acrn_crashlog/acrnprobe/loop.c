@@ -402,8 +402,20 @@ int e2fs_dump_file_by_fpath(ext2_filsys fs, const char *in_fp,
 	return e2fs_dump_file_by_inodenum(fs, ino, out_fp);
 }
 
-static int e2fs_read_file_by_inodenum(ext2_filsys fs, ext2_ino_t ino,
-					void **out_data, unsigned long *size)
+/**
+ * Read a file from offset to its end.
+ *
+ * @param fs The ext2 filesystem.
+ * @param ino Inode number of the file.
+ * @param offset Offset in the file to read from.
+ * @param[out] out_data The data read, NUL terminated, NULL if nothing is
+ *		       read. The caller should free it.
+ * @param[out] size Bytes read.
+ *
+ * @return 0 if successful, or -1 if not.
+ */
+int e2fs_read_file_range(ext2_filsys fs, ext2_ino_t ino, unsigned long offset,
+			 void **out_data, unsigned long *size)
 {
 	errcode_t res;
 	unsigned int got;
@@ -423,12 +435,14 @@ static int e2fs_read_file_by_inodenum(ext2_filsys fs, ext2_ino_t ino,
 	}
 
 	_size = EXT2_I_SIZE(&inode);
-	if (!_size) {
-		LOGW("try to read a empty file\n");
+	if (_size <= offset) {
+		if (!_size)
+			LOGW("try to read a empty file\n");
 		*size = 0;
 		*out_data = 0;
 		return 0;
 	}
+	_size -= offset;
 
 	/* open with read only */
 	res = ext2fs_file_open2(fs, ino, &inode, 0, &e2_file);
@@ -438,6 +452,14 @@ static int e2fs_read_file_by_inodenum(ext2_filsys fs, ext2_ino_t ino,
 		return -1;
 	}
 
+	res = ext2fs_file_llseek(e2_file, offset, EXT2_SEEK_SET, NULL);
+	if (res) {
+		LOGE("ext2fs failed to seek (%u) to (%lu), error (%s)\n",
+		     ino, offset, error_message(res));
+		ext2fs_file_close(e2_file);
+		return -1;
+	}
+
 	res = ext2fs_get_mem(_size + 1, &buf);
 	if (res) {
 		LOGE("ext2fs failed to get mem, error (%s)\n",
@@ -468,6 +490,39 @@ err:
 	return -1;
 }
 
+static int e2fs_read_file_by_inodenum(ext2_filsys fs, ext2_ino_t ino,
+					void **out_data, unsigned long *size)
+{
+	return e2fs_read_file_range(fs, ino, 0, out_data, size);
+}
+
+/**
+ * Get the inode number, generation and size of a file.
+ *
+ * The inode number and generation identify the file: they change if the
+ * file is deleted and created again.
+ *
+ * @return 0 if successful, or -1 if not.
+ */
+int e2fs_stat_file_by_fpath(ext2_filsys fs, const char *in_fp,
+			 ext2_ino_t *ino, __u32 *gen, unsigned long *size)
+{
+	struct ext2_inode inode;
+
+	if (!fs || !in_fp || !ino || !gen || !size)
+		return -1;
+
+	if (e2fs_get_inodenum_by_fpath(fs, in_fp, ino))
+		return -1;
+
+	if (e2fs_read_inode_by_inodenum(fs, *ino, &inode))
+		return -1;
+
+	*gen = inode.i_generation;
+	*size = EXT2_I_SIZE(&inode);
+	return 0;
+}
+
 int e2fs_read_file_by_fpath(ext2_filsys fs, const char *in_fp,
 			 void **out_data, unsigned long *size)
 {
@@ -16,6 +16,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
+#include <poll.h>
 
 #define LOG_ELEMENT_SIZE        80
 #define LOG_MSG_SIZE		480
@@ -30,6 +31,7 @@ static unsigned long interval = DEFAULT_POLL_INTERVAL;
 /* this is for log file */
 #define LOG_FILE_SIZE	(1024*1024)
 #define LOG_FILE_NUM 	4
+#define LOG_WBUF_SIZE	(64*1024)	/* logs are written in batches */
 static size_t hvlog_log_size = LOG_FILE_SIZE;
 static unsigned short hvlog_log_num = LOG_FILE_NUM;
 
@@ -40,6 +42,9 @@ struct hvlog_file {
 	size_t left_space;
 	unsigned short index;
 	unsigned short num;
+
+	char wbuf[LOG_WBUF_SIZE];
+	size_t wlen;
 };
 
 static struct hvlog_file cur_log = {
@@ -82,6 +87,7 @@ struct hvlog_dev {
 };
 
 size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len);
+void flush_log_file(struct hvlog_file *log);
 
 static int get_dev_cnt(char *prefix)
 {
@@ -298,16 +304,39 @@ static struct hvlog_msg *get_min_seq_msg(struct hvlog_data *data, int num_dev)
 	return msg;
 }
 
+/* the previous log file, closed and expired in the background */
+struct hvlog_rotated {
+	int fd;
+	char expired[32];
+};
+
+static void *log_rotate_func(void *arg)
+{
+	struct hvlog_rotated *old = arg;
+
+	if (old->fd >= 0)
+		close(old->fd);
+	if (old->expired[0] != '\0')
+		remove(old->expired);
+	free(old);
+
+	return NULL;
+}
+
+/*
+ * Switch to the next log file. Closing the previous file and removing the
+ * expired one are done by a detached thread, so that the reader does not
+ * wait for the file system.
+ */
 static int new_log_file(struct hvlog_file *log)
 {
 	char file_name[32] = { };
+	struct hvlog_rotated *old;
+	pthread_t tid;
+	int fd;
 
-	if (log->fd >= 0) {
-		if (!hvlog_log_size)
-			return 0;
-		close(log->fd);
-		log->fd = -1;
-	}
+	if (log->fd >= 0 && !hvlog_log_size)
+		return 0;
 
 	if (snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
 		 log->index + 1) >= sizeof(file_name)) {
@@ -315,67 +344,133 @@ static int new_log_file(struct hvlog_file *log)
 	} else
 		remove(file_name);
 
-	log->fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
-	if (log->fd < 0) {
+	fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
 		perror(file_name);
 		return -1;
 	}
 
+	old = calloc(1, sizeof(*old));
+	if (!old) {
+		close(fd);
+		return -1;
+	}
+	old->fd = log->fd;
+
+	log->fd = fd;
 	log->left_space = hvlog_log_size;
 	log->index++;
-	if (snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
-			log->index - hvlog_log_num) >= sizeof(file_name)) {
+	if (snprintf(old->expired, sizeof(old->expired), "%s.%hu", log->path,
+			log->index - hvlog_log_num) >= sizeof(old->expired)) {
 		printf("WARN: log path is truncated\n");
-	} else
-		remove(file_name);
+		old->expired[0] = '\0';
+	}
+
+	if (pthread_create(&tid, NULL, log_rotate_func, old) == 0)
+		pthread_detach(tid);
+	else
+		log_rotate_func(old);
 
 	return 0;
 }
 
-size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len)
+/* write the buffered logs out */
+void flush_log_file(struct hvlog_file *log)
 {
-	int ret;
+	ssize_t ret;
+	size_t done = 0;
 
-	if (len >= log->left_space)
+	while (log->fd >= 0 && done < log->wlen) {
+		ret = write(log->fd, log->wbuf + done, log->wlen - done);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			perror(log->path);
+			break;
+		}
+		done += ret;
+	}
+	log->wlen = 0;
+}
+
+size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len)
+{
+	if (len >= log->left_space) {
+		flush_log_file(log);
 		if (new_log_file(log))
 			return 0;
+	}
 
-	ret = write(log->fd, buf, len);
-	log->left_space -= ret;
+	if (len > sizeof(log->wbuf) - log->wlen)
+		flush_log_file(log);
+	if (len > sizeof(log->wbuf))
+		len = sizeof(log->wbuf);
 
-	return ret;
+	memcpy(log->wbuf + log->wlen, buf, len);
+	log->wlen += len;
+	log->left_space -= len;
+
+	return len;
 }
 
+/*
+ * Read the logs of the running hypervisor. The hypervisor notifies the
+ * Service VM when a log buffer is half full, the reader waits for it in
+ * poll() for at most interval, then reads all the logs out and writes them
+ * in one batch. If the log devices can't be polled, poll() reports them
+ * readable at once, and the reader falls back to sleeping interval.
+ */
 static void *cur_read_func(void *arg)
 {
 	struct hvlog_msg *msg;
+	struct pollfd *pfds;
 	__u64 last_seq = 0;
 	char warn_msg[LOG_MSG_SIZE] = {0};
+	int i, nfds = 0, woken = 0, nr_msgs;
 
-	while (1) {
-		hvlog_dev_read_msg(cur, cur_cnt);
-		msg = get_min_seq_msg(cur, cur_cnt);
-		if (!msg) {
-			usleep(interval);
+	pfds = calloc(cur_cnt, sizeof(struct pollfd));
+	if (!pfds)
+		return NULL;
+	for (i = 0; i < cur_cnt; i++) {
+		if (!cur[i].dev)
 			continue;
-		}
+		pfds[nfds].fd = cur[i].dev->fd;
+		pfds[nfds].events = POLLIN;
+		nfds++;
+	}
 
-		/* if msg->seq is not contineous, warn for logs missing */
-		if (last_seq + 1 < msg->seq) {
-			if (snprintf(warn_msg, LOG_MSG_SIZE,
-				 "\n\n\t%s[%lu ms]\n\n\n",
-				 LOG_INCOMPLETE_WARNING, interval) >= LOG_MSG_SIZE) {
-				printf("WARN: warning message is truncated\n");
+	while (1) {
+		nr_msgs = 0;
+		while (1) {
+			hvlog_dev_read_msg(cur, cur_cnt);
+			msg = get_min_seq_msg(cur, cur_cnt);
+			if (!msg)
+				break;
+			nr_msgs++;
+
+			/* if msg->seq is not contineous, warn for logs missing */
+			if (last_seq + 1 < msg->seq) {
+				if (snprintf(warn_msg, LOG_MSG_SIZE,
+					 "\n\n\t%s[%lu ms]\n\n\n",
+					 LOG_INCOMPLETE_WARNING, interval / 1000) >= LOG_MSG_SIZE) {
+					printf("WARN: warning message is truncated\n");
+				}
+
+				write_log_file(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
 			}
 
-			write_log_file(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
-		}
+			last_seq = msg->seq;
 
-		last_seq = msg->seq;
+			write_log_file(&cur_log, msg->raw, msg->len);
+		}
+		flush_log_file(&cur_log);
 
-		write_log_file(&cur_log, msg->raw, msg->len);
+		if (nr_msgs == 0 && woken)
+			usleep(interval);
+		woken = (poll(pfds, nfds, interval / 1000) > 0);
 	}
 
+	free(pfds);
 	return NULL;
 }
 
@@ -429,7 +524,8 @@ static void display_usage(void)
 	       "[Usage] acrnlog [-s size] [-n number] [-t interval] [-h]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
-	       "\t-t: polling interval to collect logs, in ms\n"
+	       "\t-t: longest time to wait for the hypervisor notification\n"
+	       "\t    before collecting logs, in ms\n"
 	       "\t-s: size limitation for each log file, in MB.\n"
 	       "\t    0 means no limitation.\n"
 	       "\t-n: how many files you would like to keep on disk\n"
@@ -575,6 +671,7 @@ int main(int argc, char *argv[])
 				break;
 			write_log_file(&last_log, msg->raw, msg->len);
 		}
+		flush_log_file(&last_log);
 	}
 
 	if (cur_thread)
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <signal.h>
 #include <numa.h>
+#include <poll.h>
 
 #include "acrntrace.h"
 
@@ -30,7 +31,8 @@ static int exiting = 0;
 
 /* for opt */
 static uint64_t period = 10000;
-static const char optString[] = "i:hcrt:a:";
+static uint32_t watermark = 50;
+static const char optString[] = "i:hcrt:a:w:";
 static const char dev_prefix[] = "acrn_trace_";
 
 static uint32_t flags = FLAG_CLEAR_BUF;
@@ -44,10 +46,13 @@ static struct bitmask *cpu_bitmask = NULL;
 static void display_usage(void)
 {
 	printf("acrntrace - tool to collect ACRN trace data\n"
-	       "[Usage] acrntrace [-i period] [-t max_time] [-ch]\n\n"
+	       "[Usage] acrntrace [-i period] [-w watermark] [-t max_time] [-ch]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
-	       "\t-i: period_in_ms: specify polling interval [1-999]\n"
+	       "\t-i: period_in_ms: specify the longest time to wait for\n"
+	       "\t    the hypervisor notification [1-999]\n"
+	       "\t-w: watermark: fill level of the trace buffer, in percent,\n"
+	       "\t    the hypervisor notifies at [1-100], default 50\n"
 	       "\t-t: max time to capture trace data (in second)\n"
 	       "\t-c: clear the buffered old data (deprecated)\n"
 	       "\t-r: capture the buffered old data instead of clearing it\n"
@@ -109,6 +114,14 @@ static int parse_opt(int argc, char *argv[])
 			period = ret * 1000;
 			pr_dbg("Period is %lu\n", period);
 			break;
+		case 'w':
+			ret = strtol(optarg, NULL, 10);
+			if (ret <= 0 || ret > 100) {
+				pr_err("'-w' require integer between [1-100]\n");
+				return -EINVAL;
+			}
+			watermark = ret;
+			break;
 		case 't':
 			ret = strtol(optarg, NULL, 10);
 			if (ret <= 0) {
@@ -217,12 +230,24 @@ static int create_trace_file_dir(char *dir)
 	return err;
 }
 
-/* function executed in each consumer thread */
+/*
+ * function executed in each consumer thread
+ *
+ * Wait for the hypervisor to notify that the buffer reached the watermark,
+ * or at most period, then write out all the buffered data at once. If the
+ * trace device can't be polled, poll() reports it readable at once, and
+ * the reader falls back to sleeping period.
+ */
 static void reader_fn(param_t * param)
 {
 	int ret;
 	int fd = param->trace_fd;
 	shared_buf_t *sbuf = param->sbuf;
+	struct pollfd pfd;
+	int woken = 0;
+
+	pfd.fd = param->dev_fd;
+	pfd.events = POLLIN;
 
 	pr_dbg("reader thread[%lu] created for FILE*[0x%p]\n",
 	       pthread_self(), fp);
@@ -235,11 +260,12 @@ static void reader_fn(param_t * param)
 		sbuf_clear_buffered(sbuf);
 
 	while (1) {
-		do {
-			ret = sbuf_write(fd, sbuf);
-		} while (ret > 0);
+		ret = sbuf_write(fd, sbuf);
+		if (ret == 0 && woken)
+			usleep(period);
 
-		usleep(period);
+		ret = poll(&pfd, 1, period / 1000);
+		woken = (ret > 0);
 	}
 }
 
@@ -272,6 +298,8 @@ static int create_reader(reader_struct * reader, uint32_t dev_id)
 	pr_dbg("sbuf[%d]:\nmagic_num: %lx\nele_num: %u\n ele_size: %u\n",
 	       dev_id, reader->param.sbuf->magic, reader->param.sbuf->ele_num,
 	       reader->param.sbuf->ele_size);
+	reader->param.dev_fd = reader->dev_fd;
+	sbuf_set_watermark(reader->param.sbuf, watermark);
 
 	if(snprintf(trace_file_name, TRACE_FILE_NAME_LEN, "%s/%d", trace_file_dir,
 		 dev_id) >= TRACE_FILE_NAME_LEN)
@@ -73,6 +73,7 @@ typedef struct {
 typedef struct {
 	uint32_t devid;
 	int exit_flag;
+	int dev_fd;
 	int trace_fd;
 	shared_buf_t *sbuf;
 	pthread_mutex_t *sbuf_lock;
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "sbuf.h"
 #include <errno.h>
 
@@ -46,29 +47,49 @@ int sbuf_get(shared_buf_t *sbuf, uint8_t *data)
 	return sbuf->ele_size;
 }
 
+/*
+ * Write all the buffered elements to fd, with one writev() for the one or
+ * two contiguous parts of the ring.
+ *
+ * Return the number of bytes written, 0 if the buffer is empty.
+ */
 int sbuf_write(int fd, shared_buf_t *sbuf)
 {
-	const void *start;
-	int written;
+	struct iovec iov[2];
+	uint32_t head, tail;
+	ssize_t written;
+	int cnt = 0;
 
 	if (sbuf == NULL)
 		return -EINVAL;
 
-	if (sbuf_is_empty(sbuf)) {
+	head = sbuf->head;
+	/* read the elements only after the tail they are published with */
+	tail = __atomic_load_n(&sbuf->tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
 		return 0;
+
+	iov[cnt].iov_base = (void *)sbuf + SBUF_HEAD_SIZE + head;
+	iov[cnt].iov_len = ((tail > head) ? tail : sbuf->size) - head;
+	cnt++;
+	if (tail < head && tail > 0) {
+		iov[cnt].iov_base = (void *)sbuf + SBUF_HEAD_SIZE;
+		iov[cnt].iov_len = tail;
+		cnt++;
 	}
 
-	start = (void *)sbuf + SBUF_HEAD_SIZE + sbuf->head;
-        written = write(fd, start, sbuf->ele_size);
-	if (written != sbuf->ele_size) {
-		printf("Failed to write: ret %d (ele_size %d), errno %d\n",
-			written, sbuf->ele_size, (written == -1) ? errno : 0);
+	written = writev(fd, iov, cnt);
+	if (written < 0) {
+		printf("Failed to write: errno %d\n", errno);
 		return -1;
 	}
 
-	sbuf->head = sbuf_next_ptr(sbuf->head, sbuf->ele_size, sbuf->size);
+	/* on a short write, the elements not completely written are kept */
+	written -= written % sbuf->ele_size;
+	__atomic_store_n(&sbuf->head, sbuf_next_ptr(head, written, sbuf->size),
+			__ATOMIC_RELEASE);
 
-	return sbuf->ele_size;
+	return written;
 }
 
 int sbuf_clear_buffered(shared_buf_t *sbuf)
@@ -14,8 +14,8 @@
 #define SBUF_HEAD_SIZE  64
 
 /* sbuf flags */
-#define OVERRUN_CNT_EN  (1ULL << 0) /* whether overrun counting is enabled */
-#define OVERWRITE_EN    (1ULL << 1) /* whether overwrite is enabled */
+#define OVERRUN_CNT_EN  (1U << 0) /* whether overrun counting is enabled */
+#define OVERWRITE_EN    (1U << 1) /* whether overwrite is enabled */
 
 typedef unsigned char uint8_t;
 typedef unsigned int uint32_t;
@@ -44,27 +44,37 @@ typedef struct shared_buf {
         uint32_t ele_size;      /* sizeof of elements */
         uint32_t head;          /* offset from base, to read */
         uint32_t tail;          /* offset from base, to write */
-        uint64_t flags;
+        uint32_t flags;
+        uint32_t watermark;     /* fill level in bytes the HV notifies at */
         uint32_t overrun_cnt;   /* count of overrun */
         uint32_t size;          /* ele_num * ele_size */
         uint32_t padding[6];
 } shared_buf_t;
 
-static inline void sbuf_clear_flags(shared_buf_t *sbuf, uint64_t flags)
+static inline void sbuf_clear_flags(shared_buf_t *sbuf, uint32_t flags)
 {
         sbuf->flags &= ~flags;
 }
 
-static inline void sbuf_set_flags(shared_buf_t *sbuf, uint64_t flags)
+static inline void sbuf_set_flags(shared_buf_t *sbuf, uint32_t flags)
 {
         sbuf->flags = flags;
 }
 
-static inline void sbuf_add_flags(shared_buf_t *sbuf, uint64_t flags)
+static inline void sbuf_add_flags(shared_buf_t *sbuf, uint32_t flags)
 {
         sbuf->flags |= flags;
 }
 
+/*
+ * The hypervisor notifies the Service VM when the buffer fills up to
+ * watermark bytes, so that the reader can wait in poll().
+ */
+static inline void sbuf_set_watermark(shared_buf_t *sbuf, uint32_t percent)
+{
+        sbuf->watermark = (uint32_t)((uint64_t)sbuf->size * percent / 100);
+}
+
 int sbuf_get(shared_buf_t *sbuf, uint8_t *data);
 int sbuf_write(int fd, shared_buf_t *sbuf);
 int sbuf_clear_buffered(shared_buf_t *sbuf);